@@ -1546,6 +1546,8 @@ void bt_generic_le(u8 active_mode)
 		if (!ret) break;
 
 	rx_continue:
+		/* stream packets to the host on the bulk endpoint */
+		usb_send_queued(clkn);
 		rx_tc = 0;
 		rx_err = 0;
 	}
@@ -1604,10 +1606,11 @@ void bt_le_sync(u8 active_mode)
 
 		RXLED_CLR;
 
-		/* Wait for DMA. Meanwhile keep track of RSSI. */
+		/* Wait for DMA. Meanwhile keep track of RSSI and stream
+		 * queued packets to the host on the bulk endpoint. */
 		rssi_reset();
 		while ((rx_tc == 0) && (rx_err == 0) && (do_hop == 0) && requested_mode == active_mode)
-			;
+			usb_send_queued(clkn);
 
 		rssi = (int8_t)(cc2400_get(RSSI) >> 8);
 		rssi_min = rssi_max = rssi;
@@ -321,3 +321,21 @@ void handle_usb(u32 clkn)
 	/* polled "interrupt" */
 	USBHwISR();
 }
+
+/* For the modes which service USB from the interrupt: only move queued
+ * packets to the bulk endpoint. The interrupt is masked meanwhile, so a
+ * UBERTOOTH_POLL request can not dequeue at the same time. */
+void usb_send_queued(u32 clkn)
+{
+	u8 epstat;
+
+	ICER0 = ICER0_ICE_USB;
+	epstat = USBHwEPGetStatus(BULK_IN_EP);
+	if (!(epstat & EPSTAT_B1FULL)) {
+		dequeue_send(clkn);
+	}
+	if (!(epstat & EPSTAT_B2FULL)) {
+		dequeue_send(clkn);
+	}
+	ISER0 = ISER0_ISE_USB;
+}
@@ -60,5 +60,6 @@ void queue_init();
 usb_pkt_rx *usb_enqueue();
 usb_pkt_rx *dequeue();
 void handle_usb(u32 clkn);
+void usb_send_queued(u32 clkn);
 
 #endif /* __UBERTOOTH_USB_H */
@@ -124,15 +124,9 @@ static void cb_cap(ubertooth_t* ut, void* args)
 	PacketSource_Ubertooth* ubertooth = (PacketSource_Ubertooth*) args;
 	btbb_packet* pkt = NULL;
 	usb_pkt_rx* rx = ringbuffer_bottom_usb(ut->packets);
-	char syms[BANK_LEN * NUM_BANKS];
-
-	for (int i = 0; i < NUM_BANKS; i++)
-		memcpy(syms + i * BANK_LEN,
-		       ringbuffer_get_bt(ut->packets, i),
-		       BANK_LEN);
-
-	int offset = btbb_find_ac(syms, BANK_LEN, LAP_ANY, 1, &pkt);
+	int offset = ubertooth_find_ac(ut, 0, BANK_LEN, LAP_ANY, 1, &pkt);
 	if (offset >= 0) {
+		char* syms = ringbuffer_bt_window(ut->packets);
 
 		uint32_t clkn = (rx->clkn_high << 20) + (le32toh(rx->clk100ns) + offset*10) / 3125;
 
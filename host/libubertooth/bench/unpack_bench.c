@@ -0,0 +1,142 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Times the symbol unpacking kernels of ubertooth_ringbuffer.c against
+ * the original one symbol at a time loop, and checks that they all give
+ * the same output.
+ *
+ * Usage: unpack_bench [iterations]
+ */
+
+/* the kernels are static */
+#include "ubertooth_ringbuffer.c"
+
+#include <time.h>
+
+#define BENCH_PACKETS 4096
+#define DEFAULT_ITERATIONS 200
+
+typedef void (*unpack_fn)(const uint8_t* buf, char* unpacked);
+
+/* As unpack_symbols() was before the lookup table */
+static void unpack_symbols_scalar(const uint8_t* buf, char* unpacked)
+{
+	int i, j;
+
+	for (i = 0; i < SYM_LEN; i++) {
+		for (j = 0; j < 8; j++) {
+			unpacked[i * 8 + j] = ((buf[i] << j) & 0x80) >> 7;
+		}
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec;
+}
+
+static uint8_t packed[BENCH_PACKETS][SYM_LEN];
+static char expected[BENCH_PACKETS][BANK_LEN];
+static char unpacked[BENCH_PACKETS][BANK_LEN];
+
+/* Returns ns per packet, or -1 if the output differs from the scalar
+ * kernel's */
+static double run(unpack_fn fn, int iterations)
+{
+	uint64_t start;
+	int i, n;
+
+	memset(unpacked, 0xff, sizeof(unpacked));
+	for (i = 0; i < BENCH_PACKETS; i++)
+		fn(packed[i], unpacked[i]);
+	if (memcmp(unpacked, expected, sizeof(expected)) != 0)
+		return -1;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < BENCH_PACKETS; i++)
+			fn(packed[i], unpacked[i]);
+
+	return (double)(now_ns() - start) / ((double)iterations * BENCH_PACKETS);
+}
+
+static int report(const char* name, unpack_fn fn, int iterations,
+                  double scalar_ns)
+{
+	double ns = run(fn, iterations);
+
+	if (ns < 0) {
+		printf("%-8s output differs from scalar\n", name);
+		return -1;
+	}
+	printf("%-8s %8.1f ns/packet %6.2fx\n", name, ns,
+	       scalar_ns > 0 ? scalar_ns / ns : 1.0);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int i, j, iterations = DEFAULT_ITERATIONS, failed = 0;
+	double scalar_ns;
+	uint32_t x = 0x12345678;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations < 1)
+		iterations = 1;
+
+	/* xorshift32, so every run times the same input */
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		for (j = 0; j < SYM_LEN; j++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			packed[i][j] = x & 0xff;
+		}
+		unpack_symbols_scalar(packed[i], expected[i]);
+	}
+
+	printf("%d packets of %d symbols, %d iterations\n",
+	       BENCH_PACKETS, BANK_LEN, iterations);
+
+	scalar_ns = run(unpack_symbols_scalar, iterations);
+	printf("%-8s %8.1f ns/packet\n", "scalar", scalar_ns);
+
+#ifdef UNPACK_ENTRY
+	failed |= report("table", unpack_symbols_table, iterations, scalar_ns);
+#endif
+#ifdef UNPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		failed |= report("sse2", unpack_symbols_sse2, iterations, scalar_ns);
+	else
+		printf("%-8s not supported by this CPU\n", "sse2");
+	if (__builtin_cpu_supports("avx2"))
+		failed |= report("avx2", unpack_symbols_avx2, iterations, scalar_ns);
+	else
+		printf("%-8s not supported by this CPU\n", "avx2");
+#endif
+	failed |= report("selected", unpack_symbols, iterations, scalar_ns);
+
+	return failed ? 1 : 0;
+}
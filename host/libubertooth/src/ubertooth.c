@@ -25,6 +25,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/time.h>
 
 #include "ubertooth_callback.h"
 #include "ubertooth.h"
@@ -39,18 +40,42 @@
 #endif
 
 
-uint32_t systime;
-FILE* infile = NULL;
-FILE* dumpfile = NULL;
-int max_ac_errors = 2;
-
-unsigned int packet_counter_max;
-
 void print_version() {
 	printf("libubertooth %s (%s), libbtbb %s (%s)\n", VERSION, RELEASE,
 	       btbb_get_version(), btbb_get_release());
 }
 
+uint64_t ubertooth_monotonic_ns(void)
+{
+#if defined( __APPLE__ )
+	static mach_timebase_info_data_t sTimebaseInfo;
+	uint64_t ts = mach_absolute_time( );
+	if (sTimebaseInfo.denom == 0) {
+		(void) mach_timebase_info(&sTimebaseInfo);
+	}
+	return (ts*sTimebaseInfo.numer/sTimebaseInfo.denom);
+#else
+	struct timespec ts = { 0, 0 };
+	(void) clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (1000000000ull*(uint64_t) ts.tv_sec) + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/* Estimate when a packet was received from the arrival time of the
+ * transfer carrying it and the clock of the transfer's last packet */
+static uint64_t pkt_host_ns(uint64_t xfer_ns, uint32_t last_clk100ns,
+                            uint32_t clk100ns)
+{
+	uint32_t delta;
+
+	if (last_clk100ns >= clk100ns)
+		delta = last_clk100ns - clk100ns;
+	else
+		delta = last_clk100ns + (CLK100NS_WRAP - clk100ns);
+
+	return xfer_ns - 100ull * delta;
+}
+
 ubertooth_t* cleanup_devh = NULL;
 static void cleanup(int sig __attribute__((unused)))
 {
@@ -58,10 +83,15 @@ static void cleanup(int sig __attribute__((unused)))
 		cleanup_devh->stop_ubertooth = 1;
 }
 
+/* The interrupted thread may hold the pcap writer's lock, so that is
+ * left alone here; tools writing pcap files use do_exit = 0 and close
+ * it with ubertooth_stop() once they have left their receive loop. */
 static void cleanup_exit(int sig __attribute__((unused)))
 {
-	if (cleanup_devh)
+	if (cleanup_devh) {
+		cleanup_devh->pcap = NULL;
 		ubertooth_stop(cleanup_devh);
+	}
 	exit(0);
 }
 
@@ -96,68 +126,6 @@ void ubertooth_set_timeout(ubertooth_t* ut, int seconds) {
 	alarm(seconds);
 }
 
-static struct libusb_device_handle* find_ubertooth_device(int ubertooth_device)
-{
-	struct libusb_context *ctx = NULL;
-	struct libusb_device **usb_list = NULL;
-	struct libusb_device_handle *devh = NULL;
-	struct libusb_device_descriptor desc;
-	int usb_devs, i, r, ret, ubertooths = 0;
-	int ubertooth_devs[] = {0,0,0,0,0,0,0,0};
-
-	usb_devs = libusb_get_device_list(ctx, &usb_list);
-	for(i = 0 ; i < usb_devs ; ++i) {
-		r = libusb_get_device_descriptor(usb_list[i], &desc);
-		if(r < 0)
-			fprintf(stderr, "couldn't get usb descriptor for dev #%d!\n", i);
-		if ((desc.idVendor == TC13_VENDORID && desc.idProduct == TC13_PRODUCTID)
-		    || (desc.idVendor == U0_VENDORID && desc.idProduct == U0_PRODUCTID)
-		    || (desc.idVendor == U1_VENDORID && desc.idProduct == U1_PRODUCTID))
-		{
-			ubertooth_devs[ubertooths] = i;
-			ubertooths++;
-		}
-	}
-	if(ubertooths == 1) {
-		ret = libusb_open(usb_list[ubertooth_devs[0]], &devh);
-		if (ret)
-			show_libusb_error(ret);
-	}
-	else if (ubertooths == 0)
-		return NULL;
-	else {
-		if (ubertooth_device < 0) {
-			fprintf(stderr, "multiple Ubertooth devices found! Use '-U' to specify device number\n");
-			u8 serial[17], r;
-			for(i = 0 ; i < ubertooths ; ++i) {
-				libusb_get_device_descriptor(usb_list[ubertooth_devs[i]], &desc);
-				ret = libusb_open(usb_list[ubertooth_devs[i]], &devh);
-				if (ret) {
-					fprintf(stderr, "  Device %d: ", i);
-					show_libusb_error(ret);
-				}
-				else {
-					r = cmd_get_serial(devh, serial);
-					if(r==0) {
-						fprintf(stderr, "  Device %d: ", i);
-						print_serial(serial, stderr);
-					}
-					libusb_close(devh);
-				}
-			}
-			devh = NULL;
-		} else {
-			ret = libusb_open(usb_list[ubertooth_devs[ubertooth_device]], &devh);
-			if (ret) {
-					show_libusb_error(ret);
-					devh = NULL;
-				}
-		}
-	}
-	return devh;
-}
-
-
 /*
  * based on http://libusb.sourceforge.net/api-1.0/group__asyncio.html#ga9fcb2aa23d342060ebda1d0cf7478856
  */
@@ -188,115 +156,751 @@ static void rx_xfer_status(int status)
 	fprintf(stderr,"rx_xfer status: %s (%d)\n",error_name,status);
 }
 
+/* xfers_in_flight is changed on the USB thread when there is one */
+static void xfer_submitted(ubertooth_t* ut)
+{
+	__atomic_add_fetch(&ut->xfers_in_flight, 1, __ATOMIC_ACQ_REL);
+}
+
+static void xfer_finished(ubertooth_t* ut)
+{
+	__atomic_sub_fetch(&ut->xfers_in_flight, 1, __ATOMIC_ACQ_REL);
+}
+
+static int xfers_pending(ubertooth_t* ut)
+{
+	return __atomic_load_n(&ut->xfers_in_flight, __ATOMIC_ACQUIRE);
+}
+
+/* Let ubertooth_bulk_wait() know that there are packets in the fifo,
+ * or that there will be none */
+static void wake_consumer(ubertooth_t* ut)
+{
+	pthread_mutex_lock(&ut->rx_lock);
+	pthread_cond_broadcast(&ut->rx_ready);
+	pthread_mutex_unlock(&ut->rx_lock);
+
+	if (ut->notify != NULL) {
+		pthread_mutex_lock(ut->notify_lock);
+		pthread_cond_broadcast(ut->notify);
+		pthread_mutex_unlock(ut->notify_lock);
+	}
+}
+
+/* Called on the USB event thread: copy the packets out and give the
+ * transfer straight back to libusb. The transfer stays counted in
+ * xfers_in_flight unless it is not resubmitted. */
+static void xfer_to_fifo(ubertooth_t* ut, struct libusb_transfer *xfer)
+{
+	int i, n, r;
+	usb_pkt_rx* rx;
+	uint32_t last_clk100ns = 0;
+	uint64_t xfer_ns = ubertooth_monotonic_ns();
+
+	n = xfer->actual_length / PKT_LEN;
+	if (n > 0)
+		last_clk100ns = ((usb_pkt_rx*)(xfer->buffer + PKT_LEN * (n - 1)))->clk100ns;
+	for (i = 0; i < n; i++) {
+		rx = (usb_pkt_rx*)(xfer->buffer + PKT_LEN * i);
+		if (rx->pkt_type != KEEP_ALIVE)
+			fifo_push(ut->fifo, rx,
+			          pkt_host_ns(xfer_ns, last_clk100ns, rx->clk100ns));
+	}
+	if (n > 0)
+		wake_consumer(ut);
+
+	if (ut->stop_ubertooth) {
+		xfer_finished(ut);
+		return;
+	}
+
+	r = ubertooth_usb_submit(xfer);
+	if (r < 0) {
+		fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+		xfer_finished(ut);
+		wake_consumer(ut);
+	}
+}
+
 static void cb_xfer(struct libusb_transfer *xfer)
 {
-	int r;
-	uint8_t *tmp;
+	int i, r;
 	ubertooth_t* ut = (ubertooth_t*)xfer->user_data;
 
 	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		if(xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
-			r = libusb_submit_transfer(ut->rx_xfer);
-			if (r < 0)
+		if(xfer->status == LIBUSB_TRANSFER_TIMED_OUT && !ut->stop_ubertooth) {
+			r = ubertooth_usb_submit(xfer);
+			if (r < 0) {
 				fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+				xfer_finished(ut);
+				if (ut->usb_thread_running)
+					wake_consumer(ut);
+			}
 			return;
 		}
-		if(xfer->status != LIBUSB_TRANSFER_CANCELLED)
+		/* a transfer which times out while stopping is no error */
+		if(xfer->status != LIBUSB_TRANSFER_CANCELLED &&
+		   !(xfer->status == LIBUSB_TRANSFER_TIMED_OUT && ut->stop_ubertooth))
 			rx_xfer_status(xfer->status);
-		libusb_free_transfer(xfer);
-		ut->rx_xfer = NULL;
+		if(xfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+			ubertooth_device_lost(ut);
+		xfer_finished(ut);
+		if (ut->usb_thread_running)
+			wake_consumer(ut);
 		return;
 	}
 
-	if(ut->usb_really_full) {
-		/* This should never happen, but we'd prefer to error and exit
-		 * than to clobber existing data
-		 */
-		fprintf(stderr, "uh oh, full_usb_buf not emptied\n");
-		ut->stop_ubertooth = 1;
+	if (ut->usb_thread_running) {
+		xfer_to_fifo(ut, xfer);
+		return;
 	}
 
-	if(ut->stop_ubertooth)
+	xfer_finished(ut);
+
+	/* Queue the transfer for ubertooth_bulk_receive(). There is one
+	 * slot per transfer, so this can never overflow; while the
+	 * consumer is behind the remaining transfers keep receiving. */
+	i = (ut->full_head + ut->full_count) % ut->xfer_depth;
+	ut->full_xfers[i] = xfer;
+	ut->full_ns[i] = ubertooth_monotonic_ns();
+	ut->full_count++;
+}
+
+static void ubertooth_bulk_cancel(ubertooth_t* ut)
+{
+	int i;
+
+	if (ut->rx_xfers == NULL)
 		return;
 
-	tmp = ut->full_usb_buf;
-	ut->full_usb_buf = ut->empty_usb_buf;
-	ut->empty_usb_buf = tmp;
-	ut->usb_really_full = 1;
-	ut->rx_xfer->buffer = ut->empty_usb_buf;
+	for (i = 0; i < ut->xfer_depth; i++)
+		if (ut->rx_xfers[i] != NULL)
+			ubertooth_usb_cancel(ut->rx_xfers[i]);
+}
 
-	r = libusb_submit_transfer(ut->rx_xfer);
-	if (r < 0)
-		fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+void ubertooth_bulk_free(ubertooth_t* ut)
+{
+	int i;
+	struct timeval tv = { 0, 100000 };
+
+	if (ut->rx_xfers == NULL)
+		return;
+
+	ubertooth_bulk_thread_stop(ut);
+	ubertooth_bulk_cancel(ut);
+
+	/* Transfers may only be freed once libusb has finished with them */
+	for (i = 0; xfers_pending(ut) > 0 && i < 10; i++)
+		if (ubertooth_usb_handle_events(ut->ctx, &tv) < 0)
+			break;
+	if (xfers_pending(ut) > 0) {
+		fprintf(stderr, "%d USB transfers still pending\n", xfers_pending(ut));
+		return;
+	}
+
+	for (i = 0; i < ut->xfer_depth; i++)
+		libusb_free_transfer(ut->rx_xfers[i]);
+	free(ut->rx_xfers);
+	free(ut->full_xfers);
+	free(ut->full_ns);
+	free(ut->rx_bufs);
+	ut->rx_xfers = NULL;
+	ut->full_xfers = NULL;
+	ut->full_ns = NULL;
+	ut->rx_bufs = NULL;
+	ut->full_head = 0;
+	ut->full_count = 0;
 }
 
 int ubertooth_bulk_init(ubertooth_t* ut)
 {
-	int r;
-	uint8_t rx_buf1[BUFFER_SIZE];
-	uint8_t rx_buf2[BUFFER_SIZE];
+	int i, r;
+
+	ubertooth_bulk_free(ut);
+	if (ut->rx_xfers != NULL)
+		return -1;
 
-	ut->empty_usb_buf = &rx_buf1[0];
-	ut->full_usb_buf = &rx_buf2[0];
-	ut->usb_really_full = 0;
-	ut->rx_xfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(ut->rx_xfer, ut->devh, DATA_IN, ut->empty_usb_buf,
-	                          XFER_LEN, cb_xfer, ut, TIMEOUT);
+	if (ut->xfer_depth < 1)
+		ut->xfer_depth = 1;
 
-	r = libusb_submit_transfer(ut->rx_xfer);
-	if (r < 0) {
-		fprintf(stderr, "rx_xfer submission: %d\n", r);
+	ut->rx_xfers = (struct libusb_transfer**)calloc(ut->xfer_depth, sizeof(struct libusb_transfer*));
+	ut->full_xfers = (struct libusb_transfer**)calloc(ut->xfer_depth, sizeof(struct libusb_transfer*));
+	ut->full_ns = (uint64_t*)calloc(ut->xfer_depth, sizeof(uint64_t));
+	ut->rx_bufs = (uint8_t*)malloc(ut->xfer_depth * XFER_LEN);
+	if (ut->rx_xfers == NULL || ut->full_xfers == NULL || ut->full_ns == NULL
+	    || ut->rx_bufs == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(ut->rx_xfers);
+		free(ut->full_xfers);
+		free(ut->full_ns);
+		free(ut->rx_bufs);
+		ut->rx_xfers = NULL;
+		ut->full_xfers = NULL;
+		ut->full_ns = NULL;
+		ut->rx_bufs = NULL;
+		return -1;
+	}
+	ut->full_head = 0;
+	ut->full_count = 0;
+
+	for (i = 0; i < ut->xfer_depth; i++) {
+		ut->rx_xfers[i] = libusb_alloc_transfer(0);
+		if (ut->rx_xfers[i] == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			ubertooth_bulk_free(ut);
+			return -1;
+		}
+		libusb_fill_bulk_transfer(ut->rx_xfers[i], ut->devh, DATA_IN,
+		                          ut->rx_bufs + i * XFER_LEN,
+		                          XFER_LEN, cb_xfer, ut, TIMEOUT);
+	}
+
+	for (i = 0; i < ut->xfer_depth; i++) {
+		r = ubertooth_usb_submit(ut->rx_xfers[i]);
+		if (r < 0) {
+			fprintf(stderr, "rx_xfer submission: %d\n", r);
+			/* cancels and frees those already submitted */
+			ubertooth_bulk_free(ut);
+			return -1;
+		}
+		xfer_submitted(ut);
+	}
+	return 0;
+}
+
+/* Number of bulk transfers ubertooth_bulk_init() keeps in flight, only
+ * while none are */
+int ubertooth_set_xfer_depth(ubertooth_t* ut, int depth)
+{
+	if (depth < 1 || depth > MAX_XFER_DEPTH) {
+		fprintf(stderr, "Transfer depth must be 1 to %d\n", MAX_XFER_DEPTH);
+		return -1;
+	}
+	if (ut->rx_xfers != NULL) {
+		fprintf(stderr, "Transfer depth can not be changed while streaming\n");
+		return -1;
+	}
+	ut->xfer_depth = depth;
+	return 0;
+}
+
+/* Once everything received before the device was lost has been handed
+ * out: reconnect if enabled, otherwise give up rather than wait for
+ * transfers which will never complete */
+static int device_gone(ubertooth_t* ut)
+{
+	if (ubertooth_reconnect(ut) == 0)
+		return 0;
+	ut->stop_ubertooth = 1;
+	return -1;
+}
+
+/* Buffered output which is due is written out even while nothing comes
+ * in */
+static void poll_outputs(ubertooth_t* ut)
+{
+	if (ut->dumpfile)
+		dump_writer_poll(ut->dumpfile);
+	if (ut->capfile)
+		capfile_writer_poll(ut->capfile);
+}
+
+/* Nothing more can arrive in the fifo once every transfer has ended or
+ * the USB thread has given up. The fifo is filled before a transfer
+ * stops being counted, so it is looked at last. */
+static int fifo_stream_over(ubertooth_t* ut)
+{
+	if (xfers_pending(ut) > 0 && !ut->usb_thread_exited)
+		return 0;
+	return fifo_depth(ut->fifo) == 0;
+}
+
+/* For a device serviced by the USB thread: reconnect it if it was
+ * unplugged, and set stop_ubertooth once its stream is over. Returns
+ * -1 if there will be no more packets. */
+int ubertooth_bulk_thread_check(ubertooth_t* ut)
+{
+	if (ut->hotplug.lost)
+		return device_gone(ut);
+	if (fifo_stream_over(ut)) {
+		ut->stop_ubertooth = 1;
 		return -1;
 	}
 	return 0;
 }
 
+/* Wait for the USB thread to fill the fifo. Signal handlers can only
+ * set stop_ubertooth, so that is looked at every BULK_WAIT_POLL_NS too.
+ * Once the fifo is drained and nothing more can arrive the stream is
+ * over. */
+static void bulk_wait_fifo(ubertooth_t* ut)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	pthread_mutex_lock(&ut->rx_lock);
+	while (fifo_depth(ut->fifo) == 0 && !ut->stop_ubertooth) {
+		if (ut->hotplug.lost) {
+			pthread_mutex_unlock(&ut->rx_lock);
+			device_gone(ut);
+			pthread_mutex_lock(&ut->rx_lock);
+			continue;
+		}
+		if (fifo_stream_over(ut)) {
+			ut->stop_ubertooth = 1;
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ns = ts.tv_nsec + BULK_WAIT_POLL_NS;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&ut->rx_ready, &ut->rx_lock, &ts);
+		pthread_mutex_unlock(&ut->rx_lock);
+		poll_outputs(ut);
+		pthread_mutex_lock(&ut->rx_lock);
+	}
+	pthread_mutex_unlock(&ut->rx_lock);
+}
+
 void ubertooth_bulk_wait(ubertooth_t* ut)
 {
 	int r;
+	struct timeval tv;
 
-	while (!ut->usb_really_full) {
-		r = libusb_handle_events(NULL);
-		if (r < 0) {
-			if (r == LIBUSB_ERROR_INTERRUPTED)
-				break;
+	if (ut->usb_thread_running) {
+		bulk_wait_fifo(ut);
+		return;
+	}
+
+	while (ut->full_count == 0) {
+		if (xfers_pending(ut) > 0) {
+			tv.tv_sec = 0;
+			tv.tv_usec = BULK_WAIT_POLL_NS / 1000;
+			r = ubertooth_usb_handle_events(ut->ctx, &tv);
+			if (r < 0) {
+				if (r == LIBUSB_ERROR_INTERRUPTED)
+					break;
+				show_libusb_error(r);
+			}
+			poll_outputs(ut);
+		}
+		if (xfers_pending(ut) == 0 && ut->full_count == 0) {
+			if (ut->hotplug.lost && device_gone(ut) == 0)
+				continue;
+			/* every transfer ended in an error: end of stream */
+			ut->stop_ubertooth = 1;
+			break;
+		}
+	}
+}
+
+static void* usb_thread(void* arg)
+{
+	int r;
+	ubertooth_t* ut = (ubertooth_t*)arg;
+	struct timeval tv;
+
+	while (!ut->stop_usb_thread) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		r = ubertooth_usb_handle_events(ut->ctx, &tv);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
 			show_libusb_error(r);
+			break;
 		}
 	}
+	ut->usb_thread_exited = 1;
+	wake_consumer(ut);
+	return NULL;
 }
 
-int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
+/* Service libusb on a separate thread so that slow callbacks do not
+ * stall USB. Call after ubertooth_bulk_init(); packets are then handed
+ * to ubertooth_bulk_receive() through ut->fifo. */
+int ubertooth_bulk_thread_start(ubertooth_t* ut)
 {
-	int i, r;
-	usb_pkt_rx* rx;
+	int r;
+
+	if (ut->usb_thread_running)
+		return 0;
 
-	if (!ut->usb_really_full)
+	if (ut->fifo == NULL) {
+		ut->fifo = fifo_init(ut->fifo_size);
+		if (ut->fifo == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+	}
+
+	ut->stop_usb_thread = 0;
+	ut->usb_thread_exited = 0;
+	ut->usb_thread_running = 1;
+	r = pthread_create(&ut->usb_thread, NULL, usb_thread, ut);
+	if (r != 0) {
+		fprintf(stderr, "Unable to start USB thread (%d)\n", r);
+		ut->usb_thread_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void ubertooth_bulk_thread_stop(ubertooth_t* ut)
+{
+	if (!ut->usb_thread_running)
+		return;
+
+	ut->stop_usb_thread = 1;
+	pthread_join(ut->usb_thread, NULL);
+	ut->usb_thread_running = 0;
+}
+
+void ubertooth_print_fifo_stats(ubertooth_t* ut, FILE* fileptr)
+{
+	if (ut->fifo == NULL)
+		return;
+	if (fileptr == NULL)
+		fileptr = stderr;
+
+	fprintf(fileptr, "fifo: size=%u depth=%u high_water=%u packets=%llu dropped=%llu\n",
+	        ut->fifo->size, fifo_depth(ut->fifo), ut->fifo->high_water,
+	        (unsigned long long)ut->fifo->pushed,
+	        (unsigned long long)ut->fifo->dropped);
+}
+
+static int bulk_receive_fifo(ubertooth_t* ut, rx_callback cb, void* cb_args)
+{
+	uint32_t i, n;
+	usb_pkt_rx* pkts;
+	uint64_t* host_ns;
+
+	n = fifo_get_batch(ut->fifo, &pkts, &host_ns);
+	if (n == 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		ut->rx_host_ns = host_ns[i];
+		ringbuffer_add(ut->packets, &pkts[i]);
+		(*cb)(ut, cb_args);
+		if (ut->stop_ubertooth) {
+			fifo_release(ut->fifo, i + 1);
+			ubertooth_bulk_cancel(ut);
+			return 1;
+		}
+	}
+	fifo_release(ut->fifo, n);
+
+	fflush(stderr);
+	return 0;
+}
+
+/* Take the oldest completed transfer off the queue, waiting for
+ * libusb if there is none yet */
+static struct libusb_transfer* next_full_xfer(ubertooth_t* ut, uint64_t* xfer_ns)
+{
+	int r;
+	struct libusb_transfer* xfer;
+
+	/* nothing will come in once every transfer has failed */
+	if (ut->full_count == 0 && xfers_pending(ut) > 0)
 	{
-		r = libusb_handle_events(NULL);
+		r = ubertooth_usb_handle_events(ut->ctx, NULL);
 		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
 			show_libusb_error(r);
 	}
 
-	if (ut->usb_really_full) {
-		/* process each received block */
-		for (i = 0; i < PKTS_PER_XFER; i++) {
-			rx = (usb_pkt_rx*)(ut->full_usb_buf + PKT_LEN * i);
-			if(rx->pkt_type != KEEP_ALIVE) {
-				ringbuffer_add(ut->packets, rx);
-				(*cb)(ut, cb_args);
-			}
-			if(ut->stop_ubertooth) {
-				if(ut->rx_xfer)
-					libusb_cancel_transfer(ut->rx_xfer);
-				return 1;
-			}
+	if (ut->full_count == 0)
+		return NULL;
+
+	xfer = ut->full_xfers[ut->full_head];
+	*xfer_ns = ut->full_ns[ut->full_head];
+	ut->full_head = (ut->full_head + 1) % ut->xfer_depth;
+	ut->full_count--;
+
+	return xfer;
+}
+
+/* hand the buffer back to the device */
+static void resubmit_xfer(ubertooth_t* ut, struct libusb_transfer* xfer)
+{
+	int r = ubertooth_usb_submit(xfer);
+	if (r < 0)
+		fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+	else
+		xfer_submitted(ut);
+}
+
+int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
+{
+	int i, n;
+	usb_pkt_rx* rx;
+	struct libusb_transfer* xfer;
+	uint64_t xfer_ns;
+	uint32_t last_clk100ns = 0;
+
+	if (ut->usb_thread_running)
+		return bulk_receive_fifo(ut, cb, cb_args);
+
+	xfer = next_full_xfer(ut, &xfer_ns);
+	if (xfer == NULL)
+		return -1;
+
+	/* process each received block, a trailing short packet is a
+	 * keep alive */
+	n = xfer->actual_length / PKT_LEN;
+	if (n > 0)
+		last_clk100ns = ((usb_pkt_rx*)(xfer->buffer + PKT_LEN * (n - 1)))->clk100ns;
+	for (i = 0; i < n; i++) {
+		rx = (usb_pkt_rx*)(xfer->buffer + PKT_LEN * i);
+		if(rx->pkt_type != KEEP_ALIVE) {
+			ut->rx_host_ns = pkt_host_ns(xfer_ns, last_clk100ns, rx->clk100ns);
+			ringbuffer_add(ut->packets, rx);
+			(*cb)(ut, cb_args);
+		}
+		if(ut->stop_ubertooth) {
+			ubertooth_bulk_cancel(ut);
+			return 1;
+		}
+	}
+
+	resubmit_xfer(ut, xfer);
+
+	fflush(stderr);
+	return 0;
+}
+
+static int bulk_receive_batch_fifo(ubertooth_t* ut, rx_batch_callback cb,
+                                   void* cb_args)
+{
+	uint32_t n;
+	usb_pkt_rx* pkts;
+	uint64_t* host_ns;
+
+	n = fifo_get_batch(ut->fifo, &pkts, &host_ns);
+	if (n == 0)
+		return -1;
+
+	ut->rx_host_ns = host_ns[0];
+	usb_pkt_batch_set(&ut->rx_batch, (const uint8_t*)pkts, n,
+	                  sizeof(usb_pkt_rx), host_ns[n - 1]);
+	(*cb)(ut, &ut->rx_batch, cb_args);
+	fifo_release(ut->fifo, n);
+
+	if (ut->stop_ubertooth) {
+		ubertooth_bulk_cancel(ut);
+		return 1;
+	}
+
+	fflush(stderr);
+	return 0;
+}
+
+/* Like ubertooth_bulk_receive(), but the callback gets every packet of
+ * a transfer at once, in place in the transfer buffer. Nothing is
+ * copied into ut->packets and symbols are only unpacked on request
+ * through usb_pkt_batch_get_bt(). The batch is only valid for the
+ * duration of the callback. */
+int ubertooth_bulk_receive_batch(ubertooth_t* ut, rx_batch_callback cb,
+                                 void* cb_args)
+{
+	int i, n, count = 0;
+	const usb_pkt_rx* rx;
+	struct libusb_transfer* xfer;
+	uint64_t xfer_ns;
+
+	if (ut->usb_thread_running)
+		return bulk_receive_batch_fifo(ut, cb, cb_args);
+
+	xfer = next_full_xfer(ut, &xfer_ns);
+	if (xfer == NULL)
+		return -1;
+
+	/* leave out keep alives */
+	n = xfer->actual_length / PKT_LEN;
+	for (i = 0; i < n; i++) {
+		rx = (const usb_pkt_rx*)(xfer->buffer + PKT_LEN * i);
+		if (rx->pkt_type != KEEP_ALIVE)
+			ut->rx_slots[count++] = i;
+	}
+
+	if (count > 0) {
+		ut->rx_host_ns = xfer_ns;
+		usb_pkt_batch_set_slots(&ut->rx_batch, xfer->buffer,
+		                        count < n ? ut->rx_slots : NULL,
+		                        count, PKT_LEN, xfer_ns);
+		(*cb)(ut, &ut->rx_batch, cb_args);
+	}
+
+	if(ut->stop_ubertooth) {
+		ubertooth_bulk_cancel(ut);
+		return 1;
+	}
+
+	resubmit_xfer(ut, xfer);
+
+	fflush(stderr);
+	return 0;
+}
+
+/* Parse a signal gate spec, "snr=<n>,trigger,neighbours=<n>" with any
+ * of the options left out, and enable the gate */
+int ubertooth_gate_parse(const char* spec, signal_gate* gate)
+{
+	const char* p = spec;
+	const char* value;
+	char* end;
+
+	memset(gate, 0, sizeof(signal_gate));
+	gate->neighbours = DEFAULT_GATE_NEIGHBOURS;
+
+	while (*p != '\0') {
+		value = p;
+		end = (char*)p;
+		if (strncmp(p, "snr=", 4) == 0) {
+			value = p + 4;
+			gate->min_snr = strtol(value, &end, 10);
+		} else if (strncmp(p, "neighbours=", 11) == 0) {
+			value = p + 11;
+			gate->neighbours = strtol(value, &end, 10);
+		} else if (strncmp(p, "trigger", 7) == 0) {
+			gate->require_trigger = 1;
+			end = (char*)p + 7;
 		}
-		ut->usb_really_full = 0;
-		fflush(stderr);
+
+		/* unknown option, or a value without digits */
+		if (end == p || end == value || (*end != '\0' && *end != ',') ||
+		    gate->min_snr < 0 || gate->neighbours < 0) {
+			fprintf(stderr, "Invalid signal gate: %s\n", spec);
+			return -1;
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	gate->enabled = 1;
+	return 0;
+}
+
+static int block_has_signal(ubertooth_t* ut, const usb_pkt_rx* rx)
+{
+	int8_t noise;
+
+	if (ut->gate.require_trigger && !(rx->status & (CS_TRIGGER | RSSI_TRIGGER)))
 		return 0;
-	} else {
+
+	/* without RSSI statistics there is nothing to go by */
+	if (ut->gate.min_snr > 0 && rx->rssi_count > 0 && ut->rssi) {
+		noise = rssi_tracker_noise(ut->rssi, rx->channel);
+		if (noise != INT8_MIN &&
+		    (int8_t)rx->rssi_max - noise < ut->gate.min_snr)
+			return 0;
+	}
+	return 1;
+}
+
+/* Whether the access code search of search_length symbols from bank is
+ * worth doing: one of the banks the symbols come from, or one of their
+ * neighbours, has to show signal. Counts the skipped searches. */
+int ubertooth_gate_pass(ubertooth_t* ut, uint8_t bank, int search_length)
+{
+	int first, last, i;
+
+	if (!ut->gate.enabled)
+		return 1;
+
+	first = bank - ut->gate.neighbours;
+	if (first < 0)
+		first = 0;
+	/* the last symbol looked at is the end of a 64 bit access code */
+	last = bank + (search_length + 62) / BANK_LEN + ut->gate.neighbours;
+	if (last > NUM_BANKS - 1)
+		last = NUM_BANKS - 1;
+
+	ut->gate.searches++;
+	for (i = first; i <= last; i++) {
+		if (block_has_signal(ut, ringbuffer_get_usb(ut->packets, i)))
+			return 1;
+	}
+	ut->gate.skipped++;
+	return 0;
+}
+
+void ubertooth_print_gate_stats(ubertooth_t* ut, FILE* fileptr)
+{
+	if (!ut->gate.enabled)
+		return;
+	if (fileptr == NULL)
+		fileptr = stderr;
+
+	fprintf(fileptr, "signal gate: searches=%llu skipped=%llu\n",
+	        (unsigned long long)ut->gate.searches,
+	        (unsigned long long)ut->gate.skipped);
+}
+
+/* btbb_find_ac() on the ringbuffer symbols starting at bank. A pre-scan
+ * of the packed symbols picks out candidate offsets, so libbtbb only
+ * has to check those and symbols are only unpacked when there is one. */
+int ubertooth_find_ac(ubertooth_t* ut, uint8_t bank, int search_length,
+                      uint32_t lap, int max_ac_errors, btbb_packet** pkt)
+{
+	ac_search_t* s = ac_search_get(&ut->ac_search, lap, max_ac_errors);
+	const uint8_t* packed = ringbuffer_get_packed(ut->packets, bank);
+	char* syms;
+	int offset = 0;
+
+	if (!ubertooth_gate_pass(ut, bank, search_length))
 		return -1;
+
+	if (s == NULL)
+		return btbb_find_ac(ringbuffer_get_bt(ut->packets, bank),
+		                    search_length, lap, max_ac_errors, pkt);
+
+	while ((offset = ac_search_find(s, packed, offset, search_length)) >= 0) {
+		syms = ringbuffer_get_bt(ut->packets, bank);
+		if (btbb_find_ac(syms + offset, 1, lap, max_ac_errors, pkt) == 0)
+			return offset;
+		offset++;
+	}
+	return -1;
+}
+
+/* Like ubertooth_find_ac(), for whichever LAP of the watchlist comes
+ * first */
+int ubertooth_find_ac_watchlist(ubertooth_t* ut, const ac_watchlist_t* wl,
+                                uint8_t bank, int search_length,
+                                btbb_packet** pkt)
+{
+	const uint8_t* packed = ringbuffer_get_packed(ut->packets, bank);
+	char* syms;
+	uint32_t lap;
+	int offset = 0;
+
+	if (!ubertooth_gate_pass(ut, bank, search_length))
+		return -1;
+
+	while ((offset = ac_watchlist_find(wl, packed, offset, search_length, &lap)) >= 0) {
+		syms = ringbuffer_get_bt(ut->packets, bank);
+		if (btbb_find_ac(syms + offset, 1, lap, wl->max_ac_errors, pkt) == 0)
+			return offset;
+		offset++;
 	}
+	return -1;
+}
+
+/* The result of a search done ahead of time by another thread, as
+ * ubertooth_find_ac() would have returned it. Only the signal gate is
+ * left to do, as it depends on the noise floor seen so far. */
+int ubertooth_take_ac_result(ubertooth_t* ut, uint8_t bank, int search_length,
+                             btbb_packet** pkt)
+{
+	ac_result* r = ut->ac_result;
+
+	if (!ubertooth_gate_pass(ut, bank, search_length))
+		return -1;
+	if (r->offset < 0)
+		return -1;
+
+	*pkt = r->pkt;
+	r->pkt = NULL;
+	return r->offset;
 }
 
 static int stream_rx_usb(ubertooth_t* ut, rx_callback cb, void* cb_args)
@@ -307,7 +911,7 @@ static int stream_rx_usb(ubertooth_t* ut, rx_callback cb, void* cb_args)
 		return r;
 
 	// tell ubertooth to send packets
-	r = cmd_rx_syms(ut->devh);
+	r = ubertooth_start_mode(ut, UBERTOOTH_RX_SYMBOLS, 0, 0);
 	if (r < 0)
 		return r;
 
@@ -321,25 +925,138 @@ static int stream_rx_usb(ubertooth_t* ut, rx_callback cb, void* cb_args)
 	return 0;
 }
 
+static int stream_rx_usb_batch(ubertooth_t* ut, rx_batch_callback cb,
+                               void* cb_args)
+{
+	// init USB transfer
+	int r = ubertooth_bulk_init(ut);
+	if (r < 0)
+		return r;
+
+	// tell ubertooth to send packets
+	r = ubertooth_start_mode(ut, UBERTOOTH_RX_SYMBOLS, 0, 0);
+	if (r < 0)
+		return r;
+
+	// receive and process each packet
+	while(!ut->stop_ubertooth) {
+		ubertooth_bulk_wait(ut);
+		r = ubertooth_bulk_receive_batch(ut, cb, cb_args);
+		if (r == 1)
+			return 1;
+	}
+	return 0;
+}
+
 /* file should be in full USB packet format (ubertooth-dump -f) */
 int stream_rx_file(ubertooth_t* ut, FILE* fp, rx_callback cb, void* cb_args)
 {
-	uint8_t buf[BUFFER_SIZE];
-	size_t nitems;
+	replay_file* rf;
+	const uint8_t* records;
+	int i, n;
 
-	while(1) {
-		uint32_t systime_be;
-		nitems = fread(&systime_be, sizeof(systime_be), 1, fp);
-		if (nitems != 1)
-			return 0;
-		systime = (time_t)be32toh(systime_be);
+	rf = replay_open(fp);
+	if (rf == NULL)
+		return -1;
 
-		nitems = fread(buf, sizeof(buf[0]), PKT_LEN, fp);
-		if (nitems != PKT_LEN)
-			return 0;
-		ringbuffer_add(ut->packets, (usb_pkt_rx*)buf);
-		(*cb)(ut, cb_args);
+	/* no arrival times to discipline the clock with */
+	ut->rx_host_ns = 0;
+	ut->infile = fp;
+
+	while (!ut->stop_ubertooth &&
+	       (n = replay_next(rf, &records, REPLAY_BATCH)) > 0) {
+		for (i = 0; i < n && !ut->stop_ubertooth; i++, records += REPLAY_RECORD_LEN) {
+			ut->systime = (time_t)replay_systime(records);
+			ringbuffer_add(ut->packets, replay_packet(records));
+			(*cb)(ut, cb_args);
+		}
+	}
+
+	replay_close(rf);
+	return 0;
+}
+
+/* As stream_rx_file(), but packets are passed in place, a batch at a
+ * time. All the packets in a batch have the same ut->systime. */
+int stream_rx_file_batch(ubertooth_t* ut, FILE* fp, rx_batch_callback cb,
+                         void* cb_args)
+{
+	replay_file* rf;
+	const uint8_t* records;
+	uint32_t systime;
+	int i, n;
+
+	rf = replay_open(fp);
+	if (rf == NULL)
+		return -1;
+
+	ut->rx_host_ns = 0;
+	ut->infile = fp;
+
+	while (!ut->stop_ubertooth &&
+	       (n = replay_next(rf, &records, REPLAY_BATCH)) > 0) {
+		/* split the run where the second changes */
+		while (n > 0) {
+			systime = replay_systime(records);
+			for (i = 1; i < n; i++)
+				if (replay_systime(records + i * REPLAY_RECORD_LEN) != systime)
+					break;
+
+			ut->systime = (time_t)systime;
+			usb_pkt_batch_set(&ut->rx_batch, records + REPLAY_SYSTIME_LEN,
+			                  i, REPLAY_RECORD_LEN, 0);
+			(*cb)(ut, &ut->rx_batch, cb_args);
+
+			records += i * REPLAY_RECORD_LEN;
+			n -= i;
+		}
+	}
+
+	replay_close(rf);
+	return 0;
+}
+
+/* Replay the packets of an indexed capture file which match q, NULL
+ * for all of them. Blocks the index rules out are not read. */
+int stream_rx_capfile(ubertooth_t* ut, capfile_reader* cf, const capfile_query* q,
+                      rx_callback cb, void* cb_args)
+{
+	capfile_query all;
+	const uint8_t* rec;
+	uint64_t time_ns;
+	uint32_t i, j;
+
+	if (q == NULL) {
+		capfile_query_init(&all);
+		q = &all;
+	}
+
+	ut->rx_host_ns = 0;
+	ut->infile = cf->fp;
+	/* record times are since the epoch rather than CLOCK_MONOTONIC */
+	if (cf->meta.flags & CAPFILE_HOST_TIME)
+		clock_sync_set_epoch(&ut->clock);
+
+	for (i = 0; i < cf->num_blocks && !ut->stop_ubertooth; i++) {
+		if (!capfile_block_matches(&cf->index[i], q))
+			continue;
+		rec = capfile_read_block(cf, i);
+		if (rec == NULL)
+			return -1;
+
+		for (j = 0; j < cf->index[i].count; j++, rec += CAPFILE_RECORD_LEN) {
+			if (!capfile_record_matches(rec, q))
+				continue;
+			time_ns = capfile_record_time(rec);
+			ut->systime = (time_t)(time_ns / 1000000000ull);
+			/* second resolution times are no use to the clock */
+			if (cf->meta.flags & CAPFILE_HOST_TIME)
+				ut->rx_host_ns = time_ns;
+			ringbuffer_add(ut->packets, capfile_record_packet(rec));
+			(*cb)(ut, cb_args);
+		}
 	}
+	return 0;
 }
 
 /* Receive and process packets. For now, returning from
@@ -348,7 +1065,7 @@ int stream_rx_file(ubertooth_t* ut, FILE* fp, rx_callback cb, void* cb_args)
  * nice. */
 void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 {
-	int r = btbb_init(max_ac_errors);
+	int r = btbb_init(ut->max_ac_errors);
 	if (r < 0)
 		return;
 
@@ -367,7 +1084,6 @@ void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 	 */
 	if (pn != NULL && btbb_piconet_get_flag(pn, BTBB_CLK27_VALID)) {
 		ut->stop_ubertooth = 0;
-		ut->usb_really_full = 0;
 		// cmd_stop(ut->devh);
 		cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
 		cmd_start_hopping(ut->devh, btbb_piconet_get_clk_offset(pn), 0);
@@ -375,18 +1091,52 @@ void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 	}
 }
 
+static int afh_estimator_start(ubertooth_t* ut, btbb_piconet* pn,
+                               afh_change_callback cb, void* cb_args)
+{
+	afh_estimator_free(ut->afh);
+	if (ut->afh_window_ms)
+		ut->afh = afh_estimator_init(AFH_WINDOW_TIME, 1000000ull * ut->afh_window_ms,
+		                             cb, cb_args);
+	else
+		ut->afh = afh_estimator_init(AFH_WINDOW_PACKETS, ut->packet_counter_max,
+		                             cb, cb_args);
+	if (ut->afh == NULL)
+		return -1;
+
+	return afh_estimator_add_piconet(ut->afh, btbb_piconet_get_lap(pn));
+}
+
+static void afh_monitor_change(const afh_change* change, void* args)
+{
+	btbb_piconet* pn = (btbb_piconet*)args;
+
+	if (change->used) {
+		if (btbb_piconet_set_channel_seen(pn, change->channel)) {
+			printf("+ channel %2d is used now\n", change->channel);
+			btbb_print_afh_map(pn);
+		}
+	} else {
+		if (btbb_piconet_clear_channel_seen(pn, change->channel)) {
+			printf("- channel %2d is not used any more\n", change->channel);
+			btbb_print_afh_map(pn);
+		}
+	}
+}
+
 void rx_afh(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 {
-	int r = btbb_init(max_ac_errors);
+	int piconet;
+	int r = btbb_init(ut->max_ac_errors);
 	if (r < 0)
 		return;
 
-	cmd_set_channel(ut->devh, 9999);
+	ubertooth_set_channel(ut, 9999);
 
 	if (timeout) {
 		ubertooth_set_timeout(ut, timeout);
 
-		cmd_afh(ut->devh);
+		ubertooth_start_mode(ut, UBERTOOTH_AFH, 0, 0);
 		stream_rx_usb(ut, cb_afh_initial, pn);
 
 		cmd_stop(ut->devh);
@@ -395,25 +1145,53 @@ void rx_afh(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 	}
 
 	/*
-	 * Monitor changes in AFH channel map
+	 * Monitor changes in AFH channel map, channels found so far are
+	 * dropped unless seen again within the window
 	 */
-	cmd_clear_afh_map(ut->devh);
-	cmd_afh(ut->devh);
+	piconet = afh_estimator_start(ut, pn, afh_monitor_change, pn);
+	if (piconet < 0)
+		return;
+	afh_estimator_seed(ut->afh, piconet, btbb_piconet_get_afh_map(pn),
+	                   ubertooth_monotonic_ns());
+
+	ubertooth_clear_afh_map(ut);
+	ubertooth_start_mode(ut, UBERTOOTH_AFH, 0, 0);
 	stream_rx_usb(ut, cb_afh_monitor, pn);
 }
 
+typedef struct {
+	btbb_piconet* pn;
+	uint8_t changed;
+} afh_r_state;
+
+static void afh_r_change(const afh_change* change, void* args)
+{
+	afh_r_state* state = (afh_r_state*)args;
+
+	if (change->used)
+		btbb_piconet_set_channel_seen(state->pn, change->channel);
+	else
+		btbb_piconet_clear_channel_seen(state->pn, change->channel);
+	state->changed = 1;
+}
+
 void rx_afh_r(ubertooth_t* ut, btbb_piconet* pn, int timeout __attribute__((unused)))
 {
-	static uint32_t lasttime;
+	uint32_t lasttime = 0;
+	/* the map is printed once to start with */
+	afh_r_state state = { pn, 1 };
 
-	int r = btbb_init(max_ac_errors);
+	int r = btbb_init(ut->max_ac_errors);
 	int i, j;
 	if (r < 0)
 		return;
 
-	cmd_set_channel(ut->devh, 9999);
+	if (afh_estimator_start(ut, pn, afh_r_change, &state) < 0)
+		return;
+
+	ubertooth_set_channel(ut, 9999);
 
-	cmd_afh(ut->devh);
+	ubertooth_start_mode(ut, UBERTOOTH_AFH, 0, 0);
 
 	// init USB transfer
 	r = ubertooth_bulk_init(ut);
@@ -421,16 +1199,18 @@ void rx_afh_r(ubertooth_t* ut, btbb_piconet* pn, int timeout __attribute__((unus
 		return;
 
 	// tell ubertooth to send packets
-	r = cmd_rx_syms(ut->devh);
+	r = ubertooth_start_mode(ut, UBERTOOTH_RX_SYMBOLS, 0, 0);
 	if (r < 0)
 		return;
 
 	// receive and process each packet
-	while(1) {
-		// libusb_handle_events(NULL);
+	while(!ut->stop_ubertooth) {
+		// libusb_handle_events(ut->ctx);
 		ubertooth_bulk_wait(ut);
 		r = ubertooth_bulk_receive(ut, cb_afh_r, pn);
-		if(lasttime < time(NULL)) {
+		/* at most once a second, and only when the map has changed */
+		if(state.changed && lasttime < time(NULL)) {
+			state.changed = 0;
 			lasttime = time(NULL);
 			printf("%u ", (uint32_t)time(NULL));
 			// btbb_print_afh_map(pn);
@@ -452,14 +1232,14 @@ void rx_afh_r(ubertooth_t* ut, btbb_piconet* pn, int timeout __attribute__((unus
 /* sniff one target LAP until the UAP is determined */
 void rx_file(FILE* fp, btbb_piconet* pn)
 {
-	int r = btbb_init(max_ac_errors);
-	if (r < 0)
-		return;
-
 	ubertooth_t* ut = ubertooth_init();
 	if (ut == NULL)
 		return;
 
+	int r = btbb_init(ut->max_ac_errors);
+	if (r < 0)
+		return;
+
 	stream_rx_file(ut, fp, cb_br_rx, pn);
 }
 
@@ -472,85 +1252,127 @@ void rx_btle_file(FILE* fp)
 	stream_rx_file(ut, fp, cb_btle, NULL);
 }
 
-static void cb_dump_bitstream(ubertooth_t* ut, void* args __attribute__((unused)))
+static void cb_dump_bitstream(ubertooth_t* ut,
+                              usb_pkt_batch* batch,
+                              void* args __attribute__((unused)))
 {
-	int i;
-	char nl = '\n';
+	int i, j;
 
-	char bitstream[BANK_LEN];
-	memcpy(bitstream, ringbuffer_top_bt(ut->packets), BANK_LEN);
+	char bitstream[BANK_LEN + 1];
+	const char* bt;
 
-	// convert to ascii
-	for (i = 0; i < BANK_LEN; ++i)
-		bitstream[i] += 0x30;
+	for (j = 0; j < batch->count; j++) {
+		bt = usb_pkt_batch_get_bt(batch, j);
+		if (bt == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return;
+		}
 
-	fprintf(stderr, "rx block timestamp %u * 100 nanoseconds\n",
-	        ringbuffer_top_usb(ut->packets)->clk100ns);
-	if (dumpfile == NULL) {
-		fwrite(bitstream, sizeof(u8), BANK_LEN, stdout);
-		fwrite(&nl, sizeof(u8), 1, stdout);
-	} else {
-		fwrite(bitstream, sizeof(u8), BANK_LEN, dumpfile);
-		fwrite(&nl, sizeof(u8), 1, dumpfile);
+		// convert to ascii
+		for (i = 0; i < BANK_LEN; ++i)
+			bitstream[i] = bt[i] + 0x30;
+		bitstream[BANK_LEN] = '\n';
+
+		fprintf(stderr, "rx block timestamp %u * 100 nanoseconds\n",
+		        usb_pkt_batch_get(batch, j)->clk100ns);
+		dump_writer_write(ut->dumpfile, bitstream, sizeof(bitstream));
 	}
 }
 
-static void cb_dump_full(ubertooth_t* ut, void* args __attribute__((unused)))
+static void cb_dump_full(ubertooth_t* ut,
+                         usb_pkt_batch* batch,
+                         void* args __attribute__((unused)))
 {
-	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
-
-	fprintf(stderr, "rx block timestamp %u * 100 nanoseconds\n", rx->clk100ns);
-	uint32_t time_be = htobe32((uint32_t)time(NULL));
-	if (dumpfile == NULL) {
-		fwrite(&time_be, 1, sizeof(time_be), stdout);
-		fwrite((uint8_t*)rx, sizeof(u8), PKT_LEN, stdout);
-	} else {
-		fwrite(&time_be, 1, sizeof(time_be), dumpfile);
-		fwrite((uint8_t*)rx, sizeof(u8), PKT_LEN, dumpfile);
-		fflush(dumpfile);
+	int j;
+	const usb_pkt_rx* rx;
+	uint32_t last_clk100ns;
+
+	uint32_t now = (uint32_t)time(NULL);
+	last_clk100ns = usb_pkt_batch_get(batch, batch->count - 1)->clk100ns;
+	for (j = 0; j < batch->count; j++) {
+		rx = usb_pkt_batch_get(batch, j);
+		fprintf(stderr, "rx block timestamp %u * 100 nanoseconds\n", rx->clk100ns);
+		if (ut->dumpfile)
+			dump_writer_write_pkt(ut->dumpfile, now, rx);
+		if (ut->capfile)
+			capfile_writer_write_host(ut->capfile,
+					pkt_host_ns(batch->host_ns, last_clk100ns, rx->clk100ns), rx);
 	}
 }
 
-/* dump received symbols to stdout */
+/* dump received symbols to dumpfile and capfile, or stdout if there is
+ * neither */
 void rx_dump(ubertooth_t* ut, int bitstream)
 {
+	if (ut->dumpfile == NULL && (bitstream || ut->capfile == NULL)) {
+		ut->dumpfile = dump_writer_fdopen(STDOUT_FILENO, NULL);
+		if (ut->dumpfile == NULL)
+			return;
+	}
+
 	if (bitstream)
-		stream_rx_usb(ut, cb_dump_bitstream, NULL);
+		stream_rx_usb_batch(ut, cb_dump_bitstream, NULL);
 	else
-		stream_rx_usb(ut, cb_dump_full, NULL);
+		stream_rx_usb_batch(ut, cb_dump_full, NULL);
 }
 
 void ubertooth_stop(ubertooth_t* ut)
 {
 	/* make sure xfers are not active */
-	if(ut->rx_xfer != NULL)
-		libusb_cancel_transfer(ut->rx_xfer);
+	ubertooth_bulk_free(ut);
+	fifo_free(ut->fifo);
+	ut->fifo = NULL;
+	usb_pkt_batch_free(&ut->rx_batch);
+	ac_search_free(ut->ac_search);
+	ut->ac_search = NULL;
+	cmd_queue_free(ut->cmdq);
+	ut->cmdq = NULL;
+	ubertooth_hotplug_disable(ut);
+	afh_estimator_free(ut->afh);
+	ut->afh = NULL;
+	rssi_tracker_free(ut->rssi);
+	ut->rssi = NULL;
 	if (ut->devh != NULL) {
 		cmd_stop(ut->devh);
-		libusb_release_interface(ut->devh, 0);
+		ubertooth_usb_close(ut->devh);
+		ut->devh = NULL;
+	}
+	if (ut->ctx != NULL) {
+		ubertooth_usb_exit(ut->ctx);
+		ut->ctx = NULL;
 	}
-	libusb_close(ut->devh);
-	libusb_exit(NULL);
 
-	if (ut->h_pcap_bredr) {
-		btbb_pcap_close(ut->h_pcap_bredr);
-		ut->h_pcap_bredr = NULL;
+	if (ut->pcap) {
+		pcap_writer_close(ut->pcap);
+		ut->pcap = NULL;
 	}
-	if (ut->h_pcap_le) {
-		lell_pcap_close(ut->h_pcap_le);
-		ut->h_pcap_le = NULL;
+	if (ut->output) {
+		output_close(ut->output);
+		ut->output = NULL;
 	}
-
-	if (ut->h_pcapng_bredr) {
-		btbb_pcapng_close(ut->h_pcapng_bredr);
-		ut->h_pcapng_bredr = NULL;
+	if (ut->dumpfile) {
+		dump_writer_close(ut->dumpfile);
+		ut->dumpfile = NULL;
 	}
-	if (ut->h_pcapng_le) {
-		lell_pcapng_close(ut->h_pcapng_le);
-		ut->h_pcapng_le = NULL;
+	if (ut->capfile) {
+		capfile_writer_close(ut->capfile);
+		ut->capfile = NULL;
 	}
 }
 
+/* ubertooth_stop() and release everything ubertooth_init() set up */
+void ubertooth_free(ubertooth_t* ut)
+{
+	if (ut == NULL)
+		return;
+
+	ubertooth_stop(ut);
+	free(ut->packets);
+	pthread_cond_destroy(&ut->rx_ready);
+	pthread_mutex_destroy(&ut->rx_lock);
+	free(ut);
+}
+
 ubertooth_t* ubertooth_init()
 {
 	ubertooth_t* ut = (ubertooth_t*)malloc(sizeof(ubertooth_t));
@@ -563,34 +1385,79 @@ ubertooth_t* ubertooth_init()
 	if(ut->packets == NULL)
 		fprintf(stderr, "Unable to initialize ringbuffer\n");
 
+	ut->rssi = rssi_tracker_init(NUM_BANKS, DEFAULT_RSSI_NOISE_WINDOW,
+	                             DEFAULT_RSSI_NOISE_PERCENTILE);
+	if(ut->rssi == NULL)
+		fprintf(stderr, "Unable to initialize RSSI tracker\n");
+
+	ut->ctx = NULL;
 	ut->devh = NULL;
-	ut->rx_xfer = NULL;
-	ut->empty_usb_buf = NULL;
-	ut->full_usb_buf = NULL;
-	ut->usb_really_full = 0;
+	ut->xfer_depth = DEFAULT_XFER_DEPTH;
+	ut->rx_xfers = NULL;
+	ut->rx_bufs = NULL;
+	ut->xfers_in_flight = 0;
+	ut->full_xfers = NULL;
+	ut->full_ns = NULL;
+	ut->full_head = 0;
+	ut->full_count = 0;
+	ut->fifo = NULL;
+	ut->fifo_size = DEFAULT_FIFO_SIZE;
+	ut->usb_thread_running = 0;
+	ut->stop_usb_thread = 0;
+	ut->usb_thread_exited = 0;
+	pthread_mutex_init(&ut->rx_lock, NULL);
+	pthread_cond_init(&ut->rx_ready, NULL);
+	ut->notify_lock = NULL;
+	ut->notify = NULL;
 	ut->stop_ubertooth = 0;
-	ut->abs_start_ns = 0;
-	ut->start_clk100ns = 0;
-	ut->last_clk100ns = 0;
-	ut->clk100ns_upper = 0;
-
-	ut->h_pcap_bredr = NULL;
-	ut->h_pcap_le = NULL;
-	ut->h_pcapng_bredr = NULL;
-	ut->h_pcapng_le = NULL;
+	ut->rx_host_ns = 0;
+	memset(&ut->rx_batch, 0, sizeof(ut->rx_batch));
+	ut->ac_search = NULL;
+	ut->watchlist = NULL;
+	clock_sync_init(&ut->clock);
+	memset(&ut->gate, 0, sizeof(ut->gate));
+	ut->cmdq = NULL;
+	memset(&ut->config, 0, sizeof(ut->config));
+	memset(&ut->hotplug, 0, sizeof(ut->hotplug));
+
+	ut->pcap = NULL;
+	ut->output = NULL;
+
+	ut->systime = 0;
+	ut->infile = NULL;
+	ut->dumpfile = NULL;
+	ut->capfile = NULL;
+	ut->ac_result = NULL;
+	ut->max_ac_errors = DEFAULT_MAX_AC_ERRORS;
+	ut->packet_counter_max = 0;
+	ut->afh_window_ms = 0;
+	ut->afh = NULL;
+	ut->prev_ts = 0;
+	ut->trim_counter = 0;
+	ut->calibrated = 0;
 
 	return ut;
 }
 
 int ubertooth_connect(ubertooth_t* ut, int ubertooth_device)
 {
-	int r = libusb_init(NULL);
+	char spec[12];
+
+	if (ubertooth_device < 0)
+		return ubertooth_connect_spec(ut, NULL);
+	snprintf(spec, sizeof(spec), "%d", ubertooth_device);
+	return ubertooth_connect_spec(ut, spec);
+}
+
+static int connect_usb(ubertooth_t* ut, const char* spec)
+{
+	int r = libusb_init(&ut->ctx);
 	if (r < 0) {
 		fprintf(stderr, "libusb_init failed (got 1.0?)\n");
 		return -1;
 	}
 
-	ut->devh = find_ubertooth_device(ubertooth_device);
+	ut->devh = ubertooth_open_device(ut->ctx, spec);
 	if (ut->devh == NULL) {
 		fprintf(stderr, "could not open Ubertooth device\n");
 		ubertooth_stop(ut);
@@ -603,6 +1470,27 @@ int ubertooth_connect(ubertooth_t* ut, int ubertooth_device)
 		ubertooth_stop(ut);
 		return -1;
 	}
+	return 0;
+}
+
+/* spec is as for ubertooth_open_device(), or "emu:<options>" for an
+ * emulated Ubertooth, see emu_parse_options() */
+int ubertooth_connect_spec(ubertooth_t* ut, const char* spec)
+{
+	int r;
+
+	if (spec != NULL && strncmp(spec, EMU_SPEC_PREFIX, strlen(EMU_SPEC_PREFIX)) == 0)
+		r = emu_open(spec + strlen(EMU_SPEC_PREFIX), &ut->ctx, &ut->devh);
+	else
+		r = connect_usb(ut, spec);
+	if (r < 0)
+		return -1;
+
+	ut->cmdq = cmd_queue_init(ut->ctx, ut->devh);
+	if (ut->cmdq == NULL) {
+		ubertooth_stop(ut);
+		return -1;
+	}
 
 	return 1;
 }
@@ -610,10 +1498,29 @@ int ubertooth_connect(ubertooth_t* ut, int ubertooth_device)
 ubertooth_t* ubertooth_start(int ubertooth_device)
 {
 	ubertooth_t* ut = ubertooth_init();
+	if (ut == NULL)
+		return NULL;
 
 	int r = ubertooth_connect(ut, ubertooth_device);
-	if (r < 0)
+	if (r < 0) {
+		ubertooth_free(ut);
 		return NULL;
+	}
+
+	return ut;
+}
+
+ubertooth_t* ubertooth_start_spec(const char* spec)
+{
+	ubertooth_t* ut = ubertooth_init();
+	if (ut == NULL)
+		return NULL;
+
+	int r = ubertooth_connect_spec(ut, spec);
+	if (r < 0) {
+		ubertooth_free(ut);
+		return NULL;
+	}
 
 	return ut;
 }
@@ -24,7 +24,24 @@
 
 #include "ubertooth_control.h"
 #include "ubertooth_ringbuffer.h"
+#include "ubertooth_fifo.h"
+#include "ubertooth_ac.h"
+#include "ubertooth_dump.h"
+#include "ubertooth_pcap.h"
+#include "ubertooth_output.h"
+#include "ubertooth_clock.h"
+#include "ubertooth_rssi.h"
+#include "ubertooth_cmd_queue.h"
+#include "ubertooth_afh.h"
+#include "ubertooth_hotplug.h"
+#include "ubertooth_device.h"
+#include "ubertooth_replay.h"
+#include "ubertooth_capfile.h"
+#include "ubertooth_parallel.h"
+#include "ubertooth_emu.h"
 #include <btbb.h>
+#include <pthread.h>
+#include <signal.h>
 
 /* specan output types
  * see https://github.com/dkogan/feedgnuplot for plotter */
@@ -35,59 +52,199 @@ enum specan_modes {
 	SPECAN_FILE           = 3
 };
 
+/* Longest ubertooth_bulk_wait() waits for USB before it looks at
+ * stop_ubertooth and flushes output files */
+#define BULK_WAIT_POLL_NS 100000000
+
+/* Most devices ubertooth_open_device() will enumerate */
+#define MAX_UBERTOOTHS 8
+
+/* clk100ns is CLKN bits 0-19 in units of 100 ns, it wraps every 327.68 s */
+#define CLK100NS_WRAP 3276800000u
+
 enum board_ids {
 	BOARD_ID_UBERTOOTH_ZERO = 0,
 	BOARD_ID_UBERTOOTH_ONE  = 1,
 	BOARD_ID_TC13BADGE      = 2
 };
 
+/* Early reject of blocks that show no sign of a packet, so the access
+ * code search is skipped for them, see ubertooth_gate_pass() */
+typedef struct {
+	uint8_t enabled;
+	/* require CS_TRIGGER or RSSI_TRIGGER from the firmware */
+	uint8_t require_trigger;
+	/* rssi_max this far above the channel noise floor, raw units */
+	int min_snr;
+	/* banks either side of the searched ones which also count, so
+	 * packets straddling banks are not lost */
+	int neighbours;
+
+	/* access code searches asked about, and those skipped */
+	uint64_t searches;
+	uint64_t skipped;
+} signal_gate;
+
+#define DEFAULT_GATE_NEIGHBOURS 1
+
 typedef struct {
 	/* Ringbuffers for USB and Bluetooth symbols */
 	ringbuffer_t* packets;
 
+	struct libusb_context* ctx;
 	struct libusb_device_handle* devh;
-	struct libusb_transfer* rx_xfer;
-	uint8_t* empty_usb_buf;
-	uint8_t* full_usb_buf;
-	uint8_t usb_really_full;
-
-	uint8_t stop_ubertooth;
-	uint64_t abs_start_ns;
-	uint32_t start_clk100ns;
-	uint64_t last_clk100ns;
-	uint64_t clk100ns_upper;
-
-	btbb_pcap_handle* h_pcap_bredr;
-	lell_pcap_handle* h_pcap_le;
-	btbb_pcapng_handle* h_pcapng_bredr;
-	lell_pcapng_handle* h_pcapng_le;
+
+	/* Bulk IN transfers, all submitted up front by ubertooth_bulk_init().
+	 * Completed transfers wait in full_xfers until they have been
+	 * processed by ubertooth_bulk_receive() and are resubmitted. */
+	int xfer_depth;
+	struct libusb_transfer** rx_xfers;
+	uint8_t* rx_bufs;
+	/* only accessed atomically, the USB thread changes it too */
+	int xfers_in_flight;
+	struct libusb_transfer** full_xfers;
+	uint64_t* full_ns;
+	int full_head;
+	int full_count;
+
+	/* Optional USB event thread which moves received packets into
+	 * fifo, see ubertooth_bulk_thread_start() */
+	fifo_t* fifo;
+	uint32_t fifo_size;
+	pthread_t usb_thread;
+	uint8_t usb_thread_running;
+	volatile uint8_t stop_usb_thread;
+	/* set by the USB thread when it stops servicing libusb */
+	volatile uint8_t usb_thread_exited;
+	/* signalled by the USB thread when it has added to fifo */
+	pthread_mutex_t rx_lock;
+	pthread_cond_t rx_ready;
+	/* also signalled if set, see ubertooth_capture_open_all() */
+	pthread_mutex_t* notify_lock;
+	pthread_cond_t* notify;
+
+	/* set from signal handlers and other threads */
+	volatile sig_atomic_t stop_ubertooth;
+	/* Host CLOCK_MONOTONIC estimate for the packet being processed */
+	uint64_t rx_host_ns;
+	/* Reused by ubertooth_bulk_receive_batch() */
+	usb_pkt_batch rx_batch;
+	uint8_t rx_slots[PKTS_PER_XFER];
+	/* Pre-scan state for ubertooth_find_ac() */
+	ac_search_t* ac_search;
+	/* Search already done for cb_rx(), see ubertooth_parallel.c */
+	ac_result* ac_result;
+	/* If set, cb_rx() only looks for these LAPs. Owned by the caller. */
+	ac_watchlist_t* watchlist;
+	/* Maps the device clock onto host time */
+	clock_sync_t clock;
+	/* Per channel signal and noise floor */
+	rssi_tracker_t* rssi;
+	/* Skip the access code search for blocks without signal */
+	signal_gate gate;
+	/* Commands issued from the callbacks, set up by ubertooth_connect() */
+	cmd_queue_t* cmdq;
+	/* Settings to restore after a reconnect */
+	ubertooth_config config;
+	/* Reconnect by serial number, see ubertooth_hotplug_enable() */
+	hotplug_state hotplug;
+
+	/* PCAP/PCAPNG output, written on a thread of its own */
+	pcap_writer_t* pcap;
+	/* Structured packet output, NULL for the plain text output */
+	output_t* output;
+
+	/* Session state used by the callbacks */
+	/* Time of the packet being processed, from the file when replaying */
+	uint32_t systime;
+	/* Set when replaying a capture, owned by the caller */
+	FILE* infile;
+	/* Raw packet dump, closed by ubertooth_stop() */
+	dump_writer_t* dumpfile;
+	/* Indexed capture file, closed by ubertooth_stop() */
+	capfile_writer* capfile;
+	int max_ac_errors;
+	/* AFH: packets without one on a channel before it counts as unused,
+	 * or if afh_window_ms is set, time */
+	unsigned int packet_counter_max;
+	unsigned int afh_window_ms;
+	/* AFH channel usage, set up by rx_afh() and rx_afh_r() */
+	afh_estimator_t* afh;
+	/* LE: clock of the previous packet */
+	uint32_t prev_ts;
+	/* BR: consecutive early (<0) or late (>0) access codes for clock
+	 * trimming, and whether the first offset has been corrected */
+	int trim_counter;
+	uint8_t calibrated;
 } ubertooth_t;
 
 typedef void (*rx_callback)(ubertooth_t* ut, void* args);
+typedef void (*rx_batch_callback)(ubertooth_t* ut, usb_pkt_batch* batch, void* args);
 
 typedef struct {
 	unsigned allowed_access_address_errors;
 } btle_options;
 
-extern uint32_t systime;
-extern FILE* infile;
-extern FILE* dumpfile;
-extern int max_ac_errors;
+#define DEFAULT_MAX_AC_ERRORS 2
 
 void print_version();
+uint64_t ubertooth_monotonic_ns(void);
 void register_cleanup_handler(ubertooth_t* ut, int do_exit);
 ubertooth_t* ubertooth_init();
 int ubertooth_connect(ubertooth_t* ut, int ubertooth_device);
+int ubertooth_connect_spec(ubertooth_t* ut, const char* spec);
 ubertooth_t* ubertooth_start(int ubertooth_device);
+ubertooth_t* ubertooth_start_spec(const char* spec);
 void ubertooth_stop(ubertooth_t* ut);
+void ubertooth_free(ubertooth_t* ut);
 int ubertooth_check_api(ubertooth_t *ut);
 void ubertooth_set_timeout(ubertooth_t* ut, int seconds);
 
 int ubertooth_bulk_init(ubertooth_t* ut);
+int ubertooth_set_xfer_depth(ubertooth_t* ut, int depth);
+void ubertooth_bulk_free(ubertooth_t* ut);
 void ubertooth_bulk_wait(ubertooth_t* ut);
 int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args);
+int ubertooth_bulk_receive_batch(ubertooth_t* ut, rx_batch_callback cb, void* cb_args);
+int ubertooth_bulk_thread_start(ubertooth_t* ut);
+void ubertooth_bulk_thread_stop(ubertooth_t* ut);
+int ubertooth_bulk_thread_check(ubertooth_t* ut);
+void ubertooth_print_fifo_stats(ubertooth_t* ut, FILE* fileptr);
+
+/* Send a setting and remember it for ubertooth_reconnect() */
+int ubertooth_set_channel(ubertooth_t* ut, u16 channel);
+int ubertooth_set_modulation(ubertooth_t* ut, u16 mod);
+int ubertooth_set_squelch(ubertooth_t* ut, u16 level);
+int ubertooth_set_access_address(ubertooth_t* ut, u32 access_address);
+int ubertooth_set_afh_map(ubertooth_t* ut, uint8_t* afh_map);
+int ubertooth_clear_afh_map(ubertooth_t* ut);
+int ubertooth_start_mode(ubertooth_t* ut, uint8_t mode, u16 value, u16 index);
+
+int ubertooth_hotplug_enable(ubertooth_t* ut);
+void ubertooth_hotplug_disable(ubertooth_t* ut);
+void ubertooth_device_lost(ubertooth_t* ut);
+int ubertooth_reconnect(ubertooth_t* ut);
+void ubertooth_print_hotplug_stats(ubertooth_t* ut, FILE* fileptr);
+
+int ubertooth_gate_parse(const char* spec, signal_gate* gate);
+int ubertooth_gate_pass(ubertooth_t* ut, uint8_t bank, int search_length);
+void ubertooth_print_gate_stats(ubertooth_t* ut, FILE* fileptr);
+
+int ubertooth_find_ac(ubertooth_t* ut, uint8_t bank, int search_length,
+                      uint32_t lap, int max_ac_errors, btbb_packet** pkt);
+int ubertooth_find_ac_watchlist(ubertooth_t* ut, const ac_watchlist_t* wl,
+                                uint8_t bank, int search_length,
+                                btbb_packet** pkt);
+int ubertooth_take_ac_result(ubertooth_t* ut, uint8_t bank, int search_length,
+                             btbb_packet** pkt);
 
 int stream_rx_file(ubertooth_t* ut,FILE* fp, rx_callback cb, void* cb_args);
+int stream_rx_file_batch(ubertooth_t* ut, FILE* fp, rx_batch_callback cb, void* cb_args);
+int stream_rx_capfile(ubertooth_t* ut, capfile_reader* cf, const capfile_query* q,
+                      rx_callback cb, void* cb_args);
+int rx_file_parallel(ubertooth_t* ut, FILE* fp, btbb_piconet* pn, int threads);
+int rx_capfile_parallel(ubertooth_t* ut, capfile_reader* cf,
+                        const capfile_query* q, btbb_piconet* pn, int threads);
 
 void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout);
 void rx_file(FILE* fp, btbb_piconet* pn);
@@ -0,0 +1,423 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_ac.h"
+#include "ubertooth_control.h"
+#include <btbb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Sync words use the libbtbb bit order: bit i is the i-th symbol on
+ * air. The codeword is syncword ^ AC_PN and belongs to the (64,30)
+ * block code generated by g(D) = 260534236651 (octal). */
+#define AC_PN            0x83848D96BBCC54FCULL
+#define AC_GEN_POLY      0260534236651ULL
+#define AC_GEN_POLY_DEG  34
+
+/* The last 7 symbols are the LAP MSB and the barker sequence. libbtbb
+ * skips windows more than MAX_BARKER_ERRORS away from either valid
+ * value and corrects the rest before the syndrome check. */
+#define BARKER_0         0x27
+#define BARKER_1         0x58
+#define MAX_BARKER_ERRORS 1
+#define BARKER_SHIFT     57
+#define BARKER_MASK      0x01ffffffffffffffULL
+
+static uint64_t syndrome_of(const ac_search_t* s, uint64_t codeword)
+{
+	uint64_t syndrome = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		syndrome ^= s->syndrome_table[i][(codeword >> (i * 8)) & 0xff];
+	return syndrome;
+}
+
+static uint32_t syndrome_hash(const ac_search_t* s, uint64_t syndrome)
+{
+	return (uint32_t)((syndrome * 0x9E3779B97F4A7C15ULL) >> (64 - s->syndrome_map_bits));
+}
+
+/* Mark the syndromes of all error patterns of 1 to depth bits */
+static void mark_errors(ac_search_t* s, const uint64_t* bit_syndrome,
+                        uint64_t syndrome, int start, int depth)
+{
+	int i;
+	uint32_t h;
+
+	for (i = start; i < 64; i++) {
+		h = syndrome_hash(s, syndrome ^ bit_syndrome[i]);
+		s->syndrome_map[h >> 3] |= 1 << (h & 7);
+		if (depth > 1)
+			mark_errors(s, bit_syndrome, syndrome ^ bit_syndrome[i],
+			            i + 1, depth - 1);
+	}
+}
+
+static int init_syndromes(ac_search_t* s)
+{
+	uint64_t bit_syndrome[64];
+	uint64_t rem = 1, count = 0, choose = 1;
+	int i, j, k, bits;
+
+	/* x^i mod g(x) */
+	for (i = 0; i < 64; i++) {
+		bit_syndrome[i] = rem;
+		rem <<= 1;
+		if (rem & (1ULL << AC_GEN_POLY_DEG))
+			rem ^= AC_GEN_POLY;
+	}
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 256; j++) {
+			s->syndrome_table[i][j] = 0;
+			for (k = 0; k < 8; k++)
+				if (j & (1 << k))
+					s->syndrome_table[i][j] ^= bit_syndrome[i * 8 + k];
+		}
+	}
+
+	if (s->max_ac_errors == 0)
+		return 0;
+
+	/* Size the bitmap to keep it about 1/256 full. libbtbb only
+	 * corrects a subset of these error patterns, which is fine for a
+	 * filter that must not have false negatives. */
+	for (i = 1; i <= s->max_ac_errors; i++) {
+		choose = choose * (64 - i + 1) / i;
+		count += choose;
+	}
+	for (bits = 0; (1ULL << bits) < count; bits++);
+	bits += 8;
+	if (bits < 10)
+		bits = 10;
+	if (bits > 24)
+		bits = 24;
+
+	s->syndrome_map_bits = bits;
+	s->syndrome_map = (uint8_t*)calloc(1, (1 << bits) / 8);
+	if (s->syndrome_map == NULL)
+		return -1;
+	mark_errors(s, bit_syndrome, 0, 0, s->max_ac_errors);
+
+	return 0;
+}
+
+ac_search_t* ac_search_init(uint32_t lap, int max_ac_errors)
+{
+	ac_search_t* s;
+
+	if (max_ac_errors < 0)
+		return NULL;
+	if (lap == LAP_ANY && max_ac_errors > AC_SEARCH_MAX_ANY_ERRORS)
+		return NULL;
+
+	s = (ac_search_t*)calloc(1, sizeof(ac_search_t));
+	if (s == NULL)
+		return NULL;
+
+	s->lap = lap;
+	s->max_ac_errors = max_ac_errors;
+
+	if (lap != LAP_ANY) {
+		s->syncword = btbb_gen_syncword(lap);
+	} else if (init_syndromes(s) < 0) {
+		ac_search_free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void ac_search_free(ac_search_t* s)
+{
+	if (s == NULL)
+		return;
+	free(s->syndrome_map);
+	free(s);
+}
+
+ac_search_t* ac_search_get(ac_search_t** s, uint32_t lap, int max_ac_errors)
+{
+	if (*s != NULL && (*s)->lap == lap && (*s)->max_ac_errors == max_ac_errors)
+		return *s;
+
+	ac_search_free(*s);
+	*s = ac_search_init(lap, max_ac_errors);
+	return *s;
+}
+
+/* little endian load which needs no endian.h; compilers turn this
+ * into a single load (and byte swap on big endian hosts) */
+static inline uint64_t load64(const uint8_t* p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/* 64 symbols starting at symbol p */
+static inline uint64_t window(const uint8_t* packed, int p)
+{
+	int shift = p & 7;
+	uint64_t lo = load64(packed + (p >> 3));
+
+	if (shift == 0)
+		return lo;
+	return (lo >> shift) | ((uint64_t)packed[(p >> 3) + 8] << (64 - shift));
+}
+
+static inline int barker_errors(uint8_t barker, uint8_t valid)
+{
+	return __builtin_popcount(barker ^ valid);
+}
+
+static inline __attribute__((always_inline))
+int search(const ac_search_t* s, const uint8_t* packed, int start, int end)
+{
+	int p;
+	uint64_t w, syndrome;
+	uint8_t barker, corrected;
+
+	if (s->lap != LAP_ANY) {
+		for (p = start; p < end; p++) {
+			w = window(packed, p);
+			if (__builtin_popcountll(w ^ s->syncword) <= s->max_ac_errors)
+				return p;
+		}
+		return -1;
+	}
+
+	for (p = start; p < end; p++) {
+		w = window(packed, p);
+		barker = (uint8_t)(w >> BARKER_SHIFT);
+		if (barker_errors(barker, BARKER_0) <= MAX_BARKER_ERRORS)
+			corrected = BARKER_0;
+		else if (barker_errors(barker, BARKER_1) <= MAX_BARKER_ERRORS)
+			corrected = BARKER_1;
+		else
+			continue;
+
+		w = (w & BARKER_MASK) | ((uint64_t)corrected << BARKER_SHIFT);
+		syndrome = syndrome_of(s, w ^ AC_PN);
+		if (syndrome == 0)
+			return p;
+		if (s->syndrome_map != NULL) {
+			uint32_t h = syndrome_hash(s, syndrome);
+			if (s->syndrome_map[h >> 3] & (1 << (h & 7)))
+				return p;
+		}
+	}
+	return -1;
+}
+
+static int search_generic(const ac_search_t* s, const uint8_t* packed,
+                          int start, int end)
+{
+	return search(s, packed, start, end);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("popcnt")))
+static int search_popcnt(const ac_search_t* s, const uint8_t* packed,
+                         int start, int end)
+{
+	return search(s, packed, start, end);
+}
+#endif
+
+static int (*search_impl)(const ac_search_t*, const uint8_t*, int, int);
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+/* use the popcnt instruction when the CPU has it */
+static void search_resolve(void)
+{
+	int (*impl)(const ac_search_t*, const uint8_t*, int, int) = search_generic;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt"))
+		impl = search_popcnt;
+#endif
+	search_impl = impl;
+}
+
+int ac_search_find(const ac_search_t* s, const uint8_t* packed, int start, int end)
+{
+	pthread_once(&search_once, search_resolve);
+	return search_impl(s, packed, start, end);
+}
+
+ac_watchlist_t* ac_watchlist_init(const uint32_t* laps, int num_laps,
+                                  int max_ac_errors)
+{
+	ac_watchlist_t* wl;
+	uint32_t v, mask, *fill;
+	int f, i, buckets;
+
+	/* with 64 or more errors any window would match */
+	if (num_laps <= 0 || max_ac_errors < 0 || max_ac_errors > 63)
+		return NULL;
+
+	wl = (ac_watchlist_t*)calloc(1, sizeof(ac_watchlist_t));
+	if (wl == NULL)
+		return NULL;
+
+	wl->max_ac_errors = max_ac_errors;
+	wl->num_laps = num_laps;
+	wl->num_frags = max_ac_errors + 1;
+	wl->frag_bits = MIN(16, 64 / wl->num_frags);
+	buckets = 1 << wl->frag_bits;
+	mask = buckets - 1;
+
+	wl->laps = (uint32_t*)malloc(num_laps * sizeof(uint32_t));
+	wl->syncwords = (uint64_t*)malloc(num_laps * sizeof(uint64_t));
+	wl->bucket_start = (uint32_t**)calloc(wl->num_frags, sizeof(uint32_t*));
+	wl->bucket = (uint32_t**)calloc(wl->num_frags, sizeof(uint32_t*));
+	fill = (uint32_t*)malloc(buckets * sizeof(uint32_t));
+	if (wl->laps == NULL || wl->syncwords == NULL ||
+	    wl->bucket_start == NULL || wl->bucket == NULL || fill == NULL)
+		goto fail;
+
+	for (i = 0; i < num_laps; i++) {
+		wl->laps[i] = laps[i] & 0xffffff;
+		wl->syncwords[i] = btbb_gen_syncword(wl->laps[i]);
+	}
+
+	for (f = 0; f < wl->num_frags; f++) {
+		wl->bucket_start[f] = (uint32_t*)calloc(buckets + 1, sizeof(uint32_t));
+		wl->bucket[f] = (uint32_t*)malloc(num_laps * sizeof(uint32_t));
+		if (wl->bucket_start[f] == NULL || wl->bucket[f] == NULL)
+			goto fail;
+
+		/* count, prefix sum, then place */
+		for (i = 0; i < num_laps; i++) {
+			v = (wl->syncwords[i] >> (f * wl->frag_bits)) & mask;
+			wl->bucket_start[f][v + 1]++;
+		}
+		for (i = 0; i < buckets; i++)
+			wl->bucket_start[f][i + 1] += wl->bucket_start[f][i];
+		memcpy(fill, wl->bucket_start[f], buckets * sizeof(uint32_t));
+		for (i = 0; i < num_laps; i++) {
+			v = (wl->syncwords[i] >> (f * wl->frag_bits)) & mask;
+			wl->bucket[f][fill[v]++] = i;
+		}
+	}
+
+	free(fill);
+	return wl;
+
+fail:
+	free(fill);
+	ac_watchlist_free(wl);
+	return NULL;
+}
+
+/* Watchlist of the LAPs in a file, 6 hex digits per line */
+ac_watchlist_t* ac_watchlist_load(const char* filename, int max_errors)
+{
+	FILE* fp;
+	char line[64], *end;
+	uint32_t* laps = NULL, *tmp;
+	int num_laps = 0, size = 0;
+	ac_watchlist_t* wl;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint32_t lap = strtoul(line, &end, 16);
+		if (end == line)
+			continue; /* blank line or comment */
+		if (num_laps == size) {
+			size = size ? size * 2 : 64;
+			tmp = (uint32_t*)realloc(laps, size * sizeof(uint32_t));
+			if (tmp == NULL) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				free(laps);
+				fclose(fp);
+				return NULL;
+			}
+			laps = tmp;
+		}
+		laps[num_laps++] = lap;
+	}
+	fclose(fp);
+
+	if (num_laps == 0) {
+		fprintf(stderr, "No LAPs in %s\n", filename);
+		return NULL;
+	}
+
+	wl = ac_watchlist_init(laps, num_laps, max_errors);
+	if (wl == NULL)
+		fprintf(stderr, "Unable to create watchlist\n");
+	free(laps);
+	return wl;
+}
+
+void ac_watchlist_free(ac_watchlist_t* wl)
+{
+	int f;
+
+	if (wl == NULL)
+		return;
+
+	for (f = 0; f < wl->num_frags; f++) {
+		if (wl->bucket_start != NULL)
+			free(wl->bucket_start[f]);
+		if (wl->bucket != NULL)
+			free(wl->bucket[f]);
+	}
+	free(wl->bucket_start);
+	free(wl->bucket);
+	free(wl->syncwords);
+	free(wl->laps);
+	free(wl);
+}
+
+int ac_watchlist_find(const ac_watchlist_t* wl, const uint8_t* packed,
+                      int start, int end, uint32_t* lap)
+{
+	int p, f;
+	uint32_t v, i, mask = (1 << wl->frag_bits) - 1;
+	uint32_t idx;
+	uint64_t w;
+
+	for (p = start; p < end; p++) {
+		w = window(packed, p);
+		for (f = 0; f < wl->num_frags; f++) {
+			v = (w >> (f * wl->frag_bits)) & mask;
+			for (i = wl->bucket_start[f][v]; i < wl->bucket_start[f][v + 1]; i++) {
+				idx = wl->bucket[f][i];
+				if (__builtin_popcountll(w ^ wl->syncwords[idx]) <= wl->max_ac_errors) {
+					*lap = wl->laps[idx];
+					return p;
+				}
+			}
+		}
+	}
+	return -1;
+}
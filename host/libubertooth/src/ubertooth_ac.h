@@ -0,0 +1,88 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_AC_H__
+#define __UBERTOOTH_AC_H__
+
+#include <stdint.h>
+
+/* Access code pre-scan on packed symbols (see ringbuffer_get_packed()).
+ *
+ * ac_search_find() never misses a position at which btbb_find_ac()
+ * would find an access code, but may report positions at which it
+ * would not. Every candidate still has to be confirmed by libbtbb. */
+
+/* Largest max_ac_errors with a LAP_ANY pre-scan, beyond this the
+ * syndrome bitmap gets too big */
+#define AC_SEARCH_MAX_ANY_ERRORS 4
+
+typedef struct {
+	uint32_t lap;
+	int max_ac_errors;
+
+	/* specific LAP */
+	uint64_t syncword;
+
+	/* LAP_ANY: syndrome of every 64 bit word, one table per byte,
+	 * and a bitmap of the syndromes of correctable errors */
+	uint64_t syndrome_table[8][256];
+	uint8_t* syndrome_map;
+	int syndrome_map_bits;
+} ac_search_t;
+
+ac_search_t* ac_search_init(uint32_t lap, int max_ac_errors);
+void ac_search_free(ac_search_t* s);
+
+/* Return s itself if it matches lap and max_ac_errors, otherwise
+ * replace it with a new search. NULL means no pre-scan is available. */
+ac_search_t* ac_search_get(ac_search_t** s, uint32_t lap, int max_ac_errors);
+
+/* First candidate offset in [start, end) or -1. The symbols from
+ * packed must cover end + 63 symbols. */
+int ac_search_find(const ac_search_t* s, const uint8_t* packed, int start, int end);
+
+/* Search for any of a list of LAPs in one pass. Every sync word is
+ * split into max_ac_errors + 1 disjoint fragments, at least one of
+ * which has to match exactly, so each window only gets compared with
+ * the few sync words that share a fragment with it. */
+typedef struct {
+	int max_ac_errors;
+	int num_laps;
+	uint32_t* laps;
+	uint64_t* syncwords;
+
+	int num_frags;
+	int frag_bits;
+	/* fragment f of value v: bucket[f][bucket_start[f][v]] up to
+	 * bucket[f][bucket_start[f][v + 1]] hold indexes into laps */
+	uint32_t** bucket_start;
+	uint32_t** bucket;
+} ac_watchlist_t;
+
+ac_watchlist_t* ac_watchlist_init(const uint32_t* laps, int num_laps,
+                                  int max_ac_errors);
+ac_watchlist_t* ac_watchlist_load(const char* filename, int max_errors);
+void ac_watchlist_free(ac_watchlist_t* wl);
+
+/* First offset in [start, end) that matches a LAP within max_ac_errors,
+ * or -1. The LAP goes to *lap. */
+int ac_watchlist_find(const ac_watchlist_t* wl, const uint8_t* packed,
+                      int start, int end, uint32_t* lap);
+
+#endif /* __UBERTOOTH_AC_H__ */
@@ -0,0 +1,270 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_afh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+afh_estimator_t* afh_estimator_init(afh_window_type type, uint64_t window,
+                                    afh_change_callback cb, void* cb_args)
+{
+	afh_estimator_t* e;
+
+	if (window == 0) {
+		fprintf(stderr, "AFH window must not be empty\n");
+		return NULL;
+	}
+
+	e = (afh_estimator_t*)calloc(1, sizeof(afh_estimator_t));
+	if (e == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	e->type = type;
+	if (type == AFH_WINDOW_PACKETS) {
+		/* exact, channels further out go round the wheel again */
+		e->tick_len = 1;
+	} else {
+		e->tick_len = (window + AFH_WHEEL_SLOTS - 1) / AFH_WHEEL_SLOTS;
+	}
+	e->window_ticks = (window + e->tick_len - 1) / e->tick_len;
+	e->cb = cb;
+	e->cb_args = cb_args;
+
+	return e;
+}
+
+void afh_estimator_free(afh_estimator_t* e)
+{
+	if (e == NULL)
+		return;
+	free(e->piconets);
+	free(e);
+}
+
+int afh_estimator_find_piconet(const afh_estimator_t* e, uint32_t lap)
+{
+	int i;
+
+	for (i = 0; i < e->num_piconets; i++)
+		if (e->piconets[i].lap == lap)
+			return i;
+	return -1;
+}
+
+int afh_estimator_add_piconet(afh_estimator_t* e, uint32_t lap)
+{
+	afh_piconet* p;
+	int i = afh_estimator_find_piconet(e, lap);
+
+	if (i >= 0)
+		return i;
+
+	if (e->num_piconets == e->max_piconets) {
+		i = e->max_piconets ? 2 * e->max_piconets : 4;
+		p = (afh_piconet*)realloc(e->piconets, i * sizeof(afh_piconet));
+		if (p == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		e->piconets = p;
+		e->max_piconets = i;
+	}
+
+	p = &e->piconets[e->num_piconets];
+	memset(p, 0, sizeof(afh_piconet));
+	p->lap = lap;
+	memset(p->wheel, -1, sizeof(p->wheel));
+
+	return e->num_piconets++;
+}
+
+static void unlink_channel(afh_piconet* p, int channel)
+{
+	afh_channel* c = &p->channels[channel];
+
+	if (c->prev >= 0)
+		p->channels[c->prev].next = c->next;
+	else
+		p->wheel[c->slot] = c->next;
+	if (c->next >= 0)
+		p->channels[c->next].prev = c->prev;
+}
+
+static void link_channel(afh_piconet* p, int channel)
+{
+	afh_channel* c = &p->channels[channel];
+
+	c->slot = c->expiry % AFH_WHEEL_SLOTS;
+	c->prev = -1;
+	c->next = p->wheel[c->slot];
+	if (c->next >= 0)
+		p->channels[c->next].prev = channel;
+	p->wheel[c->slot] = channel;
+}
+
+static void set_used(afh_estimator_t* e, afh_piconet* p, int channel, int used,
+                     uint64_t now_ns)
+{
+	afh_change change;
+
+	p->channels[channel].used = used;
+	if (used) {
+		p->afh_map[channel / 8] |= 1 << (channel % 8);
+		p->num_used++;
+	} else {
+		p->afh_map[channel / 8] &= ~(1 << (channel % 8));
+		p->num_used--;
+	}
+
+	if (e->cb) {
+		change.lap = p->lap;
+		change.channel = channel;
+		change.used = used;
+		change.num_used = p->num_used;
+		change.time_ns = now_ns;
+		change.afh_map = p->afh_map;
+		e->cb(&change, e->cb_args);
+	}
+}
+
+static void advance_piconet(afh_estimator_t* e, afh_piconet* p, uint64_t now,
+                            uint64_t now_ns)
+{
+	uint64_t steps, tick;
+	afh_channel* c;
+	int channel, next;
+
+	if (now <= p->now)
+		return;
+
+	/* after a full turn every slot has been looked at */
+	steps = now - p->now;
+	if (steps > AFH_WHEEL_SLOTS)
+		steps = AFH_WHEEL_SLOTS;
+
+	for (tick = p->now + 1; tick <= p->now + steps; tick++) {
+		channel = p->wheel[tick % AFH_WHEEL_SLOTS];
+		while (channel >= 0) {
+			c = &p->channels[channel];
+			next = c->next;
+			if (c->expiry <= now) {
+				unlink_channel(p, channel);
+				set_used(e, p, channel, 0, now_ns);
+			}
+			channel = next;
+		}
+	}
+	p->now = now;
+}
+
+static uint64_t tick_of(const afh_estimator_t* e, const afh_piconet* p,
+                        uint64_t now_ns)
+{
+	if (e->type == AFH_WINDOW_PACKETS)
+		return p->packets / e->tick_len;
+	return now_ns / e->tick_len;
+}
+
+void afh_estimator_seed(afh_estimator_t* e, int piconet, const uint8_t* afh_map,
+                        uint64_t now_ns)
+{
+	afh_piconet* p;
+	afh_channel* c;
+	int i;
+
+	if (piconet < 0 || piconet >= e->num_piconets)
+		return;
+	p = &e->piconets[piconet];
+
+	for (i = 0; i < AFH_CHANNELS; i++) {
+		c = &p->channels[i];
+		if (c->used || !(afh_map[i / 8] & (1 << (i % 8))))
+			continue;
+		c->used = 1;
+		c->hits = 0;
+		c->expiry = tick_of(e, p, now_ns) + e->window_ticks;
+		c->last_seen_ns = now_ns;
+		link_channel(p, i);
+		p->afh_map[i / 8] |= 1 << (i % 8);
+		p->num_used++;
+	}
+}
+
+void afh_estimator_seen(afh_estimator_t* e, int piconet, uint8_t channel,
+                        uint64_t now_ns)
+{
+	afh_piconet* p;
+	afh_channel* c;
+	uint64_t now;
+
+	if (piconet < 0 || piconet >= e->num_piconets || channel >= AFH_CHANNELS)
+		return;
+	p = &e->piconets[piconet];
+	c = &p->channels[channel];
+
+	p->packets++;
+	now = tick_of(e, p, now_ns);
+
+	/* move the channel on before anything expires, so it is never
+	 * dropped and added back by the same packet */
+	if (c->used)
+		unlink_channel(p, channel);
+	c->expiry = now + e->window_ticks;
+	c->last_seen_ns = now_ns;
+	link_channel(p, channel);
+
+	if (c->used) {
+		c->hits++;
+	} else {
+		c->hits = 1;
+		set_used(e, p, channel, 1, now_ns);
+	}
+
+	advance_piconet(e, p, now, now_ns);
+}
+
+void afh_estimator_advance(afh_estimator_t* e, uint64_t now_ns)
+{
+	int i;
+
+	if (e->type == AFH_WINDOW_PACKETS)
+		return;
+
+	for (i = 0; i < e->num_piconets; i++)
+		advance_piconet(e, &e->piconets[i], now_ns / e->tick_len, now_ns);
+}
+
+const uint8_t* afh_estimator_map(const afh_estimator_t* e, int piconet)
+{
+	if (piconet < 0 || piconet >= e->num_piconets)
+		return NULL;
+	return e->piconets[piconet].afh_map;
+}
+
+uint32_t afh_estimator_hits(const afh_estimator_t* e, int piconet, uint8_t channel)
+{
+	if (piconet < 0 || piconet >= e->num_piconets || channel >= AFH_CHANNELS)
+		return 0;
+	if (!e->piconets[piconet].channels[channel].used)
+		return 0;
+	return e->piconets[piconet].channels[channel].hits;
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_AFH_H__
+#define __UBERTOOTH_AFH_H__
+
+#include <stdint.h>
+
+#define AFH_CHANNELS 79
+
+/* A channel is used until a window has passed without a packet on it.
+ * Channels are kept in the slot of the tick they expire at, so only the
+ * slots that have come due are looked at. A tick is a packet for packet
+ * windows, and 1/AFH_WHEEL_SLOTS of the window for time windows. */
+#define AFH_WHEEL_SLOTS 256
+
+typedef enum {
+	/* packets of the piconet */
+	AFH_WINDOW_PACKETS,
+	/* nanoseconds of host time */
+	AFH_WINDOW_TIME
+} afh_window_type;
+
+typedef struct {
+	uint32_t lap;
+	uint8_t channel;
+	/* 1 if the channel is used now, 0 if it has expired */
+	uint8_t used;
+	uint8_t num_used;
+	uint64_t time_ns;
+	/* the map after the change */
+	const uint8_t* afh_map;
+} afh_change;
+
+typedef void (*afh_change_callback)(const afh_change* change, void* args);
+
+typedef struct {
+	/* next and previous channel in the slot, -1 for none */
+	int8_t next;
+	int8_t prev;
+	uint8_t used;
+	uint8_t slot;
+	uint64_t expiry;
+	uint64_t last_seen_ns;
+	/* packets since the channel was last found used */
+	uint32_t hits;
+} afh_channel;
+
+typedef struct {
+	uint32_t lap;
+	/* packets seen, the clock of packet windows */
+	uint64_t packets;
+	/* last tick the wheel was advanced to */
+	uint64_t now;
+	int8_t wheel[AFH_WHEEL_SLOTS];
+	afh_channel channels[AFH_CHANNELS];
+	uint8_t afh_map[10];
+	uint8_t num_used;
+} afh_piconet;
+
+typedef struct {
+	afh_window_type type;
+	uint64_t tick_len;
+	uint64_t window_ticks;
+
+	afh_piconet* piconets;
+	int num_piconets;
+	int max_piconets;
+
+	afh_change_callback cb;
+	void* cb_args;
+} afh_estimator_t;
+
+afh_estimator_t* afh_estimator_init(afh_window_type type, uint64_t window,
+                                    afh_change_callback cb, void* cb_args);
+void afh_estimator_free(afh_estimator_t* e);
+
+/* Returns the index of the piconet, adding it if it is new */
+int afh_estimator_add_piconet(afh_estimator_t* e, uint32_t lap);
+int afh_estimator_find_piconet(const afh_estimator_t* e, uint32_t lap);
+
+/* Start with the channels of afh_map used, as if a packet had been seen
+ * on each at now_ns. No changes are reported for them. */
+void afh_estimator_seed(afh_estimator_t* e, int piconet, const uint8_t* afh_map,
+                        uint64_t now_ns);
+
+/* A packet of the piconet on a channel */
+void afh_estimator_seen(afh_estimator_t* e, int piconet, uint8_t channel,
+                        uint64_t now_ns);
+/* Expire channels of all piconets, a no-op for packet windows */
+void afh_estimator_advance(afh_estimator_t* e, uint64_t now_ns);
+
+const uint8_t* afh_estimator_map(const afh_estimator_t* e, int piconet);
+uint32_t afh_estimator_hits(const afh_estimator_t* e, int piconet, uint8_t channel);
+
+#endif /* __UBERTOOTH_AFH_H__ */
@@ -27,8 +27,6 @@
 
 #include "ubertooth_callback.h"
 
-unsigned int packet_counter_max;
-
 static int8_t cc2400_rssi_to_dbm( const int8_t rssi )
 {
 	/* models the cc2400 datasheet fig 22 for 1M as piece-wise linear */
@@ -49,84 +47,84 @@ static int8_t cc2400_rssi_to_dbm( const int8_t rssi )
 	}
 }
 
-#define RSSI_HISTORY_LEN NUM_BANKS
-
-/* Ignore packets with a SNR lower than this in order to reduce
- * processor load.  TODO: this should be a command line parameter. */
-
-static int8_t rssi_history[NUM_BREDR_CHANNELS][RSSI_HISTORY_LEN] = {{INT8_MIN}};
+/* Number of consecutive early/late access codes before the clock is
+ * trimmed */
+#define CLK_TRIM_THRESHOLD 8
 
-static void determine_signal_and_noise( usb_pkt_rx *rx, int8_t * sig, int8_t * noise )
+/* Also keeps the noise floor that ubertooth_gate_pass() compares
+ * blocks against up to date */
+static void determine_signal_and_noise( ubertooth_t* ut, usb_pkt_rx *rx,
+                                        int8_t * sig, int8_t * noise )
 {
-	int8_t * channel_rssi_history = rssi_history[rx->channel];
-	int8_t rssi;
-	int i;
+	int8_t rssi, noise_floor;
 
-	/* Shift rssi max history and append current max */
-	memmove(channel_rssi_history,
-	        channel_rssi_history+1,
-	        RSSI_HISTORY_LEN-1);
-	channel_rssi_history[RSSI_HISTORY_LEN-1] = rx->rssi_max;
-
-#if 0
-	/* Signal starts in oldest bank, but may cross into second
-	 * oldest bank.  Take the max or the 2 maxs. */
-	rssi = MAX(channel_rssi_history[0], channel_rssi_history[1]);
-#else
-	/* Alternatively, use all banks in history. */
-	rssi = channel_rssi_history[0];
-	for (i = 1; i < RSSI_HISTORY_LEN; i++)
-		rssi = MAX(rssi, channel_rssi_history[i]);
-#endif
+	rssi_tracker_update(ut->rssi, rx, &rssi, &noise_floor);
 	*sig = cc2400_rssi_to_dbm( rssi );
-
-	/* Noise is an IIR of averages */
-	/* FIXME: currently bogus */
-	*noise = cc2400_rssi_to_dbm( rx->rssi_avg );
+	*noise = cc2400_rssi_to_dbm( noise_floor );
 }
 
-static uint64_t now_ns( void )
+/* The AFH callbacks have no use for signal levels, but the signal gate
+ * needs the noise floor of the channels they listen on */
+static void gate_track_noise( ubertooth_t* ut )
 {
-/* As per Apple QA1398 */
-#if defined( __APPLE__ )
-	static mach_timebase_info_data_t sTimebaseInfo;
-	uint64_t ts = mach_absolute_time( );
-	if (sTimebaseInfo.denom == 0) {
-		(void) mach_timebase_info(&sTimebaseInfo);
-	}
-	return (ts*sTimebaseInfo.numer/sTimebaseInfo.denom);
-#else
-	struct timespec ts = { 0, 0 };
-	(void) clock_gettime( CLOCK_REALTIME, &ts );
-	return (1000000000ull*(uint64_t) ts.tv_sec) + (uint64_t) ts.tv_nsec;
-#endif
-}
+	int8_t rssi, noise_floor;
 
-static void track_clk100ns( ubertooth_t* ut, const usb_pkt_rx* rx )
-{
-	/* track clk100ns */
-	if (!ut->start_clk100ns) {
-		ut->last_clk100ns = ut->start_clk100ns = rx->clk100ns;
-		ut->abs_start_ns = now_ns( );
-	}
-	/* detect clk100ns roll-over */
-	if (rx->clk100ns < ut->last_clk100ns) {
-		ut->clk100ns_upper += 1;
-	}
-	ut->last_clk100ns = rx->clk100ns;
+	if (ut->gate.enabled && ut->gate.min_snr > 0 && ut->rssi)
+		rssi_tracker_update(ut->rssi, ringbuffer_top_usb(ut->packets),
+		                    &rssi, &noise_floor);
 }
 
-static uint64_t now_ns_from_clk100ns( ubertooth_t* ut, const usb_pkt_rx* rx )
+/* Wall clock time of a packet from the disciplined device clock, and
+ * the clock's error estimate in *error_ns. Live packets feed the clock
+ * with the arrival time of the newest packet. */
+static uint64_t packet_time_ns( ubertooth_t* ut, const usb_pkt_rx* rx,
+                                uint64_t* error_ns )
 {
-	track_clk100ns( ut, rx );
-	return ut->abs_start_ns +
-	       100ull*(uint64_t)((rx->clk100ns - ut->start_clk100ns) & 0xffffffff) +
-	       ((100ull*ut->clk100ns_upper)<<32);
+	const usb_pkt_rx* top = ringbuffer_top_usb(ut->packets);
+
+	if (ut->rx_host_ns)
+		clock_sync_add_sample(&ut->clock, top->clk100ns, top->clkn_high,
+		                      ut->rx_host_ns);
+	return clock_sync_realtime_ns(&ut->clock, rx->clk100ns, rx->clkn_high, error_ns);
 }
 
 /* Sniff for LAPs. If a piconet is provided, use the given LAP to
  * search for UAP.
  */
+static void output_br(ubertooth_t* ut, btbb_packet* pkt,
+                      uint64_t time_ns, uint64_t time_err_ns, uint32_t clk100ns,
+                      uint32_t clkn, uint32_t clk_offset,
+                      int8_t signal_level, int8_t noise_level)
+{
+	output_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = EVENT_BR;
+	ev.channel = btbb_packet_get_channel(pkt);
+	ev.signal = signal_level;
+	ev.noise = noise_level;
+	ev.systime = ut->systime;
+	ev.time_ns = time_ns;
+	ev.time_err_ns = time_err_ns;
+	ev.address = btbb_packet_get_lap(pkt);
+	ev.clk100ns = clk100ns;
+	ev.clkn = clkn;
+	ev.clk_offset = clk_offset;
+	ev.ac_errors = btbb_packet_get_ac_errors(pkt);
+	output_write_event(ut->output, &ev);
+}
+
+/* Access code starting in the newest bank, for lap or, if that is
+ * LAP_ANY and there is a watchlist, for one of the watched LAPs */
+static int find_ac_top(ubertooth_t* ut, uint32_t lap, btbb_packet** pkt)
+{
+	if (lap == LAP_ANY && ut->watchlist)
+		return ubertooth_find_ac_watchlist(ut, ut->watchlist, NUM_BANKS-1,
+		                                   BANK_LEN - 64, pkt);
+	return ubertooth_find_ac(ut, NUM_BANKS-1, BANK_LEN - 64, lap,
+	                         ut->max_ac_errors, pkt);
+}
+
 void cb_br_rx(ubertooth_t* ut, void* args)
 {
 	btbb_packet* pkt = NULL;
@@ -146,9 +144,10 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		goto out;
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
+	uint64_t nowns_err;
+	uint64_t nowns = packet_time_ns( ut, rx, &nowns_err );
 
-	determine_signal_and_noise( rx, &signal_level, &noise_level );
+	determine_signal_and_noise( ut, rx, &signal_level, &noise_level );
 	snr = signal_level - noise_level;
 
 	/* Look for packets with specified LAP, if given. Otherwise
@@ -160,9 +159,11 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
-	offset = btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, lap, max_ac_errors, &pkt);
+	offset = find_ac_top(ut, lap, &pkt);
 	if (offset < 0)
 		goto out;
+	if (lap == LAP_ANY && ut->watchlist)
+		lap = btbb_packet_get_lap(pkt);
 
 	btbb_packet_set_modulation(pkt, BTBB_MOD_GFSK);
 	btbb_packet_set_transport(pkt, BTBB_TRANSPORT_ANY);
@@ -177,42 +178,40 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 	/* When reading from file, caller will read
 	 * systime before calling this routine, so do
 	 * not overwrite. Otherwise, get current time. */
-	if (infile == NULL)
-		systime = time(NULL);
+	if (ut->infile == NULL)
+		ut->systime = nowns / 1000000000ull;
 
 	/* If dumpfile is specified, write out all banks to the
 	 * file. There could be duplicate data in the dump if more
 	 * than one LAP is found within the span of NUM_BANKS. */
-	if (dumpfile) {
-		uint32_t systime_be = htobe32(systime);
-		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
-		fwrite(ringbuffer_top_usb(ut->packets), sizeof(usb_pkt_rx), 1, dumpfile);
-		fflush(dumpfile);
-	}
-
-	printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d\n",
-	       (int)systime,
-	       btbb_packet_get_channel(pkt),
-	       btbb_packet_get_lap(pkt),
-	       btbb_packet_get_ac_errors(pkt),
-	       rx->clk100ns,
-	       btbb_packet_get_clkn(pkt),
-	       signal_level,
-	       noise_level,
-	       snr);
+	if (ut->dumpfile)
+		dump_writer_write_pkt(ut->dumpfile, ut->systime, ringbuffer_top_usb(ut->packets));
+
+	if (ut->output)
+		output_br(ut, pkt, nowns, nowns_err, rx->clk100ns,
+		          btbb_packet_get_clkn(pkt), 0, signal_level, noise_level);
+	else
+		printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d time_ns=%llu time_err_ns=%llu\n",
+		       (int)ut->systime,
+		       btbb_packet_get_channel(pkt),
+		       btbb_packet_get_lap(pkt),
+		       btbb_packet_get_ac_errors(pkt),
+		       rx->clk100ns,
+		       btbb_packet_get_clkn(pkt),
+		       signal_level,
+		       noise_level,
+		       snr,
+		       (unsigned long long)nowns,
+		       (unsigned long long)nowns_err);
 
 	int r = btbb_process_packet(pkt, pn);
 
-	/* Dump to PCAP/PCAPNG if specified */
-	if (ut->h_pcap_bredr) {
-		btbb_pcap_append_packet(ut->h_pcap_bredr, nowns,
-		                        signal_level, noise_level,
-		                        lap, uap, pkt);
-	}
-	if (ut->h_pcapng_bredr) {
-		btbb_pcapng_append_packet(ut->h_pcapng_bredr, nowns,
-		                          signal_level, noise_level,
-		                          lap, uap, pkt);
+	/* Dump to PCAP/PCAPNG if specified, the writer takes over pkt */
+	if (ut->pcap) {
+		pcap_writer_append_bredr(ut->pcap, nowns,
+		                         signal_level, noise_level,
+		                         lap, uap, pkt);
+		pkt = NULL;
 	}
 
 	if(r < 0) {
@@ -235,6 +234,7 @@ void cb_scan(ubertooth_t* ut, void* args __attribute__((unused)))
 	int8_t snr;
 	int offset;
 	uint32_t clkn;
+	uint64_t nowns, nowns_err;
 
 	/* Do analysis based on oldest packet */
 	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
@@ -243,12 +243,12 @@ void cb_scan(ubertooth_t* ut, void* args __attribute__((unused)))
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		goto out;
 
-	determine_signal_and_noise( rx, &signal_level, &noise_level );
+	determine_signal_and_noise( ut, rx, &signal_level, &noise_level );
 	snr = signal_level - noise_level;
 
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
-	offset = btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, LAP_ANY, max_ac_errors, &pkt);
+	offset = find_ac_top(ut, LAP_ANY, &pkt);
 	if (offset < 0)
 		goto out;
 
@@ -259,16 +259,25 @@ void cb_scan(ubertooth_t* ut, void* args __attribute__((unused)))
 	btbb_packet_set_data(pkt, ringbuffer_top_bt(ut->packets) + offset, NUM_BANKS * BANK_LEN - offset,
 	                     rx->channel, clkn);
 
-	printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d\n",
-	       (int)time(NULL),
-	       btbb_packet_get_channel(pkt),
-	       btbb_packet_get_lap(pkt),
-	       btbb_packet_get_ac_errors(pkt),
-	       rx->clk100ns,
-	       btbb_packet_get_clkn(pkt),
-	       signal_level,
-	       noise_level,
-	       snr);
+	nowns = packet_time_ns( ut, rx, &nowns_err );
+	ut->systime = nowns / 1000000000ull;
+	if (ut->output) {
+		output_br(ut, pkt, nowns, nowns_err, rx->clk100ns,
+		          btbb_packet_get_clkn(pkt), 0, signal_level, noise_level);
+	} else {
+		printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d time_ns=%llu time_err_ns=%llu\n",
+		       (int)ut->systime,
+		       btbb_packet_get_channel(pkt),
+		       btbb_packet_get_lap(pkt),
+		       btbb_packet_get_ac_errors(pkt),
+		       rx->clk100ns,
+		       btbb_packet_get_clkn(pkt),
+		       signal_level,
+		       noise_level,
+		       snr,
+		       (unsigned long long)nowns,
+		       (unsigned long long)nowns_err);
+	}
 
 	btbb_process_packet(pkt, NULL);
 
@@ -283,8 +292,8 @@ void cb_afh_initial(ubertooth_t* ut, void* args)
 	btbb_packet* pkt = NULL;
 	uint8_t channel;
 
-
-	if( btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, btbb_piconet_get_lap(pn), max_ac_errors, &pkt) < 0 )
+	gate_track_noise(ut);
+	if( ubertooth_find_ac(ut, NUM_BANKS-1, BANK_LEN - 64, btbb_piconet_get_lap(pn), ut->max_ac_errors, &pkt) < 0 )
 		goto out;
 
 	/* detect AFH map
@@ -307,86 +316,48 @@ void cb_afh_initial(ubertooth_t* ut, void* args)
 			btbb_piconet_set_channel_seen(pn, channel-1);
 		}
 
-		cmd_set_afh_map(ut->devh, btbb_piconet_get_afh_map(pn));
+		cmd_queue_set_afh_map(ut->cmdq, btbb_piconet_get_afh_map(pn));
+		memcpy(ut->config.afh_map, btbb_piconet_get_afh_map(pn), 10);
+		ut->config.flags |= CONFIG_AFH_MAP;
 		btbb_print_afh_map(pn);
 	}
-	cmd_hop(ut->devh);
+	cmd_queue_hop(ut->cmdq);
 
 out:
 	if (pkt)
 		btbb_packet_unref(pkt);
 }
 
-void cb_afh_monitor(ubertooth_t* ut, void* args)
+/* Channel changes are reported by the estimator, see rx_afh() */
+static void afh_track(ubertooth_t* ut, btbb_piconet* pn)
 {
-	btbb_piconet* pn = (btbb_piconet*)args;
 	btbb_packet* pkt = NULL;
 	uint8_t channel;
-	int i;
-
-	static unsigned long last_seen[79] = {0};
-	static unsigned long counter = 0;
+	int piconet;
 
-
-	if( btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, btbb_piconet_get_lap(pn), max_ac_errors, &pkt) < 0 )
+	gate_track_noise(ut);
+	afh_estimator_advance(ut->afh, ut->rx_host_ns);
+	if( ubertooth_find_ac(ut, NUM_BANKS-1, BANK_LEN - 64, btbb_piconet_get_lap(pn), ut->max_ac_errors, &pkt) < 0 )
 		goto out;
 
-	counter++;
 	channel = ringbuffer_top_usb(ut->packets)->channel;
-	last_seen[channel]=counter;
-
-	if(btbb_piconet_set_channel_seen(pn, channel)) {
-		printf("+ channel %2d is used now\n", channel);
-		btbb_print_afh_map(pn);
-	// } else {
-	// 	printf("channel %d is already used\n", channel);
-	}
-
-	for(i=0; i<79; i++) {
-		if((counter - last_seen[i] >= packet_counter_max)) {
-			if(btbb_piconet_clear_channel_seen(pn, i)) {
-				printf("- channel %2d is not used any more\n", i);
-				btbb_print_afh_map(pn);
-			}
-		}
-	}
-	cmd_hop(ut->devh);
+	piconet = afh_estimator_add_piconet(ut->afh, btbb_piconet_get_lap(pn));
+	afh_estimator_seen(ut->afh, piconet, channel, ut->rx_host_ns);
+	cmd_queue_hop(ut->cmdq);
 
 out:
 	if (pkt)
 		btbb_packet_unref(pkt);
 }
 
-void cb_afh_r(ubertooth_t* ut, void* args)
+void cb_afh_monitor(ubertooth_t* ut, void* args)
 {
-	btbb_piconet* pn = (btbb_piconet*)args;
-	btbb_packet* pkt = NULL;
-	uint8_t channel;
-	int i;
-
-	static unsigned long last_seen[79] = {0};
-	static unsigned long counter = 0;
-
-	if( btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, btbb_piconet_get_lap(pn), max_ac_errors, &pkt) < 0 )
-		goto out;
-
-
-	counter++;
-	channel = ringbuffer_top_usb(ut->packets)->channel;
-	last_seen[channel]=counter;
-
-	btbb_piconet_set_channel_seen(pn, channel);
-
-	for(i=0; i<79; i++) {
-		if((counter - last_seen[i] >= packet_counter_max)) {
-			btbb_piconet_clear_channel_seen(pn, i);
-		}
-	}
-	cmd_hop(ut->devh);
+	afh_track(ut, (btbb_piconet*)args);
+}
 
-out:
-	if (pkt)
-		btbb_packet_unref(pkt);
+void cb_afh_r(ubertooth_t* ut, void* args)
+{
+	afh_track(ut, (btbb_piconet*)args);
 }
 
 
@@ -401,7 +372,6 @@ void cb_btle(ubertooth_t* ut, void* args)
 	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
 	// u32 access_address = 0; // Build warning
 
-	static u32 prev_ts = 0;
 	uint32_t refAA;
 	int8_t sig, noise;
 
@@ -409,47 +379,46 @@ void cb_btle(ubertooth_t* ut, void* args)
 	if (rx->pkt_type == LE_PROMISC) {
 		u8 state = rx->data[0];
 		void *val = &rx->data[1];
+		/* keep structured output parseable */
+		FILE* f = ut->output ? stderr : stdout;
 
-		printf("--------------------\n");
-		printf("LE Promisc - ");
+		fprintf(f, "--------------------\n");
+		fprintf(f, "LE Promisc - ");
 		switch (state) {
 			case 0:
-				printf("Access Address: %08x\n", *(uint32_t *)val);
+				fprintf(f, "Access Address: %08x\n", *(uint32_t *)val);
 				break;
 			case 1:
-				printf("CRC Init: %06x\n", *(uint32_t *)val);
+				fprintf(f, "CRC Init: %06x\n", *(uint32_t *)val);
 				break;
 			case 2:
-				printf("Hop interval: %g ms\n", *(uint16_t *)val * 1.25);
+				fprintf(f, "Hop interval: %g ms\n", *(uint16_t *)val * 1.25);
 				break;
 			case 3:
-				printf("Hop increment: %u\n", *(uint8_t *)val);
+				fprintf(f, "Hop increment: %u\n", *(uint8_t *)val);
 				break;
 			default:
-				printf("Unknown %u\n", state);
+				fprintf(f, "Unknown %u\n", state);
 				break;
 		};
-		printf("\n");
+		fprintf(f, "\n");
 
 		return;
 	}
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
+	uint64_t nowns_err;
+	uint64_t nowns = packet_time_ns( ut, rx, &nowns_err );
 
 	/* Sanity check */
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		return;
 
-	if (infile == NULL)
-		systime = time(NULL);
+	if (ut->infile == NULL)
+		ut->systime = nowns / 1000000000ull;
 
 	/* Dump to sumpfile if specified */
-	if (dumpfile) {
-		uint32_t systime_be = htobe32(systime);
-		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
-		fwrite(rx, sizeof(usb_pkt_rx), 1, dumpfile);
-		fflush(dumpfile);
-	}
+	if (ut->dumpfile)
+		dump_writer_write_pkt(ut->dumpfile, ut->systime, rx);
 
 	lell_allocate_and_decode(rx->data, rx->channel + 2402, rx->clk100ns, &pkt);
 
@@ -461,51 +430,57 @@ void cb_btle(ubertooth_t* ut, void* args)
 		return;
 	}
 
-	/* Dump to PCAP/PCAPNG if specified */
-	refAA = lell_packet_is_data(pkt) ? 0 : 0x8e89bed6;
-	determine_signal_and_noise( rx, &sig, &noise );
-
-	if (ut->h_pcap_le) {
-		/* only one of these two will succeed, depending on
-		 * whether PCAP was opened with DLT_PPI or not */
-		lell_pcap_append_packet(ut->h_pcap_le, nowns,
-					sig, noise,
-					refAA, pkt);
-		lell_pcap_append_ppi_packet(ut->h_pcap_le, nowns,
-		                            rx->clkn_high,
-		                            rx->rssi_min, rx->rssi_max,
-		                            rx->rssi_avg, rx->rssi_count,
-		                            pkt);
-	}
-	if (ut->h_pcapng_le) {
-		lell_pcapng_append_packet(ut->h_pcapng_le, nowns,
-		                          sig, noise,
-		                          refAA, pkt);
-	}
-
 	// rollover
 	u32 rx_ts = rx->clk100ns;
-	if (rx_ts < prev_ts)
+	if (rx_ts < ut->prev_ts)
 		rx_ts += 3276800000;
-	u32 ts_diff = rx_ts - prev_ts;
-	prev_ts = rx->clk100ns;
-	printf("systime=%u freq=%d addr=%08x delta_t=%.03f ms rssi=%d\n",
-	       systime, rx->channel + 2402, lell_get_access_address(pkt),
-	       ts_diff / 10000.0, rx->rssi_min - 54);
+	u32 ts_diff = rx_ts - ut->prev_ts;
+	ut->prev_ts = rx->clk100ns;
 
 	int len = (rx->data[5] & 0x3f) + 6 + 3;
 	if (len > 50) len = 50;
 
-	for (i = 4; i < len; ++i)
-		printf("%02x ", rx->data[i]);
-	printf("\n");
+	if (ut->output) {
+		output_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = EVENT_LE;
+		ev.channel = rx->channel;
+		ev.signal = rx->rssi_min - 54;
+		ev.systime = ut->systime;
+		ev.time_ns = nowns;
+		ev.time_err_ns = nowns_err;
+		ev.address = lell_get_access_address(pkt);
+		ev.clk100ns = rx->clk100ns;
+		ev.delta_t = ts_diff;
+		ev.data_len = len - 4;
+		ev.data = rx->data + 4;
+		output_write_event(ut->output, &ev);
+	} else {
+		printf("systime=%u freq=%d addr=%08x delta_t=%.03f ms rssi=%d time_ns=%llu time_err_ns=%llu\n",
+		       ut->systime, rx->channel + 2402, lell_get_access_address(pkt),
+		       ts_diff / 10000.0, rx->rssi_min - 54,
+		       (unsigned long long)nowns, (unsigned long long)nowns_err);
+
+		for (i = 4; i < len; ++i)
+			printf("%02x ", rx->data[i]);
+		printf("\n");
 
-	lell_print(pkt);
-	printf("\n");
+		lell_print(pkt);
+		printf("\n");
+	}
 
-	lell_packet_unref(pkt);
+	/* Dump to PCAP/PCAPNG if specified, the writer takes over pkt */
+	if (ut->pcap) {
+		refAA = lell_packet_is_data(pkt) ? 0 : 0x8e89bed6;
+		determine_signal_and_noise( ut, rx, &sig, &noise );
+		pcap_writer_append_le(ut->pcap, nowns, sig, noise, refAA, rx, pkt);
+	} else {
+		lell_packet_unref(pkt);
+	}
 
-	fflush(stdout);
+	if (ut->output == NULL)
+		fflush(stdout);
 }
 /*
  * Sniff E-GO packets
@@ -513,19 +488,39 @@ void cb_btle(ubertooth_t* ut, void* args)
 void cb_ego(ubertooth_t* ut, void* args __attribute__((unused)))
 {
 	int i;
-	static u32 prev_ts = 0;
 	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
 
 	u32 rx_time = rx->clk100ns;
-	if (rx_time < prev_ts)
+	if (rx_time < ut->prev_ts)
 		rx_time += 3276800000; // rollover
-	u32 ts_diff = rx_time - prev_ts;
-	prev_ts = rx->clk100ns;
-	printf("time=%u delta_t=%.06f ms freq=%d \n",
-	       rx->clk100ns, ts_diff / 10000.0,
-	       rx->channel + 2402);
+	u32 ts_diff = rx_time - ut->prev_ts;
+	ut->prev_ts = rx->clk100ns;
 
 	int len = 36; // FIXME
+	uint64_t nowns_err;
+	uint64_t nowns = packet_time_ns( ut, rx, &nowns_err );
+
+	if (ut->output) {
+		output_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = EVENT_EGO;
+		ev.channel = rx->channel;
+		ev.systime = nowns / 1000000000ull;
+		ev.time_ns = nowns;
+		ev.time_err_ns = nowns_err;
+		ev.clk100ns = rx->clk100ns;
+		ev.delta_t = ts_diff;
+		ev.data_len = len;
+		ev.data = rx->data;
+		output_write_event(ut->output, &ev);
+		return;
+	}
+
+	printf("time=%u delta_t=%.06f ms freq=%d time_ns=%llu time_err_ns=%llu\n",
+	       rx->clk100ns, ts_diff / 10000.0,
+	       rx->channel + 2402,
+	       (unsigned long long)nowns, (unsigned long long)nowns_err);
 
 	for (i = 0; i < len; ++i)
 		printf("%02x ", rx->data[i]);
@@ -539,17 +534,14 @@ void cb_rx(ubertooth_t* ut, void* args)
 {
 	btbb_packet* pkt = NULL;
 	btbb_piconet* pn = (btbb_piconet *)args;
-	char syms[NUM_BANKS * BANK_LEN];
+	char* syms;
 	int offset;
 	uint16_t clk_offset;
 	uint32_t clkn;
-	int i, r;
+	int r;
 	uint32_t lap = LAP_ANY;
 	uint8_t uap = UAP_ANY;
 
-	static int trim_counter = 0;
-	static int calibrated = 0;
-
 	/* Do analysis based on oldest packet */
 	usb_pkt_rx* rx = ringbuffer_bottom_usb(ut->packets);
 
@@ -561,19 +553,14 @@ void cb_rx(ubertooth_t* ut, void* args)
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		goto out;
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
+	uint64_t nowns_err;
+	uint64_t nowns = packet_time_ns( ut, rx, &nowns_err );
 
 	int8_t signal_level = rx->rssi_max;
 	int8_t noise_level = rx->rssi_min;
-	determine_signal_and_noise( rx, &signal_level, &noise_level );
+	determine_signal_and_noise( ut, rx, &signal_level, &noise_level );
 	int8_t snr = signal_level - noise_level;
 
-	/* Copy out remaining banks of symbols for full analysis. */
-	for (i = 0; i < NUM_BANKS; i++)
-		memcpy(syms + i * BANK_LEN,
-		       ringbuffer_get_bt(ut->packets, i),
-		       BANK_LEN);
-
 	/* Look for packets with specified LAP, if given. Otherwise
 	 * search for any packet. */
 	if (pn) {
@@ -583,9 +570,25 @@ void cb_rx(ubertooth_t* ut, void* args)
 
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
-	offset = btbb_find_ac(syms, BANK_LEN, lap, max_ac_errors, &pkt);
-	if (offset < 0)
-		goto out;
+	if (ut->ac_result) {
+		offset = ubertooth_take_ac_result(ut, 0, BANK_LEN, &pkt);
+		if (offset < 0)
+			goto out;
+		if (ut->watchlist)
+			lap = btbb_packet_get_lap(pkt);
+	} else if (ut->watchlist) {
+		offset = ubertooth_find_ac_watchlist(ut, ut->watchlist, 0, BANK_LEN, &pkt);
+		if (offset < 0)
+			goto out;
+		lap = btbb_packet_get_lap(pkt);
+	} else {
+		offset = ubertooth_find_ac(ut, 0, BANK_LEN, lap, ut->max_ac_errors, &pkt);
+		if (offset < 0)
+			goto out;
+	}
+
+	/* All banks of symbols for full analysis. */
+	syms = ringbuffer_bt_window(ut->packets);
 
 	/* calculate the offset between the first bit of the AC and the rising edge of CLKN */
 	clk_offset = (le32toh(rx->clk100ns) + offset*10 + 6250 - 4000) % 6250;
@@ -603,51 +606,62 @@ void cb_rx(ubertooth_t* ut, void* args)
 	/* When reading from file, caller will read
 	 * systime before calling this routine, so do
 	 * not overwrite. Otherwise, get current time. */
-	if (infile == NULL)
-		systime = time(NULL);
-
-	printf("\n");
-	printf("systime=%u ch=%2d LAP=%06x err=%u clkn=%u clk_offset=%u s=%d n=%d snr=%d\n",
-	       (uint32_t)time(NULL),
-	       btbb_packet_get_channel(pkt),
-	       btbb_packet_get_lap(pkt),
-	       btbb_packet_get_ac_errors(pkt),
-	       clkn,
-	       clk_offset,
-	       signal_level,
-	       noise_level,
-	       snr
-	);
+	if (ut->infile == NULL)
+		ut->systime = nowns / 1000000000ull;
+
+	if (ut->output) {
+		output_br(ut, pkt, nowns, nowns_err, rx->clk100ns, clkn,
+		          clk_offset, signal_level, noise_level);
+	} else {
+		printf("\n");
+		printf("systime=%u ch=%2d LAP=%06x err=%u clkn=%u clk_offset=%u s=%d n=%d snr=%d time_ns=%llu time_err_ns=%llu\n",
+		       ut->systime,
+		       btbb_packet_get_channel(pkt),
+		       btbb_packet_get_lap(pkt),
+		       btbb_packet_get_ac_errors(pkt),
+		       clkn,
+		       clk_offset,
+		       signal_level,
+		       noise_level,
+		       snr,
+		       (unsigned long long)nowns,
+		       (unsigned long long)nowns_err
+		);
+	}
 
 	/* calibrate Ubertooth clock such that the first bit of the AC
 	 * arrives CLK_TUNE_TIME after the rising edge of CLKN */
-	if (pn != NULL && infile == NULL) {
-		if (trim_counter < -PKTS_PER_XFER
-		    || ((clk_offset < CLK_TUNE_TIME - CLK_TUNE_OFFSET) && !calibrated)) {
-			printf("offset < CLK_TUNE_TIME\n");
-			printf("CLK100ns Trim: %d\n", 6250 + clk_offset - CLK_TUNE_TIME);
-			cmd_trim_clock(ut->devh, 6250 + clk_offset - CLK_TUNE_TIME);
-			trim_counter = 0;
-			calibrated = 1;
+	if (pn != NULL && ut->infile == NULL) {
+		if (ut->trim_counter < -CLK_TRIM_THRESHOLD
+		    || ((clk_offset < CLK_TUNE_TIME - CLK_TUNE_OFFSET) && !ut->calibrated)) {
+			if (ut->output == NULL) {
+				printf("offset < CLK_TUNE_TIME\n");
+				printf("CLK100ns Trim: %d\n", 6250 + clk_offset - CLK_TUNE_TIME);
+			}
+			cmd_queue_trim_clock(ut->cmdq, 6250 + clk_offset - CLK_TUNE_TIME);
+			ut->trim_counter = 0;
+			ut->calibrated = 1;
 			goto out;
-		} else if (trim_counter > PKTS_PER_XFER
-		           || ((clk_offset > CLK_TUNE_TIME + CLK_TUNE_OFFSET) && !calibrated)) {
-			printf("offset > CLK_TUNE_TIME\n");
-			printf("CLK100ns Trim: %d\n", clk_offset - CLK_TUNE_TIME);
-			cmd_trim_clock(ut->devh, clk_offset - CLK_TUNE_TIME);
-			trim_counter = 0;
-			calibrated = 1;
+		} else if (ut->trim_counter > CLK_TRIM_THRESHOLD
+		           || ((clk_offset > CLK_TUNE_TIME + CLK_TUNE_OFFSET) && !ut->calibrated)) {
+			if (ut->output == NULL) {
+				printf("offset > CLK_TUNE_TIME\n");
+				printf("CLK100ns Trim: %d\n", clk_offset - CLK_TUNE_TIME);
+			}
+			cmd_queue_trim_clock(ut->cmdq, clk_offset - CLK_TUNE_TIME);
+			ut->trim_counter = 0;
+			ut->calibrated = 1;
 			goto out;
 		}
 
 		if (clk_offset < CLK_TUNE_TIME - CLK_TUNE_OFFSET) {
-			trim_counter--;
+			ut->trim_counter--;
 			goto out;
 		} else if (clk_offset > CLK_TUNE_TIME + CLK_TUNE_OFFSET) {
-			trim_counter++;
+			ut->trim_counter++;
 			goto out;
 		} else {
-			trim_counter = 0;
+			ut->trim_counter = 0;
 		}
 	}
 
@@ -657,27 +671,19 @@ void cb_rx(ubertooth_t* ut, void* args)
 	/* If dumpfile is specified, write out all banks to the
 	 * file. There could be duplicate data in the dump if more
 	 * than one LAP is found within the span of NUM_BANKS. */
-	if (dumpfile && r==3) {
-		uint32_t systime_be = htobe32(systime);
-		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
-		fwrite(rx, sizeof(usb_pkt_rx), 1, dumpfile);
-		fflush(dumpfile);
-	}
-
-	/* Dump to PCAP/PCAPNG if specified */
-	if (ut->h_pcap_bredr) {
-		btbb_pcap_append_packet(ut->h_pcap_bredr, nowns,
-		                        signal_level, noise_level,
-		                        lap, uap, pkt);
-	}
-	if (ut->h_pcapng_bredr) {
-		btbb_pcapng_append_packet(ut->h_pcapng_bredr, nowns,
-		                          signal_level, noise_level,
-		                          lap, uap, pkt);
+	if (ut->dumpfile && r==3)
+		dump_writer_write_pkt(ut->dumpfile, ut->systime, rx);
+
+	/* Dump to PCAP/PCAPNG if specified, the writer takes over pkt */
+	if (ut->pcap) {
+		pcap_writer_append_bredr(ut->pcap, nowns,
+		                         signal_level, noise_level,
+		                         lap, uap, pkt);
+		pkt = NULL;
 	}
 
-	if(infile == NULL && r < 0)
-		cmd_start_hopping(ut->devh, btbb_piconet_get_clk_offset(pn), 0);
+	if(ut->infile == NULL && r < 0)
+		cmd_queue_start_hopping(ut->cmdq, btbb_piconet_get_clk_offset(pn), 0);
 
 out:
 	if (pkt)
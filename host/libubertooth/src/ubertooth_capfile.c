@@ -0,0 +1,855 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_capfile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define CAPFILE_BLOCK_SIZE \
+	(CAPFILE_BLOCK_HEADER_LEN + CAPFILE_BLOCK_RECORDS * CAPFILE_RECORD_LEN)
+
+/* Offset of the symbols in usb_pkt_rx, and of the header bytes which
+ * CAPFILE_ENC_DELTA keeps a column each, clk100ns is delta coded */
+#define PKT_HEADER_LEN 14
+static const uint8_t header_columns[] = { 0, 1, 2, 3, 8, 9, 10, 11, 12, 13 };
+#define NUM_COLUMNS (sizeof(header_columns) / sizeof(header_columns[0]))
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, v);
+	put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+	put_u32(p, v);
+	put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* clk100ns is little endian in the packet as it came over USB */
+static uint32_t pkt_clk100ns(const usb_pkt_rx* rx)
+{
+	return get_u32((const uint8_t*)&rx->clk100ns);
+}
+
+static uint8_t* put_varint(uint8_t* p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+/* small negative deltas stay short */
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t delta_encode(const uint8_t* records, uint32_t count, uint8_t* out)
+{
+	const uint8_t* rec;
+	uint64_t prev_ns = 0, t;
+	uint32_t prev_clk = 0, clk;
+	uint8_t* p = out;
+	uint32_t i, c;
+
+	for (i = 0, rec = records; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		t = capfile_record_time(rec);
+		p = put_varint(p, zigzag((int64_t)(t - prev_ns)));
+		prev_ns = t;
+	}
+	for (i = 0, rec = records; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		clk = pkt_clk100ns(capfile_record_packet(rec));
+		p = put_varint(p, zigzag((int32_t)(clk - prev_clk)));
+		prev_clk = clk;
+	}
+	for (c = 0; c < NUM_COLUMNS; c++)
+		for (i = 0, rec = records + 8; i < count; i++, rec += CAPFILE_RECORD_LEN)
+			*p++ = rec[header_columns[c]];
+	for (i = 0, rec = records + 8; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		memcpy(p, rec + PKT_HEADER_LEN, DMA_SIZE);
+		p += DMA_SIZE;
+	}
+	return p - out;
+}
+
+static int delta_decode(const uint8_t* in, size_t len, uint32_t count, uint8_t* records)
+{
+	const uint8_t* end = in + len;
+	const uint8_t* p = in;
+	uint8_t* rec;
+	uint64_t prev_ns = 0, v;
+	uint32_t prev_clk = 0;
+	uint32_t i, c;
+
+	for (i = 0, rec = records; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		p = get_varint(p, end, &v);
+		if (p == NULL)
+			return -1;
+		prev_ns += unzigzag(v);
+		put_u64(rec, prev_ns);
+	}
+	for (i = 0, rec = records + 8; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		p = get_varint(p, end, &v);
+		if (p == NULL)
+			return -1;
+		prev_clk += (int32_t)unzigzag(v);
+		put_u32(rec + 4, prev_clk);
+	}
+	if ((size_t)(end - p) != count * (NUM_COLUMNS + DMA_SIZE))
+		return -1;
+	for (c = 0; c < NUM_COLUMNS; c++)
+		for (i = 0, rec = records + 8; i < count; i++, rec += CAPFILE_RECORD_LEN)
+			rec[header_columns[c]] = *p++;
+	for (i = 0, rec = records + 8; i < count; i++, rec += CAPFILE_RECORD_LEN) {
+		memcpy(rec + PKT_HEADER_LEN, p, DMA_SIZE);
+		p += DMA_SIZE;
+	}
+	return 0;
+}
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void capfile_meta_init(capfile_meta* meta)
+{
+	memset(meta, 0, sizeof(*meta));
+	meta->board_id = -1;
+	meta->created_ns = realtime_ns();
+}
+
+static void encode_header(uint8_t* buf, const capfile_meta* meta)
+{
+	memset(buf, 0, CAPFILE_HEADER_LEN);
+	memcpy(buf, CAPFILE_MAGIC, 8);
+	put_u16(buf + 8, CAPFILE_VERSION);
+	put_u16(buf + 10, CAPFILE_HEADER_LEN);
+	put_u32(buf + 12, CAPFILE_BLOCK_RECORDS);
+	put_u32(buf + 16, meta->flags);
+	put_u32(buf + 20, (uint32_t)meta->board_id);
+	memcpy(buf + 24, meta->serial, 16);
+	put_u16(buf + 40, meta->modulation);
+	buf[42] = meta->mode;
+	put_u64(buf + 48, meta->created_ns);
+	strncpy((char*)buf + 56, meta->firmware, 63);
+}
+
+static int decode_header(const uint8_t* buf, capfile_meta* meta)
+{
+	if (memcmp(buf, CAPFILE_MAGIC, 8) != 0) {
+		fprintf(stderr, "Not an Ubertooth capture file\n");
+		return -1;
+	}
+	if (get_u16(buf + 8) != CAPFILE_VERSION ||
+	    get_u16(buf + 10) != CAPFILE_HEADER_LEN ||
+	    get_u32(buf + 12) != CAPFILE_BLOCK_RECORDS) {
+		fprintf(stderr, "Unsupported capture file version %u\n", get_u16(buf + 8));
+		return -1;
+	}
+
+	memset(meta, 0, sizeof(*meta));
+	meta->flags = get_u32(buf + 16);
+	meta->board_id = (int32_t)get_u32(buf + 20);
+	memcpy(meta->serial, buf + 24, 16);
+	meta->modulation = get_u16(buf + 40);
+	meta->mode = buf[42];
+	meta->created_ns = get_u64(buf + 48);
+	memcpy(meta->firmware, buf + 56, 63);
+	return 0;
+}
+
+static void encode_index_entry(uint8_t* buf, const capfile_block* b)
+{
+	memset(buf, 0, CAPFILE_INDEX_ENTRY_LEN);
+	put_u64(buf, b->offset);
+	put_u64(buf + 8, b->min_ns);
+	put_u64(buf + 16, b->max_ns);
+	put_u32(buf + 24, b->first_clk100ns);
+	put_u32(buf + 28, b->last_clk100ns);
+	put_u32(buf + 32, b->count);
+	put_u16(buf + 36, b->types);
+	memcpy(buf + 38, b->channels, CAPFILE_CHANNEL_BYTES);
+	put_u32(buf + 48, b->length);
+}
+
+static void decode_index_entry(const uint8_t* buf, capfile_block* b)
+{
+	b->offset = get_u64(buf);
+	b->min_ns = get_u64(buf + 8);
+	b->max_ns = get_u64(buf + 16);
+	b->first_clk100ns = get_u32(buf + 24);
+	b->last_clk100ns = get_u32(buf + 28);
+	b->count = get_u32(buf + 32);
+	b->types = get_u16(buf + 36);
+	memcpy(b->channels, buf + 38, CAPFILE_CHANNEL_BYTES);
+	b->length = get_u32(buf + 48);
+}
+
+/* Add one record to the index entry of the block it is in */
+static void index_record(capfile_block* b, uint64_t time_ns, const usb_pkt_rx* rx)
+{
+	if (b->count == 0 || time_ns < b->min_ns)
+		b->min_ns = time_ns;
+	if (b->count == 0 || time_ns > b->max_ns)
+		b->max_ns = time_ns;
+	if (b->count == 0)
+		b->first_clk100ns = pkt_clk100ns(rx);
+	b->last_clk100ns = pkt_clk100ns(rx);
+	if (rx->pkt_type < 16)
+		b->types |= 1 << rx->pkt_type;
+	if (rx->channel < CAPFILE_CHANNELS)
+		b->channels[rx->channel / 8] |= 1 << (rx->channel % 8);
+	b->count++;
+}
+
+capfile_writer* capfile_writer_open(const char* path, const capfile_meta* meta)
+{
+	uint8_t header[CAPFILE_HEADER_LEN];
+	capfile_writer* w;
+
+	w = (capfile_writer*)calloc(1, sizeof(capfile_writer));
+	if (w == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	w->block = (uint8_t*)malloc(CAPFILE_BLOCK_SIZE);
+	w->out = (uint8_t*)malloc(CAPFILE_BLOCK_HEADER_LEN + CAPFILE_MAX_PAYLOAD);
+	w->scratch = (uint8_t*)malloc(CAPFILE_MAX_PAYLOAD);
+	if (w->block == NULL || w->out == NULL || w->scratch == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto fail;
+	}
+
+	w->fp = fopen(path, "wb");
+	if (w->fp == NULL) {
+		perror(path);
+		goto fail;
+	}
+
+	encode_header(header, meta);
+	if (fwrite(header, CAPFILE_HEADER_LEN, 1, w->fp) != 1) {
+		perror(path);
+		fclose(w->fp);
+		goto fail;
+	}
+	w->offset = CAPFILE_HEADER_LEN;
+	w->realtime_offset = (int64_t)(realtime_ns() - ubertooth_monotonic_ns());
+	return w;
+
+fail:
+	free(w->scratch);
+	free(w->out);
+	free(w->block);
+	free(w);
+	return NULL;
+}
+
+int capfile_writer_set_encoding(capfile_writer* w, uint16_t encoding)
+{
+	switch (encoding) {
+	case CAPFILE_ENC_RAW:
+	case CAPFILE_ENC_DELTA:
+		break;
+	case CAPFILE_ENC_DELTA_ZLIB:
+#ifdef HAVE_ZLIB
+		break;
+#else
+		fprintf(stderr, "Built without zlib, capture file blocks can not be deflated\n");
+		return -1;
+#endif
+	default:
+		fprintf(stderr, "Unknown capture file block encoding %u\n", encoding);
+		return -1;
+	}
+	w->encoding = encoding;
+	return 0;
+}
+
+/* Encode the block, returns the header and payload to write */
+static uint8_t* encode_block(capfile_writer* w, size_t* len)
+{
+	uint32_t count = w->current.count;
+	uint8_t* out;
+#ifdef HAVE_ZLIB
+	uLongf zlen;
+	size_t n;
+#endif
+
+	switch (w->encoding) {
+	case CAPFILE_ENC_DELTA:
+		out = w->out;
+		*len = delta_encode(w->block + CAPFILE_BLOCK_HEADER_LEN, count,
+		                    out + CAPFILE_BLOCK_HEADER_LEN);
+		break;
+#ifdef HAVE_ZLIB
+	case CAPFILE_ENC_DELTA_ZLIB:
+		out = w->out;
+		n = delta_encode(w->block + CAPFILE_BLOCK_HEADER_LEN, count, w->scratch);
+		zlen = CAPFILE_MAX_PAYLOAD;
+		/* speed over ratio, the symbols are mostly noise anyway */
+		if (compress2(out + CAPFILE_BLOCK_HEADER_LEN, &zlen, w->scratch, n,
+		              Z_BEST_SPEED) != Z_OK) {
+			fprintf(stderr, "Unable to compress capture file block\n");
+			return NULL;
+		}
+		*len = zlen;
+		break;
+#endif
+	default:
+		out = w->block;
+		*len = count * CAPFILE_RECORD_LEN;
+		break;
+	}
+
+	memcpy(out, CAPFILE_BLOCK_MAGIC, 4);
+	put_u32(out + 4, count);
+	put_u16(out + 8, w->encoding);
+	put_u16(out + 10, 0);
+	put_u32(out + 12, *len);
+	return out;
+}
+
+static int flush_block(capfile_writer* w)
+{
+	capfile_block* index;
+	capfile_block* b = &w->current;
+	uint8_t* out;
+	size_t len;
+
+	if (b->count == 0)
+		return 0;
+
+	if (w->num_blocks == w->index_size) {
+		index = (capfile_block*)realloc(w->index,
+				(w->index_size + 256) * sizeof(capfile_block));
+		if (index == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		w->index = index;
+		w->index_size += 256;
+	}
+
+	out = encode_block(w, &len);
+	if (out == NULL)
+		return -1;
+
+	b->offset = w->offset;
+	b->length = CAPFILE_BLOCK_HEADER_LEN + len;
+	if (fwrite(out, b->length, 1, w->fp) != 1) {
+		perror("capture file");
+		return -1;
+	}
+	w->offset += b->length;
+
+	w->index[w->num_blocks++] = *b;
+	memset(b, 0, sizeof(*b));
+	return 0;
+}
+
+int capfile_writer_write(capfile_writer* w, uint64_t time_ns, const usb_pkt_rx* rx)
+{
+	uint8_t* record;
+
+	record = w->block + CAPFILE_BLOCK_HEADER_LEN
+	         + w->current.count * CAPFILE_RECORD_LEN;
+	put_u64(record, time_ns);
+	memcpy(record + 8, rx, PKT_LEN);
+	if (w->current.count == 0)
+		w->current_ns = ubertooth_monotonic_ns();
+	index_record(&w->current, time_ns, rx);
+
+	if (w->current.count == CAPFILE_BLOCK_RECORDS)
+		return flush_block(w);
+	return 0;
+}
+
+int capfile_writer_write_host(capfile_writer* w, uint64_t host_ns, const usb_pkt_rx* rx)
+{
+	if (host_ns == 0)
+		return capfile_writer_write(w, realtime_ns(), rx);
+	return capfile_writer_write(w, host_ns + w->realtime_offset, rx);
+}
+
+int capfile_writer_poll(capfile_writer* w)
+{
+	if (w->current.count == 0 ||
+	    ubertooth_monotonic_ns() - w->current_ns < CAPFILE_FLUSH_NS)
+		return 0;
+	if (flush_block(w) < 0)
+		return -1;
+	return fflush(w->fp) == 0 ? 0 : -1;
+}
+
+int capfile_writer_close(capfile_writer* w)
+{
+	uint8_t entry[CAPFILE_INDEX_ENTRY_LEN];
+	uint8_t trailer[CAPFILE_TRAILER_LEN];
+	uint64_t index_offset;
+	uint32_t i;
+	int r = 0;
+
+	if (w == NULL)
+		return 0;
+
+	if (flush_block(w) < 0)
+		r = -1;
+
+	index_offset = w->offset;
+	for (i = 0; i < w->num_blocks && r == 0; i++) {
+		encode_index_entry(entry, &w->index[i]);
+		if (fwrite(entry, sizeof(entry), 1, w->fp) != 1)
+			r = -1;
+	}
+
+	memset(trailer, 0, sizeof(trailer));
+	put_u64(trailer, index_offset);
+	put_u32(trailer + 8, w->num_blocks);
+	memcpy(trailer + 16, CAPFILE_INDEX_MAGIC, 8);
+	if (r == 0 && fwrite(trailer, sizeof(trailer), 1, w->fp) != 1)
+		r = -1;
+
+	if (fclose(w->fp) != 0)
+		r = -1;
+	if (r < 0)
+		fprintf(stderr, "Unable to write the capture file index\n");
+
+	free(w->index);
+	free(w->scratch);
+	free(w->out);
+	free(w->block);
+	free(w);
+	return r;
+}
+
+int capfile_probe(FILE* fp)
+{
+	char magic[8];
+	off_t pos = ftello(fp);
+	int r;
+
+	/* can not be put back on a pipe */
+	if (pos < 0)
+		return 0;
+
+	r = fread(magic, sizeof(magic), 1, fp) == 1 &&
+	    memcmp(magic, CAPFILE_MAGIC, sizeof(magic)) == 0;
+	fseeko(fp, pos, SEEK_SET);
+	return r;
+}
+
+/* The blocks an index entry points at have to lie between the header
+ * and the index */
+static int check_index_entry(const capfile_block* b, uint64_t index_offset)
+{
+	return b->count <= CAPFILE_BLOCK_RECORDS &&
+	       b->offset >= CAPFILE_HEADER_LEN &&
+	       b->length >= CAPFILE_BLOCK_HEADER_LEN &&
+	       b->length <= CAPFILE_BLOCK_HEADER_LEN + CAPFILE_MAX_PAYLOAD &&
+	       b->offset + b->length <= index_offset;
+}
+
+static int read_index(capfile_reader* r, uint64_t index_offset, uint32_t num_blocks)
+{
+	uint8_t entry[CAPFILE_INDEX_ENTRY_LEN];
+	off_t size;
+	uint32_t i;
+
+	/* the index runs from index_offset up to the trailer */
+	if (fseeko(r->fp, 0, SEEK_END) < 0 || (size = ftello(r->fp)) < 0)
+		return -1;
+	if (index_offset < CAPFILE_HEADER_LEN ||
+	    index_offset + (uint64_t)num_blocks * CAPFILE_INDEX_ENTRY_LEN
+	    + CAPFILE_TRAILER_LEN != (uint64_t)size) {
+		fprintf(stderr, "Capture file index does not fit the file\n");
+		return -1;
+	}
+
+	r->index = (capfile_block*)calloc(num_blocks ? num_blocks : 1, sizeof(capfile_block));
+	if (r->index == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	if (fseeko(r->fp, index_offset, SEEK_SET) < 0)
+		return -1;
+	for (i = 0; i < num_blocks; i++) {
+		if (fread(entry, sizeof(entry), 1, r->fp) != 1)
+			return -1;
+		decode_index_entry(entry, &r->index[i]);
+		if (!check_index_entry(&r->index[i], index_offset)) {
+			fprintf(stderr, "Bad index entry for block %u\n", i);
+			return -1;
+		}
+	}
+	r->num_blocks = num_blocks;
+	return 0;
+}
+
+/* No index, as when the capture was cut short: walk the blocks and
+ * index them again */
+static int rebuild_index(capfile_reader* r)
+{
+	uint8_t hdr[CAPFILE_BLOCK_HEADER_LEN];
+	capfile_block* index;
+	capfile_block* b;
+	const uint8_t* rec;
+	uint64_t offset = CAPFILE_HEADER_LEN;
+	uint32_t size = 0, i;
+
+	fprintf(stderr, "Capture file has no index, scanning it\n");
+	free(r->index);
+	r->index = NULL;
+	r->num_blocks = 0;
+
+	while (fseeko(r->fp, offset, SEEK_SET) == 0 &&
+	       fread(hdr, sizeof(hdr), 1, r->fp) == 1 &&
+	       memcmp(hdr, CAPFILE_BLOCK_MAGIC, 4) == 0) {
+		if (r->num_blocks == size) {
+			index = (capfile_block*)realloc(r->index, (size + 256) * sizeof(capfile_block));
+			if (index == NULL) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				return -1;
+			}
+			r->index = index;
+			size += 256;
+		}
+		b = &r->index[r->num_blocks];
+		memset(b, 0, sizeof(*b));
+		b->offset = offset;
+		b->length = CAPFILE_BLOCK_HEADER_LEN + get_u32(hdr + 12);
+		b->count = get_u32(hdr + 4);
+
+		/* a block cut off part way is dropped */
+		rec = capfile_read_block(r, r->num_blocks);
+		if (rec == NULL)
+			break;
+		b->count = 0;
+		for (i = 0; i < get_u32(hdr + 4); i++, rec += CAPFILE_RECORD_LEN)
+			index_record(b, capfile_record_time(rec), capfile_record_packet(rec));
+
+		r->num_blocks++;
+		offset += b->length;
+	}
+	return 0;
+}
+
+capfile_reader* capfile_open(FILE* fp)
+{
+	uint8_t header[CAPFILE_HEADER_LEN];
+	uint8_t trailer[CAPFILE_TRAILER_LEN];
+	capfile_reader* r;
+
+	r = (capfile_reader*)calloc(1, sizeof(capfile_reader));
+	if (r == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	r->fp = fp;
+	r->block = (uint8_t*)malloc(CAPFILE_BLOCK_SIZE);
+	r->in = (uint8_t*)malloc(CAPFILE_BLOCK_HEADER_LEN + CAPFILE_MAX_PAYLOAD);
+	r->scratch = (uint8_t*)malloc(CAPFILE_MAX_PAYLOAD);
+	if (r->block == NULL || r->in == NULL || r->scratch == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto fail;
+	}
+
+	if (fseeko(fp, 0, SEEK_SET) < 0 ||
+	    fread(header, sizeof(header), 1, fp) != 1 ||
+	    decode_header(header, &r->meta) < 0)
+		goto fail;
+
+	if (fseeko(fp, -CAPFILE_TRAILER_LEN, SEEK_END) == 0 &&
+	    fread(trailer, sizeof(trailer), 1, fp) == 1 &&
+	    memcmp(trailer + 16, CAPFILE_INDEX_MAGIC, 8) == 0 &&
+	    read_index(r, get_u64(trailer), get_u32(trailer + 8)) == 0)
+		return r;
+
+	if (rebuild_index(r) < 0)
+		goto fail;
+	return r;
+
+fail:
+	capfile_close(r);
+	return NULL;
+}
+
+void capfile_close(capfile_reader* r)
+{
+	if (r == NULL)
+		return;
+	free(r->index);
+	free(r->scratch);
+	free(r->in);
+	free(r->block);
+	free(r);
+}
+
+static int decode_block(capfile_reader* r, uint16_t encoding, uint32_t count,
+                        const uint8_t* payload, size_t len)
+{
+#ifdef HAVE_ZLIB
+	uLongf n;
+#endif
+
+	switch (encoding) {
+	case CAPFILE_ENC_RAW:
+		if (len != count * CAPFILE_RECORD_LEN)
+			return -1;
+		memcpy(r->block, payload, len);
+		return 0;
+	case CAPFILE_ENC_DELTA:
+		return delta_decode(payload, len, count, r->block);
+	case CAPFILE_ENC_DELTA_ZLIB:
+#ifdef HAVE_ZLIB
+		n = CAPFILE_MAX_PAYLOAD;
+		if (uncompress(r->scratch, &n, payload, len) != Z_OK)
+			return -1;
+		return delta_decode(r->scratch, n, count, r->block);
+#else
+		fprintf(stderr, "Capture file is compressed, and this was built without zlib\n");
+		return -1;
+#endif
+	default:
+		fprintf(stderr, "Unknown capture file block encoding %u\n", encoding);
+		return -1;
+	}
+}
+
+const uint8_t* capfile_read_block(capfile_reader* r, uint32_t i)
+{
+	const capfile_block* b = &r->index[i];
+	uint8_t* hdr = r->in;
+	uint32_t count;
+
+	if (b->length > CAPFILE_BLOCK_HEADER_LEN + CAPFILE_MAX_PAYLOAD ||
+	    b->length < CAPFILE_BLOCK_HEADER_LEN)
+		return NULL;
+	if (fseeko(r->fp, b->offset, SEEK_SET) < 0 ||
+	    fread(r->in, b->length, 1, r->fp) != 1)
+		return NULL;
+
+	/* the index says how many records there are to go through */
+	count = get_u32(hdr + 4);
+	if (memcmp(hdr, CAPFILE_BLOCK_MAGIC, 4) != 0 ||
+	    count > CAPFILE_BLOCK_RECORDS || count != b->count ||
+	    get_u32(hdr + 12) != b->length - CAPFILE_BLOCK_HEADER_LEN ||
+	    decode_block(r, get_u16(hdr + 8), count, hdr + CAPFILE_BLOCK_HEADER_LEN,
+	                 b->length - CAPFILE_BLOCK_HEADER_LEN) < 0) {
+		fprintf(stderr, "Bad block at offset %llu\n", (unsigned long long)b->offset);
+		return NULL;
+	}
+	return r->block;
+}
+
+void print_capfile_meta(const capfile_meta* meta, FILE* fileptr)
+{
+	int i;
+
+	if (fileptr == NULL)
+		fileptr = stdout;
+
+	fprintf(fileptr, "Serial No: ");
+	for (i = 0; i < 16; i++)
+		fprintf(fileptr, "%02x", meta->serial[i]);
+	fprintf(fileptr, "  Board ID: %d  Firmware: %s\n", meta->board_id,
+	        meta->firmware[0] ? meta->firmware : "unknown");
+	fprintf(fileptr, "Modulation: %u  Mode: %u  Created: %llu\n",
+	        meta->modulation, meta->mode,
+	        (unsigned long long)(meta->created_ns / 1000000000ull));
+}
+
+void capfile_query_init(capfile_query* q)
+{
+	memset(q, 0, sizeof(*q));
+	q->to_ns = UINT64_MAX;
+	q->clk_to = UINT32_MAX;
+}
+
+int capfile_parse_query(const char* spec, capfile_query* q)
+{
+	const char* p = spec;
+	const char* value;
+	char* end;
+	double secs;
+	unsigned long clk;
+	long v;
+
+	while (*p != '\0') {
+		value = strchr(p, '=');
+		if (value == NULL)
+			goto bad;
+		value++;
+
+		if (strncmp(p, "from=", 5) == 0 || strncmp(p, "to=", 3) == 0) {
+			secs = strtod(value, &end);
+			if (end == value || secs < 0 || (*end != '\0' && *end != ','))
+				goto bad;
+			if (*p == 'f')
+				q->from_ns = (uint64_t)(secs * 1e9);
+			else
+				q->to_ns = (uint64_t)(secs * 1e9);
+		} else if (strncmp(p, "clk_from=", 9) == 0 || strncmp(p, "clk_to=", 7) == 0) {
+			clk = strtoul(value, &end, 10);
+			if (end == value || clk >= CLK100NS_WRAP ||
+			    (*end != '\0' && *end != ','))
+				goto bad;
+			if (p[4] == 'f')
+				q->clk_from = clk;
+			else
+				q->clk_to = clk;
+		} else if (strncmp(p, "channel=", 8) == 0) {
+			v = strtol(value, &end, 10);
+			if (end == value || v < 0 || v >= CAPFILE_CHANNELS ||
+			    (*end != '\0' && *end != ','))
+				goto bad;
+			q->channels[v / 8] |= 1 << (v % 8);
+		} else if (strncmp(p, "type=", 5) == 0) {
+			v = strtol(value, &end, 10);
+			if (end == value || v < 0 || v >= 16 || (*end != '\0' && *end != ','))
+				goto bad;
+			q->types |= 1 << v;
+		} else {
+			goto bad;
+		}
+
+		p = strchr(p, ',');
+		if (p == NULL)
+			break;
+		p++;
+	}
+	if (q->clk_from > q->clk_to) {
+		fprintf(stderr, "Invalid capture query: clk_from is after clk_to\n");
+		return -1;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "Invalid capture query: %s\n", p);
+	return -1;
+}
+
+static int any_channel(const capfile_query* q)
+{
+	int i;
+
+	for (i = 0; i < CAPFILE_CHANNEL_BYTES; i++)
+		if (q->channels[i])
+			return 0;
+	return 1;
+}
+
+/* Whether the device clocks of a block can fall in the query range. The
+ * clock wraps, so the block covers first..last or, if that goes back,
+ * first..CLK100NS_WRAP and 0..last. */
+static int block_clk_matches(const capfile_block* b, const capfile_query* q)
+{
+	/* long enough to have wrapped more than once, could be anything */
+	if (b->max_ns - b->min_ns >= 100ull * CLK100NS_WRAP)
+		return 1;
+	if (b->first_clk100ns <= b->last_clk100ns)
+		return b->first_clk100ns <= q->clk_to && b->last_clk100ns >= q->clk_from;
+	return q->clk_to >= b->first_clk100ns || q->clk_from <= b->last_clk100ns;
+}
+
+int capfile_block_matches(const capfile_block* b, const capfile_query* q)
+{
+	int i;
+
+	if (b->max_ns < q->from_ns || b->min_ns > q->to_ns)
+		return 0;
+	if (!block_clk_matches(b, q))
+		return 0;
+	if (q->types && !(b->types & q->types))
+		return 0;
+	if (any_channel(q))
+		return 1;
+	for (i = 0; i < CAPFILE_CHANNEL_BYTES; i++)
+		if (b->channels[i] & q->channels[i])
+			return 1;
+	return 0;
+}
+
+int capfile_record_matches(const uint8_t* record, const capfile_query* q)
+{
+	const usb_pkt_rx* rx = capfile_record_packet(record);
+	uint64_t t = capfile_record_time(record);
+
+	if (t < q->from_ns || t > q->to_ns)
+		return 0;
+	if (pkt_clk100ns(rx) < q->clk_from || pkt_clk100ns(rx) > q->clk_to)
+		return 0;
+	if (q->types && (rx->pkt_type >= 16 || !(q->types & (1 << rx->pkt_type))))
+		return 0;
+	if (any_channel(q))
+		return 1;
+	return rx->channel < CAPFILE_CHANNELS &&
+	       (q->channels[rx->channel / 8] & (1 << (rx->channel % 8)));
+}
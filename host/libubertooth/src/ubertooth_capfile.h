@@ -0,0 +1,188 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CAPFILE_H__
+#define __UBERTOOTH_CAPFILE_H__
+
+#include "ubertooth_control.h"
+#include <stdio.h>
+
+/* Indexed capture files. All fields are little endian.
+ *
+ *   header   CAPFILE_HEADER_LEN bytes, the capfile_meta
+ *   blocks   a CAPFILE_BLOCK_HEADER_LEN header, then up to
+ *            CAPFILE_BLOCK_RECORDS records of a 64 bit time in ns since
+ *            the epoch followed by the USB packet, encoded as the block
+ *            header says
+ *   index    CAPFILE_INDEX_ENTRY_LEN bytes per block
+ *   trailer  index offset, number of blocks and CAPFILE_INDEX_MAGIC
+ *
+ * A file whose writer did not get to close it has no index, it is
+ * rebuilt by walking the blocks. */
+#define CAPFILE_MAGIC            "UBTCAP\r\n"
+#define CAPFILE_INDEX_MAGIC      "UBTCIDX\n"
+#define CAPFILE_BLOCK_MAGIC      "UBTB"
+#define CAPFILE_VERSION          1
+#define CAPFILE_HEADER_LEN       128
+#define CAPFILE_BLOCK_HEADER_LEN 16
+#define CAPFILE_RECORD_LEN       (8 + PKT_LEN)
+#define CAPFILE_INDEX_ENTRY_LEN  56
+#define CAPFILE_TRAILER_LEN      24
+#define CAPFILE_BLOCK_RECORDS    1024
+
+/* Bitmap of usb_pkt_rx channels */
+#define CAPFILE_CHANNELS      80
+#define CAPFILE_CHANNEL_BYTES (CAPFILE_CHANNELS / 8)
+
+/* Block encodings. CAPFILE_ENC_DELTA stores the times and clk100ns as
+ * varint deltas from the previous record, the other 10 packet header
+ * bytes a column each, then the symbols. CAPFILE_ENC_DELTA_ZLIB is that
+ * deflated, only available when built with zlib. */
+#define CAPFILE_ENC_RAW        0
+#define CAPFILE_ENC_DELTA      1
+#define CAPFILE_ENC_DELTA_ZLIB 2
+
+/* A block is written out once its first record is this old, so that
+ * a slow capture can be read while it is still going */
+#define CAPFILE_FLUSH_NS 1000000000ull
+
+/* Most an encoded block can take up, deflate included */
+#define CAPFILE_MAX_PAYLOAD (CAPFILE_BLOCK_RECORDS * (CAPFILE_RECORD_LEN + 16) + 4096)
+
+/* Record times are per packet host estimates, rather than the second
+ * they were written in as for converted ubertooth-dump files */
+#define CAPFILE_HOST_TIME 0x01
+
+typedef struct {
+	uint32_t flags;
+	/* as returned by cmd_get_serial(), without the status byte */
+	u8 serial[16];
+	char firmware[64];
+	int32_t board_id;
+	uint16_t modulation;
+	/* the command that started the capture, e.g. UBERTOOTH_RX_SYMBOLS */
+	uint8_t mode;
+	uint64_t created_ns;
+} capfile_meta;
+
+/* What the index holds for each block */
+typedef struct {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t count;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t first_clk100ns;
+	uint32_t last_clk100ns;
+	/* bit n set if a packet of type n is in the block */
+	uint16_t types;
+	uint8_t channels[CAPFILE_CHANNEL_BYTES];
+} capfile_block;
+
+typedef struct {
+	FILE* fp;
+	uint64_t offset;
+	/* added to CLOCK_MONOTONIC to get the time since the epoch */
+	int64_t realtime_offset;
+	uint16_t encoding;
+
+	uint8_t* block;
+	/* encoded blocks, and delta coded ones waiting for deflate */
+	uint8_t* out;
+	uint8_t* scratch;
+	capfile_block current;
+	/* CLOCK_MONOTONIC when the first record of current was written */
+	uint64_t current_ns;
+
+	capfile_block* index;
+	uint32_t num_blocks;
+	uint32_t index_size;
+} capfile_writer;
+
+typedef struct {
+	FILE* fp;
+	capfile_meta meta;
+	capfile_block* index;
+	uint32_t num_blocks;
+	uint8_t* block;
+	/* blocks as stored, and delta coded ones after inflate */
+	uint8_t* in;
+	uint8_t* scratch;
+} capfile_reader;
+
+/* Packets wanted from a capture, see capfile_parse_query() */
+typedef struct {
+	uint64_t from_ns;
+	uint64_t to_ns;
+	/* device clock, both ends included */
+	uint32_t clk_from;
+	uint32_t clk_to;
+	/* all clear for any channel, type */
+	uint8_t channels[CAPFILE_CHANNEL_BYTES];
+	uint16_t types;
+} capfile_query;
+
+void capfile_meta_init(capfile_meta* meta);
+
+capfile_writer* capfile_writer_open(const char* path, const capfile_meta* meta);
+/* CAPFILE_ENC_*, for the blocks written from now on */
+int capfile_writer_set_encoding(capfile_writer* w, uint16_t encoding);
+int capfile_writer_write(capfile_writer* w, uint64_t time_ns, const usb_pkt_rx* rx);
+/* host_ns as from ubertooth_monotonic_ns(), 0 for now */
+int capfile_writer_write_host(capfile_writer* w, uint64_t host_ns, const usb_pkt_rx* rx);
+/* Write out the current block if it is older than CAPFILE_FLUSH_NS.
+ * Call this now and then when nothing may be written for a while. */
+int capfile_writer_poll(capfile_writer* w);
+/* Writes the index, returns -1 if anything could not be written */
+int capfile_writer_close(capfile_writer* w);
+
+/* Whether fp is at the start of a capture file, fp is left where it was */
+int capfile_probe(FILE* fp);
+/* fp is still the caller's to close */
+capfile_reader* capfile_open(FILE* fp);
+void capfile_close(capfile_reader* r);
+/* Records of block i, CAPFILE_RECORD_LEN apart, valid until the next
+ * call. NULL if the block can not be read. */
+const uint8_t* capfile_read_block(capfile_reader* r, uint32_t i);
+void print_capfile_meta(const capfile_meta* meta, FILE* fileptr);
+
+void capfile_query_init(capfile_query* q);
+/* Parse "from=<secs>,to=<secs>,clk_from=<n>,clk_to=<n>,channel=<n>,
+ * type=<n>", times are since the epoch, clk_* the clk100ns of the
+ * packets, and channel and type may be repeated */
+int capfile_parse_query(const char* spec, capfile_query* q);
+int capfile_block_matches(const capfile_block* b, const capfile_query* q);
+int capfile_record_matches(const uint8_t* record, const capfile_query* q);
+
+static inline uint64_t capfile_record_time(const uint8_t* record)
+{
+	uint64_t t = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		t = (t << 8) | record[i];
+	return t;
+}
+
+static inline const usb_pkt_rx* capfile_record_packet(const uint8_t* record)
+{
+	return (const usb_pkt_rx*)(record + 8);
+}
+
+#endif /* __UBERTOOTH_CAPFILE_H__ */
@@ -0,0 +1,236 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ubertooth_capture.h"
+
+/* Open every attached Ubertooth */
+ubertooth_capture_t* ubertooth_capture_open_all(void)
+{
+	int i, r, count;
+	ubertooth_t* ut;
+	ubertooth_capture_t* cap;
+
+	count = ubertooth_count_devices();
+	if (count <= 0) {
+		fprintf(stderr, "could not find any Ubertooth devices\n");
+		return NULL;
+	}
+
+	cap = (ubertooth_capture_t*)calloc(1, sizeof(ubertooth_capture_t));
+	if (cap == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	cap->merge_latency_ns = DEFAULT_MERGE_LATENCY_NS;
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->ready, NULL);
+
+	for (i = 0; i < count; i++) {
+		ut = ubertooth_init();
+		if (ut == NULL)
+			break;
+
+		r = ubertooth_connect(ut, i);
+		if (r < 0) {
+			fprintf(stderr, "skipping Ubertooth device %d\n", i);
+			ubertooth_free(ut);
+			continue;
+		}
+
+		r = ubertooth_check_api(ut);
+		if (r < 0) {
+			ubertooth_free(ut);
+			continue;
+		}
+
+		ut->notify_lock = &cap->lock;
+		ut->notify = &cap->ready;
+		cap->devices[cap->num_devices++] = ut;
+	}
+
+	if (cap->num_devices == 0) {
+		pthread_cond_destroy(&cap->ready);
+		pthread_mutex_destroy(&cap->lock);
+		free(cap);
+		return NULL;
+	}
+
+	return cap;
+}
+
+/* Start streaming on all devices. mode is the command which puts a
+ * device into the wanted receive mode, e.g. UBERTOOTH_RX_SYMBOLS; it is
+ * sent with ubertooth_start_mode() so that it is replayed on reconnect. */
+int ubertooth_capture_start(ubertooth_capture_t* cap, uint8_t mode,
+                            u16 value, u16 index)
+{
+	int i, r;
+	ubertooth_t* ut;
+
+	for (i = 0; i < cap->num_devices; i++) {
+		ut = cap->devices[i];
+
+		r = ubertooth_bulk_init(ut);
+		if (r < 0)
+			return r;
+
+		r = ubertooth_bulk_thread_start(ut);
+		if (r < 0)
+			return r;
+
+		r = ubertooth_start_mode(ut, mode, value, index);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/* Sleep until a device adds to its fifo beyond depth[], or until
+ * deadline_ns on the host CLOCK_MONOTONIC. Signal handlers can only set
+ * stop_ubertooth, so this never sleeps for longer than BULK_WAIT_POLL_NS. */
+static void capture_wait(ubertooth_capture_t* cap, const uint32_t* depth,
+                         uint64_t deadline_ns)
+{
+	int i;
+	uint64_t now_ns = ubertooth_monotonic_ns();
+	uint64_t ns;
+	struct timespec ts;
+
+	if (deadline_ns <= now_ns)
+		return;
+	ns = deadline_ns - now_ns;
+	if (ns > BULK_WAIT_POLL_NS)
+		ns = BULK_WAIT_POLL_NS;
+
+	pthread_mutex_lock(&cap->lock);
+	/* the fifo is filled before the wakeup, which needs this lock */
+	for (i = 0; i < cap->num_devices; i++) {
+		if (fifo_depth(cap->devices[i]->fifo) > depth[i] ||
+		    cap->devices[i]->stop_ubertooth) {
+			pthread_mutex_unlock(&cap->lock);
+			return;
+		}
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns += ts.tv_nsec;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	pthread_cond_timedwait(&cap->ready, &cap->lock, &ts);
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* Pass packets from all devices to cb, oldest first. The callback is
+ * given the device the packet came from. A packet is only released
+ * once every device has data queued, or after it has waited
+ * merge_latency_ns for a quiet device.
+ *
+ * Returns the number of packets processed, or -1 if capture was
+ * stopped. */
+int ubertooth_capture_receive(ubertooth_capture_t* cap, rx_callback cb, void* cb_args)
+{
+	int i, oldest, waiting, count = 0;
+	uint32_t n;
+	uint32_t depth[MAX_UBERTOOTHS];
+	usb_pkt_rx* pkts[MAX_UBERTOOTHS];
+	uint64_t* host_ns[MAX_UBERTOOTHS];
+	uint64_t deadline_ns = 0;
+	ubertooth_t* ut;
+
+	while (!cap->stop_capture) {
+		oldest = -1;
+		waiting = 0;
+		for (i = 0; i < cap->num_devices; i++) {
+			ut = cap->devices[i];
+			if (ut->stop_ubertooth) {
+				cap->stop_capture = 1;
+				break;
+			}
+			depth[i] = fifo_depth(ut->fifo);
+			n = fifo_get_batch(ut->fifo, &pkts[i], &host_ns[i]);
+			if (n == 0) {
+				if (ubertooth_bulk_thread_check(ut) < 0) {
+					cap->stop_capture = 1;
+					break;
+				}
+				waiting = 1;
+				continue;
+			}
+			if (oldest < 0 || host_ns[i][0] < host_ns[oldest][0])
+				oldest = i;
+		}
+
+		if (cap->stop_capture)
+			break;
+		if (oldest < 0) {
+			deadline_ns = ubertooth_monotonic_ns() + BULK_WAIT_POLL_NS;
+			break;
+		}
+
+		/* a quiet device may still deliver something older */
+		deadline_ns = host_ns[oldest][0] + cap->merge_latency_ns;
+		if (waiting && deadline_ns > ubertooth_monotonic_ns())
+			break;
+
+		ut = cap->devices[oldest];
+		ut->rx_host_ns = host_ns[oldest][0];
+		ringbuffer_add(ut->packets, pkts[oldest]);
+		fifo_release(ut->fifo, 1);
+		(*cb)(ut, cb_args);
+		count++;
+
+		/* let the caller look at its stop conditions now and then */
+		if (count >= PKTS_PER_XFER * cap->num_devices)
+			break;
+	}
+
+	if (cap->stop_capture)
+		return -1;
+	if (count == 0)
+		capture_wait(cap, depth, deadline_ns);
+
+	return count;
+}
+
+void ubertooth_capture_stop(ubertooth_capture_t* cap)
+{
+	int i;
+
+	for (i = 0; i < cap->num_devices; i++)
+		ubertooth_stop(cap->devices[i]);
+}
+
+/* Stop and free every device, and cap */
+void ubertooth_capture_free(ubertooth_capture_t* cap)
+{
+	int i;
+
+	if (cap == NULL)
+		return;
+
+	for (i = 0; i < cap->num_devices; i++)
+		ubertooth_free(cap->devices[i]);
+	pthread_cond_destroy(&cap->ready);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+}
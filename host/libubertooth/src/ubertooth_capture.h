@@ -0,0 +1,48 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CAPTURE_H__
+#define __UBERTOOTH_CAPTURE_H__
+
+#include "ubertooth.h"
+
+/* How long to hold back packets waiting for a quiet device, in ns */
+#define DEFAULT_MERGE_LATENCY_NS 50000000ull
+
+/* Concurrent capture from several Ubertooths. Each device has its own
+ * libusb context and USB thread; ubertooth_capture_receive() merges
+ * their packets into one stream ordered by ut->rx_host_ns. */
+typedef struct {
+	int num_devices;
+	ubertooth_t* devices[MAX_UBERTOOTHS];
+	uint64_t merge_latency_ns;
+	uint8_t stop_capture;
+	/* signalled by every device's USB thread as it adds to its fifo */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} ubertooth_capture_t;
+
+ubertooth_capture_t* ubertooth_capture_open_all(void);
+int ubertooth_capture_start(ubertooth_capture_t* cap, uint8_t mode,
+                            u16 value, u16 index);
+int ubertooth_capture_receive(ubertooth_capture_t* cap, rx_callback cb, void* cb_args);
+void ubertooth_capture_stop(ubertooth_capture_t* cap);
+void ubertooth_capture_free(ubertooth_capture_t* cap);
+
+#endif /* __UBERTOOTH_CAPTURE_H__ */
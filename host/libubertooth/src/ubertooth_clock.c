@@ -0,0 +1,240 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_clock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* CLKN is 28 bits */
+#define DEVICE_CLOCK_SPAN ((uint64_t)CLK100NS_WRAP << 8)
+
+static int64_t realtime_offset(void)
+{
+	struct timeval tv;
+	uint64_t mono = ubertooth_monotonic_ns();
+
+	gettimeofday(&tv, NULL);
+	return (int64_t)(1000000000ull * tv.tv_sec + 1000ull * tv.tv_usec) - (int64_t)mono;
+}
+
+/* What clock_sync_realtime_ns() adds to the host times */
+static int64_t host_offset(const clock_sync_t* cs)
+{
+	return cs->epoch ? 0 : realtime_offset();
+}
+
+void clock_sync_init(clock_sync_t* cs)
+{
+	memset(cs, 0, sizeof(clock_sync_t));
+	cs->slope = 100.0;
+	cs->error_ns = CLOCK_SYNC_INITIAL_ERROR_NS;
+}
+
+void clock_sync_set_epoch(clock_sync_t* cs)
+{
+	clock_sync_init(cs);
+	cs->epoch = 1;
+}
+
+int64_t clock_sync_device_time(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high)
+{
+	uint64_t raw = (uint64_t)clkn_high * CLK100NS_WRAP + clk100ns;
+	uint64_t delta;
+
+	if (!cs->have_dev) {
+		cs->last_raw = raw;
+		cs->last_dev = raw;
+		cs->have_dev = 1;
+		return cs->last_dev;
+	}
+
+	delta = (raw + DEVICE_CLOCK_SPAN - cs->last_raw) % DEVICE_CLOCK_SPAN;
+	/* a step back, rather than most of a day ahead */
+	if (delta > DEVICE_CLOCK_SPAN / 2)
+		cs->last_dev -= DEVICE_CLOCK_SPAN - delta;
+	else
+		cs->last_dev += delta;
+	cs->last_raw = raw;
+
+	return cs->last_dev;
+}
+
+static int64_t round_ns(double x)
+{
+	return (int64_t)(x >= 0 ? x + 0.5 : x - 0.5);
+}
+
+static uint64_t predict(const clock_sync_t* cs, int64_t dev)
+{
+	return cs->ref_host_ns + round_ns(cs->slope * (dev - cs->ref_dev));
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double median(double* v, int n)
+{
+	qsort(v, n, sizeof(double), cmp_double);
+	return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void fit(clock_sync_t* cs)
+{
+	const clock_sample* newest;
+	const clock_sample *a, *b;
+	double med, mad;
+	int i, j, n = 0;
+
+	newest = &cs->samples[(cs->next + CLOCK_SYNC_SAMPLES - 1) % CLOCK_SYNC_SAMPLES];
+	cs->ref_dev = newest->dev;
+	cs->ref_host_ns = newest->host_ns;
+	cs->have_fit = 1;
+
+	if (cs->num_samples < 2) {
+		cs->slope = 100.0;
+		cs->error_ns = CLOCK_SYNC_INITIAL_ERROR_NS;
+		return;
+	}
+
+	/* median of the pairwise slopes */
+	for (i = 0; i < cs->num_samples; i++) {
+		for (j = i + 1; j < cs->num_samples; j++) {
+			a = &cs->samples[i];
+			b = &cs->samples[j];
+			if (a->dev == b->dev)
+				continue;
+			cs->scratch[n++] = ((double)b->host_ns - (double)a->host_ns) /
+			                   (double)(b->dev - a->dev);
+		}
+	}
+	if (n > 0)
+		cs->slope = median(cs->scratch, n);
+
+	/* median residual for the intercept */
+	for (i = 0; i < cs->num_samples; i++)
+		cs->scratch[i] = (double)(int64_t)(cs->samples[i].host_ns - cs->ref_host_ns) -
+		                 cs->slope * (cs->samples[i].dev - cs->ref_dev);
+	med = median(cs->scratch, cs->num_samples);
+	cs->ref_host_ns += round_ns(med);
+
+	/* about three standard deviations, from the median absolute
+	 * deviation of the residuals */
+	for (i = 0; i < cs->num_samples; i++)
+		cs->scratch[i] = cs->scratch[i] > med ? cs->scratch[i] - med
+		                                      : med - cs->scratch[i];
+	mad = median(cs->scratch, cs->num_samples);
+	if (cs->num_samples < 3)
+		cs->error_ns = CLOCK_SYNC_INITIAL_ERROR_NS;
+	else
+		cs->error_ns = (uint64_t)(3 * 1.4826 * mad) + 100;
+}
+
+static void commit_sample(clock_sync_t* cs, const clock_sample* s)
+{
+	uint64_t expected;
+	int64_t err;
+
+	if (cs->have_fit && cs->num_samples > 0) {
+		expected = predict(cs, s->dev);
+		err = (int64_t)(s->host_ns - expected);
+		if (llabs(err) > (long long)CLOCK_SYNC_STEP_NS) {
+			if (++cs->outliers < CLOCK_SYNC_MAX_OUTLIERS)
+				return;
+			/* the device clock was set, start over */
+			cs->num_samples = 0;
+			cs->next = 0;
+			cs->steps++;
+		}
+	}
+	cs->outliers = 0;
+
+	cs->samples[cs->next] = *s;
+	cs->next = (cs->next + 1) % CLOCK_SYNC_SAMPLES;
+	if (cs->num_samples < CLOCK_SYNC_SAMPLES)
+		cs->num_samples++;
+
+	cs->realtime_offset_ns = host_offset(cs);
+	fit(cs);
+}
+
+void clock_sync_add_sample(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                           uint64_t host_ns)
+{
+	clock_sample s;
+
+	s.dev = clock_sync_device_time(cs, clk100ns, clkn_high);
+	s.host_ns = host_ns;
+
+	/* the first sample is used straight away */
+	if (cs->num_samples == 0 && !cs->have_candidate) {
+		commit_sample(cs, &s);
+		cs->interval_start_ns = host_ns;
+		return;
+	}
+
+	if (cs->have_candidate &&
+	    host_ns - cs->interval_start_ns >= CLOCK_SYNC_INTERVAL_NS) {
+		commit_sample(cs, &cs->candidate);
+		cs->have_candidate = 0;
+		cs->interval_start_ns = host_ns;
+	}
+
+	/* USB only ever adds latency: keep the earliest arrival relative
+	 * to the device clock */
+	if (!cs->have_candidate ||
+	    (int64_t)(s.host_ns - cs->candidate.host_ns) < 100 * (s.dev - cs->candidate.dev)) {
+		cs->candidate = s;
+		cs->have_candidate = 1;
+	}
+}
+
+uint64_t clock_sync_host_ns(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                            uint64_t* error_ns)
+{
+	int64_t dev = clock_sync_device_time(cs, clk100ns, clkn_high);
+
+	if (!cs->have_fit) {
+		/* nothing to go by, anchor the device clock to now */
+		cs->ref_dev = dev;
+		cs->ref_host_ns = ubertooth_monotonic_ns();
+		cs->realtime_offset_ns = realtime_offset();
+		if (cs->epoch) {
+			cs->ref_host_ns += cs->realtime_offset_ns;
+			cs->realtime_offset_ns = 0;
+		}
+		cs->have_fit = 1;
+	}
+
+	if (error_ns)
+		*error_ns = cs->error_ns;
+	return predict(cs, dev);
+}
+
+uint64_t clock_sync_realtime_ns(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                                uint64_t* error_ns)
+{
+	uint64_t host_ns = clock_sync_host_ns(cs, clk100ns, clkn_high, error_ns);
+	return host_ns + cs->realtime_offset_ns;
+}
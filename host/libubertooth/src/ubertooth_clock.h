@@ -0,0 +1,106 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CLOCK_H__
+#define __UBERTOOTH_CLOCK_H__
+
+#include <stdint.h>
+
+/* Maps the device clock onto host time.
+ *
+ * The device clock is 3125 * CLKN + the 100 ns timer, which is
+ * clkn_high * CLK100NS_WRAP + clk100ns. It is unwrapped into a 64 bit
+ * count of 100 ns ticks. Against this the host arrival times of the
+ * packets are fitted with a Theil-Sen (median of pairwise slopes)
+ * regression, which follows the drift of the device crystal and is not
+ * thrown off by USB latency spikes. */
+
+/* Samples in the regression window */
+#define CLOCK_SYNC_SAMPLES     64
+/* Keep the lowest latency arrival of each interval as a sample */
+#define CLOCK_SYNC_INTERVAL_NS 1000000000ull
+/* A sample this far off the fit is an outlier, and this many outliers
+ * in a row mean the device clock was set: start over */
+#define CLOCK_SYNC_STEP_NS     5000000ull
+#define CLOCK_SYNC_MAX_OUTLIERS 3
+/* Error bound until there are enough samples to estimate one */
+#define CLOCK_SYNC_INITIAL_ERROR_NS 10000000ull
+
+typedef struct {
+	/* device clock, 100 ns ticks */
+	int64_t dev;
+	/* CLOCK_MONOTONIC */
+	uint64_t host_ns;
+} clock_sample;
+
+typedef struct {
+	/* unwrapping */
+	uint64_t last_raw;
+	int64_t last_dev;
+	uint8_t have_dev;
+
+	/* lowest latency arrival in the current interval */
+	clock_sample candidate;
+	uint8_t have_candidate;
+	uint64_t interval_start_ns;
+
+	/* regression window, samples[next] is the oldest once full */
+	clock_sample samples[CLOCK_SYNC_SAMPLES];
+	int num_samples;
+	int next;
+	double scratch[CLOCK_SYNC_SAMPLES * (CLOCK_SYNC_SAMPLES - 1) / 2];
+
+	/* host_ns = ref_host_ns + slope * (dev - ref_dev) */
+	uint8_t have_fit;
+	int64_t ref_dev;
+	uint64_t ref_host_ns;
+	double slope;
+	uint64_t error_ns;
+
+	int outliers;
+	uint32_t steps;
+	/* CLOCK_REALTIME - CLOCK_MONOTONIC, 0 in epoch mode */
+	int64_t realtime_offset_ns;
+	/* host times are CLOCK_REALTIME already, as in capture files */
+	uint8_t epoch;
+} clock_sync_t;
+
+void clock_sync_init(clock_sync_t* cs);
+/* Take host times to be CLOCK_REALTIME from now on, for replaying
+ * packet times read from a file */
+void clock_sync_set_epoch(clock_sync_t* cs);
+
+/* Unwrapped device clock of a packet in 100 ns ticks */
+int64_t clock_sync_device_time(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high);
+
+/* A packet with this clock arrived at host_ns (CLOCK_MONOTONIC, or
+ * CLOCK_REALTIME in epoch mode) */
+void clock_sync_add_sample(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                           uint64_t host_ns);
+
+/* Host time of a packet, in the clock of the samples or CLOCK_REALTIME.
+ * Without any
+ * samples (replaying a file) the first packet is taken to be now.
+ * error_ns may be NULL. */
+uint64_t clock_sync_host_ns(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                            uint64_t* error_ns);
+uint64_t clock_sync_realtime_ns(clock_sync_t* cs, uint32_t clk100ns, uint8_t clkn_high,
+                                uint64_t* error_ns);
+
+#endif /* __UBERTOOTH_CLOCK_H__ */
@@ -0,0 +1,249 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_cmd_queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Tries of libusb_handle_events_timeout() for a cancelled command */
+#define CMD_QUEUE_CANCEL_TRIES 20
+
+static void cmd_done(struct libusb_transfer* xfer);
+
+/* Called with the lock held */
+static void submit_next(cmd_queue_t* q)
+{
+	queued_cmd* c;
+	int r;
+
+	while (!q->in_flight && q->count > 0) {
+		q->current = q->pending[q->head];
+		q->head = (q->head + 1) % CMD_QUEUE_SIZE;
+		q->count--;
+		c = &q->current;
+
+		libusb_fill_control_setup(q->buffer, c->type, c->command, 0, 0, c->size);
+		if (c->size > 0)
+			memcpy(q->buffer + LIBUSB_CONTROL_SETUP_SIZE, c->data, c->size);
+		libusb_fill_control_transfer(q->xfer, q->devh, q->buffer, cmd_done, q, 1000);
+
+		r = ubertooth_usb_submit(q->xfer);
+		if (r < 0) {
+			show_libusb_error(r);
+			q->stats[c->command].errors++;
+			continue;
+		}
+		q->in_flight = 1;
+	}
+}
+
+static void cmd_done(struct libusb_transfer* xfer)
+{
+	cmd_queue_t* q = (cmd_queue_t*)xfer->user_data;
+	cmd_stats* s;
+	uint64_t latency;
+
+	pthread_mutex_lock(&q->lock);
+	latency = ubertooth_monotonic_ns() - q->current.queued_ns;
+	s = &q->stats[q->current.command];
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		s->sent++;
+		s->latency_total_ns += latency;
+		if (latency > s->latency_max_ns)
+			s->latency_max_ns = latency;
+	} else if (xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		show_libusb_error(xfer->status);
+		s->errors++;
+	}
+	q->in_flight = 0;
+	submit_next(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+cmd_queue_t* cmd_queue_init(struct libusb_context* ctx,
+                            struct libusb_device_handle* devh)
+{
+	cmd_queue_t* q = (cmd_queue_t*)calloc(1, sizeof(cmd_queue_t));
+	if (q == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	q->buffer = (uint8_t*)malloc(LIBUSB_CONTROL_SETUP_SIZE + CMD_QUEUE_MAX_DATA);
+	q->xfer = libusb_alloc_transfer(0);
+	if (q->buffer == NULL || q->xfer == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		libusb_free_transfer(q->xfer);
+		free(q->buffer);
+		free(q);
+		return NULL;
+	}
+
+	q->ctx = ctx;
+	q->devh = devh;
+	pthread_mutex_init(&q->lock, NULL);
+
+	return q;
+}
+
+void cmd_queue_free(cmd_queue_t* q)
+{
+	struct timeval tv = { 0, 100000 };
+	int i, in_flight;
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->count = 0;
+	in_flight = q->in_flight;
+	if (in_flight)
+		ubertooth_usb_cancel(q->xfer);
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 0; in_flight && i < CMD_QUEUE_CANCEL_TRIES; i++) {
+		ubertooth_usb_handle_events(q->ctx, &tv);
+		pthread_mutex_lock(&q->lock);
+		in_flight = q->in_flight;
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	/* libusb still owns the transfer if it never completed */
+	if (!in_flight) {
+		libusb_free_transfer(q->xfer);
+		free(q->buffer);
+	}
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+int cmd_queue_submit(cmd_queue_t* q, uint8_t type, uint8_t command,
+                     const uint8_t* data, uint16_t size, uint8_t flags)
+{
+	queued_cmd* c = NULL;
+
+	/* not connected, replaying a file */
+	if (q == NULL)
+		return -1;
+
+	if (size > CMD_QUEUE_MAX_DATA) {
+		fprintf(stderr, "Command %d too long to queue\n", command);
+		return -1;
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	/* only into the last command, so nothing queued after it is
+	 * overtaken */
+	if ((flags & CMD_COALESCE) && q->count > 0) {
+		c = &q->pending[(q->head + q->count - 1) % CMD_QUEUE_SIZE];
+		if (c->command == command && c->type == type)
+			q->stats[command].coalesced++;
+		else
+			c = NULL;
+	}
+
+	if (c == NULL) {
+		if (q->count == CMD_QUEUE_SIZE) {
+			q->stats[command].dropped++;
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		c = &q->pending[(q->head + q->count) % CMD_QUEUE_SIZE];
+		q->count++;
+		c->type = type;
+		c->command = command;
+		c->flags = flags;
+		c->queued_ns = ubertooth_monotonic_ns();
+	}
+
+	/* a coalesced command keeps its place and queueing time */
+	c->size = size;
+	if (size > 0)
+		memcpy(c->data, data, size);
+
+	submit_next(q);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+int cmd_queue_hop(cmd_queue_t* q)
+{
+	return cmd_queue_submit(q, CTRL_OUT, UBERTOOTH_HOP, NULL, 0, CMD_COALESCE);
+}
+
+int cmd_queue_set_afh_map(cmd_queue_t* q, const uint8_t* afh_map)
+{
+	return cmd_queue_submit(q, CTRL_OUT, UBERTOOTH_SET_AFHMAP, afh_map, 10,
+	                        CMD_COALESCE);
+}
+
+/* Trims add up, so they are never coalesced */
+int cmd_queue_trim_clock(cmd_queue_t* q, uint16_t offset)
+{
+	uint8_t data[2] = {
+		(offset >> 8) & 0xff,
+		(offset >> 0) & 0xff
+	};
+
+	return cmd_queue_submit(q, CTRL_OUT, UBERTOOTH_TRIM_CLOCK, data, 2, 0);
+}
+
+int cmd_queue_start_hopping(cmd_queue_t* q, int clkn_offset, int clk100ns_offset)
+{
+	int i;
+	uint8_t data[6];
+	for(i=0; i < 4; i++)
+		data[i] = (clkn_offset >> (8*(3-i))) & 0xff;
+
+	data[4] = (clk100ns_offset >> 8) & 0xff;
+	data[5] = (clk100ns_offset >> 0) & 0xff;
+
+	return cmd_queue_submit(q, CTRL_OUT, UBERTOOTH_START_HOPPING, data, 6,
+	                        CMD_COALESCE);
+}
+
+void cmd_queue_print_stats(cmd_queue_t* q, FILE* fileptr)
+{
+	cmd_stats* s;
+	int i;
+
+	if (q == NULL)
+		return;
+	if (fileptr == NULL)
+		fileptr = stderr;
+
+	pthread_mutex_lock(&q->lock);
+	for (i = 0; i < 256; i++) {
+		s = &q->stats[i];
+		if (s->sent == 0 && s->dropped == 0 && s->errors == 0)
+			continue;
+		fprintf(fileptr, "command %d: sent=%llu coalesced=%llu dropped=%llu errors=%llu"
+		        " latency avg=%lluus max=%lluus\n", i,
+		        (unsigned long long)s->sent,
+		        (unsigned long long)s->coalesced,
+		        (unsigned long long)s->dropped,
+		        (unsigned long long)s->errors,
+		        (unsigned long long)(s->sent ? s->latency_total_ns / s->sent / 1000 : 0),
+		        (unsigned long long)(s->latency_max_ns / 1000));
+	}
+	pthread_mutex_unlock(&q->lock);
+}
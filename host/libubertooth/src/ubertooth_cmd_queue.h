@@ -0,0 +1,89 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CMD_QUEUE_H__
+#define __UBERTOOTH_CMD_QUEUE_H__
+
+#include "ubertooth_control.h"
+#include <pthread.h>
+
+#define CMD_QUEUE_SIZE     32
+#define CMD_QUEUE_MAX_DATA 16
+
+/* Replace the data of the last command queued if it is of the same
+ * type and still waiting, rather than queueing another one */
+#define CMD_COALESCE 0x01
+
+typedef struct {
+	uint8_t type;
+	uint8_t command;
+	uint8_t flags;
+	uint16_t size;
+	uint8_t data[CMD_QUEUE_MAX_DATA];
+	uint64_t queued_ns;
+} queued_cmd;
+
+typedef struct {
+	uint64_t sent;
+	uint64_t coalesced;
+	uint64_t dropped;
+	uint64_t errors;
+	/* from queueing to completion */
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+} cmd_stats;
+
+/* Control commands issued while streaming. They are sent one at a time
+ * without blocking the caller, and the next one is submitted when the
+ * previous completes, from whichever thread handles libusb events.
+ * A command may be coalesced with the one queued just before it. */
+typedef struct {
+	struct libusb_context* ctx;
+	struct libusb_device_handle* devh;
+	struct libusb_transfer* xfer;
+	uint8_t* buffer;
+
+	queued_cmd pending[CMD_QUEUE_SIZE];
+	int head;
+	int count;
+	/* the command of xfer, while in_flight */
+	queued_cmd current;
+	uint8_t in_flight;
+
+	pthread_mutex_t lock;
+	cmd_stats stats[256];
+} cmd_queue_t;
+
+cmd_queue_t* cmd_queue_init(struct libusb_context* ctx,
+                            struct libusb_device_handle* devh);
+/* Cancels the command in flight and waits for it */
+void cmd_queue_free(cmd_queue_t* q);
+
+int cmd_queue_submit(cmd_queue_t* q, uint8_t type, uint8_t command,
+                     const uint8_t* data, uint16_t size, uint8_t flags);
+
+/* Queued versions of the commands the callbacks use */
+int cmd_queue_hop(cmd_queue_t* q);
+int cmd_queue_set_afh_map(cmd_queue_t* q, const uint8_t* afh_map);
+int cmd_queue_trim_clock(cmd_queue_t* q, uint16_t offset);
+int cmd_queue_start_hopping(cmd_queue_t* q, int clkn_offset, int clk100ns_offset);
+
+void cmd_queue_print_stats(cmd_queue_t* q, FILE* fileptr);
+
+#endif /* __UBERTOOTH_CMD_QUEUE_H__ */
@@ -19,9 +19,11 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <btbb.h>
 #include "ubertooth_control.h"
+#include "ubertooth_emu.h"
 
 void show_libusb_error(int error_code)
 {
@@ -76,7 +78,7 @@ int cmd_ping(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_PING, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_PING, 0, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -89,7 +91,7 @@ int cmd_rx_syms(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_RX_SYMBOLS, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_RX_SYMBOLS, 0, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -107,7 +109,7 @@ int cmd_specan(struct libusb_device_handle* devh, u16 low_freq, u16 high_freq)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SPECAN,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SPECAN,
 			low_freq, high_freq, NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -120,7 +122,7 @@ int cmd_led_specan(struct libusb_device_handle* devh, u16 rssi_threshold)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_LED_SPECAN,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_LED_SPECAN,
 			rssi_threshold, 0, NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -133,7 +135,7 @@ int cmd_set_usrled(struct libusb_device_handle* devh, u16 state)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_USRLED, state, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_USRLED, state, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -147,7 +149,7 @@ int cmd_get_usrled(struct libusb_device_handle* devh)
 	u8 state;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_USRLED, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_USRLED, 0, 0,
 			&state, 1, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -160,7 +162,7 @@ int cmd_set_rxled(struct libusb_device_handle* devh, u16 state)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_RXLED, state, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_RXLED, state, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -174,7 +176,7 @@ int cmd_get_rxled(struct libusb_device_handle* devh)
 	u8 state;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_RXLED, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_RXLED, 0, 0,
 			&state, 1, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -187,7 +189,7 @@ int cmd_set_txled(struct libusb_device_handle* devh, u16 state)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_TXLED, state, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_TXLED, state, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -201,7 +203,7 @@ int cmd_get_txled(struct libusb_device_handle* devh)
 	u8 state;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_TXLED, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_TXLED, 0, 0,
 			&state, 1, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -215,7 +217,7 @@ int cmd_get_modulation(struct libusb_device_handle* devh)
 	u8 modulation;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_MOD, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_MOD, 0, 0,
 			&modulation, 1, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -229,7 +231,7 @@ int cmd_get_channel(struct libusb_device_handle* devh)
 {
 	u8 result[2];
 	int r;
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_CHANNEL, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_CHANNEL, 0, 0,
 			result, 2, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -247,7 +249,7 @@ int cmd_set_channel(struct libusb_device_handle* devh, u16 channel)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_CHANNEL, channel, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_CHANNEL, channel, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -264,7 +266,7 @@ int cmd_get_partnum(struct libusb_device_handle* devh)
 	u8 result[5];
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_PARTNUM, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_PARTNUM, 0, 0,
 			result, 5, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -292,7 +294,7 @@ void print_serial(u8 *serial, FILE *fileptr)
 int cmd_get_serial(struct libusb_device_handle* devh, u8 *serial)
 {
 	int r;
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_SERIAL, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_SERIAL, 0, 0,
 			serial, 17, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -309,7 +311,7 @@ int cmd_set_modulation(struct libusb_device_handle* devh, u16 mod)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_MOD, mod, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_MOD, mod, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -325,7 +327,7 @@ int cmd_set_isp(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_ISP, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_ISP, 0, 0,
 			NULL, 0, 1000);
 	/* LIBUSB_ERROR_PIPE or LIBUSB_ERROR_OTHER is expected */
 	if (r && (r != LIBUSB_ERROR_PIPE) && (r != LIBUSB_ERROR_OTHER) &&
@@ -340,7 +342,7 @@ int cmd_reset(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_RESET, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_RESET, 0, 0,
 			NULL, 0, 1000);
 	/* LIBUSB_ERROR_PIPE or LIBUSB_ERROR_OTHER is expected */
 	if (r && (r != LIBUSB_ERROR_PIPE) && (r != LIBUSB_ERROR_OTHER) &&
@@ -355,7 +357,7 @@ int cmd_stop(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_STOP, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_STOP, 0, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -371,7 +373,7 @@ int cmd_set_paen(struct libusb_device_handle* devh, u16 state)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_PAEN, state, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_PAEN, state, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -387,7 +389,7 @@ int cmd_set_hgm(struct libusb_device_handle* devh, u16 state)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_HGM, state, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_HGM, state, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -403,7 +405,7 @@ int cmd_tx_test(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_TX_TEST, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_TX_TEST, 0, 0,
 			NULL, 0, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -419,7 +421,7 @@ int cmd_flash(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_FLASH, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_FLASH, 0, 0,
 			NULL, 0, 1000);
 	/* LIBUSB_ERROR_PIPE or LIBUSB_ERROR_OTHER is expected */
 	if ((r != LIBUSB_ERROR_PIPE) && (r != LIBUSB_ERROR_OTHER)) {
@@ -434,7 +436,7 @@ int cmd_get_palevel(struct libusb_device_handle* devh)
 	u8 level;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_PALEVEL, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_PALEVEL, 0, 0,
 			&level, 1, 3000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -447,7 +449,7 @@ int cmd_set_palevel(struct libusb_device_handle* devh, u16 level)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_PALEVEL, level, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_PALEVEL, level, 0,
 			NULL, 0, 3000);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -466,7 +468,7 @@ int cmd_get_rangeresult(struct libusb_device_handle* devh,
 	u8 result[5];
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_RANGE_CHECK, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_RANGE_CHECK, 0, 0,
 			result, sizeof(result), 3000);
 	if (r < LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -490,7 +492,7 @@ int cmd_range_test(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_RANGE_TEST, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_RANGE_TEST, 0, 0,
 			NULL, 0, 1000);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -507,7 +509,7 @@ int cmd_repeater(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_REPEATER, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_REPEATER, 0, 0,
 			NULL, 0, 1000);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -525,7 +527,7 @@ void cmd_get_rev_num(struct libusb_device_handle* devh, char *version, u8 len)
 	u8 result[2 + 1 + 255];
 	u16 result_ver;
 	int r;
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_REV_NUM, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_REV_NUM, 0, 0,
 			result, sizeof(result), 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -553,7 +555,7 @@ void cmd_get_compile_info(struct libusb_device_handle* devh, char *compile_info,
 {
 	u8 result[1 + 255];
 	int r;
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_COMPILE_INFO, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_COMPILE_INFO, 0, 0,
 			result, sizeof(result), 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -576,7 +578,7 @@ int cmd_get_board_id(struct libusb_device_handle* devh)
 {
 	u8 board_id;
 	int r;
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_BOARD_ID, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_BOARD_ID, 0, 0,
 			&board_id, 1, 1000);
 	if (r == LIBUSB_ERROR_PIPE) {
 		fprintf(stderr, "control message unsupported\n");
@@ -593,7 +595,7 @@ int cmd_set_squelch(struct libusb_device_handle* devh, u16 level)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_SQUELCH, level, 0, NULL, 0, 3000);
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_SQUELCH, level, 0, NULL, 0, 3000);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_PIPE) {
 			fprintf(stderr, "control message unsupported\n");
@@ -610,7 +612,7 @@ int cmd_get_squelch(struct libusb_device_handle* devh)
 	u8 level;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_SQUELCH, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_SQUELCH, 0, 0,
 			&level, 1, 3000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -633,7 +635,7 @@ int cmd_set_bdaddr(struct libusb_device_handle* devh, u64 address)
 	for(r=0; r < 8; r++)
 		data[r+8] = (syncword >> (8*r)) & 0xff;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_BDADDR, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_BDADDR, 0, 0,
 		data, data_len, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -678,7 +680,7 @@ int cmd_set_clock(struct libusb_device_handle* devh, u32 clkn)
 	for(r=0; r < 4; r++)
 		data[r] = (clkn >> (8*r)) & 0xff;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_CLOCK, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_CLOCK, 0, 0,
 		data, 4, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -697,7 +699,7 @@ uint32_t cmd_get_clock(struct libusb_device_handle* devh)
 	unsigned char data[4];
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_CLOCK, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_CLOCK, 0, 0,
 			data, 4, 3000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -712,7 +714,7 @@ int cmd_btle_sniffing(struct libusb_device_handle* devh, u16 num)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_BTLE_SNIFFING, num, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_BTLE_SNIFFING, num, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -727,21 +729,13 @@ int cmd_btle_sniffing(struct libusb_device_handle* devh, u16 num)
 
 int cmd_set_afh_map(struct libusb_device_handle* devh, uint8_t* afh_map)
 {
-	uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE+10];
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-
-	libusb_fill_control_setup(buffer, CTRL_OUT, UBERTOOTH_SET_AFHMAP, 0, 0, 10);
-	memcpy ( &buffer[LIBUSB_CONTROL_SETUP_SIZE], afh_map, 10 );
-	libusb_fill_control_transfer(xfer, devh, buffer, callback, NULL, 1000);
-	libusb_submit_transfer(xfer);
-
-	return 0;
+	return ubertooth_cmd_async(devh, CTRL_OUT, UBERTOOTH_SET_AFHMAP, afh_map, 10);
 }
 
 int cmd_clear_afh_map(struct libusb_device_handle* devh)
 {
 	int r;
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_CLEAR_AFHMAP, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_CLEAR_AFHMAP, 0, 0,
 		NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -760,7 +754,7 @@ u32 cmd_get_access_address(struct libusb_device_handle* devh)
 	unsigned char data[4];
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_ACCESS_ADDRESS, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_ACCESS_ADDRESS, 0, 0,
 			data, 4, 3000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -777,7 +771,7 @@ int cmd_set_access_address(struct libusb_device_handle* devh, u32 access_address
 	for(r=0; r < 4; r++)
 		data[r] = (access_address >> (8*r)) & 0xff;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_ACCESS_ADDRESS, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_ACCESS_ADDRESS, 0, 0,
 		data, 4, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -792,7 +786,7 @@ int cmd_set_access_address(struct libusb_device_handle* devh, u32 access_address
 
 int cmd_do_something(struct libusb_device_handle *devh, unsigned char *data, int len)
 {
-	int r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_DO_SOMETHING, 0, 0,
+	int r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_DO_SOMETHING, 0, 0,
 				data, len, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -807,7 +801,7 @@ int cmd_do_something(struct libusb_device_handle *devh, unsigned char *data, int
 
 int cmd_do_something_reply(struct libusb_device_handle* devh, unsigned char *data, int len)
 {
-	int r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_DO_SOMETHING_REPLY, 0, 0,
+	int r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_DO_SOMETHING_REPLY, 0, 0,
 				data, len, 3000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -825,7 +819,7 @@ int cmd_get_crc_verify(struct libusb_device_handle* devh)
 	u8 verify;
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_CRC_VERIFY, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_CRC_VERIFY, 0, 0,
 			&verify, 1, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -838,7 +832,7 @@ int cmd_set_crc_verify(struct libusb_device_handle* devh, int verify)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_SET_CRC_VERIFY, verify, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_SET_CRC_VERIFY, verify, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -851,7 +845,7 @@ int cmd_poll(struct libusb_device_handle* devh, usb_pkt_rx *p)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_POLL, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_POLL, 0, 0,
 			(u8 *)p, sizeof(usb_pkt_rx), 1000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -864,7 +858,7 @@ int cmd_btle_promisc(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_BTLE_PROMISC, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_BTLE_PROMISC, 0, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -882,7 +876,7 @@ int cmd_read_register(struct libusb_device_handle* devh, u8 reg)
 	int r;
 	u8 data[2];
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_READ_REGISTER, reg, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_READ_REGISTER, reg, 0,
 			data, 2, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -900,7 +894,7 @@ int cmd_btle_slave(struct libusb_device_handle* devh, u8 *mac_address)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_BTLE_SLAVE, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_BTLE_SLAVE, 0, 0,
 			mac_address, 6, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -918,7 +912,7 @@ int cmd_btle_set_target(struct libusb_device_handle* devh, u8 *mac_address)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_BTLE_SET_TARGET, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_BTLE_SET_TARGET, 0, 0,
 			mac_address, 6, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -935,7 +929,7 @@ int cmd_btle_set_target(struct libusb_device_handle* devh, u8 *mac_address)
 int cmd_set_jam_mode(struct libusb_device_handle* devh, int mode) {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_JAM_MODE, mode, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_JAM_MODE, mode, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -953,7 +947,7 @@ int cmd_ego(struct libusb_device_handle* devh, int mode)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_EGO, mode, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_EGO, mode, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -970,7 +964,7 @@ int cmd_afh(struct libusb_device_handle* devh)
 {
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_OUT, UBERTOOTH_AFH, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_OUT, UBERTOOTH_AFH, 0, 0,
 			NULL, 0, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -986,21 +980,14 @@ int cmd_afh(struct libusb_device_handle* devh)
 
 int cmd_hop(struct libusb_device_handle* devh)
 {
-	uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE];
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-
-	libusb_fill_control_setup(buffer, CTRL_OUT, UBERTOOTH_HOP, 0, 0, 0);
-	libusb_fill_control_transfer(xfer, devh, buffer, callback, NULL, 1000);
-	libusb_submit_transfer(xfer);
-
-	return 0;
+	return ubertooth_cmd_async(devh, CTRL_OUT, UBERTOOTH_HOP, NULL, 0);
 }
 
 int32_t cmd_api_version(struct libusb_device_handle* devh) {
 	unsigned char data[4];
 	int r;
 
-	r = libusb_control_transfer(devh, CTRL_IN, UBERTOOTH_GET_API_VERSION, 0, 0,
+	r = ubertooth_usb_control(devh, CTRL_IN, UBERTOOTH_GET_API_VERSION, 0, 0,
 			data, 4, 3000);
 	if (r < 0) {
 		show_libusb_error(r);
@@ -1017,7 +1004,7 @@ int ubertooth_cmd_sync(struct libusb_device_handle* devh,
 {
 	int r;
 
-	r = libusb_control_transfer(devh, type, command, 0, 0,
+	r = ubertooth_usb_control(devh, type, command, 0, 0,
 			data, size, 1000);
 	if (r < 0) {
 		if (r == LIBUSB_ERROR_PIPE) {
@@ -1039,18 +1026,28 @@ int ubertooth_cmd_async(struct libusb_device_handle* devh,
 {
 	int r = 0;
 
-	uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + size];
+	/* the transfer outlives this call, so the buffer can not be on
+	 * the stack. libusb frees it with the transfer in callback(). */
+	uint8_t* buffer = (uint8_t*)malloc(LIBUSB_CONTROL_SETUP_SIZE + size);
 	struct libusb_transfer* xfer = libusb_alloc_transfer(0);
+	if (buffer == NULL || xfer == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		libusb_free_transfer(xfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
 
 	libusb_fill_control_setup(buffer, type, command, 0, 0, size);
 	if(size > 0)
 		memcpy ( &buffer[LIBUSB_CONTROL_SETUP_SIZE], data, size );
 	libusb_fill_control_transfer(xfer, devh, buffer, callback, NULL, 1000);
-	xfer->status = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-	r = libusb_submit_transfer(xfer);
+	xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r = ubertooth_usb_submit(xfer);
 
-	if (r < 0)
+	if (r < 0) {
 		show_libusb_error(r);
+		libusb_free_transfer(xfer);
+	}
 
 	return r;
 }
@@ -33,6 +33,7 @@
 #define le32toh EndianU32_LtoN
 #define htobe64 EndianU64_NtoB
 #define be64toh EndianU64_BtoN
+#define le64toh EndianU64_LtoN
 #define htole16 EndianU16_NtoL
 #define htole32 EndianU32_NtoL
 #else
@@ -66,10 +67,16 @@
 #define PKT_LEN       64
 #define SYM_LEN       50
 #define SYM_OFFSET    14
-#define PKTS_PER_XFER 8
+/* symbols are packed one per bit */
+#define SYMS_PER_BYTE 8
+#define PKTS_PER_XFER 16
 #define NUM_BANKS     10
 #define XFER_LEN      (PKT_LEN * PKTS_PER_XFER)
-#define BANK_LEN      (SYM_LEN * PKTS_PER_XFER)
+#define BANK_LEN      (SYM_LEN * SYMS_PER_BYTE)
+
+/* Number of bulk transfers kept in flight while streaming */
+#define DEFAULT_XFER_DEPTH 8
+#define MAX_XFER_DEPTH     32
 
 #define MAX(a,b) ((a)>(b) ? (a) : (b))
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
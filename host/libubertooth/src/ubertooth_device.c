@@ -0,0 +1,500 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_device.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Deepest hub chain USB allows */
+#define MAX_PORT_DEPTH 7
+
+typedef struct {
+	ubertooth_device_info entries[DEVICE_CACHE_ENTRIES];
+	int count;
+	uint8_t dirty;
+} device_cache;
+
+/* An Ubertooth on the bus, with its serial if cached or read */
+typedef struct {
+	libusb_device* dev;
+	ubertooth_device_info info;
+	uint8_t have_serial;
+} candidate;
+
+int ubertooth_is_device(const struct libusb_device_descriptor* desc)
+{
+	return (desc->idVendor == TC13_VENDORID && desc->idProduct == TC13_PRODUCTID)
+	       || (desc->idVendor == U0_VENDORID && desc->idProduct == U0_PRODUCTID)
+	       || (desc->idVendor == U1_VENDORID && desc->idProduct == U1_PRODUCTID);
+}
+
+static void serial_to_hex(const u8* serial, char* hex)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		sprintf(hex + 2 * i, "%02x", serial[i + 1]);
+}
+
+static int hex_to_serial(const char* hex, u8* serial)
+{
+	int i;
+
+	if (strlen(hex) != 32)
+		return -1;
+	serial[0] = 0;
+	for (i = 0; i < 16; i++)
+		if (sscanf(hex + 2 * i, "%2hhx", &serial[i + 1]) != 1)
+			return -1;
+	return 0;
+}
+
+static int cache_dir(char* buf, size_t len)
+{
+	const char* dir = getenv("XDG_CACHE_HOME");
+
+	if (dir != NULL && *dir != '\0') {
+		snprintf(buf, len, "%s/ubertooth", dir);
+		return 0;
+	}
+	dir = getenv("HOME");
+	if (dir == NULL || *dir == '\0')
+		return -1;
+	snprintf(buf, len, "%s/.cache/ubertooth", dir);
+	return 0;
+}
+
+/* One line per device: <path> <address> <serial> <board id> <firmware> */
+static void cache_load(device_cache* cache)
+{
+	char path[PATH_MAX], line[256], serial[33];
+	ubertooth_device_info* e;
+	FILE* fp;
+
+	cache->count = 0;
+	cache->dirty = 0;
+	if (cache_dir(path, sizeof(path)) < 0)
+		return;
+	strncat(path, "/devices", sizeof(path) - strlen(path) - 1);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	while (cache->count < DEVICE_CACHE_ENTRIES && fgets(line, sizeof(line), fp)) {
+		e = &cache->entries[cache->count];
+		memset(e, 0, sizeof(*e));
+		if (sscanf(line, "%31s %hhu %32s %d %63[^\n]", e->path, &e->address,
+		           serial, &e->board_id, e->firmware) < 4)
+			continue;
+		if (hex_to_serial(serial, e->serial) < 0)
+			continue;
+		cache->count++;
+	}
+	fclose(fp);
+}
+
+/* Best effort, a missing cache only costs opening the devices */
+static void cache_save(device_cache* cache)
+{
+	char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX], serial[33];
+	ubertooth_device_info* e;
+	char* slash;
+	FILE* fp;
+	int i;
+
+	if (!cache->dirty || cache_dir(dir, sizeof(dir)) < 0)
+		return;
+
+	/* ~/.cache may not exist either */
+	slash = strrchr(dir, '/');
+	if (slash != NULL && slash != dir) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+		*slash = '/';
+	}
+	mkdir(dir, 0755);
+
+	snprintf(path, sizeof(path), "%s/devices", dir);
+	snprintf(tmp, sizeof(tmp), "%s/devices.%d", dir, (int)getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		return;
+	for (i = 0; i < cache->count; i++) {
+		e = &cache->entries[i];
+		serial_to_hex(e->serial, serial);
+		fprintf(fp, "%s %u %s %d %s\n", e->path, e->address, serial,
+		        e->board_id, e->firmware);
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+		remove(tmp);
+	cache->dirty = 0;
+}
+
+static ubertooth_device_info* cache_find(device_cache* cache, const char* path,
+                                         uint8_t address)
+{
+	int i;
+
+	for (i = 0; i < cache->count; i++)
+		if (cache->entries[i].address == address &&
+		    strcmp(cache->entries[i].path, path) == 0)
+			return &cache->entries[i];
+	return NULL;
+}
+
+static void cache_store(device_cache* cache, const ubertooth_device_info* info)
+{
+	int i;
+
+	/* one entry per location, the oldest goes when full */
+	for (i = 0; i < cache->count; i++)
+		if (strcmp(cache->entries[i].path, info->path) == 0)
+			break;
+	if (i == DEVICE_CACHE_ENTRIES) {
+		memmove(&cache->entries[0], &cache->entries[1],
+		        (DEVICE_CACHE_ENTRIES - 1) * sizeof(ubertooth_device_info));
+		i--;
+	}
+	if (i == cache->count)
+		cache->count++;
+	cache->entries[i] = *info;
+	cache->dirty = 1;
+}
+
+static void device_path(libusb_device* dev, char* path)
+{
+	uint8_t ports[MAX_PORT_DEPTH];
+	int n, i, len;
+
+	len = snprintf(path, DEVICE_PATH_LEN, "%u-", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, ports, MAX_PORT_DEPTH);
+	if (n <= 0) {
+		snprintf(path + len, DEVICE_PATH_LEN - len, "0");
+		return;
+	}
+	for (i = 0; i < n; i++)
+		len += snprintf(path + len, DEVICE_PATH_LEN - len, i ? ".%u" : "%u",
+		                ports[i]);
+}
+
+static int find_candidates(libusb_device** usb_list, int usb_devs,
+                           candidate* cands, device_cache* cache)
+{
+	struct libusb_device_descriptor desc;
+	ubertooth_device_info* cached;
+	candidate* c;
+	int i, n = 0;
+
+	for (i = 0; i < usb_devs && n < MAX_UBERTOOTHS; i++) {
+		if (libusb_get_device_descriptor(usb_list[i], &desc) < 0) {
+			fprintf(stderr, "couldn't get usb descriptor for dev #%d!\n", i);
+			continue;
+		}
+		if (!ubertooth_is_device(&desc))
+			continue;
+
+		c = &cands[n++];
+		memset(c, 0, sizeof(*c));
+		c->dev = usb_list[i];
+		device_path(c->dev, c->info.path);
+		c->info.address = libusb_get_device_address(c->dev);
+		c->info.board_id = -1;
+
+		cached = cache ? cache_find(cache, c->info.path, c->info.address) : NULL;
+		if (cached != NULL) {
+			c->info = *cached;
+			c->have_serial = 1;
+		}
+	}
+	return n;
+}
+
+static struct libusb_device_handle* open_candidate(candidate* c, int quiet)
+{
+	struct libusb_device_handle* devh = NULL;
+	int r = libusb_open(c->dev, &devh);
+
+	if (r != 0) {
+		if (!quiet)
+			show_libusb_error(r);
+		return NULL;
+	}
+	return devh;
+}
+
+/* Read the serial of a device the cache does not know about */
+static int read_serial(candidate* c, device_cache* cache, int quiet)
+{
+	struct libusb_device_handle* devh;
+	int r;
+
+	if (c->have_serial)
+		return 0;
+
+	devh = open_candidate(c, quiet);
+	if (devh == NULL)
+		return -1;
+	r = cmd_get_serial(devh, c->info.serial);
+	libusb_close(devh);
+	if (r != 0)
+		return -1;
+
+	c->have_serial = 1;
+	cache_store(cache, &c->info);
+	return 0;
+}
+
+static int serial_matches(const candidate* c, const char* spec)
+{
+	char hex[33];
+
+	serial_to_hex(c->info.serial, hex);
+	return strncasecmp(hex, spec, strlen(spec)) == 0;
+}
+
+static int match_serial(candidate* cands, int n, const char* spec,
+                        device_cache* cache, int quiet)
+{
+	int i, match = -1, matches = 0;
+	size_t len = strlen(spec);
+
+	for (i = 0; i < (int)len; i++) {
+		if (!isxdigit((unsigned char)spec[i]) || len > 32) {
+			fprintf(stderr, "Invalid device: %s\n", spec);
+			return -1;
+		}
+	}
+
+	/* a whole serial is unique, there is no need to look further */
+	if (len == 32) {
+		for (i = 0; i < n; i++)
+			if (cands[i].have_serial && serial_matches(&cands[i], spec))
+				return i;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (read_serial(&cands[i], cache, quiet) < 0)
+			continue;
+		if (serial_matches(&cands[i], spec)) {
+			match = i;
+			matches++;
+		}
+	}
+
+	if (matches > 1) {
+		fprintf(stderr, "Serial number %s matches more than one Ubertooth\n", spec);
+		return -1;
+	}
+	if (matches == 0 && !quiet)
+		fprintf(stderr, "No Ubertooth with serial number %s\n", spec);
+	return match;
+}
+
+static void list_candidates(candidate* cands, int n, device_cache* cache)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fprintf(stderr, "  Device %d (%s): ", i, cands[i].info.path);
+		if (read_serial(&cands[i], cache, 0) == 0)
+			print_serial(cands[i].info.serial, stderr);
+		else
+			fprintf(stderr, "\n");
+	}
+}
+
+static int is_index_spec(const char* spec)
+{
+	return isdigit((unsigned char)spec[0]) && spec[1] == '\0';
+}
+
+static int is_serial_spec(const char* spec)
+{
+	return spec != NULL && *spec != '\0' && !is_index_spec(spec)
+	       && strchr(spec, '-') == NULL;
+}
+
+static int select_candidate(candidate* cands, int n, const char* spec,
+                            device_cache* cache, int quiet)
+{
+	int i;
+
+	if (spec == NULL || *spec == '\0') {
+		if (n == 1)
+			return 0;
+		if (n > 1) {
+			fprintf(stderr, "multiple Ubertooth devices found! Use '-U' to specify device number, location or serial number\n");
+			list_candidates(cands, n, cache);
+		}
+		return -1;
+	}
+
+	if (is_index_spec(spec)) {
+		i = spec[0] - '0';
+		if (i < n)
+			return i;
+		fprintf(stderr, "Ubertooth device %d not found, %d present\n", i, n);
+		return -1;
+	}
+
+	if (strchr(spec, '-') != NULL) {
+		for (i = 0; i < n; i++)
+			if (strcmp(cands[i].info.path, spec) == 0)
+				return i;
+		fprintf(stderr, "No Ubertooth at USB %s\n", spec);
+		return -1;
+	}
+
+	return match_serial(cands, n, spec, cache, quiet);
+}
+
+static struct libusb_device_handle* open_device(struct libusb_context* ctx,
+                                                const char* spec, int quiet)
+{
+	struct libusb_device **usb_list = NULL;
+	struct libusb_device_handle *devh = NULL;
+	candidate cands[MAX_UBERTOOTHS];
+	device_cache cache;
+	u8 serial[17];
+	int usb_devs, n, i, tries;
+
+	cache_load(&cache);
+
+	usb_devs = libusb_get_device_list(ctx, &usb_list);
+	if (usb_devs < 0) {
+		show_libusb_error(usb_devs);
+		return NULL;
+	}
+
+	/* a second go without the cache if it turns out to be stale */
+	for (tries = 0; tries < 2 && devh == NULL; tries++) {
+		n = find_candidates(usb_list, usb_devs, cands, &cache);
+		i = select_candidate(cands, n, spec, &cache, quiet);
+		if (i < 0)
+			break;
+		devh = open_candidate(&cands[i], quiet);
+		if (devh == NULL)
+			break;
+
+		/* only a device picked by a cached serial needs checking */
+		if (!is_serial_spec(spec))
+			break;
+		if (cmd_get_serial(devh, serial) == 0 &&
+		    memcmp(serial + 1, cands[i].info.serial + 1, 16) == 0)
+			break;
+		libusb_close(devh);
+		devh = NULL;
+		cache.count = 0;
+		cache.dirty = 1;
+	}
+
+	cache_save(&cache);
+	libusb_free_device_list(usb_list, 1);
+	return devh;
+}
+
+struct libusb_device_handle* ubertooth_open_device(struct libusb_context* ctx,
+                                                   const char* spec)
+{
+	return open_device(ctx, spec, 0);
+}
+
+struct libusb_device_handle* ubertooth_open_serial(struct libusb_context* ctx,
+                                                  const u8* serial)
+{
+	char hex[33];
+
+	serial_to_hex(serial, hex);
+	/* polled while waiting for a device to come back, keep quiet */
+	return open_device(ctx, hex, 1);
+}
+
+int ubertooth_count_devices(void)
+{
+	struct libusb_context* ctx = NULL;
+	struct libusb_device **usb_list = NULL;
+	struct libusb_device_descriptor desc;
+	int usb_devs, i, ubertooths = 0;
+
+	if (libusb_init(&ctx) < 0)
+		return -1;
+
+	usb_devs = libusb_get_device_list(ctx, &usb_list);
+	for(i = 0 ; i < usb_devs ; ++i) {
+		if (libusb_get_device_descriptor(usb_list[i], &desc) < 0)
+			continue;
+		if (ubertooth_is_device(&desc))
+			ubertooths++;
+	}
+	if (usb_devs >= 0)
+		libusb_free_device_list(usb_list, 1);
+	libusb_exit(ctx);
+
+	return MIN(ubertooths, MAX_UBERTOOTHS);
+}
+
+int ubertooth_list_devices(ubertooth_device_info* devs, int max)
+{
+	struct libusb_context* ctx = NULL;
+	struct libusb_device **usb_list = NULL;
+	struct libusb_device_handle* devh;
+	candidate cands[MAX_UBERTOOTHS];
+	device_cache cache;
+	int usb_devs, n, i, count = 0;
+
+	if (libusb_init(&ctx) < 0) {
+		fprintf(stderr, "libusb_init failed (got 1.0?)\n");
+		return -1;
+	}
+
+	usb_devs = libusb_get_device_list(ctx, &usb_list);
+	if (usb_devs < 0) {
+		show_libusb_error(usb_devs);
+		libusb_exit(ctx);
+		return -1;
+	}
+
+	cache_load(&cache);
+	/* everything is read afresh */
+	n = find_candidates(usb_list, usb_devs, cands, NULL);
+	for (i = 0; i < n && count < max; i++) {
+		devh = open_candidate(&cands[i], 0);
+		if (devh == NULL)
+			continue;
+		if (cmd_get_serial(devh, cands[i].info.serial) == 0) {
+			cands[i].info.board_id = cmd_get_board_id(devh);
+			cmd_get_rev_num(devh, cands[i].info.firmware, DEVICE_FIRMWARE_LEN);
+			cache_store(&cache, &cands[i].info);
+			devs[count++] = cands[i].info;
+		}
+		libusb_close(devh);
+	}
+	cache_save(&cache);
+
+	libusb_free_device_list(usb_list, 1);
+	libusb_exit(ctx);
+	return count;
+}
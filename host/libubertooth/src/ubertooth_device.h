@@ -0,0 +1,68 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_DEVICE_H__
+#define __UBERTOOTH_DEVICE_H__
+
+#include "ubertooth_control.h"
+
+/* "<bus>-<port>[.<port>...]", as in /sys/bus/usb/devices */
+#define DEVICE_PATH_LEN     32
+#define DEVICE_FIRMWARE_LEN 64
+
+typedef struct {
+	char path[DEVICE_PATH_LEN];
+	uint8_t address;
+	/* as returned by cmd_get_serial(), the first byte is the status */
+	u8 serial[17];
+	int board_id;
+	char firmware[DEVICE_FIRMWARE_LEN];
+} ubertooth_device_info;
+
+/* What was read from each device is kept in
+ * $XDG_CACHE_HOME/ubertooth/devices (or ~/.cache/ubertooth/devices), so
+ * that a device can be picked by serial number without opening the
+ * others. An entry only holds while the device keeps its USB address,
+ * which changes whenever it is plugged in or reset. */
+#define DEVICE_CACHE_ENTRIES 32
+
+/* Device specs, as taken by -U:
+ *   <n>           the nth Ubertooth found, 0-7
+ *   <bus>-<port>  the Ubertooth at this USB location, e.g. 1-2.3
+ *   <hex>         the Ubertooth whose serial number starts with this
+ * NULL picks the only Ubertooth attached. ubertooth_connect_spec() also
+ * takes "emu:<options>", see ubertooth_emu.h. */
+struct libusb_device_handle* ubertooth_open_device(struct libusb_context* ctx,
+                                                   const char* spec);
+
+/* Open the Ubertooth with this serial number (as returned by
+ * cmd_get_serial()), NULL if it is not attached */
+struct libusb_device_handle* ubertooth_open_serial(struct libusb_context* ctx,
+                                                  const u8* serial);
+
+/* Whether the descriptor has one of the Ubertooth vendor/product IDs */
+int ubertooth_is_device(const struct libusb_device_descriptor* desc);
+
+/* Number of Ubertooth devices attached to the host */
+int ubertooth_count_devices(void);
+
+/* Open every Ubertooth attached and describe it, returns how many */
+int ubertooth_list_devices(ubertooth_device_info* devs, int max);
+
+#endif /* __UBERTOOTH_DEVICE_H__ */
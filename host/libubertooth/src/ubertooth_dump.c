@@ -0,0 +1,416 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_dump.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of files a ring is split into when only keep= is given */
+#define DUMP_RING_FILES 8
+
+void dump_writer_default_options(dump_writer_options* opts)
+{
+	opts->buffer_size = DEFAULT_DUMP_BUFFER_SIZE;
+	opts->flush_ms = DEFAULT_DUMP_FLUSH_MS;
+	opts->rotate_bytes = 0;
+	opts->rotate_secs = 0;
+	opts->keep_bytes = 0;
+}
+
+static int parse_size(const char* s, uint64_t* size)
+{
+	char* end;
+	uint64_t v = strtoull(s, &end, 10);
+
+	if (end == s)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g': v <<= 10; /* fall through */
+	case 'M': case 'm': v <<= 10; /* fall through */
+	case 'K': case 'k': v <<= 10; end++; break;
+	case '\0': case ',': break;
+	default: return -1;
+	}
+	if (*end != '\0' && *end != ',')
+		return -1;
+
+	*size = v;
+	return 0;
+}
+
+static int parse_number(const char* s, uint64_t* v)
+{
+	char* end;
+
+	*v = strtoull(s, &end, 10);
+	if (end == s || (*end != '\0' && *end != ','))
+		return -1;
+	return 0;
+}
+
+/* Seconds, or minutes or hours with an m or h suffix */
+static int parse_duration(const char* s, uint64_t* secs)
+{
+	char* end;
+	uint64_t v = strtoull(s, &end, 10);
+
+	if (end == s)
+		return -1;
+	switch (*end) {
+	case 'h': v *= 60; /* fall through */
+	case 'm': v *= 60; /* fall through */
+	case 's': end++; break;
+	case '\0': case ',': break;
+	default: return -1;
+	}
+	if (*end != '\0' && *end != ',')
+		return -1;
+
+	*secs = v;
+	return 0;
+}
+
+int dump_writer_parse_options(const char* spec, dump_writer_options* opts)
+{
+	const char* p = spec;
+	uint64_t v;
+
+	while (*p != '\0') {
+		if (strncmp(p, "size=", 5) == 0) {
+			if (parse_size(p + 5, &opts->rotate_bytes) < 0)
+				goto bad;
+		} else if (strncmp(p, "keep=", 5) == 0) {
+			if (parse_size(p + 5, &opts->keep_bytes) < 0)
+				goto bad;
+		} else if (strncmp(p, "time=", 5) == 0) {
+			if (parse_duration(p + 5, &v) < 0)
+				goto bad;
+			opts->rotate_secs = (uint32_t)v;
+		} else if (strncmp(p, "flush=", 6) == 0) {
+			if (parse_number(p + 6, &v) < 0)
+				goto bad;
+			opts->flush_ms = (uint32_t)v;
+		} else {
+			goto bad;
+		}
+
+		p = strchr(p, ',');
+		if (p == NULL)
+			break;
+		p++;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "Invalid dump file option: %s\n", p);
+	return -1;
+}
+
+static int rotating(const dump_writer_t* w)
+{
+	return w->path != NULL &&
+	       (w->opts.rotate_bytes || w->opts.rotate_secs || w->opts.keep_bytes);
+}
+
+static int open_file(dump_writer_t* w)
+{
+	char* name = w->path;
+	size_t len;
+
+	if (rotating(w)) {
+		len = strlen(w->path) + 8;
+		name = (char*)malloc(len);
+		if (name == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		snprintf(name, len, "%s.%06u", w->path, w->file_seq);
+	}
+
+	/* never overwrite an earlier capture's file */
+	w->fd = open(name, O_WRONLY | O_CREAT | (rotating(w) ? O_EXCL : O_TRUNC), 0644);
+	if (w->fd < 0)
+		perror(name);
+	if (name != w->path)
+		free(name);
+	if (w->fd < 0)
+		return -1;
+
+	w->file_bytes = 0;
+	w->file_start_ns = ubertooth_monotonic_ns();
+	return 0;
+}
+
+/* Number the files after any <path>.<seq> already there, so that a new
+ * capture carries on from an earlier one. Those files are not part of
+ * the ring. */
+static void find_first_seq(dump_writer_t* w)
+{
+	char* dir_name, *base, *slash, *end;
+	size_t base_len;
+	unsigned long seq;
+	struct dirent* de;
+	DIR* dir;
+
+	dir_name = strdup(w->path);
+	if (dir_name == NULL)
+		return;
+	slash = strrchr(dir_name, '/');
+	if (slash == NULL) {
+		base = w->path;
+		dir = opendir(".");
+	} else {
+		base = w->path + (slash - dir_name) + 1;
+		slash[1] = '\0';
+		dir = opendir(dir_name);
+	}
+	base_len = strlen(base);
+
+	while (dir != NULL && (de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, base, base_len) != 0 ||
+		    de->d_name[base_len] != '.')
+			continue;
+		seq = strtoul(de->d_name + base_len + 1, &end, 10);
+		if (end == de->d_name + base_len + 1 || *end != '\0')
+			continue;
+		if (seq >= w->file_seq)
+			w->file_seq = seq + 1;
+	}
+	if (dir != NULL)
+		closedir(dir);
+	free(dir_name);
+
+	w->oldest_seq = w->file_seq;
+}
+
+static int write_all(int fd, const uint8_t* data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error writing dump file");
+			return -1;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Delete the oldest files until the ring fits into keep_bytes */
+static void trim_ring(dump_writer_t* w)
+{
+	char* name;
+	size_t len = strlen(w->path) + 8;
+
+	name = (char*)malloc(len);
+	if (name == NULL)
+		return;
+
+	while (w->num_kept > 0 &&
+	       w->kept_bytes + w->opts.rotate_bytes > w->opts.keep_bytes) {
+		snprintf(name, len, "%s.%06u", w->path, w->oldest_seq);
+		if (unlink(name) < 0 && errno != ENOENT)
+			perror(name);
+		w->kept_bytes -= w->kept_sizes[0];
+		memmove(w->kept_sizes, w->kept_sizes + 1,
+		        (w->num_kept - 1) * sizeof(uint64_t));
+		w->num_kept--;
+		w->oldest_seq++;
+	}
+	free(name);
+}
+
+static int rotate(dump_writer_t* w)
+{
+	uint64_t* sizes;
+
+	if (dump_writer_flush(w) < 0)
+		return -1;
+	close(w->fd);
+	w->fd = -1;
+
+	if (w->opts.keep_bytes) {
+		sizes = (uint64_t*)realloc(w->kept_sizes,
+		                           (w->num_kept + 1) * sizeof(uint64_t));
+		if (sizes == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		w->kept_sizes = sizes;
+		w->kept_sizes[w->num_kept++] = w->file_bytes;
+		w->kept_bytes += w->file_bytes;
+		trim_ring(w);
+	}
+
+	w->file_seq++;
+	return open_file(w);
+}
+
+static int need_rotate(dump_writer_t* w, size_t len)
+{
+	uint64_t pending = w->file_bytes + w->buf_len;
+
+	if (!rotating(w) || pending == 0)
+		return 0;
+	if (w->opts.rotate_bytes && pending + len > w->opts.rotate_bytes)
+		return 1;
+	if (w->opts.rotate_secs &&
+	    ubertooth_monotonic_ns() - w->file_start_ns >= 1000000000ull * w->opts.rotate_secs)
+		return 1;
+	return 0;
+}
+
+static dump_writer_t* writer_new(const dump_writer_options* opts)
+{
+	dump_writer_t* w = (dump_writer_t*)calloc(1, sizeof(dump_writer_t));
+	if (w == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	if (opts)
+		w->opts = *opts;
+	else
+		dump_writer_default_options(&w->opts);
+	if (w->opts.buffer_size == 0)
+		w->opts.buffer_size = DEFAULT_DUMP_BUFFER_SIZE;
+	w->fd = -1;
+	w->last_flush_ns = ubertooth_monotonic_ns();
+
+	if (posix_memalign((void**)&w->buf, DUMP_BUFFER_ALIGN, w->opts.buffer_size)) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+dump_writer_t* dump_writer_open(const char* path, const dump_writer_options* opts)
+{
+	dump_writer_t* w = writer_new(opts);
+	if (w == NULL)
+		return NULL;
+
+	w->path = strdup(path);
+	w->own_fd = 1;
+
+	/* a ring without a file size: split it into a few files */
+	if (w->opts.keep_bytes && !w->opts.rotate_bytes)
+		w->opts.rotate_bytes = w->opts.keep_bytes / DUMP_RING_FILES;
+
+	if (w->path != NULL && rotating(w))
+		find_first_seq(w);
+
+	if (w->path == NULL || open_file(w) < 0) {
+		dump_writer_close(w);
+		return NULL;
+	}
+	return w;
+}
+
+dump_writer_t* dump_writer_fdopen(int fd, const dump_writer_options* opts)
+{
+	dump_writer_t* w = writer_new(opts);
+	if (w == NULL)
+		return NULL;
+
+	w->fd = fd;
+	w->own_fd = 0;
+	return w;
+}
+
+int dump_writer_flush(dump_writer_t* w)
+{
+	int r = 0;
+
+	if (w->buf_len > 0 && w->fd >= 0)
+		r = write_all(w->fd, w->buf, w->buf_len);
+	w->file_bytes += w->buf_len;
+	w->buf_len = 0;
+	w->last_flush_ns = ubertooth_monotonic_ns();
+	return r;
+}
+
+int dump_writer_write(dump_writer_t* w, const void* data, size_t len)
+{
+	if (need_rotate(w, len) && rotate(w) < 0)
+		return -1;
+
+	if (w->buf_len + len > w->opts.buffer_size) {
+		if (dump_writer_flush(w) < 0)
+			return -1;
+		if (len > w->opts.buffer_size) {
+			w->file_bytes += len;
+			return write_all(w->fd, (const uint8_t*)data, len);
+		}
+	}
+
+	memcpy(w->buf + w->buf_len, data, len);
+	w->buf_len += len;
+
+	if (w->opts.flush_ms &&
+	    ubertooth_monotonic_ns() - w->last_flush_ns >= 1000000ull * w->opts.flush_ms)
+		return dump_writer_flush(w);
+	return 0;
+}
+
+/* Write out data which has been buffered for longer than flush_ms. Call
+ * this now and then when nothing may be written for a while. */
+int dump_writer_poll(dump_writer_t* w)
+{
+	if (w->buf_len == 0 || !w->opts.flush_ms)
+		return 0;
+	if (ubertooth_monotonic_ns() - w->last_flush_ns >= 1000000ull * w->opts.flush_ms)
+		return dump_writer_flush(w);
+	return 0;
+}
+
+int dump_writer_write_pkt(dump_writer_t* w, uint32_t systime, const usb_pkt_rx* rx)
+{
+	uint8_t record[sizeof(uint32_t) + sizeof(usb_pkt_rx)];
+	uint32_t systime_be = htobe32(systime);
+
+	memcpy(record, &systime_be, sizeof(systime_be));
+	memcpy(record + sizeof(systime_be), rx, sizeof(usb_pkt_rx));
+	return dump_writer_write(w, record, sizeof(record));
+}
+
+void dump_writer_close(dump_writer_t* w)
+{
+	if (w == NULL)
+		return;
+
+	dump_writer_flush(w);
+	if (w->own_fd && w->fd >= 0)
+		close(w->fd);
+	free(w->buf);
+	free(w->kept_sizes);
+	free(w->path);
+	free(w);
+}
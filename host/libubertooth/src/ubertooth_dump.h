@@ -0,0 +1,84 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_DUMP_H__
+#define __UBERTOOTH_DUMP_H__
+
+#include "ubertooth_control.h"
+#include <stddef.h>
+
+#define DEFAULT_DUMP_BUFFER_SIZE (1 << 20)
+#define DUMP_BUFFER_ALIGN        4096
+#define DEFAULT_DUMP_FLUSH_MS    1000
+
+typedef struct {
+	size_t buffer_size;
+	/* write out buffered data at least this often, 0: only when the
+	 * buffer is full */
+	uint32_t flush_ms;
+	/* start a new file after this many bytes or seconds, 0: never */
+	uint64_t rotate_bytes;
+	uint32_t rotate_secs;
+	/* ring mode: delete the oldest files to stay below this, 0: keep
+	 * everything */
+	uint64_t keep_bytes;
+} dump_writer_options;
+
+/* Buffered writer for dump files. When rotating, files are named
+ * <path>.000000, <path>.000001 and so on, following on from any that
+ * are already there. */
+typedef struct {
+	dump_writer_options opts;
+	char* path;
+	int fd;
+	int own_fd;
+
+	uint8_t* buf;
+	size_t buf_len;
+	uint64_t last_flush_ns;
+
+	unsigned file_seq;
+	uint64_t file_bytes;
+	uint64_t file_start_ns;
+
+	/* ring mode: sizes of the closed files still on disk, oldest
+	 * first, the oldest being <path>.<oldest_seq> */
+	uint64_t* kept_sizes;
+	unsigned num_kept;
+	unsigned oldest_seq;
+	uint64_t kept_bytes;
+} dump_writer_t;
+
+void dump_writer_default_options(dump_writer_options* opts);
+/* Parse "size=<bytes>[KMG],time=<n>[smh],keep=<bytes>[KMG],flush=<ms>" */
+int dump_writer_parse_options(const char* spec, dump_writer_options* opts);
+
+/* opts may be NULL for the defaults */
+dump_writer_t* dump_writer_open(const char* path, const dump_writer_options* opts);
+dump_writer_t* dump_writer_fdopen(int fd, const dump_writer_options* opts);
+void dump_writer_close(dump_writer_t* w);
+
+/* A record is never split across files */
+int dump_writer_write(dump_writer_t* w, const void* data, size_t len);
+/* Big endian systime followed by the packet */
+int dump_writer_write_pkt(dump_writer_t* w, uint32_t systime, const usb_pkt_rx* rx);
+int dump_writer_flush(dump_writer_t* w);
+int dump_writer_poll(dump_writer_t* w);
+
+#endif /* __UBERTOOTH_DUMP_H__ */
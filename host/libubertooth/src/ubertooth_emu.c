@@ -0,0 +1,882 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * An Ubertooth emulated at the USB level, so that everything from
+ * ubertooth_bulk_init() on can be run without one. It answers the
+ * control requests much as the firmware does, and once a mode which
+ * sends packets is started fills the bulk transfers from a dump file or
+ * with generated packets, at the rate the device would.
+ *
+ * Transfers complete in ubertooth_usb_handle_events(), on the thread
+ * which calls it, as they do in libusb. The firmware queue is modelled
+ * too: packets which arrive while the host is too far behind are lost,
+ * and the next one sent has FIFO_OVERFLOW set.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_emu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Packets the firmware queue holds */
+#define EMU_QUEUE_LEN 127
+
+/* How long ubertooth_usb_handle_events() waits without a timeout, as
+ * libusb_handle_events() does */
+#define EMU_EVENTS_TIMEOUT_NS (60 * 1000000000ull)
+
+/* Part number of the LPC1756 on an Ubertooth One */
+#define EMU_PARTNUM 0x25011723
+
+static const char emu_version[] = "emulator";
+static const char emu_compile_info[] = "libubertooth USB emulator";
+
+/* The context and handle of an emulated device are both the
+ * emu_device. The list is looked through by every thread making libusb
+ * calls, and emulators can be opened and closed meanwhile. */
+static emu_device* emulators = NULL;
+static pthread_mutex_t emulators_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static emu_device* find_emu(const void* p)
+{
+	emu_device* emu;
+
+	pthread_mutex_lock(&emulators_lock);
+	for (emu = emulators; emu != NULL; emu = emu->next)
+		if ((const void*)emu == p)
+			break;
+	pthread_mutex_unlock(&emulators_lock);
+	return emu;
+}
+
+int emu_is_device(struct libusb_device_handle* devh)
+{
+	return find_emu(devh) != NULL;
+}
+
+static int parse_uint(const char* p, uint64_t* v)
+{
+	char* end;
+
+	*v = strtoull(p, &end, 0);
+	if (end == p || (*end != ',' && *end != '\0'))
+		return -1;
+	return 0;
+}
+
+static int parse_serial(const char* p, u8* serial)
+{
+	int i;
+
+	if (strcspn(p, ",") != 32)
+		return -1;
+	for (i = 0; i < 16; i++)
+		if (sscanf(p + 2 * i, "%2hhx", &serial[i]) != 1)
+			return -1;
+	return 0;
+}
+
+int emu_parse_options(const char* spec, emu_options* opts)
+{
+	const char* p = spec;
+	char* end;
+	uint64_t v;
+	size_t len;
+
+	memset(opts, 0, sizeof(emu_options));
+	opts->speed = 1;
+	opts->ac_interval = EMU_DEFAULT_AC_INTERVAL;
+	opts->serial[15] = 1;
+
+	while (*p != '\0') {
+		if (strncmp(p, "file=", 5) == 0) {
+			len = strcspn(p + 5, ",");
+			free(opts->file);
+			opts->file = strndup(p + 5, len);
+			if (opts->file == NULL) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				return -1;
+			}
+		} else if (strncmp(p, "loop", 4) == 0 && (p[4] == ',' || p[4] == '\0')) {
+			opts->loop = 1;
+		} else if (strncmp(p, "speed=", 6) == 0) {
+			opts->speed = strtod(p + 6, &end);
+			if (end == p + 6 || (*end != ',' && *end != '\0') || opts->speed < 0)
+				goto bad;
+		} else if (strncmp(p, "count=", 6) == 0) {
+			if (parse_uint(p + 6, &opts->count) < 0)
+				goto bad;
+		} else if (strncmp(p, "dma_overflow=", 13) == 0) {
+			if (parse_uint(p + 13, &v) < 0)
+				goto bad;
+			opts->dma_overflow = (uint32_t)v;
+		} else if (strncmp(p, "fifo_overflow=", 14) == 0) {
+			if (parse_uint(p + 14, &v) < 0)
+				goto bad;
+			opts->fifo_overflow = (uint32_t)v;
+		} else if (strncmp(p, "keep_alive=", 11) == 0) {
+			if (parse_uint(p + 11, &v) < 0)
+				goto bad;
+			opts->keep_alive = (uint32_t)v;
+		} else if (strncmp(p, "lap=", 4) == 0) {
+			opts->lap = strtoul(p + 4, &end, 16);
+			if (end == p + 4 || (*end != ',' && *end != '\0') || opts->lap > 0xffffff)
+				goto bad;
+			opts->have_lap = 1;
+		} else if (strncmp(p, "ac=", 3) == 0) {
+			if (parse_uint(p + 3, &v) < 0 || v == 0)
+				goto bad;
+			opts->ac_interval = (uint32_t)v;
+		} else if (strncmp(p, "serial=", 7) == 0) {
+			if (parse_serial(p + 7, opts->serial) < 0)
+				goto bad;
+		} else {
+			goto bad;
+		}
+
+		p = strchr(p, ',');
+		if (p == NULL)
+			break;
+		p++;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "Invalid emulator option: %s\n", p);
+	free(opts->file);
+	opts->file = NULL;
+	return -1;
+}
+
+/* xorshift32 */
+static uint32_t emu_random(emu_device* emu)
+{
+	uint32_t x = emu->random;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	emu->random = x;
+	return x;
+}
+
+/* Symbols go out MSB first, the syncword LSB first */
+static void put_syncword(uint8_t* data, int offset, uint64_t syncword)
+{
+	int i, s;
+
+	for (i = 0; i < 64; i++) {
+		s = offset + i;
+		if ((syncword >> i) & 1)
+			data[s / 8] |= 0x80 >> (s % 8);
+		else
+			data[s / 8] &= ~(0x80 >> (s % 8));
+	}
+}
+
+static void generate_specan(emu_device* emu, usb_pkt_rx* rx)
+{
+	int i;
+
+	/* 16 frequency and RSSI triplets, as specan() sends */
+	for (i = 0; i < 16; i++) {
+		rx->data[3 * i] = (emu->specan_freq >> 8) & 0xff;
+		rx->data[3 * i + 1] = emu->specan_freq & 0xff;
+		rx->data[3 * i + 2] = (u8)(int8_t)(-100 + (int)(emu_random(emu) % 16));
+		if (++emu->specan_freq > emu->high_freq)
+			emu->specan_freq = emu->low_freq;
+	}
+}
+
+static void generate_packet(emu_device* emu, usb_pkt_rx* rx)
+{
+	uint64_t clkn = emu->clk / 3125;
+	uint32_t r;
+	int i;
+
+	memset(rx, 0, sizeof(usb_pkt_rx));
+	rx->pkt_type = emu->pkt_type;
+	rx->channel = (u8)((emu->channel - 2402) & 0xff);
+	rx->clkn_high = (clkn >> 20) & 0xff;
+	rx->clk100ns = (u32)(emu->clk % CLK100NS_WRAP);
+	emu->clk += EMU_PKT_NS / 100;
+
+	if (emu->pkt_type == SPECAN) {
+		generate_specan(emu, rx);
+		return;
+	}
+
+	for (i = 0; i < DMA_SIZE; i += 4) {
+		r = emu_random(emu);
+		memcpy(rx->data + i, &r, MIN(4, DMA_SIZE - i));
+	}
+	rx->rssi_max = (char)(-70 + (int)(emu_random(emu) % 8));
+	if (emu->opts.have_lap && emu->packets % emu->opts.ac_interval == 0) {
+		put_syncword(rx->data, emu_random(emu) % (BANK_LEN - 64),
+		             emu->syncword);
+		rx->status |= CS_TRIGGER | RSSI_TRIGGER;
+		rx->rssi_max = -30;
+	}
+	rx->rssi_min = rx->rssi_max - 8;
+	rx->rssi_avg = rx->rssi_max - 4;
+	rx->rssi_count = SYM_LEN;
+}
+
+/* Back to the start of the dump file */
+static int rewind_file(emu_device* emu)
+{
+	replay_close(emu->replay);
+	emu->replay = NULL;
+	if (fseek(emu->fp, 0, SEEK_SET) < 0)
+		return -1;
+	emu->replay = replay_open(emu->fp);
+	return emu->replay == NULL ? -1 : 0;
+}
+
+static int file_packet(emu_device* emu, usb_pkt_rx* rx)
+{
+	if (emu->replay == NULL)
+		return -1;
+
+	if (emu->record_next == emu->record_count) {
+		emu->record_next = 0;
+		emu->record_count = replay_next(emu->replay, &emu->records, REPLAY_BATCH);
+		/* a file without a single packet would loop forever */
+		if (emu->record_count == 0 && emu->opts.loop && emu->packets > 0
+		    && rewind_file(emu) == 0)
+			emu->record_count = replay_next(emu->replay, &emu->records,
+			                                REPLAY_BATCH);
+		if (emu->record_count == 0)
+			return -1;
+	}
+
+	memcpy(rx, replay_packet(emu->records + emu->record_next * REPLAY_RECORD_LEN),
+	       PKT_LEN);
+	emu->record_next++;
+	emu->clk = ((uint64_t)rx->clkn_high << 20) * 3125 + rx->clk100ns;
+	return 0;
+}
+
+/* Next packet from the source, -1 once it has run out */
+static int read_packet(emu_device* emu, usb_pkt_rx* rx)
+{
+	if (emu->gone)
+		return -1;
+	if (emu->opts.count && emu->packets == emu->opts.count) {
+		emu->gone = 1;
+		return -1;
+	}
+
+	if (emu->fp == NULL)
+		generate_packet(emu, rx);
+	else if (file_packet(emu, rx) < 0) {
+		emu->gone = 1;
+		return -1;
+	}
+	emu->packets++;
+	return 0;
+}
+
+/* Next packet to send to the host */
+static int next_packet(emu_device* emu, usb_pkt_rx* rx)
+{
+	if (read_packet(emu, rx) < 0)
+		return -1;
+	emu->paced++;
+
+	if (emu->queue_overflow || (emu->opts.fifo_overflow &&
+	                            emu->packets % emu->opts.fifo_overflow == 0)) {
+		rx->status |= FIFO_OVERFLOW;
+		emu->queue_overflow = 0;
+		emu->fifo_overflows++;
+	}
+	if (emu->opts.dma_overflow && emu->packets % emu->opts.dma_overflow == 0) {
+		rx->status |= DMA_OVERFLOW;
+		emu->dma_overflows++;
+	}
+	return 0;
+}
+
+/* Packets which arrived while the firmware queue was full are lost */
+static void drop_overdue(emu_device* emu, uint64_t now)
+{
+	usb_pkt_rx rx;
+	uint64_t arrived;
+
+	if (emu->opts.speed <= 0 || now < emu->start_ns)
+		return;
+
+	arrived = (uint64_t)((now - emu->start_ns) * emu->opts.speed / EMU_PKT_NS);
+	while (arrived > emu->paced + EMU_QUEUE_LEN) {
+		if (read_packet(emu, &rx) < 0)
+			return;
+		emu->paced++;
+		emu->dropped++;
+		emu->queue_overflow = 1;
+	}
+}
+
+/* Packets the transfer gets before a keep alive is due */
+static int xfer_packets(emu_device* emu, struct libusb_transfer* xfer)
+{
+	int n = xfer->length / PKT_LEN;
+
+	if (emu->opts.keep_alive && emu->opts.keep_alive - emu->since_keep_alive < (uint32_t)n)
+		n = emu->opts.keep_alive - emu->since_keep_alive;
+	return n;
+}
+
+/* A transfer completes once its last packet has been received */
+static uint64_t xfer_due(emu_device* emu, struct libusb_transfer* xfer)
+{
+	uint64_t n = emu->paced + xfer_packets(emu, xfer);
+
+	if (emu->opts.speed <= 0)
+		return 0;
+	return emu->start_ns + (uint64_t)(n * EMU_PKT_NS / emu->opts.speed);
+}
+
+static void fill_bulk(emu_device* emu, struct libusb_transfer* xfer)
+{
+	int i, n = xfer_packets(emu, xfer);
+	int len = 0;
+
+	for (i = 0; i < n; i++) {
+		if (next_packet(emu, (usb_pkt_rx*)(xfer->buffer + len)) < 0)
+			break;
+		len += PKT_LEN;
+	}
+	emu->since_keep_alive += i;
+
+	/* a short packet, which ends the transfer */
+	if (emu->opts.keep_alive && emu->since_keep_alive == emu->opts.keep_alive
+	    && !emu->gone && len < xfer->length) {
+		xfer->buffer[len++] = KEEP_ALIVE;
+		emu->since_keep_alive = 0;
+		emu->keep_alives++;
+	}
+
+	xfer->actual_length = len;
+	if (len == 0 && emu->gone)
+		xfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+	else
+		xfer->status = LIBUSB_TRANSFER_COMPLETED;
+}
+
+static void xfer_done(emu_device* emu, struct libusb_transfer* xfer)
+{
+	emu->done[emu->done_count++] = xfer;
+}
+
+static void remove_pending(emu_device* emu, int i)
+{
+	memmove(&emu->pending[i], &emu->pending[i + 1],
+	        (emu->pending_count - i - 1) * sizeof(emu->pending[0]));
+	emu->pending_count--;
+}
+
+/* Complete the bulk transfers which are due, *next is when the next one
+ * will be. Called with the lock held. */
+static void complete_due(emu_device* emu, uint64_t now, uint64_t* next)
+{
+	struct libusb_transfer* xfer;
+	uint64_t due;
+
+	*next = UINT64_MAX;
+	if (emu->streaming)
+		drop_overdue(emu, now);
+
+	while (emu->pending_count > 0) {
+		xfer = emu->pending[0];
+		if (emu->gone) {
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+		} else {
+			if (!emu->streaming)
+				return;
+			due = xfer_due(emu, xfer);
+			if (due > now) {
+				*next = due;
+				return;
+			}
+			fill_bulk(emu, xfer);
+		}
+		remove_pending(emu, 0);
+		xfer_done(emu, xfer);
+	}
+}
+
+static void start_stream(emu_device* emu, u8 pkt_type)
+{
+	emu->streaming = 1;
+	emu->pkt_type = pkt_type;
+	emu->start_ns = ubertooth_monotonic_ns();
+	emu->paced = 0;
+	emu->since_keep_alive = 0;
+	emu->queue_overflow = 0;
+}
+
+static int reply(unsigned char* data, uint16_t length, const void* src, int n)
+{
+	n = MIN(n, length);
+	memcpy(data, src, n);
+	return n;
+}
+
+static int reply_u8(unsigned char* data, uint16_t length, u8 v)
+{
+	return reply(data, length, &v, 1);
+}
+
+static int reply_u32(unsigned char* data, uint16_t length, u32 v)
+{
+	u8 buf[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+	return reply(data, length, buf, 4);
+}
+
+static int reply_string(unsigned char* data, uint16_t length, int skip,
+                        const char* s)
+{
+	u8 buf[3 + 255];
+	int len = strlen(s);
+
+	memset(buf, 0, skip);
+	buf[skip] = len;
+	memcpy(buf + skip + 1, s, len);
+	return reply(data, length, buf, skip + 1 + len);
+}
+
+/* Returns the length of the reply, or of the data taken, as
+ * libusb_control_transfer() does. Called with the lock held. */
+static int emu_control(emu_device* emu, uint8_t request, uint16_t value,
+                       uint16_t index, unsigned char* data, uint16_t length)
+{
+	u8 buf[1 + 16];
+	usb_pkt_rx rx;
+
+	switch (request) {
+	case UBERTOOTH_PING:
+		return 0;
+
+	/* modes which send packets */
+	case UBERTOOTH_RX_SYMBOLS:
+	case UBERTOOTH_AFH:
+		start_stream(emu, BR_PACKET);
+		return 0;
+	/* the only one which takes data, the clock offsets */
+	case UBERTOOTH_START_HOPPING:
+		start_stream(emu, BR_PACKET);
+		return length;
+	case UBERTOOTH_BTLE_SNIFFING:
+	case UBERTOOTH_BTLE_PROMISC:
+		start_stream(emu, LE_PACKET);
+		return 0;
+	case UBERTOOTH_SPECAN:
+		emu->low_freq = value;
+		emu->high_freq = MAX(index, value);
+		emu->specan_freq = value;
+		start_stream(emu, SPECAN);
+		return 0;
+	case UBERTOOTH_EGO:
+		start_stream(emu, EGO_PACKET);
+		return 0;
+	case UBERTOOTH_STOP:
+	case UBERTOOTH_RESET:
+		emu->streaming = 0;
+		return 0;
+
+	case UBERTOOTH_POLL:
+		if (emu->streaming && next_packet(emu, &rx) == 0)
+			return reply(data, length, &rx, sizeof(rx));
+		return reply_u8(data, length, 0);
+
+	case UBERTOOTH_GET_USRLED:
+		return reply_u8(data, length, emu->usrled);
+	case UBERTOOTH_SET_USRLED:
+		emu->usrled = value;
+		return 0;
+	case UBERTOOTH_GET_RXLED:
+		return reply_u8(data, length, emu->rxled);
+	case UBERTOOTH_SET_RXLED:
+		emu->rxled = value;
+		return 0;
+	case UBERTOOTH_GET_TXLED:
+		return reply_u8(data, length, emu->txled);
+	case UBERTOOTH_SET_TXLED:
+		emu->txled = value;
+		return 0;
+	case UBERTOOTH_GET_PAEN:
+		return reply_u8(data, length, emu->paen);
+	case UBERTOOTH_SET_PAEN:
+		emu->paen = value;
+		return 0;
+	case UBERTOOTH_GET_HGM:
+		return reply_u8(data, length, emu->hgm);
+	case UBERTOOTH_SET_HGM:
+		emu->hgm = value;
+		return 0;
+	case UBERTOOTH_GET_1V8:
+		return reply_u8(data, length, 0);
+	case UBERTOOTH_GET_PALEVEL:
+		return reply_u8(data, length, emu->palevel);
+	case UBERTOOTH_SET_PALEVEL:
+		emu->palevel = value;
+		return 0;
+
+	case UBERTOOTH_GET_CHANNEL:
+		buf[0] = emu->channel & 0xff;
+		buf[1] = (emu->channel >> 8) & 0xff;
+		return reply(data, length, buf, 2);
+	case UBERTOOTH_SET_CHANNEL:
+		emu->channel = value;
+		return 0;
+	case UBERTOOTH_GET_MOD:
+		return reply_u8(data, length, emu->modulation);
+	case UBERTOOTH_SET_MOD:
+		emu->modulation = value;
+		return 0;
+	case UBERTOOTH_GET_SQUELCH:
+		return reply_u8(data, length, (u8)emu->squelch);
+	case UBERTOOTH_SET_SQUELCH:
+		emu->squelch = (int8_t)value;
+		return 0;
+	case UBERTOOTH_GET_CRC_VERIFY:
+		return reply_u8(data, length, emu->crc_verify);
+	case UBERTOOTH_SET_CRC_VERIFY:
+		emu->crc_verify = value;
+		return 0;
+	case UBERTOOTH_GET_ACCESS_ADDRESS:
+		return reply_u32(data, length, emu->access_address);
+	case UBERTOOTH_SET_ACCESS_ADDRESS:
+		if (length < 4)
+			return LIBUSB_ERROR_PIPE;
+		emu->access_address = data[0] | data[1] << 8 | data[2] << 16
+		                      | (u32)data[3] << 24;
+		return length;
+	case UBERTOOTH_GET_CLOCK:
+		return reply_u32(data, length, (u32)(emu->clk / 3125));
+	case UBERTOOTH_SET_CLOCK:
+		if (length < 4)
+			return LIBUSB_ERROR_PIPE;
+		emu->clk = (uint64_t)(data[0] | data[1] << 8 | data[2] << 16
+		                      | (u32)data[3] << 24) * 3125;
+		return length;
+	case UBERTOOTH_SET_AFHMAP:
+		if (length < 10)
+			return LIBUSB_ERROR_PIPE;
+		memcpy(emu->afh_map, data, 10);
+		return length;
+	case UBERTOOTH_CLEAR_AFHMAP:
+		memset(emu->afh_map, 0, 10);
+		return 0;
+
+	case UBERTOOTH_GET_SERIAL:
+		buf[0] = 0;
+		memcpy(buf + 1, emu->opts.serial, 16);
+		return reply(data, length, buf, 17);
+	case UBERTOOTH_GET_PARTNUM:
+		buf[0] = 0;
+		reply_u32(buf + 1, 4, EMU_PARTNUM);
+		return reply(data, length, buf, 5);
+	case UBERTOOTH_GET_REV_NUM:
+		return reply_string(data, length, 2, emu_version);
+	case UBERTOOTH_GET_COMPILE_INFO:
+		return reply_string(data, length, 0, emu_compile_info);
+	case UBERTOOTH_GET_BOARD_ID:
+		return reply_u8(data, length, BOARD_ID_UBERTOOTH_ONE);
+	case UBERTOOTH_GET_API_VERSION:
+		return reply_u32(data, length, UBERTOOTH_API_VERSION);
+	case UBERTOOTH_RANGE_CHECK:
+		memset(buf, 0, 5);
+		return reply(data, length, buf, 5);
+	case UBERTOOTH_READ_REGISTER:
+		memset(buf, 0, 2);
+		return reply(data, length, buf, 2);
+	case UBERTOOTH_DO_SOMETHING_REPLY:
+		return 0;
+
+	/* taken, but nothing to show for it */
+	case UBERTOOTH_TX_SYMBOLS:
+	case UBERTOOTH_SET_1V8:
+	case UBERTOOTH_TX_TEST:
+	case UBERTOOTH_REPEATER:
+	case UBERTOOTH_RANGE_TEST:
+	case UBERTOOTH_LED_SPECAN:
+	case UBERTOOTH_SET_BDADDR:
+	case UBERTOOTH_DO_SOMETHING:
+	case UBERTOOTH_BTLE_SLAVE:
+	case UBERTOOTH_BTLE_SET_TARGET:
+	case UBERTOOTH_BTLE_PHY:
+	case UBERTOOTH_WRITE_REGISTER:
+	case UBERTOOTH_WRITE_REGISTERS:
+	case UBERTOOTH_JAM_MODE:
+	case UBERTOOTH_HOP:
+	case UBERTOOTH_TRIM_CLOCK:
+		return length;
+
+	/* flashing and the like */
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+int emu_open(const char* spec, struct libusb_context** ctx,
+             struct libusb_device_handle** devh)
+{
+	emu_device* emu = (emu_device*)calloc(1, sizeof(emu_device));
+	if (emu == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+
+	if (emu_parse_options(spec, &emu->opts) < 0) {
+		free(emu);
+		return -1;
+	}
+
+	if (emu->opts.file != NULL) {
+		emu->fp = fopen(emu->opts.file, "rb");
+		if (emu->fp == NULL) {
+			perror(emu->opts.file);
+			goto fail;
+		}
+		emu->replay = replay_open(emu->fp);
+		if (emu->replay == NULL)
+			goto fail;
+	}
+	if (emu->opts.have_lap)
+		emu->syncword = btbb_gen_syncword(emu->opts.lap);
+
+	emu->channel = 2441;
+	emu->modulation = MOD_BT_BASIC_RATE;
+	emu->low_freq = 2402;
+	emu->high_freq = 2480;
+	emu->specan_freq = 2402;
+	emu->random = 0x2545f491;
+
+	pthread_mutex_init(&emu->lock, NULL);
+	pthread_cond_init(&emu->wake, NULL);
+
+	pthread_mutex_lock(&emulators_lock);
+	emu->next = emulators;
+	emulators = emu;
+	pthread_mutex_unlock(&emulators_lock);
+
+	*ctx = (struct libusb_context*)emu;
+	*devh = (struct libusb_device_handle*)emu;
+	return 0;
+
+fail:
+	/* before fclose, since closing a replay seeks its stream */
+	replay_close(emu->replay);
+	if (emu->fp != NULL)
+		fclose(emu->fp);
+	free(emu->opts.file);
+	free(emu);
+	return -1;
+}
+
+static void emu_free(emu_device* emu)
+{
+	emu_device** p;
+
+	pthread_mutex_lock(&emulators_lock);
+	for (p = &emulators; *p != NULL; p = &(*p)->next) {
+		if (*p == emu) {
+			*p = emu->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&emulators_lock);
+
+	fprintf(stderr, "Emulator sent %llu packets, dropped %llu, %llu keep alives, "
+	        "%llu DMA and %llu FIFO overflows\n",
+	        (unsigned long long)(emu->packets - emu->dropped),
+	        (unsigned long long)emu->dropped,
+	        (unsigned long long)emu->keep_alives,
+	        (unsigned long long)emu->dma_overflows,
+	        (unsigned long long)emu->fifo_overflows);
+
+	replay_close(emu->replay);
+	if (emu->fp != NULL)
+		fclose(emu->fp);
+	free(emu->opts.file);
+	pthread_cond_destroy(&emu->wake);
+	pthread_mutex_destroy(&emu->lock);
+	free(emu);
+}
+
+/* Wait on emu->wake until when_ns at the latest. The condition variable
+ * uses the realtime clock, so the wait is converted. */
+static void wait_until(emu_device* emu, uint64_t when_ns)
+{
+	struct timespec ts;
+	uint64_t now = ubertooth_monotonic_ns();
+	uint64_t abs_ns;
+
+	if (when_ns <= now)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	abs_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec + (when_ns - now);
+	ts.tv_sec = abs_ns / 1000000000ull;
+	ts.tv_nsec = abs_ns % 1000000000ull;
+	pthread_cond_timedwait(&emu->wake, &emu->lock, &ts);
+}
+
+static int emu_handle_events(emu_device* emu, uint64_t timeout_ns)
+{
+	struct libusb_transfer* done[EMU_MAX_XFERS];
+	uint64_t now = ubertooth_monotonic_ns();
+	uint64_t deadline = now + timeout_ns;
+	uint64_t next;
+	int i, n;
+
+	pthread_mutex_lock(&emu->lock);
+	while (1) {
+		complete_due(emu, now, &next);
+		if (emu->done_count > 0 || now >= deadline)
+			break;
+		wait_until(emu, MIN(next, deadline));
+		now = ubertooth_monotonic_ns();
+	}
+	n = emu->done_count;
+	memcpy(done, emu->done, n * sizeof(done[0]));
+	emu->done_count = 0;
+	pthread_mutex_unlock(&emu->lock);
+
+	/* without the lock, callbacks submit the transfer again */
+	for (i = 0; i < n; i++)
+		done[i]->callback(done[i]);
+	return 0;
+}
+
+int ubertooth_usb_control(struct libusb_device_handle* devh, uint8_t type,
+                          uint8_t request, uint16_t value, uint16_t index,
+                          unsigned char* data, uint16_t length,
+                          unsigned int timeout)
+{
+	emu_device* emu = find_emu(devh);
+	int r;
+
+	if (emu == NULL)
+		return libusb_control_transfer(devh, type, request, value, index,
+		                               data, length, timeout);
+
+	pthread_mutex_lock(&emu->lock);
+	r = emu_control(emu, request, value, index, data, length);
+	pthread_cond_broadcast(&emu->wake);
+	pthread_mutex_unlock(&emu->lock);
+	return r;
+}
+
+int ubertooth_usb_submit(struct libusb_transfer* xfer)
+{
+	emu_device* emu = find_emu(xfer->dev_handle);
+	const uint8_t* setup;
+	int r = 0;
+
+	if (emu == NULL)
+		return libusb_submit_transfer(xfer);
+
+	pthread_mutex_lock(&emu->lock);
+	if (emu->pending_count + emu->done_count >= EMU_MAX_XFERS) {
+		r = LIBUSB_ERROR_BUSY;
+	} else if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		/* done at once, the callback is still left to
+		 * ubertooth_usb_handle_events() */
+		setup = xfer->buffer;
+		r = emu_control(emu, setup[1], setup[2] | setup[3] << 8,
+		                setup[4] | setup[5] << 8,
+		                xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+		                setup[6] | setup[7] << 8);
+		xfer->actual_length = MAX(r, 0);
+		xfer->status = r < 0 ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+		xfer_done(emu, xfer);
+		r = 0;
+	} else if (emu->gone) {
+		r = LIBUSB_ERROR_NO_DEVICE;
+	} else {
+		emu->pending[emu->pending_count++] = xfer;
+	}
+	pthread_cond_broadcast(&emu->wake);
+	pthread_mutex_unlock(&emu->lock);
+	return r;
+}
+
+int ubertooth_usb_cancel(struct libusb_transfer* xfer)
+{
+	emu_device* emu = find_emu(xfer->dev_handle);
+	int i, r = LIBUSB_ERROR_NOT_FOUND;
+
+	if (emu == NULL)
+		return libusb_cancel_transfer(xfer);
+
+	pthread_mutex_lock(&emu->lock);
+	for (i = 0; i < emu->pending_count; i++) {
+		if (emu->pending[i] == xfer) {
+			remove_pending(emu, i);
+			xfer->actual_length = 0;
+			xfer->status = LIBUSB_TRANSFER_CANCELLED;
+			xfer_done(emu, xfer);
+			pthread_cond_broadcast(&emu->wake);
+			r = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&emu->lock);
+	return r;
+}
+
+int ubertooth_usb_handle_events(struct libusb_context* ctx, struct timeval* tv)
+{
+	emu_device* emu = find_emu(ctx);
+
+	if (emu == NULL) {
+		if (tv == NULL)
+			return libusb_handle_events(ctx);
+		return libusb_handle_events_timeout(ctx, tv);
+	}
+
+	if (tv == NULL)
+		return emu_handle_events(emu, EMU_EVENTS_TIMEOUT_NS);
+	return emu_handle_events(emu, (uint64_t)tv->tv_sec * 1000000000ull
+	                              + (uint64_t)tv->tv_usec * 1000);
+}
+
+/* The emulator goes with the context */
+void ubertooth_usb_close(struct libusb_device_handle* devh)
+{
+	if (find_emu(devh) != NULL)
+		return;
+	libusb_release_interface(devh, 0);
+	libusb_close(devh);
+}
+
+void ubertooth_usb_exit(struct libusb_context* ctx)
+{
+	emu_device* emu = find_emu(ctx);
+
+	if (emu == NULL)
+		libusb_exit(ctx);
+	else
+		emu_free(emu);
+}
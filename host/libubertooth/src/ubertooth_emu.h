@@ -0,0 +1,156 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_EMU_H__
+#define __UBERTOOTH_EMU_H__
+
+#include "ubertooth_control.h"
+#include "ubertooth_replay.h"
+#include <pthread.h>
+
+/* Device spec of an emulated Ubertooth, e.g. -U emu:file=x.dump,speed=4 */
+#define EMU_SPEC_PREFIX "emu:"
+
+/* Each packet holds 400 symbols at 1 Msym/s */
+#define EMU_PKT_NS 400000
+
+/* Transfers submitted to one emulated device at a time, more than
+ * ubertooth_bulk_init() and the command queue ever have in flight */
+#define EMU_MAX_XFERS 64
+
+/* Access codes are generated once every this many packets by default */
+#define EMU_DEFAULT_AC_INTERVAL 100
+
+typedef struct {
+	/* Dump file in the ubertooth-dump -d format, packets are
+	 * generated if NULL */
+	char* file;
+	/* Start again at the end of the file */
+	uint8_t loop;
+	/* Packet rate as a multiple of the real one, 0 for as fast as the
+	 * host takes them */
+	double speed;
+	/* The device is unplugged after this many packets, 0 for never */
+	uint64_t count;
+	/* One packet in this many is flagged, 0 for none */
+	uint32_t dma_overflow;
+	uint32_t fifo_overflow;
+	/* A keep alive ends the transfer after this many packets, 0 for
+	 * no keep alives */
+	uint32_t keep_alive;
+	/* Generated packets carry the access code of this LAP once every
+	 * ac_interval packets */
+	uint8_t have_lap;
+	uint32_t lap;
+	uint32_t ac_interval;
+	/* Returned by UBERTOOTH_GET_SERIAL */
+	u8 serial[16];
+} emu_options;
+
+typedef struct emu_device {
+	emu_options opts;
+	pthread_mutex_t lock;
+	/* signalled whenever there may be something for
+	 * ubertooth_usb_handle_events() to do */
+	pthread_cond_t wake;
+
+	/* Firmware state, as set by the control requests */
+	uint8_t streaming;
+	u8 pkt_type;
+	u16 channel;
+	u8 modulation;
+	int8_t squelch;
+	u8 palevel;
+	u8 paen;
+	u8 hgm;
+	u8 usrled;
+	u8 rxled;
+	u8 txled;
+	u8 crc_verify;
+	u32 access_address;
+	u8 afh_map[10];
+	u16 low_freq;
+	u16 high_freq;
+	u16 specan_freq;
+
+	/* Packet source: the dump file, or the generator clock in units
+	 * of 100 ns and its random number state */
+	FILE* fp;
+	replay_file* replay;
+	const uint8_t* records;
+	int record_count;
+	int record_next;
+	uint64_t clk;
+	uint32_t random;
+	uint64_t syncword;
+
+	/* Set at the end of the source, bulk transfers then fail as if
+	 * the device had been unplugged */
+	uint8_t gone;
+
+	/* Packets since streaming started, for pacing */
+	uint64_t start_ns;
+	uint64_t paced;
+	uint32_t since_keep_alive;
+	/* the firmware queue filled up, flag the next packet */
+	uint8_t queue_overflow;
+
+	/* Bulk transfers waiting for packets, and transfers whose
+	 * callback is due */
+	struct libusb_transfer* pending[EMU_MAX_XFERS];
+	int pending_count;
+	struct libusb_transfer* done[EMU_MAX_XFERS];
+	int done_count;
+
+	/* read from the source, including those dropped */
+	uint64_t packets;
+	uint64_t dropped;
+	uint64_t keep_alives;
+	uint64_t dma_overflows;
+	uint64_t fifo_overflows;
+
+	struct emu_device* next;
+} emu_device;
+
+/* Parse "file=<path>,loop,speed=<x>,count=<n>,dma_overflow=<n>,
+ * fifo_overflow=<n>,keep_alive=<n>,lap=<hex>,ac=<n>,serial=<hex>",
+ * any of them left out */
+int emu_parse_options(const char* spec, emu_options* opts);
+
+/* Emulated Ubertooth, spec is what follows EMU_SPEC_PREFIX. The context
+ * and handle only work with the ubertooth_usb_*() calls below. */
+int emu_open(const char* spec, struct libusb_context** ctx,
+             struct libusb_device_handle** devh);
+
+int emu_is_device(struct libusb_device_handle* devh);
+
+/* The libusb calls libubertooth makes for a device, which go to the
+ * emulator for an emulated one */
+int ubertooth_usb_control(struct libusb_device_handle* devh, uint8_t type,
+                          uint8_t request, uint16_t value, uint16_t index,
+                          unsigned char* data, uint16_t length,
+                          unsigned int timeout);
+int ubertooth_usb_submit(struct libusb_transfer* xfer);
+int ubertooth_usb_cancel(struct libusb_transfer* xfer);
+/* As libusb_handle_events() if tv is NULL */
+int ubertooth_usb_handle_events(struct libusb_context* ctx, struct timeval* tv);
+void ubertooth_usb_close(struct libusb_device_handle* devh);
+void ubertooth_usb_exit(struct libusb_context* ctx);
+
+#endif /* __UBERTOOTH_EMU_H__ */
@@ -0,0 +1,115 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_fifo.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+fifo_t* fifo_init(uint32_t size)
+{
+	uint32_t n = 1;
+	fifo_t* f = (fifo_t*)malloc(sizeof(fifo_t));
+	if (f == NULL)
+		return NULL;
+
+	/* round up to a power of two so indices can be masked */
+	while (n < size)
+		n <<= 1;
+
+	f->pkts = (usb_pkt_rx*)malloc(n * sizeof(usb_pkt_rx));
+	f->host_ns = (uint64_t*)malloc(n * sizeof(uint64_t));
+	if (f->pkts == NULL || f->host_ns == NULL) {
+		free(f->pkts);
+		free(f->host_ns);
+		free(f);
+		return NULL;
+	}
+	f->size = n;
+	f->head = 0;
+	f->tail = 0;
+	f->high_water = 0;
+	f->pushed = 0;
+	f->dropped = 0;
+
+	return f;
+}
+
+void fifo_free(fifo_t* f)
+{
+	if (f == NULL)
+		return;
+	free(f->pkts);
+	free(f->host_ns);
+	free(f);
+}
+
+/* Producer side. Returns -1 and counts a drop if the consumer has
+ * fallen a whole fifo behind. */
+int fifo_push(fifo_t* f, const usb_pkt_rx* rx, uint64_t host_ns)
+{
+	uint32_t head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = f->tail;
+	uint32_t depth = tail - head;
+
+	if (depth == f->size) {
+		f->dropped++;
+		return -1;
+	}
+
+	memcpy(&f->pkts[tail & (f->size - 1)], rx, sizeof(usb_pkt_rx));
+	f->host_ns[tail & (f->size - 1)] = host_ns;
+	__atomic_store_n(&f->tail, tail + 1, __ATOMIC_RELEASE);
+
+	f->pushed++;
+	if (depth + 1 > f->high_water)
+		f->high_water = depth + 1;
+
+	return 0;
+}
+
+/* Consumer side. Points pkts (and host_ns, if given) at the oldest
+ * queued packet and returns how many packets may be read from there
+ * without wrapping. */
+uint32_t fifo_get_batch(fifo_t* f, usb_pkt_rx** pkts, uint64_t** host_ns)
+{
+	uint32_t tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+	uint32_t head = f->head;
+	uint32_t index = head & (f->size - 1);
+	uint32_t count = tail - head;
+
+	if (count > f->size - index)
+		count = f->size - index;
+
+	*pkts = &f->pkts[index];
+	if (host_ns != NULL)
+		*host_ns = &f->host_ns[index];
+	return count;
+}
+
+void fifo_release(fifo_t* f, uint32_t count)
+{
+	__atomic_store_n(&f->head, f->head + count, __ATOMIC_RELEASE);
+}
+
+uint32_t fifo_depth(fifo_t* f)
+{
+	return __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_FIFO_H__
+#define __UBERTOOTH_FIFO_H__
+
+#include "ubertooth_control.h"
+
+#define DEFAULT_FIFO_SIZE 8192
+
+/* Single producer / single consumer packet queue between the USB event
+ * thread and the decoding thread. head is only written by the consumer,
+ * tail only by the producer. */
+typedef struct {
+	usb_pkt_rx* pkts;
+	uint64_t* host_ns;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+
+	/* statistics, maintained by the producer */
+	uint32_t high_water;
+	uint64_t pushed;
+	uint64_t dropped;
+} fifo_t;
+
+fifo_t* fifo_init(uint32_t size);
+void fifo_free(fifo_t* f);
+
+int fifo_push(fifo_t* f, const usb_pkt_rx* rx, uint64_t host_ns);
+uint32_t fifo_get_batch(fifo_t* f, usb_pkt_rx** pkts, uint64_t** host_ns);
+void fifo_release(fifo_t* f, uint32_t count);
+uint32_t fifo_depth(fifo_t* f);
+
+#endif /* __UBERTOOTH_FIFO_H__ */
@@ -0,0 +1,363 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_hotplug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int ubertooth_set_channel(ubertooth_t* ut, u16 channel)
+{
+	int r = cmd_set_channel(ut->devh, channel);
+	if (r == 0) {
+		ut->config.channel = channel;
+		ut->config.flags |= CONFIG_CHANNEL;
+	}
+	return r;
+}
+
+int ubertooth_set_modulation(ubertooth_t* ut, u16 mod)
+{
+	int r = cmd_set_modulation(ut->devh, mod);
+	if (r == 0) {
+		ut->config.modulation = mod;
+		ut->config.flags |= CONFIG_MODULATION;
+	}
+	return r;
+}
+
+int ubertooth_set_squelch(ubertooth_t* ut, u16 level)
+{
+	int r = cmd_set_squelch(ut->devh, level);
+	if (r == 0) {
+		ut->config.squelch = level;
+		ut->config.flags |= CONFIG_SQUELCH;
+	}
+	return r;
+}
+
+int ubertooth_set_access_address(ubertooth_t* ut, u32 access_address)
+{
+	int r = cmd_set_access_address(ut->devh, access_address);
+	if (r == 0) {
+		ut->config.access_address = access_address;
+		ut->config.flags |= CONFIG_ACCESS_ADDRESS;
+	}
+	return r;
+}
+
+int ubertooth_set_afh_map(ubertooth_t* ut, uint8_t* afh_map)
+{
+	int r = cmd_set_afh_map(ut->devh, afh_map);
+	if (r == 0) {
+		memcpy(ut->config.afh_map, afh_map, 10);
+		ut->config.flags |= CONFIG_AFH_MAP;
+	}
+	return r;
+}
+
+/* A reset device starts with a clear map */
+int ubertooth_clear_afh_map(ubertooth_t* ut)
+{
+	int r = cmd_clear_afh_map(ut->devh);
+	if (r == 0)
+		ut->config.flags &= ~CONFIG_AFH_MAP;
+	return r;
+}
+
+static int send_mode(ubertooth_t* ut, const config_mode* m)
+{
+	int r;
+
+	r = ubertooth_usb_control(ut->devh, CTRL_OUT, m->command,
+			m->value, m->index, NULL, 0, 1000);
+	if (r < 0) {
+		if (r == LIBUSB_ERROR_PIPE) {
+			fprintf(stderr, "control message unsupported\n");
+		} else {
+			show_libusb_error(r);
+		}
+		return r;
+	}
+	return 0;
+}
+
+/* Remember a mode command after the ones before it. One sent before
+ * moves to the end, and the oldest is forgotten when there are too
+ * many. */
+static void record_mode(ubertooth_config* c, uint8_t mode, u16 value, u16 index)
+{
+	int i;
+
+	for (i = 0; i < c->mode_count; i++) {
+		if (c->modes[i].command == mode)
+			break;
+	}
+	if (i == c->mode_count && c->mode_count == CONFIG_MAX_MODES)
+		i = 0;
+	if (i < c->mode_count) {
+		memmove(&c->modes[i], &c->modes[i + 1],
+		        (c->mode_count - i - 1) * sizeof(config_mode));
+		c->mode_count--;
+	}
+
+	c->modes[c->mode_count].command = mode;
+	c->modes[c->mode_count].value = value;
+	c->modes[c->mode_count].index = index;
+	c->mode_count++;
+	c->flags |= CONFIG_MODE;
+}
+
+/* Start one of the modes which send packets, e.g. UBERTOOTH_RX_SYMBOLS
+ * or UBERTOOTH_BTLE_SNIFFING */
+int ubertooth_start_mode(ubertooth_t* ut, uint8_t mode, u16 value, u16 index)
+{
+	record_mode(&ut->config, mode, value, index);
+
+	return send_mode(ut, &ut->config.modes[ut->config.mode_count - 1]);
+}
+
+static int replay_modes(ubertooth_t* ut)
+{
+	int i;
+
+	for (i = 0; i < ut->config.mode_count; i++) {
+		if (send_mode(ut, &ut->config.modes[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int replay_config(ubertooth_t* ut)
+{
+	const ubertooth_config* c = &ut->config;
+
+	if ((c->flags & CONFIG_MODULATION) &&
+	    cmd_set_modulation(ut->devh, c->modulation) < 0)
+		return -1;
+	if ((c->flags & CONFIG_SQUELCH) &&
+	    cmd_set_squelch(ut->devh, c->squelch) < 0)
+		return -1;
+	if ((c->flags & CONFIG_CHANNEL) &&
+	    cmd_set_channel(ut->devh, c->channel) < 0)
+		return -1;
+	if ((c->flags & CONFIG_ACCESS_ADDRESS) &&
+	    cmd_set_access_address(ut->devh, c->access_address) < 0)
+		return -1;
+	/* synchronously, the device has to have it before it starts */
+	if ((c->flags & CONFIG_AFH_MAP) &&
+	    ubertooth_cmd_sync(ut->devh, CTRL_OUT, UBERTOOTH_SET_AFHMAP,
+	                       (uint8_t*)c->afh_map, 10) < 0)
+		return -1;
+	return 0;
+}
+
+static int hotplug_cb(libusb_context* ctx __attribute__((unused)),
+                      libusb_device* dev, libusb_hotplug_event event,
+                      void* user_data)
+{
+	ubertooth_t* ut = (ubertooth_t*)user_data;
+	struct libusb_device_descriptor desc;
+
+	/* registered for any device since one registration can only match
+	 * a single vendor/product pair, so other arrivals are ignored here */
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		if (libusb_get_device_descriptor(dev, &desc) == 0 &&
+		    ubertooth_is_device(&desc))
+			ut->hotplug.arrived = 1;
+	} else if (ut->devh != NULL && dev == libusb_get_device(ut->devh))
+		ubertooth_device_lost(ut);
+
+	/* stay registered */
+	return 0;
+}
+
+int ubertooth_hotplug_enable(ubertooth_t* ut)
+{
+	int r;
+
+	if (ut->devh == NULL)
+		return -1;
+
+	if (emu_is_device(ut->devh)) {
+		fprintf(stderr, "An emulated Ubertooth can not be reconnected\n");
+		return -1;
+	}
+
+	r = cmd_get_serial(ut->devh, ut->hotplug.serial);
+	if (r != 0) {
+		fprintf(stderr, "Unable to read the serial number to reconnect by\n");
+		return -1;
+	}
+
+	/* without hotplug support the device is looked for periodically */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		r = libusb_hotplug_register_callback(ut->ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+				hotplug_cb, ut, &ut->hotplug.callback);
+		if (r == LIBUSB_SUCCESS)
+			ut->hotplug.have_callback = 1;
+		else
+			show_libusb_error(r);
+	}
+
+	ut->hotplug.enabled = 1;
+	return 0;
+}
+
+void ubertooth_hotplug_disable(ubertooth_t* ut)
+{
+	if (ut->hotplug.have_callback && ut->ctx != NULL)
+		libusb_hotplug_deregister_callback(ut->ctx, ut->hotplug.callback);
+	ut->hotplug.have_callback = 0;
+	ut->hotplug.enabled = 0;
+}
+
+void ubertooth_device_lost(ubertooth_t* ut)
+{
+	if (ut->hotplug.lost)
+		return;
+	ut->hotplug.lost_ns = ubertooth_monotonic_ns();
+	ut->hotplug.lost = 1;
+}
+
+static void release_device(ubertooth_t* ut)
+{
+	cmd_queue_free(ut->cmdq);
+	ut->cmdq = NULL;
+	if (ut->devh != NULL) {
+		libusb_release_interface(ut->devh, 0);
+		libusb_close(ut->devh);
+		ut->devh = NULL;
+	}
+}
+
+static int reattach(ubertooth_t* ut, struct libusb_device_handle* devh)
+{
+	int r = libusb_claim_interface(devh, 0);
+	if (r < 0) {
+		show_libusb_error(r);
+		libusb_close(devh);
+		return -1;
+	}
+	ut->devh = devh;
+
+	ut->cmdq = cmd_queue_init(ut->ctx, ut->devh);
+	if (ut->cmdq == NULL)
+		return -1;
+
+	return replay_config(ut);
+}
+
+static void record_gap(ubertooth_t* ut, uint64_t gap_ns)
+{
+	output_event ev;
+	struct timespec ts;
+
+	ut->hotplug.reconnects++;
+	ut->hotplug.gap_total_ns += gap_ns;
+	fprintf(stderr, "Ubertooth reconnected, no packets for %llu ms\n",
+	        (unsigned long long)(gap_ns / 1000000));
+
+	if (ut->output) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = EVENT_GAP;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ev.systime = (uint32_t)ts.tv_sec;
+		ev.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+		ev.gap_ms = (uint32_t)(gap_ns / 1000000);
+		output_write_event(ut->output, &ev);
+	}
+}
+
+/* Wait for the device to come back after it was lost, set it up as it
+ * was and resume streaming. Returns -1 if stopped first. */
+int ubertooth_reconnect(ubertooth_t* ut)
+{
+	struct libusb_device_handle* devh;
+	struct timeval tv;
+	int threaded = ut->usb_thread_running;
+	int streaming = ut->rx_xfers != NULL;
+	int r;
+
+	if (!ut->hotplug.enabled)
+		return -1;
+
+	fprintf(stderr, "Ubertooth disconnected, waiting for it to come back\n");
+	ubertooth_bulk_free(ut);
+	release_device(ut);
+
+	while (!ut->stop_ubertooth) {
+		tv.tv_sec = HOTPLUG_POLL_INTERVAL;
+		tv.tv_usec = 0;
+		r = libusb_handle_events_timeout(ut->ctx, &tv);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			show_libusb_error(r);
+
+		/* it may take a while to answer after arriving, keep
+		 * looking once it has */
+		if (ut->hotplug.have_callback && !ut->hotplug.arrived)
+			continue;
+
+		devh = ubertooth_open_serial(ut->ctx, ut->hotplug.serial);
+		if (devh == NULL)
+			continue;
+		if (reattach(ut, devh) == 0)
+			break;
+		release_device(ut);
+	}
+	if (ut->stop_ubertooth)
+		return -1;
+
+	ut->hotplug.arrived = 0;
+	ut->hotplug.lost = 0;
+
+	/* the device clock started again */
+	clock_sync_init(&ut->clock);
+	ut->prev_ts = 0;
+	ut->trim_counter = 0;
+	ut->calibrated = 0;
+
+	if (streaming) {
+		if (ubertooth_bulk_init(ut) < 0)
+			return -1;
+		if ((ut->config.flags & CONFIG_MODE) && replay_modes(ut) < 0)
+			return -1;
+		if (threaded && ubertooth_bulk_thread_start(ut) < 0)
+			return -1;
+	}
+
+	record_gap(ut, ubertooth_monotonic_ns() - ut->hotplug.lost_ns);
+	return 0;
+}
+
+void ubertooth_print_hotplug_stats(ubertooth_t* ut, FILE* fileptr)
+{
+	if (!ut->hotplug.enabled)
+		return;
+	if (fileptr == NULL)
+		fileptr = stderr;
+
+	fprintf(fileptr, "reconnects: %u, %llu ms without the device\n",
+	        ut->hotplug.reconnects,
+	        (unsigned long long)(ut->hotplug.gap_total_ns / 1000000));
+}
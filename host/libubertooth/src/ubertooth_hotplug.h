@@ -0,0 +1,78 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_HOTPLUG_H__
+#define __UBERTOOTH_HOTPLUG_H__
+
+#include "ubertooth_control.h"
+
+/* Which fields of ubertooth_config have been set */
+#define CONFIG_CHANNEL        0x01
+#define CONFIG_MODULATION     0x02
+#define CONFIG_SQUELCH        0x04
+#define CONFIG_ACCESS_ADDRESS 0x08
+#define CONFIG_AFH_MAP        0x10
+#define CONFIG_MODE           0x20
+
+/* Mode commands remembered for a reconnect, e.g. UBERTOOTH_AFH followed
+ * by UBERTOOTH_RX_SYMBOLS */
+#define CONFIG_MAX_MODES 4
+
+/* A command sent with ubertooth_start_mode(), these take no data */
+typedef struct {
+	uint8_t command;
+	u16 value;
+	u16 index;
+} config_mode;
+
+/* The last settings sent with the ubertooth_set_*() calls, sent again
+ * after a reconnect */
+typedef struct {
+	uint8_t flags;
+	u16 channel;
+	u16 modulation;
+	u16 squelch;
+	u32 access_address;
+	uint8_t afh_map[10];
+	/* in the order they were sent, each command at most once */
+	config_mode modes[CONFIG_MAX_MODES];
+	uint8_t mode_count;
+} ubertooth_config;
+
+/* Seconds between looking for the device when libusb can not tell us
+ * it has come back */
+#define HOTPLUG_POLL_INTERVAL 1
+
+typedef struct {
+	uint8_t enabled;
+	/* as returned by cmd_get_serial(), the first byte is the status */
+	u8 serial[17];
+	uint8_t have_callback;
+	libusb_hotplug_callback_handle callback;
+
+	/* set from libusb callbacks */
+	volatile uint8_t lost;
+	volatile uint8_t arrived;
+	uint64_t lost_ns;
+
+	uint32_t reconnects;
+	uint64_t gap_total_ns;
+} hotplug_state;
+
+#endif /* __UBERTOOTH_HOTPLUG_H__ */
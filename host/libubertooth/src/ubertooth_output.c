@@ -0,0 +1,266 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_output.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char hex_digits[] = "0123456789abcdef";
+
+int output_parse_spec(const char* spec, const char** filename)
+{
+	const char* colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+	int format;
+
+	if (len == 4 && strncmp(spec, "text", 4) == 0)
+		format = OUTPUT_TEXT;
+	else if (len == 4 && strncmp(spec, "json", 4) == 0)
+		format = OUTPUT_NDJSON;
+	else if (len == 6 && strncmp(spec, "binary", 6) == 0)
+		format = OUTPUT_BINARY;
+	else {
+		fprintf(stderr, "Unknown output format: %s\n", spec);
+		return -1;
+	}
+
+	*filename = (colon && colon[1] != '\0') ? colon + 1 : NULL;
+	return format;
+}
+
+static output_t* output_new(int format, dump_writer_t* sink)
+{
+	output_t* out;
+
+	if (sink == NULL)
+		return NULL;
+
+	out = (output_t*)malloc(sizeof(output_t));
+	if (out == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		dump_writer_close(sink);
+		return NULL;
+	}
+
+	out->format = format;
+	out->sink = sink;
+	return out;
+}
+
+output_t* output_open(int format, const char* filename)
+{
+	if (filename)
+		return output_new(format, dump_writer_open(filename, NULL));
+	return output_new(format, dump_writer_fdopen(STDOUT_FILENO, NULL));
+}
+
+/* Takes ownership of fd, which is closed by output_close() */
+output_t* output_fdopen(int format, int fd)
+{
+	dump_writer_t* sink = dump_writer_fdopen(fd, NULL);
+
+	if (sink == NULL) {
+		close(fd);
+		return NULL;
+	}
+	sink->own_fd = 1;
+	return output_new(format, sink);
+}
+
+void output_close(output_t* out)
+{
+	if (out == NULL)
+		return;
+
+	dump_writer_close(out->sink);
+	free(out);
+}
+
+/* The formatters below append to the line buffer and return the new
+ * end. OUTPUT_LINE_LEN leaves room for every field. */
+
+static uint8_t* put_str(uint8_t* p, const char* s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static uint8_t* put_uint(uint8_t* p, uint64_t v)
+{
+	uint8_t tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static uint8_t* put_int(uint8_t* p, int32_t v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return put_uint(p, -(uint32_t)v);
+	}
+	return put_uint(p, v);
+}
+
+/* the time fields every event has */
+static uint8_t* put_time(uint8_t* p, const output_event* ev)
+{
+	p = put_str(p, ",\"time_ns\":");
+	p = put_uint(p, ev->time_ns);
+	p = put_str(p, ",\"time_err_ns\":");
+	return put_uint(p, ev->time_err_ns);
+}
+
+static uint8_t* put_hex(uint8_t* p, const uint8_t* data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		*p++ = hex_digits[data[i] >> 4];
+		*p++ = hex_digits[data[i] & 0xf];
+	}
+	return p;
+}
+
+static uint8_t* put_le32(uint8_t* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+static uint8_t* put_le64(uint8_t* p, uint64_t v)
+{
+	p = put_le32(p, (uint32_t)v);
+	return put_le32(p, (uint32_t)(v >> 32));
+}
+
+static int write_ndjson(output_t* out, const output_event* ev)
+{
+	uint8_t* p = out->line;
+
+	switch (ev->type) {
+	case EVENT_BR:
+		p = put_str(p, "{\"type\":\"br\",\"systime\":");
+		p = put_uint(p, ev->systime);
+		p = put_str(p, ",\"ch\":");
+		p = put_uint(p, ev->channel);
+		p = put_str(p, ",\"lap\":");
+		p = put_uint(p, ev->address);
+		p = put_str(p, ",\"err\":");
+		p = put_uint(p, ev->ac_errors);
+		p = put_str(p, ",\"clk100ns\":");
+		p = put_uint(p, ev->clk100ns);
+		p = put_str(p, ",\"clkn\":");
+		p = put_uint(p, ev->clkn);
+		p = put_str(p, ",\"clk_offset\":");
+		p = put_uint(p, ev->clk_offset);
+		p = put_str(p, ",\"s\":");
+		p = put_int(p, ev->signal);
+		p = put_str(p, ",\"n\":");
+		p = put_int(p, ev->noise);
+		break;
+	case EVENT_LE:
+	case EVENT_EGO:
+		p = put_str(p, ev->type == EVENT_LE ? "{\"type\":\"le\",\"systime\":"
+		                                    : "{\"type\":\"ego\",\"systime\":");
+		p = put_uint(p, ev->systime);
+		p = put_str(p, ",\"freq\":");
+		p = put_uint(p, ev->channel + 2402);
+		p = put_str(p, ",\"aa\":");
+		p = put_uint(p, ev->address);
+		p = put_str(p, ",\"clk100ns\":");
+		p = put_uint(p, ev->clk100ns);
+		p = put_str(p, ",\"delta_t\":");
+		p = put_uint(p, ev->delta_t);
+		p = put_str(p, ",\"rssi\":");
+		p = put_int(p, ev->signal);
+		break;
+	case EVENT_GAP:
+		p = put_str(p, "{\"type\":\"gap\",\"systime\":");
+		p = put_uint(p, ev->systime);
+		p = put_str(p, ",\"ms\":");
+		p = put_uint(p, ev->gap_ms);
+		break;
+	default:
+		return -1;
+	}
+	p = put_time(p, ev);
+
+	if (ev->data_len > 0) {
+		p = put_str(p, ",\"data\":\"");
+		p = put_hex(p, ev->data, ev->data_len);
+		*p++ = '"';
+	}
+	p = put_str(p, "}\n");
+
+	return dump_writer_write(out->sink, out->line, p - out->line);
+}
+
+static int write_binary(output_t* out, const output_event* ev)
+{
+	uint8_t* p = out->line;
+
+	*p++ = ev->type;
+	*p++ = ev->channel;
+	*p++ = (uint8_t)ev->signal;
+	*p++ = (uint8_t)ev->noise;
+	p = put_le32(p, ev->systime);
+	p = put_le32(p, ev->address);
+	p = put_le32(p, ev->clk100ns);
+	p = put_le32(p, ev->clkn);
+	p = put_le32(p, ev->clk_offset);
+	p = put_le32(p, ev->delta_t);
+	*p++ = ev->ac_errors;
+	*p++ = ev->data_len;
+	*p++ = 0;
+	*p++ = 0;
+	p = put_le32(p, ev->gap_ms);
+	p = put_le64(p, ev->time_ns);
+	p = put_le64(p, ev->time_err_ns);
+	if (ev->data_len > 0) {
+		memcpy(p, ev->data, ev->data_len);
+		p += ev->data_len;
+	}
+
+	return dump_writer_write(out->sink, out->line, p - out->line);
+}
+
+int output_write_event(output_t* out, const output_event* ev)
+{
+	switch (out->format) {
+	case OUTPUT_NDJSON:
+		return write_ndjson(out, ev);
+	case OUTPUT_BINARY:
+		return write_binary(out, ev);
+	default:
+		return -1;
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_OUTPUT_H__
+#define __UBERTOOTH_OUTPUT_H__
+
+#include "ubertooth_dump.h"
+
+enum output_formats {
+	OUTPUT_TEXT   = 0,
+	OUTPUT_NDJSON = 1,
+	OUTPUT_BINARY = 2
+};
+
+enum output_event_types {
+	EVENT_BR  = 1,   /* BR/EDR packet, cb_br_rx(), cb_scan(), cb_rx() */
+	EVENT_LE  = 2,   /* BLE packet, cb_btle() */
+	EVENT_EGO = 3,   /* E-GO packet, cb_ego() */
+	EVENT_GAP = 4    /* device reconnected after gap_ms without packets */
+};
+
+typedef struct {
+	uint8_t type;
+	/* BR/EDR channel, or frequency - 2402 MHz */
+	uint8_t channel;
+	int8_t signal;
+	int8_t noise;
+	uint32_t systime;
+	/* wall clock time from the disciplined device clock, and that
+	 * clock's error estimate */
+	uint64_t time_ns;
+	uint64_t time_err_ns;
+	/* LAP or access address */
+	uint32_t address;
+	uint32_t clk100ns;
+	uint32_t clkn;
+	uint32_t clk_offset;
+	/* time since the previous packet in units of 100 ns */
+	uint32_t delta_t;
+	uint8_t ac_errors;
+	/* EVENT_GAP: how long the device was gone */
+	uint32_t gap_ms;
+	uint8_t data_len;
+	const uint8_t* data;
+} output_event;
+
+/* Binary records are a 52 byte little endian header followed by
+ * data_len bytes of packet data:
+ *
+ *  0  u8  type          1  u8  channel
+ *  2  s8  signal        3  s8  noise
+ *  4  u32 systime       8  u32 address
+ * 12  u32 clk100ns     16  u32 clkn
+ * 20  u32 clk_offset   24  u32 delta_t
+ * 28  u8  ac_errors    29  u8  data_len
+ * 30  u16 reserved    32  u32 gap_ms
+ * 36  u64 time_ns      44  u64 time_err_ns
+ */
+#define OUTPUT_BINARY_HEADER_LEN 52
+
+/* One NDJSON line: fixed fields plus the data as hex */
+#define OUTPUT_LINE_LEN (320 + 2 * 255)
+
+typedef struct {
+	int format;
+	dump_writer_t* sink;
+	uint8_t line[OUTPUT_LINE_LEN];
+} output_t;
+
+/* Parse "<text|json|binary>[:<file>]". Returns the format, or -1.
+ * *filename is set to the file name or NULL for stdout. */
+int output_parse_spec(const char* spec, const char** filename);
+
+/* NULL filename for stdout */
+output_t* output_open(int format, const char* filename);
+output_t* output_fdopen(int format, int fd);
+void output_close(output_t* out);
+
+int output_write_event(output_t* out, const output_event* ev);
+
+#endif /* __UBERTOOTH_OUTPUT_H__ */
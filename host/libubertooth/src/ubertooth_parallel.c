@@ -0,0 +1,429 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Offline decoding on several cores. The access code search, where
+ * nearly all of the time goes, is done by worker threads on chunks of
+ * the capture. Everything else cb_rx() does, libbtbb's piconet and
+ * survey state included, stays on the calling thread, in capture
+ * order, so the results are those of a sequential run.
+ *
+ * Chunks overlap by NUM_BANKS - 1 packets: the search for a packet
+ * looks at the NUM_BANKS packets from it on, as held by the ringbuffer
+ * after the last of them is added. Each search belongs to the chunk
+ * which owns the packet that completes its window, so no detection is
+ * found twice. */
+
+#include "ubertooth.h"
+#include "ubertooth_callback.h"
+#include "ubertooth_parallel.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAR_LEAD (NUM_BANKS - 1)
+
+typedef struct par_chunk {
+	/* the first lead packets are the end of the previous chunk */
+	usb_pkt_rx pkts[PAR_LEAD + PAR_CHUNK_PACKETS];
+	uint32_t systime[PAR_LEAD + PAR_CHUNK_PACKETS];
+	uint64_t time_ns[PAR_LEAD + PAR_CHUNK_PACKETS];
+	uint32_t lead;
+	uint32_t count;
+
+	/* one per owned packet */
+	ac_result results[PAR_CHUNK_PACKETS];
+	int done;
+
+	struct par_chunk* next;
+} par_chunk;
+
+/* Where packets come from: a dump file or an indexed capture */
+typedef struct {
+	replay_file* rf;
+	const uint8_t* records;
+	int avail;
+
+	capfile_reader* cf;
+	const capfile_query* q;
+	uint32_t block;
+	const uint8_t* rec;
+	uint32_t left;
+
+	/* a block could not be read */
+	int error;
+} par_source;
+
+typedef struct {
+	pthread_mutex_t lock;
+	/* workers wait on work, the decoding thread on done */
+	pthread_cond_t work;
+	pthread_cond_t done;
+	par_chunk* queue_head;
+	par_chunk* queue_tail;
+	int stop;
+
+	/* the search cb_rx() would do */
+	uint32_t lap;
+	int max_ac_errors;
+	const ac_watchlist_t* watchlist;
+
+	pthread_t threads[PAR_MAX_THREADS];
+	int num_threads;
+} par_decoder;
+
+static void search_chunk(par_decoder* d, ubertooth_t* ut, par_chunk* c)
+{
+	usb_pkt_rx* rx;
+	ac_result* r;
+	uint32_t i;
+
+	/* as fresh as the decoding thread's at the start of the capture */
+	memset(ut->packets, 0, sizeof(ringbuffer_t));
+
+	for (i = 0; i < c->lead + c->count; i++) {
+		ringbuffer_add(ut->packets, &c->pkts[i]);
+		if (i < c->lead)
+			continue;
+
+		r = &c->results[i - c->lead];
+		r->offset = -1;
+		r->pkt = NULL;
+
+		/* cb_rx() does not search these */
+		rx = ringbuffer_bottom_usb(ut->packets);
+		if ((rx->status & DISCARD) || rx->channel > (NUM_BREDR_CHANNELS-1))
+			continue;
+
+		if (d->watchlist)
+			r->offset = ubertooth_find_ac_watchlist(ut, d->watchlist, 0,
+			                                        BANK_LEN, &r->pkt);
+		else
+			r->offset = ubertooth_find_ac(ut, 0, BANK_LEN, d->lap,
+			                              d->max_ac_errors, &r->pkt);
+		if (r->offset < 0 && r->pkt != NULL) {
+			btbb_packet_unref(r->pkt);
+			r->pkt = NULL;
+		}
+	}
+}
+
+static void* par_worker(void* arg)
+{
+	par_decoder* d = (par_decoder*)arg;
+	ubertooth_t ut;
+	par_chunk* c;
+
+	/* only what the search uses, the signal gate is applied later in
+	 * order, it depends on the noise floor so far */
+	memset(&ut, 0, sizeof(ut));
+	ut.packets = ringbuffer_init();
+	if (ut.packets == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	while (1) {
+		while (d->queue_head == NULL && !d->stop)
+			pthread_cond_wait(&d->work, &d->lock);
+		if (d->queue_head == NULL)
+			break;
+		c = d->queue_head;
+		d->queue_head = c->next;
+		if (d->queue_head == NULL)
+			d->queue_tail = NULL;
+		pthread_mutex_unlock(&d->lock);
+
+		search_chunk(d, &ut, c);
+
+		pthread_mutex_lock(&d->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&d->done);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	ac_search_free(ut.ac_search);
+	free(ut.packets);
+	return NULL;
+}
+
+static void submit_chunk(par_decoder* d, par_chunk* c)
+{
+	pthread_mutex_lock(&d->lock);
+	c->done = 0;
+	c->next = NULL;
+	if (d->queue_tail)
+		d->queue_tail->next = c;
+	else
+		d->queue_head = c;
+	d->queue_tail = c;
+	pthread_cond_signal(&d->work);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void wait_chunk(par_decoder* d, par_chunk* c)
+{
+	pthread_mutex_lock(&d->lock);
+	while (!c->done)
+		pthread_cond_wait(&d->done, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Returns 1 for a packet, 0 at the end and -1 if the capture can not
+ * be read */
+static int source_next(par_source* s, usb_pkt_rx* pkt, uint32_t* systime,
+                       uint64_t* time_ns)
+{
+	const uint8_t* rec;
+
+	if (s->rf != NULL) {
+		if (s->avail == 0) {
+			s->avail = replay_next(s->rf, &s->records, REPLAY_BATCH);
+			if (s->avail == 0)
+				return 0;
+		}
+		*systime = replay_systime(s->records);
+		*time_ns = 0;
+		memcpy(pkt, replay_packet(s->records), PKT_LEN);
+		s->records += REPLAY_RECORD_LEN;
+		s->avail--;
+		return 1;
+	}
+
+	while (1) {
+		while (s->left == 0) {
+			if (s->block == s->cf->num_blocks)
+				return 0;
+			if (capfile_block_matches(&s->cf->index[s->block], s->q)) {
+				s->rec = capfile_read_block(s->cf, s->block);
+				if (s->rec == NULL)
+					return -1;
+				s->left = s->cf->index[s->block].count;
+			}
+			s->block++;
+		}
+
+		rec = s->rec;
+		s->rec += CAPFILE_RECORD_LEN;
+		s->left--;
+		if (capfile_record_matches(rec, s->q)) {
+			*time_ns = capfile_record_time(rec);
+			*systime = (uint32_t)(*time_ns / 1000000000ull);
+			memcpy(pkt, capfile_record_packet(rec), PKT_LEN);
+			return 1;
+		}
+	}
+}
+
+/* Next chunk, starting with the tail of the one before, which may be
+ * c itself. Returns the number of packets it owns, s->error is set if
+ * the source failed. */
+static uint32_t fill_chunk(par_source* s, par_chunk* c, par_chunk* prev)
+{
+	uint32_t i, n, total;
+	int r;
+
+	c->lead = 0;
+	if (prev != NULL) {
+		total = prev->lead + prev->count;
+		c->lead = MIN(total, PAR_LEAD);
+		i = total - c->lead;
+		memmove(c->pkts, &prev->pkts[i], c->lead * sizeof(usb_pkt_rx));
+		memmove(c->systime, &prev->systime[i], c->lead * sizeof(uint32_t));
+		memmove(c->time_ns, &prev->time_ns[i], c->lead * sizeof(uint64_t));
+	}
+
+	for (n = 0; n < PAR_CHUNK_PACKETS; n++) {
+		i = c->lead + n;
+		r = source_next(s, &c->pkts[i], &c->systime[i], &c->time_ns[i]);
+		if (r < 0)
+			s->error = 1;
+		if (r <= 0)
+			break;
+	}
+	c->count = n;
+	return n;
+}
+
+/* What cb_rx() does after each packet added, with the search done.
+ * Once stopped the packets the search found are only released. */
+static void decode_chunk(ubertooth_t* ut, par_chunk* c, btbb_piconet* pn,
+                         int host_time)
+{
+	ac_result* r;
+	uint32_t i, p;
+
+	for (i = 0; i < c->count; i++) {
+		p = c->lead + i;
+		r = &c->results[i];
+
+		if (!ut->stop_ubertooth) {
+			ut->systime = c->systime[p];
+			if (host_time)
+				ut->rx_host_ns = c->time_ns[p];
+			ringbuffer_add(ut->packets, &c->pkts[p]);
+
+			ut->ac_result = r;
+			cb_rx(ut, pn);
+			ut->ac_result = NULL;
+		}
+
+		/* not taken by cb_rx() */
+		if (r->pkt != NULL) {
+			btbb_packet_unref(r->pkt);
+			r->pkt = NULL;
+		}
+	}
+}
+
+static int decode_parallel(ubertooth_t* ut, par_source* s, btbb_piconet* pn,
+                           int threads, int host_time)
+{
+	par_decoder d;
+	par_chunk** chunks;
+	par_chunk* prev = NULL;
+	int num_chunks, head = 0, filled = 0, i, r = 0;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > PAR_MAX_THREADS)
+		threads = PAR_MAX_THREADS;
+	/* enough queued that no worker waits on the decoding thread */
+	num_chunks = 2 * threads;
+
+	memset(&d, 0, sizeof(d));
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.work, NULL);
+	pthread_cond_init(&d.done, NULL);
+	d.watchlist = ut->watchlist;
+	d.max_ac_errors = ut->max_ac_errors;
+	d.lap = LAP_ANY;
+	if (pn && btbb_piconet_get_flag(pn, BTBB_LAP_VALID))
+		d.lap = btbb_piconet_get_lap(pn);
+
+	chunks = (par_chunk**)calloc(num_chunks, sizeof(par_chunk*));
+	if (chunks == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	for (i = 0; i < num_chunks; i++) {
+		chunks[i] = (par_chunk*)malloc(sizeof(par_chunk));
+		if (chunks[i] == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			r = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&d.threads[i], NULL, par_worker, &d) != 0) {
+			fprintf(stderr, "Unable to start decoding thread\n");
+			r = -1;
+			break;
+		}
+		d.num_threads++;
+	}
+	if (d.num_threads == 0)
+		goto out;
+
+	/* keep every chunk busy, decode them in order as they finish */
+	while (filled < num_chunks && !ut->stop_ubertooth && !s->error &&
+	       fill_chunk(s, chunks[filled], prev) > 0) {
+		prev = chunks[filled];
+		submit_chunk(&d, chunks[filled++]);
+	}
+	while (filled > 0) {
+		wait_chunk(&d, chunks[head]);
+		decode_chunk(ut, chunks[head], pn, host_time);
+		filled--;
+
+		/* the chunks still queued are drained once stopped */
+		if (prev != NULL && !ut->stop_ubertooth && !s->error &&
+		    fill_chunk(s, chunks[head], prev) > 0) {
+			prev = chunks[head];
+			submit_chunk(&d, chunks[head]);
+			filled++;
+		} else {
+			prev = NULL;
+		}
+		head = (head + 1) % num_chunks;
+	}
+
+	pthread_mutex_lock(&d.lock);
+	d.stop = 1;
+	pthread_cond_broadcast(&d.work);
+	pthread_mutex_unlock(&d.lock);
+	for (i = 0; i < d.num_threads; i++)
+		pthread_join(d.threads[i], NULL);
+	if (s->error)
+		r = -1;
+
+out:
+	for (i = 0; i < num_chunks; i++)
+		free(chunks[i]);
+	free(chunks);
+	pthread_mutex_destroy(&d.lock);
+	pthread_cond_destroy(&d.work);
+	pthread_cond_destroy(&d.done);
+	return r;
+}
+
+/* rx_file() on threads cores, fp as for stream_rx_file() */
+int rx_file_parallel(ubertooth_t* ut, FILE* fp, btbb_piconet* pn, int threads)
+{
+	par_source s;
+	int r;
+
+	memset(&s, 0, sizeof(s));
+	s.rf = replay_open(fp);
+	if (s.rf == NULL)
+		return -1;
+
+	ut->rx_host_ns = 0;
+	ut->infile = fp;
+	r = decode_parallel(ut, &s, pn, threads, 0);
+
+	replay_close(s.rf);
+	return r;
+}
+
+/* As stream_rx_capfile() with cb_rx(), on threads cores */
+int rx_capfile_parallel(ubertooth_t* ut, capfile_reader* cf,
+                        const capfile_query* q, btbb_piconet* pn, int threads)
+{
+	capfile_query all;
+	par_source s;
+
+	if (q == NULL) {
+		capfile_query_init(&all);
+		q = &all;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.cf = cf;
+	s.q = q;
+
+	ut->rx_host_ns = 0;
+	ut->infile = cf->fp;
+	/* record times are since the epoch, as in stream_rx_capfile() */
+	if (cf->meta.flags & CAPFILE_HOST_TIME)
+		clock_sync_set_epoch(&ut->clock);
+	return decode_parallel(ut, &s, pn, threads,
+	                       (cf->meta.flags & CAPFILE_HOST_TIME) != 0);
+}
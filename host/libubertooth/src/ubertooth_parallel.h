@@ -0,0 +1,37 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_PARALLEL_H__
+#define __UBERTOOTH_PARALLEL_H__
+
+#include "ubertooth_control.h"
+#include <btbb.h>
+
+/* Packets each worker searches at a time */
+#define PAR_CHUNK_PACKETS 16384
+#define PAR_MAX_THREADS   64
+
+/* Access code search of the bottom bank, done ahead of cb_rx() by a
+ * worker thread. offset is -1 if nothing was found. */
+typedef struct {
+	int offset;
+	btbb_packet* pkt;
+} ac_result;
+
+#endif /* __UBERTOOTH_PARALLEL_H__ */
@@ -0,0 +1,369 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_pcap.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void write_record(pcap_writer_t* w, const pcap_record* r)
+{
+	int i;
+
+	for (i = 0; i < w->num_outputs; i++) {
+		switch (w->output_type[i]) {
+		case PCAP_BREDR:
+			if (!r->le)
+				btbb_pcap_append_packet((btbb_pcap_handle*)w->output[i],
+				                        r->ns, r->signal, r->noise,
+				                        r->lap, r->uap, (btbb_packet*)r->pkt);
+			break;
+		case PCAPNG_BREDR:
+			if (!r->le)
+				btbb_pcapng_append_packet((btbb_pcapng_handle*)w->output[i],
+				                          r->ns, r->signal, r->noise,
+				                          r->lap, r->uap, (btbb_packet*)r->pkt);
+			break;
+		case PCAP_LE:
+			if (r->le)
+				lell_pcap_append_packet((lell_pcap_handle*)w->output[i],
+				                        r->ns, r->signal, r->noise,
+				                        r->lap, (lell_packet*)r->pkt);
+			break;
+		case PCAP_LE_PPI:
+			if (r->le)
+				lell_pcap_append_ppi_packet((lell_pcap_handle*)w->output[i],
+				                            r->ns, r->clkn_high,
+				                            r->rssi_min, r->rssi_max,
+				                            r->rssi_avg, r->rssi_count,
+				                            (lell_packet*)r->pkt);
+			break;
+		case PCAPNG_LE:
+			if (r->le)
+				lell_pcapng_append_packet((lell_pcapng_handle*)w->output[i],
+				                          r->ns, r->signal, r->noise,
+				                          r->lap, (lell_packet*)r->pkt);
+			break;
+		}
+	}
+}
+
+static void release_record(pcap_record* r)
+{
+	if (r->le)
+		lell_packet_unref((lell_packet*)r->pkt);
+	else
+		btbb_packet_unref((btbb_packet*)r->pkt);
+	r->pkt = NULL;
+}
+
+/* Give up the references of the records the writer thread is done
+ * with, only on the thread which queues them. Called with lock held. */
+static void release_done(pcap_writer_t* w)
+{
+	while (w->done > 0) {
+		release_record(&w->queue[w->head]);
+		w->head = (w->head + 1) % w->size;
+		w->count--;
+		w->done--;
+	}
+}
+
+static void* writer_thread(void* arg)
+{
+	pcap_writer_t* w = (pcap_writer_t*)arg;
+	pcap_record* r;
+	uint64_t latency_total, latency_max, latency;
+	uint32_t i, n, first;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (w->pending == 0 && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->pending == 0)
+			break;
+
+		/* these slots are left alone until they are done */
+		n = w->pending < PCAP_WRITER_BATCH ? w->pending : PCAP_WRITER_BATCH;
+		first = w->next;
+		w->pending -= n;
+
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_mutex_lock(&w->io_lock);
+		latency_total = latency_max = 0;
+		for (i = 0; i < n; i++) {
+			r = &w->queue[(first + i) % w->size];
+			write_record(w, r);
+			latency = ubertooth_monotonic_ns() - r->queued_ns;
+			latency_total += latency;
+			if (latency > latency_max)
+				latency_max = latency;
+		}
+		pthread_mutex_unlock(&w->io_lock);
+
+		pthread_mutex_lock(&w->lock);
+		w->next = (first + n) % w->size;
+		w->done += n;
+		w->written += n;
+		w->batches++;
+		w->latency_total_ns += latency_total;
+		if (latency_max > w->latency_max_ns)
+			w->latency_max_ns = latency_max;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+pcap_writer_t* pcap_writer_new(uint32_t queue_size)
+{
+	int r;
+	sigset_t all, old;
+	pcap_writer_t* w = (pcap_writer_t*)calloc(1, sizeof(pcap_writer_t));
+	if (w == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	w->size = queue_size ? queue_size : DEFAULT_PCAP_QUEUE_SIZE;
+	w->queue = (pcap_record*)calloc(w->size, sizeof(pcap_record));
+	if (w->queue == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(w);
+		return NULL;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_mutex_init(&w->io_lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	/* signals are handled on the receiving thread, not while the
+	 * writer holds w->lock */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&w->thread, NULL, writer_thread, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r != 0) {
+		fprintf(stderr, "Unable to start capture file writer thread\n");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->io_lock);
+		pthread_mutex_destroy(&w->lock);
+		free(w->queue);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void pcap_writer_close(pcap_writer_t* w)
+{
+	int i;
+
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	/* everything has been written */
+	release_done(w);
+	pcap_writer_print_stats(w, stderr);
+
+	for (i = 0; i < w->num_outputs; i++) {
+		switch (w->output_type[i]) {
+		case PCAP_BREDR:
+			btbb_pcap_close((btbb_pcap_handle*)w->output[i]);
+			break;
+		case PCAPNG_BREDR:
+			btbb_pcapng_close((btbb_pcapng_handle*)w->output[i]);
+			break;
+		case PCAP_LE:
+		case PCAP_LE_PPI:
+			lell_pcap_close((lell_pcap_handle*)w->output[i]);
+			break;
+		case PCAPNG_LE:
+			lell_pcapng_close((lell_pcapng_handle*)w->output[i]);
+			break;
+		}
+	}
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->io_lock);
+	pthread_mutex_destroy(&w->lock);
+	free(w->queue);
+	free(w);
+}
+
+int pcap_writer_add_output(pcap_writer_t* w, int type, void* handle)
+{
+	pthread_mutex_lock(&w->io_lock);
+	if (w->num_outputs == PCAP_WRITER_MAX_OUTPUTS) {
+		pthread_mutex_unlock(&w->io_lock);
+		fprintf(stderr, "Too many capture files\n");
+		return -1;
+	}
+	w->output_type[w->num_outputs] = type;
+	w->output[w->num_outputs] = handle;
+	w->num_outputs++;
+	pthread_mutex_unlock(&w->io_lock);
+
+	return 0;
+}
+
+int pcap_writer_open(pcap_writer_t** w, int type, const char* filename)
+{
+	void* handle = NULL;
+	int r = -1;
+
+	if (*w == NULL) {
+		*w = pcap_writer_new(0);
+		if (*w == NULL)
+			return -1;
+	}
+
+	switch (type) {
+	case PCAP_BREDR:
+		r = btbb_pcap_create_file(filename, (btbb_pcap_handle**)&handle);
+		break;
+	case PCAPNG_BREDR:
+		r = btbb_pcapng_create_file(filename, "Ubertooth",
+		                            (btbb_pcapng_handle**)&handle);
+		break;
+	case PCAP_LE:
+		r = lell_pcap_create_file(filename, (lell_pcap_handle**)&handle);
+		break;
+	case PCAP_LE_PPI:
+		r = lell_pcap_ppi_create_file(filename, 0, (lell_pcap_handle**)&handle);
+		break;
+	case PCAPNG_LE:
+		r = lell_pcapng_create_file(filename, "Ubertooth",
+		                            (lell_pcapng_handle**)&handle);
+		break;
+	}
+	if (r != 0 || handle == NULL) {
+		fprintf(stderr, "Unable to create capture file %s\n", filename);
+		return -1;
+	}
+
+	return pcap_writer_add_output(*w, type, handle);
+}
+
+void pcap_writer_record_bdaddr(pcap_writer_t* w, uint64_t bdaddr,
+                               uint8_t uap_mask, uint8_t nap_valid)
+{
+	int i;
+
+	pthread_mutex_lock(&w->io_lock);
+	for (i = 0; i < w->num_outputs; i++) {
+		if (w->output_type[i] == PCAPNG_BREDR)
+			btbb_pcapng_record_bdaddr((btbb_pcapng_handle*)w->output[i],
+			                          bdaddr, uap_mask, nap_valid);
+	}
+	pthread_mutex_unlock(&w->io_lock);
+}
+
+static void enqueue(pcap_writer_t* w, pcap_record* r)
+{
+	uint32_t tail;
+
+	r->queued_ns = ubertooth_monotonic_ns();
+
+	pthread_mutex_lock(&w->lock);
+	release_done(w);
+	if (w->count == w->size) {
+		/* never make the caller wait for the disk */
+		w->dropped++;
+		pthread_mutex_unlock(&w->lock);
+		release_record(r);
+		return;
+	}
+
+	tail = (w->head + w->count) % w->size;
+	w->queue[tail] = *r;
+	w->count++;
+	w->pending++;
+	w->queued++;
+	if (w->count > w->high_water)
+		w->high_water = w->count;
+	/* the writer thread only sleeps with nothing pending */
+	if (w->pending == 1)
+		pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void pcap_writer_append_bredr(pcap_writer_t* w, uint64_t ns,
+                              int8_t signal, int8_t noise,
+                              uint32_t lap, uint8_t uap, btbb_packet* pkt)
+{
+	pcap_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.le = 0;
+	r.ns = ns;
+	r.signal = signal;
+	r.noise = noise;
+	r.lap = lap;
+	r.uap = uap;
+	r.pkt = pkt;
+	enqueue(w, &r);
+}
+
+void pcap_writer_append_le(pcap_writer_t* w, uint64_t ns,
+                           int8_t signal, int8_t noise, uint32_t ref_aa,
+                           const usb_pkt_rx* rx, lell_packet* pkt)
+{
+	pcap_record r;
+
+	memset(&r, 0, sizeof(r));
+	r.le = 1;
+	r.ns = ns;
+	r.signal = signal;
+	r.noise = noise;
+	r.lap = ref_aa;
+	r.clkn_high = rx->clkn_high;
+	r.rssi_min = rx->rssi_min;
+	r.rssi_max = rx->rssi_max;
+	r.rssi_avg = rx->rssi_avg;
+	r.rssi_count = rx->rssi_count;
+	r.pkt = pkt;
+	enqueue(w, &r);
+}
+
+void pcap_writer_print_stats(pcap_writer_t* w, FILE* fileptr)
+{
+	pthread_mutex_lock(&w->lock);
+	fprintf(fileptr, "Capture file writer: %llu written, %llu dropped, "
+	        "queue %u/%u (high water %u), ",
+	        (unsigned long long)w->written, (unsigned long long)w->dropped,
+	        w->count, w->size, w->high_water);
+	if (w->written > 0)
+		fprintf(fileptr, "latency avg %.3f ms max %.3f ms, %.1f packets/batch\n",
+		        w->latency_total_ns / (double)w->written / 1e6,
+		        w->latency_max_ns / 1e6,
+		        w->written / (double)w->batches);
+	else
+		fprintf(fileptr, "no packets written\n");
+	pthread_mutex_unlock(&w->lock);
+}
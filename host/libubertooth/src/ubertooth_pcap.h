@@ -0,0 +1,120 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_PCAP_H__
+#define __UBERTOOTH_PCAP_H__
+
+#include "ubertooth_control.h"
+#include <btbb.h>
+#include <pthread.h>
+
+#define PCAP_WRITER_MAX_OUTPUTS  8
+#define DEFAULT_PCAP_QUEUE_SIZE  4096
+/* Most records written per pass of the writer thread */
+#define PCAP_WRITER_BATCH        256
+
+enum pcap_output_types {
+	PCAP_BREDR   = 0,   /* btbb_pcap_handle */
+	PCAPNG_BREDR = 1,   /* btbb_pcapng_handle */
+	PCAP_LE      = 2,   /* lell_pcap_handle */
+	PCAP_LE_PPI  = 3,   /* lell_pcap_handle opened with DLT_PPI */
+	PCAPNG_LE    = 4    /* lell_pcapng_handle */
+};
+
+typedef struct {
+	uint8_t le;
+	uint64_t ns;
+	int8_t signal;
+	int8_t noise;
+	/* LAP for BR/EDR, reference access address for LE */
+	uint32_t lap;
+	uint8_t uap;
+	/* PPI fields, LE only */
+	uint8_t clkn_high;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	int8_t rssi_avg;
+	uint8_t rssi_count;
+	/* btbb_packet* or lell_packet* */
+	void* pkt;
+	uint64_t queued_ns;
+} pcap_record;
+
+/* Writes capture files on a thread of its own, so a slow disk never
+ * holds up USB. Records go to every output of a matching type. When
+ * the queue is full new records are dropped.
+ *
+ * libbtbb and liblell reference counts are not thread safe, so records
+ * stay in the queue once written until the caller's thread releases
+ * them: from head there are done written records, then the ones being
+ * written, then pending ones starting at next. */
+typedef struct {
+	int num_outputs;
+	int output_type[PCAP_WRITER_MAX_OUTPUTS];
+	void* output[PCAP_WRITER_MAX_OUTPUTS];
+
+	pcap_record* queue;
+	uint32_t size;
+	uint32_t head;
+	uint32_t count;
+	uint32_t done;
+	uint32_t next;
+	uint32_t pending;
+
+	/* lock guards the queue and statistics, io_lock the outputs */
+	pthread_mutex_t lock;
+	pthread_mutex_t io_lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	uint8_t stop;
+
+	/* statistics */
+	uint64_t queued;
+	uint64_t written;
+	uint64_t dropped;
+	uint64_t batches;
+	uint32_t high_water;
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+} pcap_writer_t;
+
+pcap_writer_t* pcap_writer_new(uint32_t queue_size);
+/* Write out everything queued, print the statistics and close all
+ * outputs */
+void pcap_writer_close(pcap_writer_t* w);
+
+/* Create a file of the given type and add it as an output, creating
+ * the writer first if *w is NULL */
+int pcap_writer_open(pcap_writer_t** w, int type, const char* filename);
+int pcap_writer_add_output(pcap_writer_t* w, int type, void* handle);
+void pcap_writer_record_bdaddr(pcap_writer_t* w, uint64_t bdaddr,
+                               uint8_t uap_mask, uint8_t nap_valid);
+
+/* The writer takes over the caller's reference to pkt, which is given
+ * up on the caller's thread */
+void pcap_writer_append_bredr(pcap_writer_t* w, uint64_t ns,
+                              int8_t signal, int8_t noise,
+                              uint32_t lap, uint8_t uap, btbb_packet* pkt);
+void pcap_writer_append_le(pcap_writer_t* w, uint64_t ns,
+                           int8_t signal, int8_t noise, uint32_t ref_aa,
+                           const usb_pkt_rx* rx, lell_packet* pkt);
+
+void pcap_writer_print_stats(pcap_writer_t* w, FILE* fileptr);
+
+#endif /* __UBERTOOTH_PCAP_H__ */
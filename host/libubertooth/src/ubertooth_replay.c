@@ -0,0 +1,165 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_replay.h"
+#include "ubertooth_interface.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int replay_map(replay_file* rf)
+{
+	struct stat st;
+	off_t pos;
+	size_t tail;
+	void* map;
+
+	if (fstat(fileno(rf->fp), &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+	/* whatever the caller has already read stays read */
+	pos = ftello(rf->fp);
+	if (pos < 0 || pos >= st.st_size)
+		return -1;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(rf->fp), 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	rf->map = (uint8_t*)map;
+	rf->map_len = st.st_size;
+	rf->offset = pos;
+	rf->end = st.st_size;
+
+	tail = (rf->end - rf->offset) % REPLAY_RECORD_LEN;
+	if (tail) {
+		fprintf(stderr, "Dump file ends with a partial record, ignoring the last %zu bytes\n",
+		        tail);
+		rf->end -= tail;
+	}
+	return 0;
+}
+
+replay_file* replay_open(FILE* fp)
+{
+	replay_file* rf = (replay_file*)calloc(1, sizeof(replay_file));
+	if (rf == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	rf->fp = fp;
+
+	if (replay_map(rf) == 0)
+		return rf;
+
+	rf->buf = (uint8_t*)malloc(REPLAY_BATCH * REPLAY_RECORD_LEN);
+	if (rf->buf == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(rf);
+		return NULL;
+	}
+	return rf;
+}
+
+void replay_close(replay_file* rf)
+{
+	if (rf == NULL)
+		return;
+
+	if (rf->map != NULL) {
+		munmap(rf->map, rf->map_len);
+		/* leave the stream where replay stopped */
+		fseeko(rf->fp, rf->offset, SEEK_SET);
+	}
+	if (rf->invalid)
+		fprintf(stderr, "Skipped %llu records that are not Ubertooth packets\n",
+		        (unsigned long long)rf->invalid);
+	free(rf->buf);
+	free(rf);
+}
+
+static int record_valid(const uint8_t* record)
+{
+	return replay_packet(record)->pkt_type <= EGO_PACKET;
+}
+
+/* Give back mapped pages that have been read, they are only faulted in
+ * again if a caller goes back to them */
+static void replay_discard(replay_file* rf)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t upto;
+
+	if (rf->offset - rf->discarded < REPLAY_DISCARD)
+		return;
+	upto = rf->offset & ~(page - 1);
+	madvise(rf->map + rf->discarded, upto - rf->discarded, MADV_DONTNEED);
+	rf->discarded = upto;
+}
+
+static uint8_t* replay_fill(replay_file* rf)
+{
+	size_t len;
+
+	if (rf->map != NULL) {
+		replay_discard(rf);
+		return rf->map;
+	}
+
+	if (rf->offset < rf->end)
+		return rf->buf;
+	/* fread() only comes back short at the end of the stream, which is
+	 * where a partial record can be */
+	len = fread(rf->buf, 1, REPLAY_BATCH * REPLAY_RECORD_LEN, rf->fp);
+	rf->offset = 0;
+	rf->end = len - len % REPLAY_RECORD_LEN;
+	if (rf->end < len)
+		fprintf(stderr, "Dump file ends with a partial record, ignoring the last %zu bytes\n",
+		        len - rf->end);
+	return rf->buf;
+}
+
+int replay_next(replay_file* rf, const uint8_t** records, int max)
+{
+	uint8_t* data;
+	int n;
+
+	while (1) {
+		data = replay_fill(rf);
+		if (rf->offset == rf->end)
+			return 0;
+
+		/* a run stops short of the first record that fails to
+		 * validate, which is then skipped */
+		for (n = 0; n < max && rf->offset + n * REPLAY_RECORD_LEN < rf->end; n++)
+			if (!record_valid(data + rf->offset + n * REPLAY_RECORD_LEN))
+				break;
+		if (n > 0)
+			break;
+		rf->offset += REPLAY_RECORD_LEN;
+		rf->invalid++;
+	}
+
+	*records = data + rf->offset;
+	rf->offset += n * REPLAY_RECORD_LEN;
+	rf->records += n;
+	return n;
+}
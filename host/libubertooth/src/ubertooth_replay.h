@@ -0,0 +1,75 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_REPLAY_H__
+#define __UBERTOOTH_REPLAY_H__
+
+#include "ubertooth_control.h"
+#include <stdio.h>
+
+/* ubertooth-dump -f / -d records: a big endian systime followed by the
+ * USB packet */
+#define REPLAY_SYSTIME_LEN 4
+#define REPLAY_RECORD_LEN  (REPLAY_SYSTIME_LEN + PKT_LEN)
+
+/* Records handed out per replay_next() call */
+#define REPLAY_BATCH 256
+
+/* Mapped pages already read are dropped every REPLAY_DISCARD bytes, so
+ * replaying a large dump does not leave it all resident */
+#define REPLAY_DISCARD (64 * 1024 * 1024)
+
+typedef struct {
+	FILE* fp;
+
+	/* the whole file when mapped, NULL when read with fread */
+	uint8_t* map;
+	size_t map_len;
+	size_t offset;
+	size_t end;
+	size_t discarded;
+
+	/* fread fallback for pipes and the like */
+	uint8_t* buf;
+
+	uint64_t records;
+	uint64_t invalid;
+} replay_file;
+
+replay_file* replay_open(FILE* fp);
+void replay_close(replay_file* rf);
+
+/* Next run of up to max consecutive records, REPLAY_RECORD_LEN apart.
+ * They stay valid until the following call. Records with an unknown
+ * packet type are skipped. Returns the number of records, 0 at the end
+ * of the file. */
+int replay_next(replay_file* rf, const uint8_t** records, int max);
+
+static inline uint32_t replay_systime(const uint8_t* record)
+{
+	return ((uint32_t)record[0] << 24) | ((uint32_t)record[1] << 16)
+	       | ((uint32_t)record[2] << 8) | record[3];
+}
+
+static inline const usb_pkt_rx* replay_packet(const uint8_t* record)
+{
+	return (const usb_pkt_rx*)(record + REPLAY_SYSTIME_LEN);
+}
+
+#endif /* __UBERTOOTH_REPLAY_H__ */
@@ -23,11 +23,132 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 
-static void unpack_symbols(const uint8_t* buf, char* unpacked)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPACK_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/* unpack_table[b] holds the 8 unpacked symbols of b, MSB first, in
+ * memory order on a little endian host */
+#define UNPACK_BIT(b, j) ((uint64_t)(((b) >> (7 - (j))) & 1) << (8 * (j)))
+#define UNPACK_ENTRY(b) (UNPACK_BIT(b, 0) | UNPACK_BIT(b, 1) | \
+                         UNPACK_BIT(b, 2) | UNPACK_BIT(b, 3) | \
+                         UNPACK_BIT(b, 4) | UNPACK_BIT(b, 5) | \
+                         UNPACK_BIT(b, 6) | UNPACK_BIT(b, 7))
+#define UNPACK_4(b)  UNPACK_ENTRY(b), UNPACK_ENTRY((b) + 1), \
+                     UNPACK_ENTRY((b) + 2), UNPACK_ENTRY((b) + 3)
+#define UNPACK_16(b) UNPACK_4(b), UNPACK_4((b) + 4), \
+                     UNPACK_4((b) + 8), UNPACK_4((b) + 12)
+#define UNPACK_64(b) UNPACK_16(b), UNPACK_16((b) + 16), \
+                     UNPACK_16((b) + 32), UNPACK_16((b) + 48)
+
+static const uint64_t unpack_table[256] = {
+	UNPACK_64(0), UNPACK_64(64), UNPACK_64(128), UNPACK_64(192)
+};
+
+static void unpack_bytes_table(const uint8_t* buf, char* unpacked, int len)
 {
-	int i, j;
+	int i;
+
+	for (i = 0; i < len; i++)
+		memcpy(unpacked + i * 8, &unpack_table[buf[i]], 8);
+}
+
+static void unpack_symbols_table(const uint8_t* buf, char* unpacked)
+{
+	unpack_bytes_table(buf, unpacked, SYM_LEN);
+}
+
+#ifdef UNPACK_X86
+/* 8 bytes in, 64 symbols out per iteration: replicate each byte eight
+ * times, then test one bit per lane */
+__attribute__((target("sse2")))
+static void unpack_symbols_sse2(const uint8_t* buf, char* unpacked)
+{
+	int i, k;
+	const __m128i bits = _mm_set_epi8(0x01, 0x02, 0x04, 0x08,
+	                                  0x10, 0x20, 0x40, (char)0x80,
+	                                  0x01, 0x02, 0x04, 0x08,
+	                                  0x10, 0x20, 0x40, (char)0x80);
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i v, b8, b16, out[4];
+
+	for (i = 0; i + 8 <= SYM_LEN; i += 8) {
+		v = _mm_loadl_epi64((const __m128i*)(buf + i));
+		b8 = _mm_unpacklo_epi8(v, v);
+		b16 = _mm_unpacklo_epi16(b8, b8);
+		out[0] = _mm_unpacklo_epi32(b16, b16);
+		out[1] = _mm_unpackhi_epi32(b16, b16);
+		b16 = _mm_unpackhi_epi16(b8, b8);
+		out[2] = _mm_unpacklo_epi32(b16, b16);
+		out[3] = _mm_unpackhi_epi32(b16, b16);
+
+		for (k = 0; k < 4; k++) {
+			v = _mm_cmpeq_epi8(_mm_and_si128(out[k], bits), bits);
+			_mm_storeu_si128((__m128i*)(unpacked + i * 8 + k * 16),
+			                 _mm_and_si128(v, one));
+		}
+	}
+	unpack_bytes_table(buf + i, unpacked + i * 8, SYM_LEN - i);
+}
+
+/* 4 bytes in, 32 symbols out per iteration */
+__attribute__((target("avx2")))
+static void unpack_symbols_avx2(const uint8_t* buf, char* unpacked)
+{
+	int i;
+	uint32_t word;
+	const __m256i spread = _mm256_set_epi8(3, 3, 3, 3, 3, 3, 3, 3,
+	                                       2, 2, 2, 2, 2, 2, 2, 2,
+	                                       1, 1, 1, 1, 1, 1, 1, 1,
+	                                       0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+	const __m256i one = _mm256_set1_epi8(1);
+	__m256i v;
 
+	for (i = 0; i + 4 <= SYM_LEN; i += 4) {
+		memcpy(&word, buf + i, 4);
+		v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+		v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+		_mm256_storeu_si256((__m256i*)(unpacked + i * 8),
+		                    _mm256_and_si256(v, one));
+	}
+	unpack_bytes_table(buf + i, unpacked + i * 8, SYM_LEN - i);
+}
+#endif /* UNPACK_X86 */
+
+static void (*unpack_symbols_impl)(const uint8_t*, char*);
+static pthread_once_t unpack_symbols_once = PTHREAD_ONCE_INIT;
+
+/* pick the fastest kernel the CPU supports, once for all threads */
+static void unpack_symbols_resolve(void)
+{
+	void (*impl)(const uint8_t*, char*) = unpack_symbols_table;
+
+#ifdef UNPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = unpack_symbols_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = unpack_symbols_sse2;
+#endif
+	unpack_symbols_impl = impl;
+}
+
+void unpack_symbols(const uint8_t* buf, char* unpacked)
+{
+	pthread_once(&unpack_symbols_once, unpack_symbols_resolve);
+	unpack_symbols_impl(buf, unpacked);
+}
+
+#else /* big endian: the table layout above does not apply */
+
+void unpack_symbols(const uint8_t* buf, char* unpacked)
+{
+	int i, j;
 
 	for (i = 0; i < SYM_LEN; i++) {
 		/* output one byte for each received symbol (0x00 or 0x01) */
@@ -37,9 +158,23 @@ static void unpack_symbols(const uint8_t* buf, char* unpacked)
 	}
 }
 
+#endif
+
+#define BITREV_2(n) (n), (n) + 2*64, (n) + 1*64, (n) + 3*64
+#define BITREV_4(n) BITREV_2(n), BITREV_2((n) + 2*16), \
+                    BITREV_2((n) + 1*16), BITREV_2((n) + 3*16)
+#define BITREV_6(n) BITREV_4(n), BITREV_4((n) + 2*4), \
+                    BITREV_4((n) + 1*4), BITREV_4((n) + 3*4)
+
+static const uint8_t bitrev[256] = {
+	BITREV_6(0), BITREV_6(2), BITREV_6(1), BITREV_6(3)
+};
+
 ringbuffer_t* ringbuffer_init()
 {
-	ringbuffer_t* rb = (ringbuffer_t*)malloc(sizeof(ringbuffer_t));
+	ringbuffer_t* rb = (ringbuffer_t*)calloc(1, sizeof(ringbuffer_t));
+	if (rb == NULL)
+		return NULL;
 
 	rb->current_bank = 0;
 
@@ -48,16 +183,39 @@ ringbuffer_t* ringbuffer_init()
 
 int ringbuffer_add(ringbuffer_t* rb, const usb_pkt_rx* rx)
 {
+	int i;
+	uint8_t* packed;
+
 	rb->current_bank = (rb->current_bank + 1) % NUM_BANKS;
 
 	/* Copy packet (for dump) */
 	memcpy(ringbuffer_top_usb(rb), rx, sizeof(usb_pkt_rx));
 
-	unpack_symbols(ringbuffer_top_usb(rb)->data, ringbuffer_top_bt(rb));
+	packed = rb->packed + rb->current_bank * SYM_LEN;
+	for (i = 0; i < SYM_LEN; i++)
+		packed[i] = bitrev[rx->data[i]];
+	memcpy(packed + NUM_BANKS * SYM_LEN, packed, SYM_LEN);
+
+	rb->bt_valid[rb->current_bank] = 0;
 
 	return 0;
 }
 
+/* Bring every bank of bt up to date. Each bank is unpacked at most
+ * once while it is in the ringbuffer. */
+static void ringbuffer_unpack(ringbuffer_t* rb)
+{
+	int i;
+
+	for (i = 0; i < NUM_BANKS; i++) {
+		if (rb->bt_valid[i])
+			continue;
+		unpack_symbols(rb->usb[i].data, rb->bt[i]);
+		memcpy(rb->bt[i + NUM_BANKS], rb->bt[i], BANK_LEN);
+		rb->bt_valid[i] = 1;
+	}
+}
+
 
 usb_pkt_rx* ringbuffer_get_usb(ringbuffer_t* rb, uint8_t index)
 {
@@ -75,6 +233,7 @@ usb_pkt_rx* ringbuffer_bottom_usb(ringbuffer_t* rb)
 
 char* ringbuffer_get_bt(ringbuffer_t* rb, uint8_t index)
 {
+	ringbuffer_unpack(rb);
 	return rb->bt[(rb->current_bank+1+index) % NUM_BANKS];
 }
 
@@ -87,3 +246,80 @@ char* ringbuffer_bottom_bt(ringbuffer_t* rb)
 {
 	return ringbuffer_get_bt(rb, 0);
 }
+
+/* All NUM_BANKS banks of symbols, oldest first, as one contiguous
+ * array of NUM_BANKS * BANK_LEN symbols */
+char* ringbuffer_bt_window(ringbuffer_t* rb)
+{
+	return ringbuffer_bottom_bt(rb);
+}
+
+/* Packed symbols of a bank and, through the mirror, all newer banks */
+const uint8_t* ringbuffer_get_packed(ringbuffer_t* rb, uint8_t index)
+{
+	return rb->packed + ((rb->current_bank+1+index) % NUM_BANKS) * SYM_LEN;
+}
+
+void usb_pkt_batch_set(usb_pkt_batch* batch, const uint8_t* buf,
+                       int count, int stride, uint64_t host_ns)
+{
+	usb_pkt_batch_set_slots(batch, buf, NULL, count, stride, host_ns);
+}
+
+/* Only the count packets of buf listed in slots */
+void usb_pkt_batch_set_slots(usb_pkt_batch* batch, const uint8_t* buf,
+                             const uint8_t* slots, int count, int stride,
+                             uint64_t host_ns)
+{
+	batch->buf = buf;
+	batch->slots = slots;
+	batch->count = count;
+	batch->stride = stride;
+	batch->host_ns = host_ns;
+
+	if (batch->bt_valid != NULL)
+		memset(batch->bt_valid, 0, MIN(count, batch->bt_size));
+}
+
+const usb_pkt_rx* usb_pkt_batch_get(const usb_pkt_batch* batch, int index)
+{
+	if (batch->slots != NULL)
+		index = batch->slots[index];
+	return (const usb_pkt_rx*)(batch->buf + index * batch->stride);
+}
+
+/* Unpacked symbols of one packet, only computed when asked for */
+const char* usb_pkt_batch_get_bt(usb_pkt_batch* batch, int index)
+{
+	char* bt;
+	uint8_t* bt_valid;
+
+	if (batch->count > batch->bt_size) {
+		bt = (char*)realloc(batch->bt, batch->count * BANK_LEN);
+		if (bt == NULL)
+			return NULL;
+		batch->bt = bt;
+		bt_valid = (uint8_t*)realloc(batch->bt_valid, batch->count);
+		if (bt_valid == NULL)
+			return NULL;
+		batch->bt_valid = bt_valid;
+		memset(batch->bt_valid, 0, batch->count);
+		batch->bt_size = batch->count;
+	}
+
+	bt = batch->bt + index * BANK_LEN;
+	if (!batch->bt_valid[index]) {
+		unpack_symbols(usb_pkt_batch_get(batch, index)->data, bt);
+		batch->bt_valid[index] = 1;
+	}
+	return bt;
+}
+
+void usb_pkt_batch_free(usb_pkt_batch* batch)
+{
+	free(batch->bt);
+	free(batch->bt_valid);
+	batch->bt = NULL;
+	batch->bt_valid = NULL;
+	batch->bt_size = 0;
+}
@@ -27,9 +27,46 @@
 typedef struct {
 	uint8_t current_bank;
 	usb_pkt_rx usb[NUM_BANKS];
-	char bt[NUM_BANKS][BANK_LEN];
+	/* Bank i is mirrored at i + NUM_BANKS, so any NUM_BANKS consecutive
+	 * banks are contiguous in memory, see ringbuffer_bt_window() */
+	char bt[2 * NUM_BANKS][BANK_LEN];
+	/* bt is only unpacked when somebody asks for it */
+	uint8_t bt_valid[NUM_BANKS];
+	/* Symbols of each bank with the bit order of every byte reversed,
+	 * so symbol i is bit i of a little endian load. Mirrored like bt,
+	 * plus room for a trailing 64 bit load. */
+	uint8_t packed[2 * NUM_BANKS * SYM_LEN + 8];
 } ringbuffer_t;
 
+/* A run of packets straight out of a USB transfer buffer. Packet i
+ * starts stride bytes after packet i-1, or if slots is set, is the
+ * slots[i]th of buf, so that packets can be left out without touching
+ * the buffer. */
+typedef struct {
+	const uint8_t* buf;
+	int count;
+	int stride;
+	const uint8_t* slots;
+	/* when the last packet arrived, 0 if not known */
+	uint64_t host_ns;
+
+	/* scratch space for usb_pkt_batch_get_bt() */
+	char* bt;
+	uint8_t* bt_valid;
+	int bt_size;
+} usb_pkt_batch;
+
+void unpack_symbols(const uint8_t* buf, char* unpacked);
+
+void usb_pkt_batch_set(usb_pkt_batch* batch, const uint8_t* buf,
+                       int count, int stride, uint64_t host_ns);
+void usb_pkt_batch_set_slots(usb_pkt_batch* batch, const uint8_t* buf,
+                             const uint8_t* slots, int count, int stride,
+                             uint64_t host_ns);
+const usb_pkt_rx* usb_pkt_batch_get(const usb_pkt_batch* batch, int index);
+const char* usb_pkt_batch_get_bt(usb_pkt_batch* batch, int index);
+void usb_pkt_batch_free(usb_pkt_batch* batch);
+
 ringbuffer_t* ringbuffer_init();
 
 int ringbuffer_add(ringbuffer_t* rb, const usb_pkt_rx* rx);
@@ -40,5 +77,7 @@ usb_pkt_rx* ringbuffer_bottom_usb(ringbuffer_t* rb);
 char* ringbuffer_get_bt(ringbuffer_t* rb, uint8_t index);
 char* ringbuffer_top_bt(ringbuffer_t* rb);
 char* ringbuffer_bottom_bt(ringbuffer_t* rb);
+char* ringbuffer_bt_window(ringbuffer_t* rb);
+const uint8_t* ringbuffer_get_packed(ringbuffer_t* rb, uint8_t index);
 
 #endif /* __UBERTOOTH_RINGBUFFER_H__ */
@@ -0,0 +1,140 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_rssi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+rssi_tracker_t* rssi_tracker_init(int signal_window, int noise_window,
+                                  int noise_percentile)
+{
+	rssi_tracker_t* t = (rssi_tracker_t*)malloc(sizeof(rssi_tracker_t));
+	if (t == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	if (rssi_tracker_configure(t, signal_window, noise_window, noise_percentile) < 0) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void rssi_tracker_free(rssi_tracker_t* t)
+{
+	free(t);
+}
+
+int rssi_tracker_configure(rssi_tracker_t* t, int signal_window, int noise_window,
+                           int noise_percentile)
+{
+	if (signal_window < 1 || signal_window > RSSI_MAX_SIGNAL_WINDOW ||
+	    noise_window < 1 || noise_window > RSSI_MAX_NOISE_WINDOW ||
+	    noise_percentile < 0 || noise_percentile > 100) {
+		fprintf(stderr, "Invalid RSSI window: signal 1-%d, noise 1-%d, percentile 0-100\n",
+		        RSSI_MAX_SIGNAL_WINDOW, RSSI_MAX_NOISE_WINDOW);
+		return -1;
+	}
+
+	memset(t->channels, 0, sizeof(t->channels));
+	t->signal_window = signal_window;
+	t->noise_window = noise_window;
+	t->noise_percentile = noise_percentile;
+	return 0;
+}
+
+static int8_t update_signal(const rssi_tracker_t* t, rssi_channel* c, int8_t v)
+{
+	int tail;
+
+	/* drop the max once it leaves the window, before adding v so that
+	 * at most signal_window values are ever kept */
+	if (c->max_len > 0 &&
+	    c->seq - c->max_seq[c->max_head] >= (uint32_t)t->signal_window) {
+		c->max_head = (c->max_head + 1) % RSSI_MAX_SIGNAL_WINDOW;
+		c->max_len--;
+	}
+
+	/* and values that can never be the max again */
+	while (c->max_len > 0) {
+		tail = (c->max_head + c->max_len - 1) % RSSI_MAX_SIGNAL_WINDOW;
+		if (c->max_val[tail] > v)
+			break;
+		c->max_len--;
+	}
+	tail = (c->max_head + c->max_len) % RSSI_MAX_SIGNAL_WINDOW;
+	c->max_val[tail] = v;
+	c->max_seq[tail] = c->seq;
+	c->max_len++;
+
+	return c->max_val[c->max_head];
+}
+
+static int8_t update_noise(const rssi_tracker_t* t, rssi_channel* c, int8_t v)
+{
+	int old, rank;
+
+	if (c->noise_len == t->noise_window) {
+		old = c->noise[c->noise_next] + 128;
+		c->hist[old]--;
+		if (old < c->q)
+			c->below--;
+	} else {
+		c->noise_len++;
+	}
+	c->noise[c->noise_next] = v;
+	c->noise_next = (c->noise_next + 1) % t->noise_window;
+	c->hist[v + 128]++;
+	if (v + 128 < c->q)
+		c->below++;
+
+	/* move q until rank falls into its bin, a step or two per packet */
+	rank = t->noise_percentile * (c->noise_len - 1) / 100;
+	while (c->below > rank) {
+		c->q--;
+		c->below -= c->hist[c->q];
+	}
+	while (c->below + c->hist[c->q] <= rank) {
+		c->below += c->hist[c->q];
+		c->q++;
+	}
+
+	return (int8_t)(c->q - 128);
+}
+
+void rssi_tracker_update(rssi_tracker_t* t, const usb_pkt_rx* rx,
+                         int8_t* signal, int8_t* noise)
+{
+	rssi_channel* c = &t->channels[rx->channel % RSSI_CHANNELS];
+
+	*signal = update_signal(t, c, (int8_t)rx->rssi_max);
+	*noise = update_noise(t, c, (int8_t)rx->rssi_avg);
+	c->seq++;
+}
+
+int8_t rssi_tracker_noise(const rssi_tracker_t* t, uint8_t channel)
+{
+	const rssi_channel* c = &t->channels[channel % RSSI_CHANNELS];
+
+	if (c->noise_len == 0)
+		return INT8_MIN;
+	return (int8_t)(c->q - 128);
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_RSSI_H__
+#define __UBERTOOTH_RSSI_H__
+
+#include "ubertooth_control.h"
+
+#define RSSI_CHANNELS 79
+
+/* Signal is the largest rssi_max of the last signal_window packets on
+ * a channel, noise the noise_percentile of their rssi_avg over the
+ * last noise_window packets. */
+#define RSSI_MAX_SIGNAL_WINDOW     64
+#define RSSI_MAX_NOISE_WINDOW      1024
+#define DEFAULT_RSSI_NOISE_WINDOW  128
+#define DEFAULT_RSSI_NOISE_PERCENTILE 10
+
+typedef struct {
+	/* packets seen on this channel */
+	uint32_t seq;
+
+	/* running max: decreasing values of the window with the sequence
+	 * number they were seen at, oldest first */
+	int8_t max_val[RSSI_MAX_SIGNAL_WINDOW];
+	uint32_t max_seq[RSSI_MAX_SIGNAL_WINDOW];
+	uint8_t max_head;
+	uint8_t max_len;
+
+	/* noise floor: the window, a histogram of it and the current
+	 * percentile q, with below samples smaller than q */
+	int8_t noise[RSSI_MAX_NOISE_WINDOW];
+	uint16_t noise_len;
+	uint16_t noise_next;
+	uint16_t hist[256];
+	int16_t q;
+	uint16_t below;
+} rssi_channel;
+
+typedef struct {
+	int signal_window;
+	int noise_window;
+	int noise_percentile;
+	rssi_channel channels[RSSI_CHANNELS];
+} rssi_tracker_t;
+
+rssi_tracker_t* rssi_tracker_init(int signal_window, int noise_window,
+                                  int noise_percentile);
+void rssi_tracker_free(rssi_tracker_t* t);
+
+/* Change the windows, this forgets the history */
+int rssi_tracker_configure(rssi_tracker_t* t, int signal_window, int noise_window,
+                           int noise_percentile);
+
+/* Add a packet, and get the signal and noise floor of its channel in
+ * raw CC2400 RSSI units */
+void rssi_tracker_update(rssi_tracker_t* t, const usb_pkt_rx* rx,
+                         int8_t* signal, int8_t* noise);
+
+/* Noise floor of a channel without adding a packet, INT8_MIN when
+ * nothing has been seen on it yet */
+int8_t rssi_tracker_noise(const rssi_tracker_t* t, uint8_t channel);
+
+#endif /* __UBERTOOTH_RSSI_H__ */
@@ -0,0 +1,220 @@
+/*
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Writes the same packets as raw, delta coded and, with zlib, deflated
+ * capture files and checks that every record reads back as it reads
+ * from the raw file. The packets cover the clk100ns wrap, times going
+ * backwards and a partial last block.
+ *
+ * Usage: capfile_roundtrip [directory]
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_capfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_PACKETS (3 * CAPFILE_BLOCK_RECORDS + 123)
+
+static uint32_t test_random(uint32_t* state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/* Packet i and the time it was received */
+static uint64_t test_packet(uint32_t i, uint32_t* state, usb_pkt_rx* rx)
+{
+	int j;
+
+	memset(rx, 0, sizeof(*rx));
+	rx->pkt_type = test_random(state) % (EGO_PACKET + 1);
+	rx->status = test_random(state) & 0x3;
+	rx->channel = test_random(state) % 79;
+	rx->clkn_high = i >> 8;
+	/* 400 us apart, wrapping a third of the way through */
+	rx->clk100ns = (CLK100NS_WRAP - TEST_PACKETS * 4000 / 3 + i * 4000) % CLK100NS_WRAP;
+	rx->rssi_max = test_random(state) % 60 - 90;
+	rx->rssi_min = rx->rssi_max - test_random(state) % 10;
+	rx->rssi_avg = rx->rssi_min + 2;
+	rx->rssi_count = test_random(state);
+	/* runs of symbols compress, noise does not */
+	for (j = 0; j < DMA_SIZE; j++)
+		rx->data[j] = (j & 8) ? test_random(state) : 0x55;
+
+	/* every 50th packet is stamped before the previous one */
+	return 1700000000ull * 1000000000ull + i * 400000ull
+	       - (i % 50 == 0 ? 700000ull : 0);
+}
+
+static int write_capfile(const char* path, uint16_t encoding)
+{
+	capfile_meta meta;
+	capfile_writer* w;
+	usb_pkt_rx rx;
+	uint32_t i, state = 1;
+	uint64_t t;
+
+	capfile_meta_init(&meta);
+	w = capfile_writer_open(path, &meta);
+	if (w == NULL)
+		return -1;
+	if (capfile_writer_set_encoding(w, encoding) < 0) {
+		capfile_writer_close(w);
+		return 1;
+	}
+
+	for (i = 0; i < TEST_PACKETS; i++) {
+		t = test_packet(i, &state, &rx);
+		if (capfile_writer_write(w, t, &rx) < 0) {
+			capfile_writer_close(w);
+			return -1;
+		}
+	}
+	return capfile_writer_close(w) < 0 ? -1 : 0;
+}
+
+/* All records of a capture file, NULL on error */
+static uint8_t* read_capfile(const char* path, uint32_t* count)
+{
+	FILE* fp;
+	capfile_reader* r;
+	const uint8_t* block;
+	uint8_t* records;
+	uint32_t i;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		return NULL;
+	}
+	r = capfile_open(fp);
+	if (r == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	records = (uint8_t*)malloc((size_t)TEST_PACKETS * CAPFILE_RECORD_LEN);
+	*count = 0;
+	for (i = 0; records != NULL && i < r->num_blocks; i++) {
+		block = capfile_read_block(r, i);
+		if (block == NULL || *count + r->index[i].count > TEST_PACKETS) {
+			fprintf(stderr, "%s: unable to read block %u\n", path, i);
+			free(records);
+			records = NULL;
+			break;
+		}
+		memcpy(records + (size_t)*count * CAPFILE_RECORD_LEN, block,
+		       (size_t)r->index[i].count * CAPFILE_RECORD_LEN);
+		*count += r->index[i].count;
+	}
+
+	capfile_close(r);
+	fclose(fp);
+	return records;
+}
+
+/* The raw records must be the packets as written */
+static int check_raw(const uint8_t* records, uint32_t count)
+{
+	usb_pkt_rx rx;
+	uint32_t i, state = 1;
+	uint64_t t;
+
+	if (count != TEST_PACKETS) {
+		fprintf(stderr, "raw: %u records, expected %u\n", count, TEST_PACKETS);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		t = test_packet(i, &state, &rx);
+		if (capfile_record_time(records + (size_t)i * CAPFILE_RECORD_LEN) != t ||
+		    memcmp(capfile_record_packet(records + (size_t)i * CAPFILE_RECORD_LEN),
+		           &rx, PKT_LEN) != 0) {
+			fprintf(stderr, "raw: record %u differs from the packet written\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_encoding(const char* dir, const char* name, uint16_t encoding,
+                          const uint8_t* raw)
+{
+	char path[4096];
+	uint8_t* records;
+	uint32_t i, count;
+	int r;
+
+	snprintf(path, sizeof(path), "%s/roundtrip_%s.ubc", dir, name);
+	r = write_capfile(path, encoding);
+	if (r > 0) {
+		printf("%s: not supported in this build, skipped\n", name);
+		return 0;
+	}
+	if (r < 0)
+		return -1;
+
+	records = read_capfile(path, &count);
+	if (records == NULL)
+		return -1;
+	if (count != TEST_PACKETS) {
+		fprintf(stderr, "%s: %u records, expected %u\n", name, count, TEST_PACKETS);
+		free(records);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (memcmp(records + (size_t)i * CAPFILE_RECORD_LEN,
+		           raw + (size_t)i * CAPFILE_RECORD_LEN, CAPFILE_RECORD_LEN) != 0) {
+			fprintf(stderr, "%s: record %u differs from raw\n", name, i);
+			free(records);
+			return -1;
+		}
+	}
+	free(records);
+	printf("%s: %u records match raw\n", name, count);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* dir = argc > 1 ? argv[1] : ".";
+	char path[4096];
+	uint8_t* raw;
+	uint32_t count;
+	int r = 0;
+
+	snprintf(path, sizeof(path), "%s/roundtrip_raw.ubc", dir);
+	if (write_capfile(path, CAPFILE_ENC_RAW) != 0)
+		return 1;
+	raw = read_capfile(path, &count);
+	if (raw == NULL || check_raw(raw, count) < 0) {
+		free(raw);
+		return 1;
+	}
+
+	if (check_encoding(dir, "delta", CAPFILE_ENC_DELTA, raw) < 0)
+		r = 1;
+	if (check_encoding(dir, "delta_zlib", CAPFILE_ENC_DELTA_ZLIB, raw) < 0)
+		r = 1;
+
+	free(raw);
+	return r;
+}
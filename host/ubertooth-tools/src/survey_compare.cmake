@@ -0,0 +1,66 @@
+#
+# This file is part of Ubertooth.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; see the file COPYING.  If not, write to
+# the Free Software Foundation, Inc., 51 Franklin Street,
+# Boston, MA 02110-1301, USA.
+#
+
+# Survey a capture file with ubertooth-rx sequentially and with -j, and
+# fail unless both find the same piconets. Run with
+#   cmake -DRX=<ubertooth-rx> -DINPUT=<file> -DTHREADS=<n> -P survey_compare.cmake
+#
+# Packet lines carry host times, which for files without per packet
+# times depend on when they are replayed, so only the survey results
+# are compared.
+
+foreach(var RX INPUT THREADS)
+	if(NOT DEFINED ${var})
+		message(FATAL_ERROR "${var} is not set")
+	endif()
+endforeach()
+
+function(survey name output)
+	execute_process(COMMAND ${RX} -z -i ${INPUT} ${ARGN}
+		OUTPUT_VARIABLE out
+		ERROR_VARIABLE err
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "${name} survey failed (${result}):\n${err}")
+	endif()
+	string(FIND "${out}" "Survey Results" start)
+	if(start EQUAL -1)
+		message(FATAL_ERROR "${name} survey printed no results:\n${out}")
+	endif()
+	string(SUBSTRING "${out}" ${start} -1 results)
+	file(WRITE ${CMAKE_CURRENT_BINARY_DIR}/survey_${name}.txt "${results}")
+	set(${output} "${out}" PARENT_SCOPE)
+	set(${output}_results "${results}" PARENT_SCOPE)
+endfunction()
+
+survey(sequential seq)
+survey(parallel par -j ${THREADS})
+
+# the same packets as rx_capfile_parallel looks for, so there is
+# something to compare
+string(FIND "${seq}" "LAP=9e8b33" found)
+if(found EQUAL -1)
+	message(FATAL_ERROR "sequential survey decoded no packets:\n${seq}")
+endif()
+
+if(NOT seq_results STREQUAL par_results)
+	message(FATAL_ERROR "survey results differ with -j ${THREADS}:\n"
+		"sequential:\n${seq_results}\nparallel:\n${par_results}")
+endif()
+message(STATUS "sequential and -j ${THREADS} surveys agree")
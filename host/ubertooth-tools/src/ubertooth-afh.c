@@ -26,22 +26,23 @@
 #include <unistd.h>
 #include <string.h>
 
-extern int max_ac_errors;
-extern unsigned int packet_counter_max;
-
 static void usage()
 {
 	printf("ubertooth-afh - passive detection of the AFH channel map\n");
 	printf("Usage:\n");
 	printf("\t-h this help\n");
-	printf("\t-r print AFH channel map once every second\n");
+	printf("\t-r print AFH channel map when it changes, at most once a second\n");
 	printf("\t-V print version information\n");
 	printf("\t-l <LAP> to decode (6 hex), otherwise sniff all LAPs\n");
 	printf("\t-u <UAP> to decode (2 hex), otherwise try to calculate (requires LAP)\n");
-	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	printf("\t-t <seconds> timeout for initial AFH map detection\n");
 	printf("\t-m <int> threshold for channel removal\n");
-	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-w <ms> remove channels not seen for this long, instead of -m\n");
+	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", DEFAULT_MAX_AC_ERRORS);
+	printf("\t-G <options> skip blocks without signal: snr=<n>,trigger,neighbours=<n>\n");
+	printf("\t             (SNR in RSSI units, firmware trigger, banks either side)\n");
+	printf("\t-R reconnect and carry on if the Ubertooth is unplugged or reset\n");
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
 
@@ -50,16 +51,21 @@ int main(int argc, char* argv[])
 	int opt, have_lap = 0, have_uap = 0, timeout = 0;//, have_initial_afh = 0;
 	// uint8_t initial_afh[10];
 	char* end;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
 	btbb_piconet* pn = NULL;
 	uint32_t lap = 0;
 	uint8_t uap = 0;
 	uint8_t use_r_format = 0;
+	int reconnect = 0;
 
 	ubertooth_t* ut = NULL;
+	signal_gate gate = { 0 };
+	int max_ac_errors = DEFAULT_MAX_AC_ERRORS;
+	unsigned int packet_counter_max = 0;
+	unsigned int afh_window_ms = 0;
 	int r;
 
-	while ((opt=getopt(argc,argv,"rhVl:u:U:e:a:t:m:")) != EOF) {
+	while ((opt=getopt(argc,argv,"rhVl:u:U:e:a:t:m:w:G:R")) != EOF) {
 		switch(opt) {
 		case 'l':
 			lap = strtol(optarg, &end, 16);
@@ -79,7 +85,7 @@ int main(int argc, char* argv[])
 			timeout = atoi(optarg);
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'e':
 			max_ac_errors = atoi(optarg);
@@ -87,12 +93,22 @@ int main(int argc, char* argv[])
 		case 'm':
 			packet_counter_max = atoi(optarg);
 			break;
+		case 'w':
+			afh_window_ms = atoi(optarg);
+			break;
+		case 'G':
+			if (ubertooth_gate_parse(optarg, &gate) < 0)
+				return 1;
+			break;
 		case 'V':
 			print_version();
 			return 0;
 		case 'r':
 			use_r_format = 1;
 			break;
+		case 'R':
+			reconnect = 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -113,13 +129,13 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	if (packet_counter_max == 0) {
+	if (packet_counter_max == 0 && afh_window_ms == 0) {
 		printf("Error: Threshold for unused channels not specified\n");
 		usage();
 		return 1;
 	}
 
-	ut = ubertooth_start(ubertooth_device);
+	ut = ubertooth_start_spec(ubertooth_device);
 	if (ut->devh == NULL) {
 		usage();
 		return 1;
@@ -128,15 +144,25 @@ int main(int argc, char* argv[])
 	r = ubertooth_check_api(ut);
 	if (r < 0)
 		return 1;
+	ut->gate = gate;
+	ut->max_ac_errors = max_ac_errors;
+	ut->packet_counter_max = packet_counter_max;
+	ut->afh_window_ms = afh_window_ms;
 
 	/* Clean up on exit. */
 	register_cleanup_handler(ut, 1);
 
+	if (reconnect && ubertooth_hotplug_enable(ut) < 0)
+		return 1;
+
 	if (use_r_format)
 		rx_afh_r(ut, pn, timeout);
 	else
 		rx_afh(ut, pn, timeout);
 
+	ubertooth_print_gate_stats(ut, stderr);
+	cmd_queue_print_stats(ut->cmdq, stderr);
+	ubertooth_print_hotplug_stats(ut, stderr);
 	ubertooth_stop(ut);
 
 	return 0;
@@ -78,20 +78,47 @@ static void usage(void)
 	printf("\t-I interfere continuously\n");
 	printf("\n");
 	printf("    Data source:\n");
-	printf("\t-U<0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	printf("\n");
 	printf("    Misc:\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
 	printf("\t-q<filename> capture packets to PCAP file (DLT_BLUETOOTH_LE_LL_WITH_PHDR)\n");
 	printf("\t-c<filename> capture packets to PCAP file (DLT_PPI)\n");
+	printf("\t-F <text|json|binary>[:<filename>] packet output format (default: text)\n");
+	printf("\t   other text goes to stderr while records go to stdout\n");
 	printf("\t-A<index> advertising channel index (default 37)\n");
 	printf("\t-v[01] verify CRC mode, get status or enable/disable\n");
 	printf("\t-x<n> allow n access address offenses (default 32)\n");
+	printf("\t-R reconnect and carry on if the Ubertooth is unplugged or reset\n");
 
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 	printf("In get/set mode no capture occurs.\n");
 }
 
+/* Records get stdout to themselves: everything else printed to stdout
+ * (survey text, libbtbb messages, statistics) goes to stderr from here
+ * on so that it can not end up in the middle of the records */
+static output_t* open_output(int format, const char* filename)
+{
+	int fd;
+
+	if (filename)
+		return output_open(format, filename);
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0) {
+		perror("dup");
+		return NULL;
+	}
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		close(fd);
+		return NULL;
+	}
+	return output_fdopen(format, fd);
+}
+
 int main(int argc, char *argv[])
 {
 	int opt;
@@ -101,8 +128,11 @@ int main(int argc, char *argv[])
 	int do_adv_index;
 	int do_slave_mode;
 	int do_target;
+	int do_reconnect = 0;
 	enum jam_modes jam_mode = JAM_NONE;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
+	int output_format = OUTPUT_TEXT;
+	const char* output_file = NULL;
 	ubertooth_t* ut = ubertooth_init();
 
 	btle_options cb_opts = { .allowed_access_address_errors = 32 };
@@ -117,7 +147,7 @@ int main(int argc, char *argv[])
 	do_adv_index = 37;
 	do_slave_mode = do_target = 0;
 
-	while ((opt=getopt(argc,argv,"a::r:hfpU:v::A:s:t:x:c:q:jJiI")) != EOF) {
+	while ((opt=getopt(argc,argv,"a::r:hfpU:v::A:s:t:x:c:q:jJiIF:R")) != EOF) {
 		switch(opt) {
 		case 'a':
 			if (optarg == NULL) {
@@ -134,37 +164,19 @@ int main(int argc, char *argv[])
 			do_promisc = 1;
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'r':
-			if (!ut->h_pcapng_le) {
-				if (lell_pcapng_create_file(optarg, "Ubertooth", &ut->h_pcapng_le)) {
-					err(1, "lell_pcapng_create_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAPNG_LE, optarg) < 0)
+				return 1;
 			break;
 		case 'q':
-			if (!ut->h_pcap_le) {
-				if (lell_pcap_create_file(optarg, &ut->h_pcap_le)) {
-					err(1, "lell_pcap_create_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAP_LE, optarg) < 0)
+				return 1;
 			break;
 		case 'c':
-			if (!ut->h_pcap_le) {
-				if (lell_pcap_ppi_create_file(optarg, 0, &ut->h_pcap_le)) {
-					err(1, "lell_pcap_ppi_create_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAP_LE_PPI, optarg) < 0)
+				return 1;
 			break;
 		case 'v':
 			if (optarg)
@@ -212,6 +224,14 @@ int main(int argc, char *argv[])
 		case 'J':
 			jam_mode = JAM_CONTINUOUS;
 			break;
+		case 'F':
+			output_format = output_parse_spec(optarg, &output_file);
+			if (output_format < 0)
+				return 1;
+			break;
+		case 'R':
+			do_reconnect = 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -219,8 +239,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (output_format != OUTPUT_TEXT) {
+		ut->output = open_output(output_format, output_file);
+		if (ut->output == NULL)
+			return 1;
+	}
 
-	r = ubertooth_connect(ut, ubertooth_device);
+	r = ubertooth_connect_spec(ut, ubertooth_device);
 	if (r < 0) {
 		usage();
 		return 1;
@@ -231,7 +256,7 @@ int main(int argc, char *argv[])
 		return 1;
 
 	/* Clean up on exit. */
-	register_cleanup_handler(ut, 1);
+	register_cleanup_handler(ut, 0);
 
 	if (do_follow && do_promisc) {
 		printf("Error: must choose either -f or -p, one or the other pal\n");
@@ -239,14 +264,20 @@ int main(int argc, char *argv[])
 	}
 
 	if (do_follow || do_promisc) {
-		usb_pkt_rx rx;
-
 		r = cmd_set_jam_mode(ut->devh, jam_mode);
 		if (jam_mode != JAM_NONE && r != 0) {
 			printf("Jamming not supported\n");
 			return 1;
 		}
-		cmd_set_modulation(ut->devh, MOD_BT_LOW_ENERGY);
+		ubertooth_set_modulation(ut, MOD_BT_LOW_ENERGY);
+
+		if (do_reconnect && ubertooth_hotplug_enable(ut) < 0)
+			return 1;
+
+		// init USB transfer before the firmware starts queueing packets
+		r = ubertooth_bulk_init(ut);
+		if (r < 0)
+			return 1;
 
 		if (do_follow) {
 			u16 channel;
@@ -256,24 +287,19 @@ int main(int argc, char *argv[])
 				channel = 2426;
 			else
 				channel = 2480;
-			cmd_set_channel(ut->devh, channel);
-			cmd_btle_sniffing(ut->devh, 2);
+			ubertooth_set_channel(ut, channel);
+			ubertooth_start_mode(ut, UBERTOOTH_BTLE_SNIFFING, 2, 0);
 		} else {
-			cmd_btle_promisc(ut->devh);
+			ubertooth_start_mode(ut, UBERTOOTH_BTLE_PROMISC, 0, 0);
 		}
 
-		while (1) {
-			int r = cmd_poll(ut->devh, &rx);
-			if (r < 0) {
-				printf("USB error\n");
+		// receive and process each packet
+		while (!ut->stop_ubertooth) {
+			ubertooth_bulk_wait(ut);
+			if (ubertooth_bulk_receive(ut, cb_btle, &cb_opts) == 1)
 				break;
-			}
-			if (r == sizeof(usb_pkt_rx)) {
-				ringbuffer_add(ut->packets, &rx);
-				cb_btle(ut, &cb_opts);
-			}
-			usleep(500);
 		}
+		ubertooth_print_hotplug_stats(ut, stderr);
 		ubertooth_stop(ut);
 	}
 
@@ -284,7 +310,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (do_set_aa) {
-		cmd_set_access_address(ut->devh, access_address);
+		ubertooth_set_access_address(ut, access_address);
 		printf("access address set to: %08x\n", access_address);
 	}
 
@@ -307,7 +333,7 @@ int main(int argc, char *argv[])
 			channel = 2426;
 		else
 			channel = 2480;
-		cmd_set_channel(ut->devh, channel);
+		ubertooth_set_channel(ut, channel);
 
 		cmd_btle_slave(ut->devh, mac_address);
 	}
@@ -47,7 +47,7 @@ static void usage()
     printf("\t-r <name> read the contents of a 16 bit CC2400 register\n");
     printf
 	("\t-r <number,number,low-high> read the contents of a 16 bit CC2400 register(s)\n");
-    printf("\t-U<0-7> set ubertooth device to use\n");
+    printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
     printf("\t-v<0-2> verbosity (default=1)\n");
 }
 
@@ -71,7 +71,7 @@ int main(int argc, char *argv[])
     int verbose = 1;
     ubertooth_t* ut = NULL;
     int do_read_register;
-    char ubertooth_device = -1;
+    const char* ubertooth_device = NULL;
     int *regList = NULL;
     int regListN = 0;
     int i;
@@ -86,7 +86,7 @@ int main(int argc, char *argv[])
 	    usage();
 	    return 0;
 	case 'U':
-	    ubertooth_device = atoi(optarg);
+	    ubertooth_device = optarg;
 	    break;
 	case 'v':
 	    verbose = atoi(optarg);
@@ -117,7 +117,7 @@ int main(int argc, char *argv[])
     }
 
     /* initialise device */
-    ut = ubertooth_start(ubertooth_device);
+    ut = ubertooth_start_spec(ubertooth_device);
     if (ut == NULL) {
 	usage();
 	return 1;
@@ -395,7 +395,7 @@ static void usage()
 	printf("\t-u <filename> upload - read firmware from device\n");
 	printf("\t-d <filename> download - write DFU file to device\n");
 	printf("\t-r reset Ubertooth after other operations complete\n");
-	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 }
 
 #define FUNC_DOWNLOAD (1<<0)
@@ -411,7 +411,8 @@ int main(int argc, char **argv) {
 	char* outfile_name;
 	libusb_device_handle* devh = NULL;
 	uint8_t functions = 0;
-	int opt, ubertooth_device = -1;
+	int opt;
+	const char* ubertooth_device = NULL;
 	int r;
 	ubertooth_t* ut = NULL;
 
@@ -456,7 +457,7 @@ int main(int argc, char **argv) {
 			functions |= FUNC_RESET;
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		default:
 		case 'h':
@@ -476,7 +477,7 @@ int main(int argc, char **argv) {
 		int rv, count= 0;
 		devh = find_ubertooth_dfu_device();
 		if(devh == NULL) {
-			ut = ubertooth_start(ubertooth_device);
+			ut = ubertooth_start_spec(ubertooth_device);
 			if(ut == NULL) {
 				fprintf(stderr, "Unable to find Ubertooth\n");
 				return 1;
@@ -22,6 +22,7 @@
 #include "ubertooth.h"
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void usage(void)
 {
@@ -31,12 +32,113 @@ static void usage(void)
 	printf("\t-b only dump received bitstream (GnuRadio style)\n");
 	printf("\t-c classic modulation\n");
 	printf("\t-l LE modulation\n");
-	printf("\t-U<0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	printf("\t-d filename\n");
+	printf("\t-D <options> dump file options: size=<bytes>[KMG],time=<n>[smh],\n");
+	printf("\t             keep=<bytes>[KMG],flush=<ms> (rotate, ring, flush interval)\n");
+	printf("\t-R reconnect and carry on if the Ubertooth is unplugged or reset\n");
+	printf("\t-C filename write an indexed capture file\n");
+	printf("\t-i filename convert a dump file (-d) to the -C format, no Ubertooth is used\n");
+	printf("\t-z compress the -C file\n");
+	printf("\t-X <n> USB transfers kept in flight (default: %d, range: 1-%d)\n",
+	       DEFAULT_XFER_DEPTH, MAX_XFER_DEPTH);
 	printf("\nThis program sends binary data to stdout.  You probably don't want to\n");
 	printf("run it from a terminal without redirecting the output.\n");
 }
 
+/* Delta coded and deflated, or just delta coded without zlib */
+static void compress_capfile(capfile_writer* w)
+{
+	if (capfile_writer_set_encoding(w, CAPFILE_ENC_DELTA_ZLIB) < 0)
+		capfile_writer_set_encoding(w, CAPFILE_ENC_DELTA);
+}
+
+typedef struct {
+	capfile_writer* w;
+	int64_t packets;
+	int error;
+} convert_state;
+
+/* The packets of a batch share the second they were received in */
+static void cb_convert(ubertooth_t* ut, usb_pkt_batch* batch, void* args)
+{
+	convert_state* state = (convert_state*)args;
+	uint64_t time_ns = (uint64_t)ut->systime * 1000000000ull;
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		if (capfile_writer_write(state->w, time_ns,
+		                         usb_pkt_batch_get(batch, i)) < 0) {
+			state->error = 1;
+			ut->stop_ubertooth = 1;
+			return;
+		}
+	}
+	state->packets += batch->count;
+}
+
+/* One pass over the old format, which has no metadata to carry over.
+ * Ctrl-C stops early with what has been converted so far indexed. */
+static int convert_dump(const char* in_path, const char* out_path, int compress)
+{
+	ubertooth_t* ut;
+	capfile_meta meta;
+	convert_state state = { NULL, 0, 0 };
+	FILE* in;
+	int r;
+
+	in = fopen(in_path, "rb");
+	if (in == NULL) {
+		perror(in_path);
+		return 1;
+	}
+
+	ut = ubertooth_init();
+	if (ut == NULL) {
+		fclose(in);
+		return 1;
+	}
+
+	capfile_meta_init(&meta);
+	state.w = capfile_writer_open(out_path, &meta);
+	if (state.w == NULL) {
+		ubertooth_free(ut);
+		fclose(in);
+		return 1;
+	}
+	if (compress)
+		compress_capfile(state.w);
+
+	register_cleanup_handler(ut, 0);
+	r = stream_rx_file_batch(ut, in, cb_convert, &state);
+	register_cleanup_handler(NULL, 0);
+	ubertooth_free(ut);
+	fclose(in);
+	if (capfile_writer_close(state.w) < 0 || r < 0 || state.error)
+		return 1;
+
+	fprintf(stderr, "%lld packets written to %s\n", (long long)state.packets,
+	        out_path);
+	return 0;
+}
+
+static capfile_writer* open_capfile(ubertooth_t* ut, const char* path, int modulation)
+{
+	capfile_meta meta;
+	u8 serial[17];
+
+	capfile_meta_init(&meta);
+	meta.flags = CAPFILE_HOST_TIME;
+	if (cmd_get_serial(ut->devh, serial) == 0)
+		memcpy(meta.serial, serial + 1, 16);
+	cmd_get_rev_num(ut->devh, meta.firmware, sizeof(meta.firmware));
+	meta.board_id = cmd_get_board_id(ut->devh);
+	meta.modulation = modulation;
+	meta.mode = UBERTOOTH_RX_SYMBOLS;
+
+	return capfile_writer_open(path, &meta);
+}
+
 /*
  * The normal output format is in chunks of 64 bytes in the USB RX packet format
  * 50 of those 64 bytes contain the received symbols (packed 8 per byte).
@@ -49,13 +151,22 @@ int main(int argc, char *argv[])
 {
 	int opt;
 	int bitstream = 0;
+	int reconnect = 0;
 	int modulation = MOD_BT_BASIC_RATE;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
+	char* dump_path = NULL;
+	char* capfile_path = NULL;
+	char* convert_path = NULL;
+	int compress = 0;
+	int xfer_depth = DEFAULT_XFER_DEPTH;
+	dump_writer_options dump_opts;
 
 	ubertooth_t* ut = NULL;
 	int r;
 
-	while ((opt=getopt(argc,argv,"bhclU:d:")) != EOF) {
+	dump_writer_default_options(&dump_opts);
+
+	while ((opt=getopt(argc,argv,"bhclU:d:D:RC:i:zX:")) != EOF) {
 		switch(opt) {
 		case 'b':
 			bitstream = 1;
@@ -67,14 +178,29 @@ int main(int argc, char *argv[])
 			modulation = MOD_BT_LOW_ENERGY;
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'd':
-			dumpfile = fopen(optarg, "w");
-			if (dumpfile == NULL) {
-				perror(optarg);
+			dump_path = optarg;
+			break;
+		case 'D':
+			if (dump_writer_parse_options(optarg, &dump_opts) < 0)
 				return 1;
-			}
+			break;
+		case 'R':
+			reconnect = 1;
+			break;
+		case 'C':
+			capfile_path = optarg;
+			break;
+		case 'i':
+			convert_path = optarg;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'X':
+			xfer_depth = atoi(optarg);
 			break;
 		case 'h':
 		default:
@@ -83,23 +209,56 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ut = ubertooth_start(ubertooth_device);
+	if (convert_path) {
+		if (capfile_path == NULL) {
+			fprintf(stderr, "-i needs a capture file to write to (-C)\n");
+			return 1;
+		}
+		return convert_dump(convert_path, capfile_path, compress);
+	}
+
+	ut = ubertooth_start_spec(ubertooth_device);
 
 	if (ut == NULL) {
 		usage();
 		return 1;
 	}
 
+	if (ubertooth_set_xfer_depth(ut, xfer_depth) < 0)
+		return 1;
+
+	if (dump_path) {
+		ut->dumpfile = dump_writer_open(dump_path, &dump_opts);
+		if (ut->dumpfile == NULL)
+			return 1;
+	}
+
 	r = ubertooth_check_api(ut);
 	if (r < 0)
 		return 1;
 
+	if (capfile_path) {
+		if (bitstream) {
+			fprintf(stderr, "-C can not be used with -b\n");
+			return 1;
+		}
+		ut->capfile = open_capfile(ut, capfile_path, modulation);
+		if (ut->capfile == NULL)
+			return 1;
+		if (compress)
+			compress_capfile(ut->capfile);
+	}
+
 	/* Clean up on exit. */
 	register_cleanup_handler(ut, 1);
 
-	cmd_set_modulation(ut->devh, modulation);
+	if (reconnect && ubertooth_hotplug_enable(ut) < 0)
+		return 1;
+
+	ubertooth_set_modulation(ut, modulation);
 	rx_dump(ut, bitstream);
 
+	ubertooth_print_hotplug_stats(ut, stderr);
 	ubertooth_stop(ut);
 	return 0;
 }
@@ -43,6 +43,32 @@ static void usage(void)
 	printf("\n");
 	printf("    Options:\n");
 	printf("\t-c <2402-2480> set channel in MHz (for continuous rx)\n");
+	printf("\t-F <text|json|binary>[:<filename>] packet output format (default: text)\n");
+	printf("\t   other text goes to stderr while records go to stdout\n");
+}
+
+/* Records get stdout to themselves: everything else printed to stdout
+ * (survey text, libbtbb messages, statistics) goes to stderr from here
+ * on so that it can not end up in the middle of the records */
+static output_t* open_output(int format, const char* filename)
+{
+	int fd;
+
+	if (filename)
+		return output_open(format, filename);
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0) {
+		perror("dup");
+		return NULL;
+	}
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		close(fd);
+		return NULL;
+	}
+	return output_fdopen(format, fd);
 }
 
 int main(int argc, char *argv[])
@@ -50,10 +76,12 @@ int main(int argc, char *argv[])
 	int opt;
 	int do_mode = -1;
 	int do_channel = 2418;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
+	int output_format = OUTPUT_TEXT;
+	const char* output_file = NULL;
 	int r;
 
-	while ((opt=getopt(argc,argv,"frijc:U:h")) != EOF) {
+	while ((opt=getopt(argc,argv,"frijc:U:F:h")) != EOF) {
 		switch(opt) {
 		case 'f':
 			do_mode = 0;
@@ -69,7 +97,12 @@ int main(int argc, char *argv[])
 			do_channel = atoi(optarg);
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
+			break;
+		case 'F':
+			output_format = output_parse_spec(optarg, &output_file);
+			if (output_format < 0)
+				return 1;
 			break;
 		case 'h':
 		default:
@@ -78,7 +111,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ut = ubertooth_start(ubertooth_device);
+	ut = ubertooth_start_spec(ubertooth_device);
 	if (ut == NULL) {
 		usage();
 		return 1;
@@ -88,6 +121,12 @@ int main(int argc, char *argv[])
 	if (r < 0)
 		return 1;
 
+	if (output_format != OUTPUT_TEXT) {
+		ut->output = open_output(output_format, output_file);
+		if (ut->output == NULL)
+			return 1;
+	}
+
 	/* Clean up on exit. */
 	register_cleanup_handler(ut, 1);
 
@@ -95,7 +134,7 @@ int main(int argc, char *argv[])
 		usb_pkt_rx rx;
 
 		if (do_mode == 1) // FIXME magic number!
-			cmd_set_channel(ut->devh, do_channel);
+			ubertooth_set_channel(ut, do_channel);
 
 		r = cmd_ego(ut->devh, do_mode);
 		if (r < 0) {
@@ -39,11 +39,13 @@ static void usage()
 	printf("\t-h this help\n");
 	printf("\t-l<LAP> (in hexadecimal)\n");
 	printf("\t-u<UAP> (in hexadecimal)\n");
-	printf("\t-U<0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
 	printf("\t-q<filename> capture packets to PCAP file\n");
 	printf("\t-e max_ac_errors\n");
 	printf("\t-d filename\n");
+	printf("\t-D <options> dump file options: size=<bytes>[KMG],time=<n>[smh],\n");
+	printf("\t             keep=<bytes>[KMG],flush=<ms> (rotate, ring, flush interval)\n");
 	printf("\t-a Enable AFH\n");
 	printf("\t-b Bluetooth device (hci0)\n");
 	printf("\t-w USB delay in 625us timeslots (default:5)\n");
@@ -58,7 +60,8 @@ int main(int argc, char *argv[])
 	int have_uap = 0;
 	int afh_enabled = 0;
 	uint8_t mode, afh_map[10];
-	char *end, ubertooth_device = -1;
+	char *end;
+	const char* ubertooth_device = NULL;
 	char *bt_dev = "hci0";
 	char addr[19] = { 0 };
 	uint32_t clock;
@@ -67,11 +70,14 @@ int main(int argc, char *argv[])
 	btbb_piconet *pn;
 	struct hci_dev_info di;
 	int cc = 0;
+	char* dump_path = NULL;
+	dump_writer_options dump_opts;
 
 	pn = btbb_piconet_new();
 	ubertooth_t* ut = ubertooth_init();
+	dump_writer_default_options(&dump_opts);
 
-	while ((opt=getopt(argc,argv,"hl:u:U:e:d:ab:w:r:q:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hl:u:U:e:d:D:ab:w:r:q:")) != EOF) {
 		switch(opt) {
 		case 'l':
 			lap = strtol(optarg, &end, 16);
@@ -86,37 +92,25 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'r':
-			if (!ut->h_pcapng_bredr) {
-				if (btbb_pcapng_create_file( optarg, "Ubertooth", &ut->h_pcapng_bredr )) {
-					err(1, "create_bredr_capture_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAPNG_BREDR, optarg) < 0)
+				return 1;
 			break;
 		case 'q':
-			if (!ut->h_pcap_bredr) {
-				if (btbb_pcap_create_file(optarg, &ut->h_pcap_bredr)) {
-					err(1, "btbb_pcap_create_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAP_BREDR, optarg) < 0)
+				return 1;
 			break;
 		case 'e':
-			max_ac_errors = atoi(optarg);
+			ut->max_ac_errors = atoi(optarg);
 			break;
 		case 'd':
-			dumpfile = fopen(optarg, "w");
-			if (dumpfile == NULL) {
-				perror(optarg);
+			dump_path = optarg;
+			break;
+		case 'D':
+			if (dump_writer_parse_options(optarg, &dump_opts) < 0)
 				return 1;
-			}
 			break;
 		case 'a':
 			afh_enabled = 1;
@@ -138,6 +132,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (dump_path) {
+		ut->dumpfile = dump_writer_open(dump_path, &dump_opts);
+		if (ut->dumpfile == NULL)
+			return 1;
+	}
+
 	dev_id = hci_devid(bt_dev);
 	sock = hci_open_dev(dev_id);
 	hci_read_clock(sock, 0, 0, &clock, &accuracy, 0);
@@ -186,8 +186,8 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
-	if (ut->h_pcapng_bredr) {
-		btbb_pcapng_record_bdaddr(ut->h_pcapng_bredr,
+	if (ut->pcap) {
+		pcap_writer_record_bdaddr(ut->pcap,
 		                            (((uint32_t)uap)<<24)|lap,
 		                            0xff, 0);
 	}
@@ -214,9 +214,9 @@ int main(int argc, char *argv[])
 	}
 
 	/* Clean up on exit. */
-	register_cleanup_handler(ut, 1);
+	register_cleanup_handler(ut, 0);
 
-	ubertooth_connect(ut, ubertooth_device);
+	ubertooth_connect_spec(ut, ubertooth_device);
 	if (ut == NULL) {
 		usage();
 		return 1;
@@ -228,7 +228,7 @@ int main(int argc, char *argv[])
 
 	cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
 	if(afh_enabled)
-		cmd_set_afh_map(ut->devh, afh_map);
+		ubertooth_set_afh_map(ut, afh_map);
 	btbb_piconet_set_clk_offset(pn, clock+delay);
 	btbb_piconet_set_flag(pn, BTBB_FOLLOWING, 1);
 	btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 1);
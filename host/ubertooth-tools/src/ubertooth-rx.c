@@ -21,10 +21,12 @@
 
 #include "ubertooth.h"
 #include "ubertooth_callback.h"
+#include "ubertooth_capture.h"
 #include <err.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static void usage()
 {
@@ -32,21 +34,111 @@ static void usage()
 	printf("Usage:\n");
 	printf("\t-h this help\n");
 	printf("\t-V print version information\n");
-	printf("\t-i filename\n");
+	printf("\t-i filename (ubertooth-dump -d or -C)\n");
+	printf("\t-j <threads> decode the input file on this many threads, 0 for one per core\n");
+	printf("\t-Q <query> only replay matching packets of a -C file: from=<secs>,to=<secs>,\n");
+	printf("\t           clk_from=<n>,clk_to=<n>,channel=<n>,type=<n> (times since the\n");
+	printf("\t           epoch, clk_* in clk100ns units, repeat channel, type)\n");
 	printf("\t-l <LAP> to decode (6 hex), otherwise sniff all LAPs\n");
+	printf("\t-w <filename> only sniff the LAPs listed in file (6 hex per line)\n");
 	printf("\t-u <UAP> to decode (2 hex), otherwise try to calculate (requires LAP)\n");
-	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
+	printf("\t-M capture with every attached Ubertooth at once\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
 	printf("\t-q<filename> capture packets to PCAP file\n");
 	printf("\t-d<filename> dump packets to binary file\n");
-	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-D <options> dump file options: size=<bytes>[KMG],time=<n>[smh],\n");
+	printf("\t             keep=<bytes>[KMG],flush=<ms> (rotate, ring, flush interval)\n");
+	printf("\t-F <text|json|binary>[:<filename>] packet output format (default: text)\n");
+	printf("\t   other text goes to stderr while records go to stdout\n");
+	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", DEFAULT_MAX_AC_ERRORS);
 	printf("\t-c <BT Channel> set a fixed bluetooth channel [Default: 39]\n");
 	printf("\t-s reset channel scanning\n");
 	printf("\t-t <SECONDS> sniff timeout - 0 means no timeout [Default: 0]\n");
 	printf("\t-z Survey mode - discover and list piconets (implies -s -t 20)\n");
+	printf("\t-T service USB on a separate thread\n");
+	printf("\t-X <n> USB transfers kept in flight (default: %d, range: 1-%d)\n",
+	       DEFAULT_XFER_DEPTH, MAX_XFER_DEPTH);
+	printf("\t-R reconnect and carry on if the Ubertooth is unplugged or reset\n");
+	printf("\t-G <options> skip blocks without signal: snr=<n>,trigger,neighbours=<n>\n");
+	printf("\t             (SNR in RSSI units, firmware trigger, banks either side)\n");
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
 
+/* Capture with every attached Ubertooth, their packets merged into one
+ * stream and written to the outputs set up on ut */
+static int rx_all_devices(ubertooth_t* ut, btbb_piconet* pn, u16 channel,
+                          int timeout)
+{
+	ubertooth_capture_t* cap;
+	ubertooth_t* dev;
+	int i, r;
+
+	cap = ubertooth_capture_open_all();
+	if (cap == NULL)
+		return -1;
+	fprintf(stderr, "capturing with %d Ubertooth devices\n", cap->num_devices);
+
+	for (i = 0; i < cap->num_devices; i++) {
+		dev = cap->devices[i];
+		dev->max_ac_errors = ut->max_ac_errors;
+		dev->gate = ut->gate;
+		dev->watchlist = ut->watchlist;
+		dev->pcap = ut->pcap;
+		dev->output = ut->output;
+		dev->dumpfile = ut->dumpfile;
+		if (pn != NULL && btbb_piconet_get_flag(pn, BTBB_UAP_VALID))
+			cmd_set_bdaddr(dev->devh, btbb_piconet_get_bdaddr(pn));
+		ubertooth_set_channel(dev, channel);
+	}
+
+	/* stopping one device stops the capture */
+	register_cleanup_handler(cap->devices[0], 0);
+	if (timeout)
+		ubertooth_set_timeout(cap->devices[0], timeout);
+
+	r = ubertooth_capture_start(cap, UBERTOOTH_RX_SYMBOLS, 0, 0);
+	while (r == 0 && ubertooth_capture_receive(cap, cb_rx, pn) >= 0)
+		;
+
+	for (i = 0; i < cap->num_devices; i++) {
+		dev = cap->devices[i];
+		ubertooth_print_fifo_stats(dev, stderr);
+		ubertooth_print_gate_stats(dev, stderr);
+		/* these belong to ut */
+		dev->watchlist = NULL;
+		dev->pcap = NULL;
+		dev->output = NULL;
+		dev->dumpfile = NULL;
+	}
+	ubertooth_capture_free(cap);
+	return r;
+}
+
+/* Records get stdout to themselves: everything else printed to stdout
+ * (survey text, libbtbb messages, statistics) goes to stderr from here
+ * on so that it can not end up in the middle of the records */
+static output_t* open_output(int format, const char* filename)
+{
+	int fd;
+
+	if (filename)
+		return output_open(format, filename);
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0) {
+		perror("dup");
+		return NULL;
+	}
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		close(fd);
+		return NULL;
+	}
+	return output_fdopen(format, fd);
+}
+
 int main(int argc, char* argv[])
 {
 	int opt, have_lap = 0, have_uap = 0;
@@ -54,20 +146,39 @@ int main(int argc, char* argv[])
 	int r;
 	int timeout = 0;
 	int reset_scan = 0;
+	int usb_thread = 0;
+	int reconnect = 0;
+	int all_devices = 0;
 	char* end;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
 	btbb_piconet* pn = NULL;
 	uint32_t lap = 0;
 	uint8_t uap = 0;
 	uint8_t channel = 39;
+	char* watchlist_file = NULL;
+	char* dump_path = NULL;
+	dump_writer_options dump_opts;
+	int output_format = OUTPUT_TEXT;
+	const char* output_file = NULL;
+	capfile_query query;
+	capfile_reader* cf;
+	int threads = -1;
 
 	ubertooth_t* ut = ubertooth_init();
+	capfile_query_init(&query);
+
+	dump_writer_default_options(&dump_opts);
 
-	while ((opt=getopt(argc,argv,"hVi:l:u:U:d:e:r:sq:t:zc:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hVi:l:u:U:Md:D:e:r:sq:t:zc:Tw:F:G:RQ:j:X:")) != EOF) {
 		switch(opt) {
+		case 'F':
+			output_format = output_parse_spec(optarg, &output_file);
+			if (output_format < 0)
+				return 1;
+			break;
 		case 'i':
-			infile = fopen(optarg, "r");
-			if (infile == NULL) {
+			ut->infile = fopen(optarg, "r");
+			if (ut->infile == NULL) {
 				printf("Could not open file %s\n", optarg);
 				usage();
 				return 1;
@@ -82,37 +193,32 @@ int main(int argc, char* argv[])
 			have_uap++;
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
+			break;
+		case 'M':
+			all_devices = 1;
 			break;
 		case 'r':
-			if (!ut->h_pcapng_bredr) {
-				if (btbb_pcapng_create_file( optarg, "Ubertooth", &ut->h_pcapng_bredr )) {
-					err(1, "create_bredr_capture_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAPNG_BREDR, optarg) < 0)
+				return 1;
 			break;
 		case 'q':
-			if (!ut->h_pcap_bredr) {
-				if (btbb_pcap_create_file(optarg, &ut->h_pcap_bredr)) {
-					err(1, "btbb_pcap_create_file: ");
-				}
-			}
-			else {
-				printf("Ignoring extra capture file: %s\n", optarg);
-			}
+			if (pcap_writer_open(&ut->pcap, PCAP_BREDR, optarg) < 0)
+				return 1;
 			break;
 		case 'd':
-			dumpfile = fopen(optarg, "w");
-			if (dumpfile == NULL) {
-				perror(optarg);
+			dump_path = optarg;
+			break;
+		case 'D':
+			if (dump_writer_parse_options(optarg, &dump_opts) < 0)
 				return 1;
-			}
 			break;
 		case 'e':
-			max_ac_errors = atoi(optarg);
+			ut->max_ac_errors = atoi(optarg);
+			break;
+		case 'G':
+			if (ubertooth_gate_parse(optarg, &ut->gate) < 0)
+				return 1;
 			break;
 		case 's':
 			++reset_scan;
@@ -126,6 +232,28 @@ int main(int argc, char* argv[])
 		case 'c':
 			channel = atoi(optarg);
 			break;
+		case 'T':
+			usb_thread = 1;
+			break;
+		case 'R':
+			reconnect = 1;
+			break;
+		case 'X':
+			if (ubertooth_set_xfer_depth(ut, atoi(optarg)) < 0)
+				return 1;
+			break;
+		case 'Q':
+			if (capfile_parse_query(optarg, &query) < 0)
+				return 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads <= 0)
+				threads = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
+		case 'w':
+			watchlist_file = optarg;
+			break;
 		case 'V':
 			print_version();
 			return 0;
@@ -141,8 +269,42 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	if (infile == NULL) {
-		r = ubertooth_connect(ut, ubertooth_device);
+	if(watchlist_file && (have_lap || have_uap)) {
+		fprintf(stderr, "No address should be specified with a watchlist\n");
+		return 1;
+	}
+
+	if (all_devices && (ut->infile || ubertooth_device || reconnect)) {
+		fprintf(stderr, "-M can not be used with -i, -U or -R\n");
+		return 1;
+	}
+
+	if (threads >= 0 && ut->infile == NULL) {
+		fprintf(stderr, "-j needs an input file (-i)\n");
+		return 1;
+	}
+
+	if (dump_path) {
+		ut->dumpfile = dump_writer_open(dump_path, &dump_opts);
+		if (ut->dumpfile == NULL)
+			return 1;
+	}
+
+	if (output_format != OUTPUT_TEXT) {
+		ut->output = open_output(output_format, output_file);
+		if (ut->output == NULL)
+			return 1;
+	}
+
+	/* after option parsing so that -e applies */
+	if(watchlist_file) {
+		ut->watchlist = ac_watchlist_load(watchlist_file, ut->max_ac_errors);
+		if (ut->watchlist == NULL)
+			return 1;
+	}
+
+	if (ut->infile == NULL && !all_devices) {
+		r = ubertooth_connect_spec(ut, ubertooth_device);
 		if (r < 0) {
 			usage();
 			return 1;
@@ -153,11 +315,11 @@ int main(int argc, char* argv[])
 			return 1;
 	}
 
-	r = btbb_init(max_ac_errors);
+	r = btbb_init(ut->max_ac_errors);
 	if (r < 0)
 		return r;
 
-	if(survey_mode) {
+	if(survey_mode || ut->watchlist) {
 		// auto-flush stdout so that wrapper scripts work
 		setvbuf(stdout, NULL, _IONBF, 0);
 		btbb_init_survey();
@@ -167,11 +329,11 @@ int main(int argc, char* argv[])
 			btbb_init_piconet(pn, lap);
 			if (have_uap) {
 				btbb_piconet_set_uap(pn, uap);
-				if (infile == NULL)
+				if (ut->devh != NULL)
 					cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
 			}
-			if (ut->h_pcapng_bredr) {
-				btbb_pcapng_record_bdaddr(ut->h_pcapng_bredr,
+			if (ut->pcap) {
+				pcap_writer_record_bdaddr(ut->pcap,
 							  (((uint32_t)uap)<<24)|lap,
 							  have_uap ? 0xff : 0x00, 0);
 			}
@@ -182,14 +344,18 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	if (infile == NULL) {
+	if (all_devices) {
+		rx_all_devices(ut, pn, reset_scan ? 9999 : 2402 + channel, timeout);
+		/* writes out the outputs */
+		ubertooth_stop(ut);
+	} else if (ut->infile == NULL) {
 		/* Scan all frequencies. Same effect as
 		 * ubertooth-utils -c9999. This is necessary after
 		 * following a piconet. */
 		if (reset_scan) {
-			cmd_set_channel(ut->devh, 9999);
+			ubertooth_set_channel(ut, 9999);
 		} else {
-			cmd_set_channel(ut->devh, 2402 + channel);
+			ubertooth_set_channel(ut, 2402 + channel);
 		}
 
 		/* Clean up on exit. */
@@ -198,13 +364,22 @@ int main(int argc, char* argv[])
 		if (timeout)
 			ubertooth_set_timeout(ut, timeout);
 
+		if (reconnect && ubertooth_hotplug_enable(ut) < 0)
+			return 1;
+
 		// init USB transfer
 		r = ubertooth_bulk_init(ut);
 		if (r < 0)
 			return r;
 
+		if (usb_thread) {
+			r = ubertooth_bulk_thread_start(ut);
+			if (r < 0)
+				return r;
+		}
+
 		// tell ubertooth to send packets
-		r = cmd_rx_syms(ut->devh);
+		r = ubertooth_start_mode(ut, UBERTOOTH_RX_SYMBOLS, 0, 0);
 		if (r < 0)
 			return r;
 
@@ -214,13 +389,34 @@ int main(int argc, char* argv[])
 			ubertooth_bulk_receive(ut, cb_rx, pn);
 		}
 
+		if (usb_thread)
+			ubertooth_print_fifo_stats(ut, stderr);
+		ubertooth_print_gate_stats(ut, stderr);
+		cmd_queue_print_stats(ut->cmdq, stderr);
+		ubertooth_print_hotplug_stats(ut, stderr);
 		ubertooth_stop(ut);
 	} else {
-		stream_rx_file(ut, infile, cb_rx, pn);
-		fclose(infile);
+		if (capfile_probe(ut->infile)) {
+			cf = capfile_open(ut->infile);
+			if (cf == NULL)
+				return 1;
+			print_capfile_meta(&cf->meta, stderr);
+			if (threads > 0)
+				rx_capfile_parallel(ut, cf, &query, pn, threads);
+			else
+				stream_rx_capfile(ut, cf, &query, cb_rx, pn);
+			capfile_close(cf);
+		} else if (threads > 0)
+			rx_file_parallel(ut, ut->infile, pn, threads);
+		else
+			stream_rx_file(ut, ut->infile, cb_rx, pn);
+		fclose(ut->infile);
+		ubertooth_print_gate_stats(ut, stderr);
+		/* writes out queued capture file records */
+		ubertooth_stop(ut);
 	}
 
-	if(survey_mode) {
+	if(survey_mode || ut->watchlist) {
 		printf("Survey Results\n");
 		while((pn=btbb_next_survey_result()) != NULL) {
 			lap = btbb_piconet_get_lap(pn);
@@ -235,8 +431,8 @@ int main(int argc, char* argv[])
 			//btbb_print_afh_map(pn);
 		}
 	}
-	if(dumpfile != NULL)
-		fclose(dumpfile);
+	ac_watchlist_free(ut->watchlist);
+	ut->watchlist = NULL;
 
 	return 0;
 }
@@ -41,12 +41,15 @@ static void usage()
 	printf("ubertooth-scan - active(bluez) device scan and inquiry supported by Ubertooth\n");
 	printf("Usage:\n");
 	printf("\t-h this Help\n");
-	printf("\t-U<0-7> set Ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set Ubertooth device to use\n");
 	printf("\t-t scan Time (seconds) - length of time to sniff packets. [Default: 20s]\n");
-	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", DEFAULT_MAX_AC_ERRORS);
+	printf("\t-w <filename> only sniff the LAPs listed in file (6 hex per line)\n");
 	printf("\t-s hci Scan - perform the equivalent of 'hcitool scan'\n");
 	printf("\t-x eXtended scan - retrieve additional information about target devices\n");
 	printf("\t-b Bluetooth device (hci0)\n");
+	printf("\t-G <options> skip blocks without signal: snr=<n>,trigger,neighbours=<n>\n");
+	printf("\t             (SNR in RSSI units, firmware trigger, banks either side)\n");
 }
 
 
@@ -183,19 +186,22 @@ int main(int argc, char *argv[])
 	inquiry_info *ii = NULL;
 	int i, rv, opt, dev_id, dev_handle, len, flags;
 	int max_rsp, num_rsp, lap, timeout = 20;
+	int max_ac_errors = DEFAULT_MAX_AC_ERRORS;
 	uint8_t uap, extended = 0;
 	uint8_t scan = 0;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
 	char *bt_dev = "hci0";
 	char addr[19] = { 0 };
 	ubertooth_t* ut = NULL;
 	btbb_piconet* pn;
 	bdaddr_t bdaddr;
+	signal_gate gate = { 0 };
+	char* watchlist_file = NULL;
 
-	while ((opt=getopt(argc,argv,"hU:t:e:xsb:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hU:t:e:xsb:G:w:")) != EOF) {
 		switch(opt) {
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'b':
 			bt_dev = optarg;
@@ -216,6 +222,13 @@ int main(int argc, char *argv[])
 		case 's':
 			scan = 1;
 			break;
+		case 'G':
+			if (ubertooth_gate_parse(optarg, &gate) < 0)
+				return 1;
+			break;
+		case 'w':
+			watchlist_file = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -235,7 +248,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	ut = ubertooth_start(ubertooth_device);
+	ut = ubertooth_start_spec(ubertooth_device);
 	if (ut == NULL) {
 		usage();
 		return 1;
@@ -243,9 +256,16 @@ int main(int argc, char *argv[])
 	rv = ubertooth_check_api(ut);
 	if (rv < 0)
 		return 1;
+	ut->gate = gate;
+	ut->max_ac_errors = max_ac_errors;
+	if (watchlist_file) {
+		ut->watchlist = ac_watchlist_load(watchlist_file, max_ac_errors);
+		if (ut->watchlist == NULL)
+			return 1;
+	}
 
 	/* Set sweep mode - otherwise AFH map is useless */
-	cmd_set_channel(ut->devh, 9999);
+	ubertooth_set_channel(ut, 9999);
 
 	/* Clean up on exit. */
 	register_cleanup_handler(ut, 0);
@@ -282,7 +302,7 @@ int main(int argc, char *argv[])
 	ubertooth_bulk_init(ut);
 
 	// tell ubertooth to send packets
-	cmd_rx_syms(ut->devh);
+	ubertooth_start_mode(ut, UBERTOOTH_RX_SYMBOLS, 0, 0);
 
 	// receive and process each packet
 	while(!ut->stop_ubertooth) {
@@ -290,7 +310,10 @@ int main(int argc, char *argv[])
 		ubertooth_bulk_receive(ut, cb_scan, NULL);
 	}
 
+	ubertooth_print_gate_stats(ut, stderr);
 	ubertooth_stop(ut);
+	ac_watchlist_free(ut->watchlist);
+	ut->watchlist = NULL;
 
 	printf("\nScan results:\n");
 	while((pn=btbb_next_survey_result()) != NULL) {
@@ -21,32 +21,26 @@
 
 #include <getopt.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "ubertooth.h"
 
 uint8_t debug;
 
-void cb_specan(ubertooth_t* ut __attribute__((unused)), void* args)
+static int specan_block(ubertooth_t* ut, const usb_pkt_rx* rx,
+                        uint16_t high_freq, uint8_t output_mode)
 {
-	uint16_t high_freq = (((uint8_t*)args)[0]) |
-	                     (((uint8_t*)args)[1] << 8);
-	uint8_t output_mode = ((uint8_t*)args)[2];
-
-	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
 	int r, j;
 	uint16_t frequency;
 	int8_t rssi;
 
-	/* process each received block */
 	for (j = 0; j < DMA_SIZE-2; j += 3) {
 		frequency = (rx->data[j] << 8) | rx->data[j + 1];
 		rssi = (int8_t)rx->data[j + 2];
 		switch(output_mode) {
 			case SPECAN_FILE:
-				r = fwrite(&rx->data[j], 1, 3, dumpfile);
-				if(r != 3) {
-					fprintf(stderr, "Error writing to file (%d)\n", r);
-					return;
-				}
+				r = dump_writer_write(ut->dumpfile, &rx->data[j], 3);
+				if(r < 0)
+					return -1;
 				break;
 			case SPECAN_STDOUT:
 				printf("%f, %d, %d\n", ((double)rx->clk100ns)/10000000,
@@ -66,10 +60,26 @@ void cb_specan(ubertooth_t* ut __attribute__((unused)), void* args)
 			default:
 				fprintf(stderr, "Unrecognised output mode (%d)\n",
 				        output_mode);
-				return;
+				return -1;
 				break;
 		}
 	}
+	return 0;
+}
+
+void cb_specan(ubertooth_t* ut, usb_pkt_batch* batch,
+               void* args)
+{
+	uint16_t high_freq = (((uint8_t*)args)[0]) |
+	                     (((uint8_t*)args)[1] << 8);
+	uint8_t output_mode = ((uint8_t*)args)[2];
+	int i;
+
+	/* process each received block */
+	for (i = 0; i < batch->count; i++) {
+		if (specan_block(ut, usb_pkt_batch_get(batch, i), high_freq, output_mode) < 0)
+			break;
+	}
 	fflush(stderr);
 }
 
@@ -84,16 +94,17 @@ static void usage(FILE *file)
 	fprintf(file, "\t-d <filename> output to file\n");
 	fprintf(file, "\t-l lower frequency (default 2402)\n");
 	fprintf(file, "\t-u upper frequency (default 2480)\n");
-	fprintf(file, "\t-U<0-7> set ubertooth device to use\n");
+	fprintf(file, "\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 }
 
 int main(int argc, char *argv[])
 {
 	int opt, r = 0, output_mode = SPECAN_STDOUT;
 	int lower= 2402, upper= 2480;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
 
 	ubertooth_t* ut = NULL;
+	dump_writer_t* dumpfile = NULL;
 
 	while ((opt=getopt(argc,argv,"vhgGd:l::u::U:")) != EOF) {
 		switch(opt) {
@@ -109,14 +120,12 @@ int main(int argc, char *argv[])
 		case 'd':
 			output_mode = SPECAN_FILE;
 			if(*optarg == '-') {
-				dumpfile = stdout;
+				dumpfile = dump_writer_fdopen(STDOUT_FILENO, NULL);
 			} else {
-				dumpfile = fopen(optarg, "w");
-				if (dumpfile == NULL) {
-					perror(optarg);
-					return 1;
-				}
+				dumpfile = dump_writer_open(optarg, NULL);
 			}
+			if (dumpfile == NULL)
+				return 1;
 			break;
 		case 'l':
 			if (optarg)
@@ -131,7 +140,7 @@ int main(int argc, char *argv[])
 				printf("upper: %d\n", upper);
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'h':
 			usage(stdout);
@@ -142,7 +151,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ut = ubertooth_start(ubertooth_device);
+	ut = ubertooth_start_spec(ubertooth_device);
 
 	if (ut == NULL) {
 		usage(stderr);
@@ -152,6 +161,7 @@ int main(int argc, char *argv[])
 	r = ubertooth_check_api(ut);
 	if (r < 0)
 		return 1;
+	ut->dumpfile = dumpfile;
 
 	/* Clean up on exit. */
 	register_cleanup_handler(ut, 1);
@@ -175,7 +185,7 @@ int main(int argc, char *argv[])
 	// receive and process each packet
 	while(1) {
 		ubertooth_bulk_wait(ut);
-		r = ubertooth_bulk_receive(ut, cb_specan, specan_args);
+		r = ubertooth_bulk_receive_batch(ut, cb_specan, specan_args);
 		if (r == -1)
 			return r;
 	}
@@ -35,7 +35,7 @@ static void usage()
 	printf("\t-V print version information\n");
 	printf("\t-l <LAP> to decode (6 hex), otherwise sniff all LAPs\n");
 	printf("\t-u <UAP> to decode (2 hex), otherwise try to calculate (requires LAP)\n");
-	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	printf("\t-t <SECONDS> timeout - 0 means no timeout [Default: 0]\n");
 }
 
@@ -45,7 +45,7 @@ int main(int argc, char* argv[])
 	int r;
 	int timeout = 0;
 	char* end;
-	char ubertooth_device = -1;
+	const char* ubertooth_device = NULL;
 	uint32_t lap = 0;
 	uint8_t uap = 0;
 
@@ -62,7 +62,7 @@ int main(int argc, char* argv[])
 			have_uap++;
 			break;
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 't':
 			timeout = atoi(optarg);
@@ -77,7 +77,7 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	r = ubertooth_connect(ut, ubertooth_device);
+	r = ubertooth_connect_spec(ut, ubertooth_device);
 	if (r < 0) {
 		usage();
 		return 1;
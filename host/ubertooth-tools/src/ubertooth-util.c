@@ -31,6 +31,30 @@ const char* board_names[] = {
 	"ToorCon 13 Badge"
 };
 
+static int list_devices(void)
+{
+	ubertooth_device_info devs[MAX_UBERTOOTHS];
+	int i, n;
+
+	n = ubertooth_list_devices(devs, MAX_UBERTOOTHS);
+	if (n < 0)
+		return 1;
+	if (n == 0) {
+		fprintf(stdout, "No Ubertooth devices found\n");
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "Device %d: %s, %s, firmware %s\n", i, devs[i].path,
+		        (devs[i].board_id >= 0 && devs[i].board_id < (int)(sizeof(board_names) / sizeof(board_names[0])))
+		        ? board_names[devs[i].board_id] : "unknown board",
+		        devs[i].firmware);
+		fprintf(stdout, "\t");
+		print_serial(devs[i].serial, stdout);
+	}
+	return 0;
+}
+
 static void usage(FILE *output)
 {
 	fprintf(output, "ubertooth-util - command line utility for Ubertooth Zero and Ubertooth One\n");
@@ -47,6 +71,7 @@ static void usage(FILE *output)
 	fprintf(output, "\t-i activate In-System Programming (ISP) mode\n");
 	fprintf(output, "\t-I identify ubertooth device by flashing all LEDs\n");
 	fprintf(output, "\t-l[0-1] get/set USR LED\n");
+	fprintf(output, "\t-L list attached ubertooth devices\n");
 	fprintf(output, "\t-m display range test result\n");
 	fprintf(output, "\t-n initiate range test\n");
 	fprintf(output, "\t-p get microcontroller Part ID\n");
@@ -55,7 +80,7 @@ static void usage(FILE *output)
 	fprintf(output, "\t-s get microcontroller serial number\n");
 	fprintf(output, "\t-S stop current operation\n");
 	fprintf(output, "\t-t intitiate continuous transmit test\n");
-	fprintf(output, "\t-U<0-7> set ubertooth device to use\n");
+	fprintf(output, "\t-U <0-7|bus-port|serial> set ubertooth device to use\n");
 	fprintf(output, "\t-v get firmware revision number\n");
 	fprintf(output, "\t-V get compile info\n");
 	fprintf(output, "\t-z set squelch level\n");
@@ -72,8 +97,8 @@ int main(int argc, char *argv[])
 	int do_range_test, do_repeater, do_firmware, do_board_id;
 	int do_range_result, do_all_leds, do_identify;
 	int do_set_squelch, do_get_squelch, squelch_level;
-	int do_something, do_compile_info, do_api_check;
-	char ubertooth_device = -1;
+	int do_something, do_compile_info, do_api_check, do_list;
+	const char* ubertooth_device = NULL;
 
 	/* set command states to negative as a starter
 	 * setting to 0 means 'do it'
@@ -84,11 +109,12 @@ int main(int argc, char *argv[])
 	do_range_result= do_all_leds= do_identify= -1;
 	do_set_squelch= -1, do_get_squelch= -1; squelch_level= 0;
 	do_something= 0; do_compile_info= -1, do_api_check = 0;
+	do_list= -1;
 
-	while ((opt=getopt(argc,argv,"U:hnmefiIprsStvbl::a::C::c::d::q::z::9VA")) != EOF) {
+	while ((opt=getopt(argc,argv,"U:hnmefiIprsStvbLl::a::C::c::d::q::z::9VA")) != EOF) {
 		switch(opt) {
 		case 'U':
-			ubertooth_device = atoi(optarg);
+			ubertooth_device = optarg;
 			break;
 		case 'f':
 			fprintf(stderr, "ubertooth-util -f is no longer required - use ubertooth-dfu instead\n");
@@ -112,6 +138,9 @@ int main(int argc, char *argv[])
 			else
 				do_all_leds= 2; /* can't use 0 as it's a valid option */
 			break;
+		case 'L':
+			do_list= 0;
+			break;
 		case 'p':
 			do_part= 0;
 			break;
@@ -193,20 +222,24 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* enumerates devices itself, none is opened */
+	if(do_list == 0)
+		return list_devices();
+
 	/* initialise device */
-	ut = ubertooth_start(ubertooth_device);
+	ut = ubertooth_start_spec(ubertooth_device);
 	if (ut == NULL) {
 		usage(stderr);
 		return 1;
 	}
 	if(do_reset == 0) {
-		fprintf(stdout, "Resetting ubertooth device number %d\n", (ubertooth_device >= 0) ? ubertooth_device : 0);
+		fprintf(stdout, "Resetting ubertooth device %s\n", ubertooth_device ? ubertooth_device : "0");
 		r = cmd_reset(ut->devh);
 		sleep(2);
-		ut = ubertooth_start(ubertooth_device);
+		ut = ubertooth_start_spec(ubertooth_device);
 	}
 	if(do_stop == 0) {
-		fprintf(stdout, "Stopping ubertooth device number %d\n", (ubertooth_device >= 0) ? ubertooth_device : 0);
+		fprintf(stdout, "Stopping ubertooth device %s\n", ubertooth_device ? ubertooth_device : "0");
 		r = cmd_stop(ut->devh);
 	}
 
@@ -288,7 +321,7 @@ int main(int argc, char *argv[])
 		return cmd_flash(ut->devh);
 	}
 	if(do_identify == 0) {
-		fprintf(stdout, "Flashing LEDs on ubertooth device number %d\n", (ubertooth_device >= 0) ? ubertooth_device : 0);
+		fprintf(stdout, "Flashing LEDs on ubertooth device %s\n", ubertooth_device ? ubertooth_device : "0");
 		while(42) {
 			do_identify= !do_identify;
 			cmd_set_usrled(ut->devh, do_identify);
@@ -320,7 +353,7 @@ int main(int argc, char *argv[])
 	}
 	if(do_set_squelch > 0) {
 		fprintf(stdout, "Setting squelch to %d\n", squelch_level);
-		cmd_set_squelch(ut->devh, squelch_level);
+		ubertooth_set_squelch(ut, squelch_level);
 	}
 	if(do_get_squelch > 0) {
 		r = cmd_get_squelch(ut->devh);